@@ -7,17 +7,27 @@
 
 #include <linux/version.h>
 #include <linux/can/dev.h>
+#include <linux/clocksource.h>
 #include <linux/device.h>
 #include <linux/ethtool.h>
+#include <linux/hrtimer.h>
+#include <linux/interrupt.h>
 #include <linux/iopoll.h>
 #include <linux/kernel.h>
+#include <linux/math64.h>
 #if (LINUX_VERSION_CODE >= KERNEL_VERSION(5, 10, 0))
 #include <linux/minmax.h>
 #endif /* LINUX_VERSION_CODE >= KERNEL_VERSION 5.10.0 */
 #include <linux/module.h>
 #include <linux/netdevice.h>
 #include <linux/pci.h>
+#include <linux/seqlock.h>
+#include <linux/skbuff.h>
 #include <linux/timer.h>
+#include <linux/u64_stats_sync.h>
+#include <net/sock.h>
+
+#include "kvaser_txq.h"
 
 #if (LINUX_VERSION_CODE < KERNEL_VERSION(4, 15, 0))
 #define netdev_info_once(dev, fmt, ...) netdev_info(dev, fmt, ##__VA_ARGS__)
@@ -39,6 +49,10 @@ static inline bool can_dev_dropped_skb(struct net_device *dev, struct sk_buff *s
 	return can_dropped_invalid_skb(dev, skb);
 }
 #endif /* LINUX_VERSION_CODE < KERNEL_VERSION 6.1.0 */
+#if (LINUX_VERSION_CODE >= KERNEL_VERSION(6, 2, 0))
+#define u64_stats_fetch_begin_irq u64_stats_fetch_begin
+#define u64_stats_fetch_retry_irq u64_stats_fetch_retry
+#endif /* LINUX_VERSION_CODE >= KERNEL_VERSION 6.2.0 */
 MODULE_LICENSE("Dual BSD/GPL");
 MODULE_AUTHOR("Kvaser AB <support@kvaser.com>");
 MODULE_DESCRIPTION("CAN driver for Kvaser CAN/PCIe devices");
@@ -49,7 +63,8 @@ MODULE_DESCRIPTION("CAN driver for Kvaser CAN/PCIe devices");
 #define KVASER_PCIEFD_DRV_NAME "kvaser_pciefd"
 
 #define KVASER_PCIEFD_WAIT_TIMEOUT msecs_to_jiffies(1000)
-#define KVASER_PCIEFD_BEC_POLL_FREQ (jiffies + msecs_to_jiffies(200))
+#define KVASER_PCIEFD_BEC_POLL_FAST_MS 200U
+#define KVASER_PCIEFD_BEC_POLL_SLOW_MS 1000U
 #define KVASER_PCIEFD_MAX_ERR_REP 256U
 #define KVASER_PCIEFD_CAN_TX_MAX_COUNT 17U
 #define KVASER_PCIEFD_MAX_CAN_CHANNELS 4U
@@ -58,6 +73,23 @@ MODULE_DESCRIPTION("CAN driver for Kvaser CAN/PCIe devices");
 #define KVASER_PCIEFD_DMA_SIZE (4U * 1024U)
 #define KVASER_PCIEFD_64BIT_DMA_BIT BIT(0)
 
+static unsigned int bec_poll_fast_ms = KVASER_PCIEFD_BEC_POLL_FAST_MS;
+module_param(bec_poll_fast_ms, uint, 0644);
+MODULE_PARM_DESC(bec_poll_fast_ms,
+		 "Error counter poll interval in ms while error passive, bus off or error reporting is throttled (default 200)");
+
+static unsigned int bec_poll_slow_ms = KVASER_PCIEFD_BEC_POLL_SLOW_MS;
+module_param(bec_poll_slow_ms, uint, 0644);
+MODULE_PARM_DESC(bec_poll_slow_ms,
+		 "Error counter poll interval in ms while error active or warning with non-zero error counters (default 1000)");
+
+static bool irq_timing;
+module_param(irq_timing, bool, 0644);
+MODULE_PARM_DESC(irq_timing,
+		 "Measure time spent in the interrupt handler, reported by ethtool -S (default off)");
+
+KVASER_TXQ_MODULE_PARAMS(kvaser_pciefd_txq_params);
+
 #define KVASER_PCIEFD_VENDOR 0x1a07
 /* Altera based devices */
 #define KVASER_PCIEFD_4HS_DEVICE_ID 0x000d
@@ -317,78 +349,106 @@ MODULE_DESCRIPTION("CAN driver for Kvaser CAN/PCIe devices");
 #define KVASER_PCIEFD_KCAN_PWM_ADDR(can) \
 	((can)->reg_base + KVASER_PCIEFD_KCAN_PWM_REG)
 
+/* Register accessors. With the KUnit tests built in, they also serve the
+ * simulated board in kvaser_pciefd_kunit.c. Addresses outside of its BAR still
+ * go to the hardware.
+ */
+#if IS_ENABLED(CONFIG_CAN_KVASER_PCIEFD_KUNIT_TEST)
+static u32 kvaser_pciefd_sim_read(const void __iomem *addr);
+static void kvaser_pciefd_sim_write(u32 value, void __iomem *addr);
+static void kvaser_pciefd_sim_write_rep(void __iomem *addr, const void *buf,
+					unsigned long count);
+static void kvaser_pciefd_sim_raw_write(u32 value, void __iomem *addr);
+
+#define kvaser_pciefd_ioread32(addr) kvaser_pciefd_sim_read(addr)
+#define kvaser_pciefd_readl(addr) kvaser_pciefd_sim_read(addr)
+#define kvaser_pciefd_iowrite32(value, addr) \
+	kvaser_pciefd_sim_write((value), (addr))
+#define kvaser_pciefd_iowrite32_rep(addr, buf, count) \
+	kvaser_pciefd_sim_write_rep((addr), (buf), (count))
+#define kvaser_pciefd_raw_writel(value, addr) \
+	kvaser_pciefd_sim_raw_write((value), (addr))
+#else
+#define kvaser_pciefd_ioread32(addr) ioread32(addr)
+#define kvaser_pciefd_readl(addr) readl(addr)
+#define kvaser_pciefd_iowrite32(value, addr) iowrite32((value), (addr))
+#define kvaser_pciefd_iowrite32_rep(addr, buf, count) \
+	iowrite32_rep((addr), (buf), (count))
+#define kvaser_pciefd_raw_writel(value, addr) __raw_writel((value), (addr))
+#endif /* CONFIG_CAN_KVASER_PCIEFD_KUNIT_TEST */
+
 /* Macros for reading and writing registers */
 #define KVASER_PCIEFD_PCI_IEN_SET(pcie, value) \
-	(iowrite32((value), KVASER_PCIEFD_PCI_IEN_ADDR((pcie))))
+	(kvaser_pciefd_iowrite32((value), KVASER_PCIEFD_PCI_IEN_ADDR((pcie))))
 #define KVASER_PCIEFD_PCI_IRQ_GET(pcie) \
-	(ioread32(KVASER_PCIEFD_PCI_IRQ_ADDR((pcie))))
+	(kvaser_pciefd_ioread32(KVASER_PCIEFD_PCI_IRQ_ADDR((pcie))))
 #define KVASER_PCIEFD_SYSID_VERSION_NUM_CHANNELS_GET(pcie)      \
-	((ioread32(KVASER_PCIEFD_SYSID_VERSION_ADDR((pcie))) >> \
+	((kvaser_pciefd_ioread32(KVASER_PCIEFD_SYSID_VERSION_ADDR((pcie))) >> \
 	  KVASER_PCIEFD_SYSID_VERSION_NRCHAN_SHIFT) &           \
 	 0xff)
 #define KVASER_PCIEFD_SYSID_VERSION_MINOR_GET(pcie) \
-	(ioread32(KVASER_PCIEFD_SYSID_VERSION_ADDR((pcie))) & 0xff)
+	(kvaser_pciefd_ioread32(KVASER_PCIEFD_SYSID_VERSION_ADDR((pcie))) & 0xff)
 #define KVASER_PCIEFD_SYSID_VERSION_MAJOR_GET(pcie)             \
-	((ioread32(KVASER_PCIEFD_SYSID_VERSION_ADDR((pcie))) >> \
+	((kvaser_pciefd_ioread32(KVASER_PCIEFD_SYSID_VERSION_ADDR((pcie))) >> \
 	  KVASER_PCIEFD_SYSID_VERSION_MAJOR_SHIFT) &            \
 	 0xff)
 #define KVASER_PCIEFD_SYSID_CANFREQ_GET(pcie) \
-	(ioread32(KVASER_PCIEFD_SYSID_CANFREQ_ADDR((pcie))))
+	(kvaser_pciefd_ioread32(KVASER_PCIEFD_SYSID_CANFREQ_ADDR((pcie))))
 #define KVASER_PCIEFD_SYSID_BUSFREQ_GET(pcie) \
-	(ioread32(KVASER_PCIEFD_SYSID_BUSFREQ_ADDR((pcie))))
+	(kvaser_pciefd_ioread32(KVASER_PCIEFD_SYSID_BUSFREQ_ADDR((pcie))))
 #define KVASER_PCIEFD_SYSID_BUILD_GET(pcie)                   \
-	((ioread32(KVASER_PCIEFD_SYSID_BUILD_ADDR((pcie))) >> \
+	((kvaser_pciefd_ioread32(KVASER_PCIEFD_SYSID_BUILD_ADDR((pcie))) >> \
 	  KVASER_PCIEFD_SYSID_BUILD_SHIFT) &                  \
 	 0x7fff)
 #define KVASER_PCIEFD_SRB_FIFO_LAST_GET(pcie) \
-	(ioread32(KVASER_PCIEFD_SRB_FIFO_LAST_ADDR((pcie))))
+	(kvaser_pciefd_ioread32(KVASER_PCIEFD_SRB_FIFO_LAST_ADDR((pcie))))
 #define KVASER_PCIEFD_SRB_CMD_SET(pcie, value) \
-	(iowrite32((value), KVASER_PCIEFD_SRB_CMD_ADDR((pcie))))
+	(kvaser_pciefd_iowrite32((value), KVASER_PCIEFD_SRB_CMD_ADDR((pcie))))
 #define KVASER_PCIEFD_SRB_IEN_SET(pcie, value) \
-	(iowrite32((value), KVASER_PCIEFD_SRB_IEN_ADDR((pcie))))
+	(kvaser_pciefd_iowrite32((value), KVASER_PCIEFD_SRB_IEN_ADDR((pcie))))
 #define KVASER_PCIEFD_SRB_IRQ_GET(pcie) \
-	(ioread32(KVASER_PCIEFD_SRB_IRQ_ADDR((pcie))))
+	(kvaser_pciefd_ioread32(KVASER_PCIEFD_SRB_IRQ_ADDR((pcie))))
 #define KVASER_PCIEFD_SRB_IRQ_SET(pcie, value) \
-	(iowrite32((value), KVASER_PCIEFD_SRB_IRQ_ADDR((pcie))))
+	(kvaser_pciefd_iowrite32((value), KVASER_PCIEFD_SRB_IRQ_ADDR((pcie))))
 #define KVASER_PCIEFD_SRB_STAT_GET(pcie) \
-	(ioread32(KVASER_PCIEFD_SRB_STAT_ADDR((pcie))))
+	(kvaser_pciefd_ioread32(KVASER_PCIEFD_SRB_STAT_ADDR((pcie))))
 #define KVASER_PCIEFD_SRB_RX_NR_PACKETS_CURRENT_GET(pcie)         \
-	(ioread32(KVASER_PCIEFD_SRB_RX_NR_PACKETS_ADDR((pcie))) & \
+	(kvaser_pciefd_ioread32(KVASER_PCIEFD_SRB_RX_NR_PACKETS_ADDR((pcie))) & \
 	 KVASER_PCIEFD_SRB_RX_NR_PACKETS_CURRENT_MASK)
 #define KVASER_PCIEFD_SRB_CTRL_SET(pcie, value) \
-	(iowrite32((value), KVASER_PCIEFD_SRB_CTRL_ADDR((pcie))))
+	(kvaser_pciefd_iowrite32((value), KVASER_PCIEFD_SRB_CTRL_ADDR((pcie))))
 #define KVASER_PCIEFD_KCAN_FIFO_SET(can, value) \
-	(iowrite32((value), KVASER_PCIEFD_KCAN_FIFO_ADDR((can))))
+	(kvaser_pciefd_iowrite32((value), KVASER_PCIEFD_KCAN_FIFO_ADDR((can))))
 #define KVASER_PCIEFD_KCAN_CTRL_SET(can, value) \
-	(iowrite32((value), KVASER_PCIEFD_KCAN_CTRL_ADDR((can))))
+	(kvaser_pciefd_iowrite32((value), KVASER_PCIEFD_KCAN_CTRL_ADDR((can))))
 #define KVASER_PCIEFD_KCAN_CMD_SET(can, value) \
-	(iowrite32((value), KVASER_PCIEFD_KCAN_CMD_ADDR((can))))
+	(kvaser_pciefd_iowrite32((value), KVASER_PCIEFD_KCAN_CMD_ADDR((can))))
 #define KVASER_PCIEFD_KCAN_IEN_SET(can, value) \
-	(iowrite32((value), KVASER_PCIEFD_KCAN_IEN_ADDR((can))))
+	(kvaser_pciefd_iowrite32((value), KVASER_PCIEFD_KCAN_IEN_ADDR((can))))
 #define KVASER_PCIEFD_KCAN_IRQ_GET(can) \
-	(ioread32(KVASER_PCIEFD_KCAN_IRQ_ADDR((can))))
+	(kvaser_pciefd_ioread32(KVASER_PCIEFD_KCAN_IRQ_ADDR((can))))
 #define KVASER_PCIEFD_KCAN_IRQ_SET(can, value) \
-	(iowrite32((value), KVASER_PCIEFD_KCAN_IRQ_ADDR((can))))
+	(kvaser_pciefd_iowrite32((value), KVASER_PCIEFD_KCAN_IRQ_ADDR((can))))
 #define KVASER_PCIEFD_KCAN_TX_NR_PACKETS_CURRENT_GET(can) \
-	(ioread32(KVASER_PCIEFD_KCAN_TX_NR_PACKETS_ADDR((can))) & 0xff)
+	(kvaser_pciefd_ioread32(KVASER_PCIEFD_KCAN_TX_NR_PACKETS_ADDR((can))) & 0xff)
 #define KVASER_PCIEFD_KCAN_TX_NR_PACKETS_MAX_GET(can)               \
-	((ioread32(KVASER_PCIEFD_KCAN_TX_NR_PACKETS_ADDR((can))) >> \
+	((kvaser_pciefd_ioread32(KVASER_PCIEFD_KCAN_TX_NR_PACKETS_ADDR((can))) >> \
 	  KVASER_PCIEFD_KCAN_TX_NR_PACKETS_MAX_SHIFT) &             \
 	 0xff)
 #define KVASER_PCIEFD_KCAN_STAT_GET(can) \
-	(ioread32(KVASER_PCIEFD_KCAN_STAT_ADDR((can))))
+	(kvaser_pciefd_ioread32(KVASER_PCIEFD_KCAN_STAT_ADDR((can))))
 #define KVASER_PCIEFD_KCAN_MODE_GET(can) \
-	(ioread32(KVASER_PCIEFD_KCAN_MODE_ADDR((can))))
+	(kvaser_pciefd_ioread32(KVASER_PCIEFD_KCAN_MODE_ADDR((can))))
 #define KVASER_PCIEFD_KCAN_MODE_SET(can, value) \
-	(iowrite32((value), KVASER_PCIEFD_KCAN_MODE_ADDR((can))))
+	(kvaser_pciefd_iowrite32((value), KVASER_PCIEFD_KCAN_MODE_ADDR((can))))
 #define KVASER_PCIEFD_KCAN_BTRN_SET(can, value) \
-	(iowrite32((value), KVASER_PCIEFD_KCAN_BTRN_ADDR((can))))
+	(kvaser_pciefd_iowrite32((value), KVASER_PCIEFD_KCAN_BTRN_ADDR((can))))
 #define KVASER_PCIEFD_KCAN_BTRD_SET(can, value) \
-	(iowrite32((value), KVASER_PCIEFD_KCAN_BTRD_ADDR((can))))
+	(kvaser_pciefd_iowrite32((value), KVASER_PCIEFD_KCAN_BTRD_ADDR((can))))
 #define KVASER_PCIEFD_KCAN_PWM_GET(can) \
-	(ioread32(KVASER_PCIEFD_KCAN_PWM_ADDR((can))))
+	(kvaser_pciefd_ioread32(KVASER_PCIEFD_KCAN_PWM_ADDR((can))))
 #define KVASER_PCIEFD_KCAN_PWM_SET(can, value) \
-	(iowrite32((value), KVASER_PCIEFD_KCAN_PWM_ADDR((can))))
+	(kvaser_pciefd_iowrite32((value), KVASER_PCIEFD_KCAN_PWM_ADDR((can))))
 
 #define KVASER_PCIEFD_PCI_IEN_DISABLE_ALL(pcie) \
 	(KVASER_PCIEFD_PCI_IEN_SET((pcie), 0))
@@ -424,14 +484,14 @@ MODULE_DESCRIPTION("CAN driver for Kvaser CAN/PCIe devices");
 #define KVASER_PCIEFD_KCAN_IRQ_CLEAR_ALL(can) \
 	(KVASER_PCIEFD_KCAN_IRQ_SET((can), GENMASK(31, 0)))
 #define KVASER_PCIEFD_KCAN_BUS_LOAD_DISABLE(can) \
-	(iowrite32(0, KVASER_PCIEFD_KCAN_BUS_LOAD_ADDR((can))))
+	(kvaser_pciefd_iowrite32(0, KVASER_PCIEFD_KCAN_BUS_LOAD_ADDR((can))))
 #define KVASER_PCIEFD_KCAN_CHANNEL_SPAN(pcie) \
 	(KVASER_PCIEFD_KCAN_CH1_ADDR((pcie)) - KVASER_PCIEFD_KCAN_CH0_ADDR((pcie)))
 #define KVASER_PCIEFD_KCAN_CHX_ADDR(pcie, i) \
 	(KVASER_PCIEFD_KCAN_CH0_ADDR((pcie)) + (i) * KVASER_PCIEFD_KCAN_CHANNEL_SPAN((pcie)))
 
 #define KVASER_PCIEFD_LOOPBACK_DISABLE(pcie) \
-	(iowrite32(0, KVASER_PCIEFD_GET_BLOCK_ADDR((pcie), loopback)))
+	(kvaser_pciefd_iowrite32(0, KVASER_PCIEFD_GET_BLOCK_ADDR((pcie), loopback)))
 
 #define KVASER_PCIEFD_WRITE_DMA_MAP(pcie, addr, index) \
 	((pcie)->driver_data->ops->kvaser_pciefd_write_dma_map((pcie), (addr), (index)))
@@ -447,6 +507,16 @@ MODULE_DESCRIPTION("CAN driver for Kvaser CAN/PCIe devices");
 #define KVASER_PCIEFD_SPACKET_RXERR_COUNT(packet) \
 	(((packet)->header[0] >> KVASER_PCIEFD_SPACK_RXERR_SHIFT) & 0xff)
 
+/* Macros for updating the driver statistics */
+#define KVASER_PCIEFD_STATS_ADD(stats, field, value)       \
+	do {                                               \
+		u64_stats_update_begin(&(stats)->syncp);   \
+		(stats)->field += (value);                 \
+		u64_stats_update_end(&(stats)->syncp);     \
+	} while (0)
+#define KVASER_PCIEFD_STATS_INC(stats, field) \
+	KVASER_PCIEFD_STATS_ADD((stats), field, 1)
+
 struct kvaser_pciefd;
 static void kvaser_pciefd_write_dma_map_altera(struct kvaser_pciefd *pcie,
 					       dma_addr_t addr, int index);
@@ -538,6 +608,31 @@ const struct kvaser_pciefd_driver_data kvaser_pciefd_sf2_driver_data = {
 	.ops = &kvaser_pciefd_sf2_dev_ops,
 };
 
+/* Per channel counters, only updated from the board IRQ handler */
+struct kvaser_pciefd_can_stats {
+	struct u64_stats_sync syncp;
+	u64 tx_fifo_overflows;
+	u64 rx_fifo_overflows;
+	u64 nacks;
+	u64 arbitration_lost;
+	u64 flushed_packets;
+	u64 err_rep_limited;
+};
+
+/* Board counters, shared by all channels and reported by each of them */
+struct kvaser_pciefd_board_stats {
+	struct u64_stats_sync syncp;
+	u64 irqs;
+	u64 dma_buffers;
+	u64 dma_packets;
+	u64 dma_packets_max;
+	u64 dma_overflows;
+	u64 dma_underflows;
+	u64 unexpected_packets;
+	u64 irq_time_ns;
+	u64 irq_time_max_ns;
+};
+
 struct kvaser_pciefd_can {
 	struct can_priv can;
 	struct kvaser_pciefd *kv_pcie;
@@ -550,6 +645,8 @@ struct kvaser_pciefd_can {
 	spinlock_t echo_lock; /* Locks the message echo buffer */
 	struct timer_list bec_poll_timer;
 	struct completion start_comp, flush_comp;
+	struct kvaser_pciefd_can_stats stats;
+	struct kvaser_txtime txtime;
 };
 
 struct kvaser_pciefd {
@@ -561,7 +658,16 @@ struct kvaser_pciefd {
 	u8 nr_channels;
 	u32 bus_freq;
 	u32 freq;
-	u32 freq_to_ticks_div;
+	/* Timestamp conversion, ns = base_ns + (ticks - base_ticks) * mult >> shift,
+	 * where base is re-anchored to a whole second of ticks when needed.
+	 * ts_lock protects the base, mult and shift are constant.
+	 */
+	u32 ts_mult;
+	u32 ts_shift;
+	seqlock_t ts_lock;
+	u64 ts_base_ticks;
+	u64 ts_base_ns;
+	struct kvaser_pciefd_board_stats stats;
 };
 
 struct kvaser_pciefd_rx_packet {
@@ -574,6 +680,47 @@ struct kvaser_pciefd_tx_packet {
 	u8 data[64];
 };
 
+struct kvaser_pciefd_stat_desc {
+	char name[ETH_GSTRING_LEN];
+	size_t offset;
+};
+
+#define KVASER_PCIEFD_CAN_STAT(field) \
+	{ #field, offsetof(struct kvaser_pciefd_can_stats, field) }
+#define KVASER_PCIEFD_BOARD_STAT(field) \
+	{ "board_" #field, offsetof(struct kvaser_pciefd_board_stats, field) }
+#define KVASER_PCIEFD_TXTIME_STAT(field) \
+	{ "txtime_" #field, offsetof(struct kvaser_txtime_stats, field) }
+
+static const struct kvaser_pciefd_stat_desc kvaser_pciefd_can_stats_desc[] = {
+	KVASER_PCIEFD_CAN_STAT(tx_fifo_overflows),
+	KVASER_PCIEFD_CAN_STAT(rx_fifo_overflows),
+	KVASER_PCIEFD_CAN_STAT(nacks),
+	KVASER_PCIEFD_CAN_STAT(arbitration_lost),
+	KVASER_PCIEFD_CAN_STAT(flushed_packets),
+	KVASER_PCIEFD_CAN_STAT(err_rep_limited),
+};
+
+static const struct kvaser_pciefd_stat_desc kvaser_pciefd_txtime_stats_desc[] = {
+	KVASER_PCIEFD_TXTIME_STAT(frames),
+	KVASER_PCIEFD_TXTIME_STAT(late_ns),
+	KVASER_PCIEFD_TXTIME_STAT(late_max_ns),
+	KVASER_PCIEFD_TXTIME_STAT(missed),
+	KVASER_PCIEFD_TXTIME_STAT(dropped),
+};
+
+static const struct kvaser_pciefd_stat_desc kvaser_pciefd_board_stats_desc[] = {
+	KVASER_PCIEFD_BOARD_STAT(irqs),
+	KVASER_PCIEFD_BOARD_STAT(dma_buffers),
+	KVASER_PCIEFD_BOARD_STAT(dma_packets),
+	KVASER_PCIEFD_BOARD_STAT(dma_packets_max),
+	KVASER_PCIEFD_BOARD_STAT(dma_overflows),
+	KVASER_PCIEFD_BOARD_STAT(dma_underflows),
+	KVASER_PCIEFD_BOARD_STAT(unexpected_packets),
+	KVASER_PCIEFD_BOARD_STAT(irq_time_ns),
+	KVASER_PCIEFD_BOARD_STAT(irq_time_max_ns),
+};
+
 static const struct can_bittiming_const kvaser_pciefd_bittiming_const = {
 	.name = KVASER_PCIEFD_DRV_NAME,
 	.tseg1_min = 1,
@@ -676,13 +823,100 @@ static void kvaser_pciefd_disable_err_gen(struct kvaser_pciefd_can *can)
 	spin_unlock_irqrestore(&can->lock, irq);
 }
 
-static void kvaser_pciefd_set_skb_timestamp(const struct kvaser_pciefd *pcie,
+/* Arm the error counter poll timer depending on the channel state. A healthy
+ * channel, error active with zero error counters, is only armed once more
+ * after error packets, so that the timer resets err_rep_cnt.
+ */
+static void kvaser_pciefd_bec_poll_schedule(struct kvaser_pciefd_can *can)
+{
+	unsigned int interval_ms;
+
+	if (can->err_rep_cnt >= KVASER_PCIEFD_MAX_ERR_REP) {
+		/* Error packets are disabled, re-enable them in time */
+		interval_ms = READ_ONCE(bec_poll_fast_ms);
+	} else {
+		switch (can->can.state) {
+		case CAN_STATE_ERROR_PASSIVE:
+			interval_ms = READ_ONCE(bec_poll_fast_ms);
+			break;
+		case CAN_STATE_BUS_OFF:
+			/* Only poll if the controller may recover by itself */
+			if (!can->can.restart_ms)
+				return;
+			interval_ms = READ_ONCE(bec_poll_fast_ms);
+			break;
+		case CAN_STATE_ERROR_ACTIVE:
+		case CAN_STATE_ERROR_WARNING:
+			if (can->bec.txerr || can->bec.rxerr) {
+				interval_ms = READ_ONCE(bec_poll_slow_ms);
+				break;
+			}
+			/* Nothing to poll, but the error report count must
+			 * still be reset before it throttles error packets
+			 */
+			if (!can->err_rep_cnt)
+				return;
+			interval_ms = READ_ONCE(bec_poll_fast_ms);
+			break;
+		default:
+			return;
+		}
+	}
+
+	mod_timer(&can->bec_poll_timer,
+		  jiffies + msecs_to_jiffies(max(interval_ms, 1U)));
+}
+
+static void kvaser_pciefd_init_timestamp(struct kvaser_pciefd *pcie)
+{
+	/* The delta from the base never exceeds one second of ticks */
+	clocks_calc_mult_shift(&pcie->ts_mult, &pcie->ts_shift, pcie->freq,
+			       NSEC_PER_SEC, 1);
+	seqlock_init(&pcie->ts_lock);
+	pcie->ts_base_ticks = 0;
+	pcie->ts_base_ns = 0;
+}
+
+static ktime_t kvaser_pciefd_ticks_to_ktime(struct kvaser_pciefd *pcie,
+					    u64 ticks)
+{
+	u64 base_ticks, base_ns;
+	unsigned long irq_flags;
+	unsigned int seq;
+
+	do {
+		seq = read_seqbegin(&pcie->ts_lock);
+		base_ticks = pcie->ts_base_ticks;
+		base_ns = pcie->ts_base_ns;
+	} while (read_seqretry(&pcie->ts_lock, seq));
+
+	/* Ticks before the base mean that the device clock was reset */
+	if (ticks < base_ticks || ticks - base_ticks >= pcie->freq) {
+		/* Move the base to the start of the current second. This
+		 * division is only needed once per second of device time.
+		 */
+		u64 sec = div_u64(ticks, pcie->freq);
+
+		base_ticks = sec * pcie->freq;
+		base_ns = sec * NSEC_PER_SEC;
+
+		write_seqlock_irqsave(&pcie->ts_lock, irq_flags);
+		pcie->ts_base_ticks = base_ticks;
+		pcie->ts_base_ns = base_ns;
+		write_sequnlock_irqrestore(&pcie->ts_lock, irq_flags);
+	}
+
+	return ns_to_ktime(base_ns + mul_u64_u32_shr(ticks - base_ticks,
+						     pcie->ts_mult,
+						     pcie->ts_shift));
+}
+
+static void kvaser_pciefd_set_skb_timestamp(struct kvaser_pciefd *pcie,
 					    struct sk_buff *skb, u64 timestamp)
 {
 	struct skb_shared_hwtstamps *hwtstamps = skb_hwtstamps(skb);
 
-	hwtstamps->hwtstamp =
-		ns_to_ktime(div_u64(timestamp * 1000, pcie->freq_to_ticks_div));
+	hwtstamps->hwtstamp = kvaser_pciefd_ticks_to_ktime(pcie, timestamp);
 }
 
 static void kvaser_pciefd_setup_controller(struct kvaser_pciefd_can *can)
@@ -784,7 +1018,7 @@ static int kvaser_pciefd_bus_on(struct kvaser_pciefd_can *can)
 	kvaser_pciefd_setup_controller(can);
 
 	can->can.state = CAN_STATE_ERROR_ACTIVE;
-	netif_wake_queue(can->can.dev);
+	netif_tx_wake_all_queues(can->can.dev);
 	can->bec.txerr = 0;
 	can->bec.rxerr = 0;
 	can->err_rep_cnt = 0;
@@ -855,6 +1089,8 @@ static int kvaser_pciefd_stop(struct net_device *netdev)
 	struct kvaser_pciefd_can *can = netdev_priv(netdev);
 	int ret = 0;
 
+	kvaser_txtime_flush(&can->txtime);
+
 	/* Don't interrupt ongoing flush */
 	if (!completion_done(&can->flush_comp))
 		kvaser_pciefd_start_controller_flush(can);
@@ -917,6 +1153,36 @@ static int kvaser_pciefd_prepare_tx_packet(struct kvaser_pciefd_tx_packet *p,
 	return DIV_ROUND_UP(packet_size, 4);
 }
 
+static void kvaser_pciefd_tx_stop_queues(struct kvaser_pciefd_can *can,
+					 u8 count)
+{
+	struct net_device *netdev = can->can.dev;
+
+	/* The next echo slot is still in use, no queue may transmit */
+	if (can->can.echo_skb[can->echo_idx]) {
+		netif_tx_stop_all_queues(netdev);
+		return;
+	}
+
+	kvaser_txq_stop(netdev, count, can->can.echo_skb_max);
+}
+
+#if (LINUX_VERSION_CODE >= KERNEL_VERSION(4, 19, 0))
+#if (LINUX_VERSION_CODE >= KERNEL_VERSION(5, 2, 0))
+static u16 kvaser_pciefd_select_queue(struct net_device *netdev,
+				      struct sk_buff *skb,
+				      struct net_device *sb_dev)
+#else
+static u16 kvaser_pciefd_select_queue(struct net_device *netdev,
+				      struct sk_buff *skb,
+				      struct net_device *sb_dev,
+				      select_queue_fallback_t fallback)
+#endif /* LINUX_VERSION_CODE >= KERNEL_VERSION 5.2.0 */
+{
+	return kvaser_txq_select(netdev, skb, &kvaser_pciefd_txq_params);
+}
+#endif /* LINUX_VERSION_CODE >= KERNEL_VERSION 4.19.0 */
+
 static netdev_tx_t kvaser_pciefd_start_xmit(struct sk_buff *skb,
 					    struct net_device *netdev)
 {
@@ -929,10 +1195,26 @@ static netdev_tx_t kvaser_pciefd_start_xmit(struct sk_buff *skb,
 	if (can_dev_dropped_skb(netdev, skb))
 		return NETDEV_TX_OK;
 
-	nwords = kvaser_pciefd_prepare_tx_packet(&packet, can, skb);
+	if (kvaser_txtime_hold(&can->txtime, skb))
+		return NETDEV_TX_OK;
 
 	spin_lock_irqsave(&can->echo_lock, irq_flags);
 
+	/* Each queue is only stopped at its own limit, so queues running in
+	 * parallel can race for the last FIFO entry or echo slot. The loser
+	 * is stopped under echo_lock, the next acknowledge wakes it.
+	 */
+	count = KVASER_PCIEFD_KCAN_TX_NR_PACKETS_CURRENT_GET(can);
+	if (can->can.echo_skb[can->echo_idx] ||
+	    count >= can->can.echo_skb_max) {
+		netif_stop_subqueue(netdev, skb_get_queue_mapping(skb));
+		spin_unlock_irqrestore(&can->echo_lock, irq_flags);
+		return NETDEV_TX_BUSY;
+	}
+
+	/* echo_idx is the sequence number of the packet */
+	nwords = kvaser_pciefd_prepare_tx_packet(&packet, can, skb);
+
 	/* Prepare and save echo skb in internal slot */
 #if (LINUX_VERSION_CODE >= KERNEL_VERSION(5, 12, 0))
 	can_put_echo_skb(skb, netdev, can->echo_idx, 0);
@@ -951,21 +1233,21 @@ static netdev_tx_t kvaser_pciefd_start_xmit(struct sk_buff *skb,
 		u32 data_last = ((u32 *)packet.data)[nwords - 1];
 
 		/* Write data to fifo, except last word */
-		iowrite32_rep(KVASER_PCIEFD_KCAN_FIFO_ADDR(can), packet.data,
-			      nwords - 1);
+		kvaser_pciefd_iowrite32_rep(KVASER_PCIEFD_KCAN_FIFO_ADDR(can),
+					    packet.data, nwords - 1);
 		/* Write last word to end of fifo */
-		__raw_writel(data_last, KVASER_PCIEFD_KCAN_FIFO_LAST_ADDR(can));
+		kvaser_pciefd_raw_writel(data_last,
+					 KVASER_PCIEFD_KCAN_FIFO_LAST_ADDR(can));
 	} else {
 		/* Complete write to fifo */
-		__raw_writel(0, KVASER_PCIEFD_KCAN_FIFO_LAST_ADDR(can));
+		kvaser_pciefd_raw_writel(0, KVASER_PCIEFD_KCAN_FIFO_LAST_ADDR(can));
 	}
 
 	count = KVASER_PCIEFD_KCAN_TX_NR_PACKETS_CURRENT_GET(can);
-	/* No room for a new message, stop the queue until at least one
-	 * successful transmit
+	/* No room for a new message in the share of a queue, stop it until at
+	 * least one successful transmit
 	 */
-	if (count >= can->can.echo_skb_max || can->can.echo_skb[can->echo_idx])
-		netif_stop_queue(netdev);
+	kvaser_pciefd_tx_stop_queues(can, count);
 
 	spin_unlock_irqrestore(&can->echo_lock, irq_flags);
 
@@ -997,7 +1279,8 @@ static int kvaser_pciefd_set_bittiming(struct kvaser_pciefd_can *can, bool data)
 	KVASER_PCIEFD_KCAN_MODE_SET(can, mode | KVASER_PCIEFD_KCAN_MODE_RM);
 
 	/* Can only set bittiming if in reset mode */
-	ret = readl_poll_timeout(KVASER_PCIEFD_KCAN_MODE_ADDR(can), test,
+	ret = readx_poll_timeout(kvaser_pciefd_readl,
+				 KVASER_PCIEFD_KCAN_MODE_ADDR(can), test,
 				 test & KVASER_PCIEFD_KCAN_MODE_RM, 0, 10);
 
 	if (ret) {
@@ -1076,14 +1359,98 @@ static const struct net_device_ops kvaser_pciefd_netdev_ops = {
 	.ndo_eth_ioctl = can_eth_ioctl_hwts,
 #endif /* LINUX_VERSION_CODE >= KERNEL_VERSION 6.0.0 */
 	.ndo_start_xmit = kvaser_pciefd_start_xmit,
+#if (LINUX_VERSION_CODE >= KERNEL_VERSION(4, 19, 0))
+	.ndo_select_queue = kvaser_pciefd_select_queue,
+#endif /* LINUX_VERSION_CODE >= KERNEL_VERSION 4.19.0 */
 	.ndo_change_mtu = can_change_mtu,
 };
 
-#if (LINUX_VERSION_CODE >= KERNEL_VERSION(6, 0, 0))
+static int kvaser_pciefd_get_sset_count(struct net_device *netdev, int sset)
+{
+	switch (sset) {
+	case ETH_SS_STATS:
+		return ARRAY_SIZE(kvaser_pciefd_can_stats_desc) +
+		       ARRAY_SIZE(kvaser_pciefd_txtime_stats_desc) +
+		       ARRAY_SIZE(kvaser_pciefd_board_stats_desc);
+	default:
+		return -EOPNOTSUPP;
+	}
+}
+
+static void kvaser_pciefd_get_strings(struct net_device *netdev, u32 sset,
+				      u8 *data)
+{
+	int i;
+
+	if (sset != ETH_SS_STATS)
+		return;
+
+	for (i = 0; i < ARRAY_SIZE(kvaser_pciefd_can_stats_desc); i++) {
+		memcpy(data, kvaser_pciefd_can_stats_desc[i].name,
+		       ETH_GSTRING_LEN);
+		data += ETH_GSTRING_LEN;
+	}
+
+	for (i = 0; i < ARRAY_SIZE(kvaser_pciefd_txtime_stats_desc); i++) {
+		memcpy(data, kvaser_pciefd_txtime_stats_desc[i].name,
+		       ETH_GSTRING_LEN);
+		data += ETH_GSTRING_LEN;
+	}
+
+	for (i = 0; i < ARRAY_SIZE(kvaser_pciefd_board_stats_desc); i++) {
+		memcpy(data, kvaser_pciefd_board_stats_desc[i].name,
+		       ETH_GSTRING_LEN);
+		data += ETH_GSTRING_LEN;
+	}
+}
+
+static void kvaser_pciefd_read_stats(const struct u64_stats_sync *syncp,
+				     const void *stats,
+				     const struct kvaser_pciefd_stat_desc *desc,
+				     int count, u64 *data)
+{
+	unsigned int start;
+	int i;
+
+	do {
+		start = u64_stats_fetch_begin_irq(syncp);
+		for (i = 0; i < count; i++)
+			data[i] = *(const u64 *)((const u8 *)stats +
+						 desc[i].offset);
+	} while (u64_stats_fetch_retry_irq(syncp, start));
+}
+
+static void kvaser_pciefd_get_ethtool_stats(struct net_device *netdev,
+					    struct ethtool_stats *stats,
+					    u64 *data)
+{
+	struct kvaser_pciefd_can *can = netdev_priv(netdev);
+	struct kvaser_pciefd *pcie = can->kv_pcie;
+
+	kvaser_pciefd_read_stats(&can->stats.syncp, &can->stats,
+				 kvaser_pciefd_can_stats_desc,
+				 ARRAY_SIZE(kvaser_pciefd_can_stats_desc),
+				 data);
+	data += ARRAY_SIZE(kvaser_pciefd_can_stats_desc);
+	kvaser_pciefd_read_stats(&can->txtime.stats.syncp, &can->txtime.stats,
+				 kvaser_pciefd_txtime_stats_desc,
+				 ARRAY_SIZE(kvaser_pciefd_txtime_stats_desc),
+				 data);
+	data += ARRAY_SIZE(kvaser_pciefd_txtime_stats_desc);
+	kvaser_pciefd_read_stats(&pcie->stats.syncp, &pcie->stats,
+				 kvaser_pciefd_board_stats_desc,
+				 ARRAY_SIZE(kvaser_pciefd_board_stats_desc),
+				 data);
+}
+
 static const struct ethtool_ops kvaser_pciefd_ethtool_ops = {
+#if (LINUX_VERSION_CODE >= KERNEL_VERSION(6, 0, 0))
 	.get_ts_info = can_ethtool_op_get_ts_info_hwts,
-};
 #endif /* LINUX_VERSION_CODE >= KERNEL_VERSION 6.0.0 */
+	.get_sset_count = kvaser_pciefd_get_sset_count,
+	.get_strings = kvaser_pciefd_get_strings,
+	.get_ethtool_stats = kvaser_pciefd_get_ethtool_stats,
+};
 
 static int kvaser_pciefd_setup_can_ctrls(struct kvaser_pciefd *pcie)
 {
@@ -1094,16 +1461,21 @@ static int kvaser_pciefd_setup_can_ctrls(struct kvaser_pciefd *pcie)
 		struct kvaser_pciefd_can *can;
 		u32 status;
 
+#if (LINUX_VERSION_CODE >= KERNEL_VERSION(4, 19, 0))
+		netdev = alloc_candev_mqs(sizeof(struct kvaser_pciefd_can),
+					  KVASER_PCIEFD_CAN_TX_MAX_COUNT,
+					  kvaser_txq_num_queues(&kvaser_pciefd_txq_params),
+					  1);
+#else
 		netdev = alloc_candev(sizeof(struct kvaser_pciefd_can),
 				      KVASER_PCIEFD_CAN_TX_MAX_COUNT);
+#endif /* LINUX_VERSION_CODE >= KERNEL_VERSION 4.19.0 */
 		if (!netdev)
 			return -ENOMEM;
 
 		can = netdev_priv(netdev);
 		netdev->netdev_ops = &kvaser_pciefd_netdev_ops;
-#if (LINUX_VERSION_CODE >= KERNEL_VERSION(6, 0, 0))
 		netdev->ethtool_ops = &kvaser_pciefd_ethtool_ops;
-#endif /* LINUX_VERSION_CODE >= KERNEL_VERSION 6.0.0 */
 		can->reg_base = KVASER_PCIEFD_KCAN_CHX_ADDR(pcie, i);
 
 		can->kv_pcie = pcie;
@@ -1111,6 +1483,8 @@ static int kvaser_pciefd_setup_can_ctrls(struct kvaser_pciefd *pcie)
 		can->err_rep_cnt = 0;
 		can->bec.txerr = 0;
 		can->bec.rxerr = 0;
+		u64_stats_init(&can->stats.syncp);
+		kvaser_txtime_init(&can->txtime, netdev);
 
 		init_completion(&can->start_comp);
 		init_completion(&can->flush_comp);
@@ -1205,8 +1579,8 @@ static void kvaser_pciefd_write_dma_map_altera(struct kvaser_pciefd *pcie,
 	word2 = 0;
 #endif
 	serdes_base = KVASER_PCIEFD_SERDES_ADDR(pcie) + 0x8 * index;
-	iowrite32(word1, serdes_base);
-	iowrite32(word2, serdes_base + 0x4);
+	kvaser_pciefd_iowrite32(word1, serdes_base);
+	kvaser_pciefd_iowrite32(word2, serdes_base + 0x4);
 }
 
 static void kvaser_pciefd_write_dma_map_sf2(struct kvaser_pciefd *pcie,
@@ -1220,8 +1594,8 @@ static void kvaser_pciefd_write_dma_map_sf2(struct kvaser_pciefd *pcie,
 	msb = addr >> 32;
 #endif
 	serdes_base = KVASER_PCIEFD_SERDES_ADDR(pcie) + 0x10 * index;
-	iowrite32(lsb, serdes_base);
-	iowrite32(msb, serdes_base + 0x4);
+	kvaser_pciefd_iowrite32(lsb, serdes_base);
+	kvaser_pciefd_iowrite32(msb, serdes_base + 0x4);
 }
 
 static int kvaser_pciefd_setup_dma(struct kvaser_pciefd *pcie)
@@ -1288,9 +1662,11 @@ static int kvaser_pciefd_setup_board(struct kvaser_pciefd *pcie)
 
 	pcie->bus_freq = KVASER_PCIEFD_SYSID_BUSFREQ_GET(pcie);
 	pcie->freq = KVASER_PCIEFD_SYSID_CANFREQ_GET(pcie);
-	pcie->freq_to_ticks_div = pcie->freq / 1000000;
-	if (pcie->freq_to_ticks_div == 0)
-		pcie->freq_to_ticks_div = 1;
+	if (!pcie->freq) {
+		dev_err(&pcie->pci->dev, "Invalid CAN clock frequency\n");
+		return -ENODEV;
+	}
+	kvaser_pciefd_init_timestamp(pcie);
 
 	/* Turn off all loopback functionality */
 	KVASER_PCIEFD_LOOPBACK_DISABLE(pcie);
@@ -1369,7 +1745,7 @@ static void kvaser_pciefd_change_state(struct kvaser_pciefd_can *can,
 		unsigned long irq_flags;
 
 		spin_lock_irqsave(&can->lock, irq_flags);
-		netif_stop_queue(can->can.dev);
+		netif_tx_stop_all_queues(can->can.dev);
 		spin_unlock_irqrestore(&can->lock, irq_flags);
 
 		/* Prevent CAN controller from auto recover from bus off */
@@ -1474,11 +1850,13 @@ static int kvaser_pciefd_handle_error_packet(struct kvaser_pciefd *pcie,
 	can = pcie->can[ch_id];
 
 	kvaser_pciefd_rx_error_frame(can, p);
-	if (can->err_rep_cnt >= KVASER_PCIEFD_MAX_ERR_REP)
+	if (can->err_rep_cnt >= KVASER_PCIEFD_MAX_ERR_REP) {
 		/* Do not report more errors, until bec_poll_timer expires */
 		kvaser_pciefd_disable_err_gen(can);
+		KVASER_PCIEFD_STATS_INC(&can->stats, err_rep_limited);
+	}
 	/* Start polling the error counters */
-	mod_timer(&can->bec_poll_timer, KVASER_PCIEFD_BEC_POLL_FREQ);
+	kvaser_pciefd_bec_poll_schedule(can);
 	return 0;
 }
 
@@ -1526,9 +1904,6 @@ static int kvaser_pciefd_handle_status_resp(struct kvaser_pciefd_can *can,
 	}
 	can->bec.txerr = bec.txerr;
 	can->bec.rxerr = bec.rxerr;
-	/* Check if we need to poll the error counters */
-	if (bec.txerr || bec.rxerr)
-		mod_timer(&can->bec_poll_timer, KVASER_PCIEFD_BEC_POLL_FREQ);
 
 	return 0;
 }
@@ -1570,11 +1945,8 @@ static int kvaser_pciefd_handle_status_packet(struct kvaser_pciefd *pcie,
 		   (cmdseq == (p->header[1] & KVASER_PCIEFD_PACKET_SEQ_MASK))) {
 		/* Response to status request received */
 		kvaser_pciefd_handle_status_resp(can, p);
-		if (can->can.state != CAN_STATE_BUS_OFF &&
-		    can->can.state != CAN_STATE_ERROR_ACTIVE) {
-			mod_timer(&can->bec_poll_timer,
-				  KVASER_PCIEFD_BEC_POLL_FREQ);
-		}
+		/* Check if we need to keep polling the error counters */
+		kvaser_pciefd_bec_poll_schedule(can);
 	} else if ((p->header[0] & KVASER_PCIEFD_SPACK_RMCD) &&
 		   !(status & KVASER_PCIEFD_KCAN_STAT_BUS_OFF_MASK)) {
 		/* Reset to bus on detected */
@@ -1599,8 +1971,11 @@ static void kvaser_pciefd_handle_nack_packet(struct kvaser_pciefd_can *can,
 		if (skb)
 			cf->can_id |= CAN_ERR_LOSTARB;
 		can->can.can_stats.arbitration_lost++;
-	} else if (skb) {
-		cf->can_id |= CAN_ERR_ACK;
+		KVASER_PCIEFD_STATS_INC(&can->stats, arbitration_lost);
+	} else {
+		if (skb)
+			cf->can_id |= CAN_ERR_ACK;
+		KVASER_PCIEFD_STATS_INC(&can->stats, nacks);
 	}
 
 	if (skb) {
@@ -1635,12 +2010,16 @@ static int kvaser_pciefd_handle_ack_packet(struct kvaser_pciefd *pcie,
 
 	if (p->header[0] & KVASER_PCIEFD_APACKET_FLU) {
 		netdev_dbg(can->can.dev, "Packet was flushed\n");
+		KVASER_PCIEFD_STATS_INC(&can->stats, flushed_packets);
 	} else {
 		int echo_idx = p->header[0] & KVASER_PCIEFD_PACKET_SEQ_MASK;
+		unsigned long irq_flags;
 		int dlc;
 		u8 count;
 		struct sk_buff *skb;
 
+		/* Pairs with the queue stop in kvaser_pciefd_start_xmit() */
+		spin_lock_irqsave(&can->echo_lock, irq_flags);
 		skb = can->can.echo_skb[echo_idx];
 		if (skb)
 			kvaser_pciefd_set_skb_timestamp(pcie, skb, p->timestamp);
@@ -1651,9 +2030,8 @@ static int kvaser_pciefd_handle_ack_packet(struct kvaser_pciefd *pcie,
 #endif /* LINUX_VERSION_CODE >= 5.12.0) */
 		count = KVASER_PCIEFD_KCAN_TX_NR_PACKETS_CURRENT_GET(can);
 
-		if (count < can->can.echo_skb_max &&
-		    netif_queue_stopped(can->can.dev))
-			netif_wake_queue(can->can.dev);
+		kvaser_txq_wake(can->can.dev, count, can->can.echo_skb_max);
+		spin_unlock_irqrestore(&can->echo_lock, irq_flags);
 
 		if (!one_shot_fail) {
 			struct net_device_stats *stats = &can->can.dev->stats;
@@ -1748,6 +2126,7 @@ static int kvaser_pciefd_read_packet(struct kvaser_pciefd *pcie, int *start_pos,
 	case KVASER_PCIEFD_PACK_TYPE_TXRQ:
 		dev_info(&pcie->pci->dev,
 			 "Received unexpected packet type 0x%08X\n", type);
+		KVASER_PCIEFD_STATS_INC(&pcie->stats, unexpected_packets);
 		break;
 
 	default:
@@ -1775,11 +2154,21 @@ static int kvaser_pciefd_read_buffer(struct kvaser_pciefd *pcie, int dma_buf)
 {
 	int pos = 0;
 	int res = 0;
+	unsigned int packets = 0;
 
 	do {
 		res = kvaser_pciefd_read_packet(pcie, &pos, dma_buf);
+		if (!res && pos > 0)
+			packets++;
 	} while (!res && pos > 0 && pos < KVASER_PCIEFD_DMA_SIZE);
 
+	u64_stats_update_begin(&pcie->stats.syncp);
+	pcie->stats.dma_buffers++;
+	pcie->stats.dma_packets += packets;
+	if (packets > pcie->stats.dma_packets_max)
+		pcie->stats.dma_packets_max = packets;
+	u64_stats_update_end(&pcie->stats.syncp);
+
 	return res;
 }
 
@@ -1802,9 +2191,19 @@ static void kvaser_pciefd_receive_irq(struct kvaser_pciefd *pcie)
 	if (irq & KVASER_PCIEFD_SRB_IRQ_DOF0 ||
 	    irq & KVASER_PCIEFD_SRB_IRQ_DOF1 ||
 	    irq & KVASER_PCIEFD_SRB_IRQ_DUF0 ||
-	    irq & KVASER_PCIEFD_SRB_IRQ_DUF1)
+	    irq & KVASER_PCIEFD_SRB_IRQ_DUF1) {
 		dev_err(&pcie->pci->dev, "DMA IRQ error 0x%08X\n", irq);
 
+		u64_stats_update_begin(&pcie->stats.syncp);
+		pcie->stats.dma_overflows +=
+			!!(irq & KVASER_PCIEFD_SRB_IRQ_DOF0) +
+			!!(irq & KVASER_PCIEFD_SRB_IRQ_DOF1);
+		pcie->stats.dma_underflows +=
+			!!(irq & KVASER_PCIEFD_SRB_IRQ_DUF0) +
+			!!(irq & KVASER_PCIEFD_SRB_IRQ_DUF1);
+		u64_stats_update_end(&pcie->stats.syncp);
+	}
+
 	KVASER_PCIEFD_SRB_IRQ_SET(pcie, irq);
 }
 
@@ -1812,8 +2211,10 @@ static void kvaser_pciefd_transmit_irq(struct kvaser_pciefd_can *can)
 {
 	u32 irq = KVASER_PCIEFD_KCAN_IRQ_GET(can);
 
-	if (irq & KVASER_PCIEFD_KCAN_IRQ_TOF)
+	if (irq & KVASER_PCIEFD_KCAN_IRQ_TOF) {
 		netdev_err(can->can.dev, "Tx FIFO overflow\n");
+		KVASER_PCIEFD_STATS_INC(&can->stats, tx_fifo_overflows);
+	}
 
 	if (irq & KVASER_PCIEFD_KCAN_IRQ_BPP)
 		netdev_err(can->can.dev,
@@ -1822,8 +2223,10 @@ static void kvaser_pciefd_transmit_irq(struct kvaser_pciefd_can *can)
 	if (irq & KVASER_PCIEFD_KCAN_IRQ_FDIC)
 		netdev_err(can->can.dev, "CAN FD frame in CAN mode\n");
 
-	if (irq & KVASER_PCIEFD_KCAN_IRQ_ROF)
+	if (irq & KVASER_PCIEFD_KCAN_IRQ_ROF) {
 		netdev_err(can->can.dev, "Rx FIFO overflow\n");
+		KVASER_PCIEFD_STATS_INC(&can->stats, rx_fifo_overflows);
+	}
 
 	KVASER_PCIEFD_KCAN_IRQ_SET(can, irq);
 }
@@ -1833,11 +2236,18 @@ static irqreturn_t kvaser_pciefd_irq_handler(int irq, void *dev)
 	struct kvaser_pciefd *pcie = (struct kvaser_pciefd *)dev;
 	const struct kvaser_pciefd_irq_mask *irq_mask = pcie->driver_data->irq_mask;
 	u32 board_irq = KVASER_PCIEFD_PCI_IRQ_GET(pcie);
+	bool timing = READ_ONCE(irq_timing);
+	u64 start_ns = 0;
 	int i;
 
 	if (!(board_irq & irq_mask->all))
 		return IRQ_NONE;
 
+	if (timing)
+		start_ns = ktime_get_ns();
+
+	KVASER_PCIEFD_STATS_INC(&pcie->stats, irqs);
+
 	if (board_irq & irq_mask->kcan_rx0)
 		kvaser_pciefd_receive_irq(pcie);
 
@@ -1853,6 +2263,16 @@ static irqreturn_t kvaser_pciefd_irq_handler(int irq, void *dev)
 			kvaser_pciefd_transmit_irq(pcie->can[i]);
 	}
 
+	if (timing) {
+		u64 delta_ns = ktime_get_ns() - start_ns;
+
+		u64_stats_update_begin(&pcie->stats.syncp);
+		pcie->stats.irq_time_ns += delta_ns;
+		if (delta_ns > pcie->stats.irq_time_max_ns)
+			pcie->stats.irq_time_max_ns = delta_ns;
+		u64_stats_update_end(&pcie->stats.syncp);
+	}
+
 	return IRQ_HANDLED;
 }
 
@@ -1886,6 +2306,7 @@ static int kvaser_pciefd_probe(struct pci_dev *pdev,
 	pcie->pci = pdev;
 	pcie->driver_data = (const struct kvaser_pciefd_driver_data *)id->driver_data;
 	irq_mask = pcie->driver_data->irq_mask;
+	u64_stats_init(&pcie->stats.syncp);
 
 	err = pci_enable_device(pdev);
 	if (err)
@@ -2002,3 +2423,7 @@ static struct pci_driver kvaser_pciefd = {
 };
 
 module_pci_driver(kvaser_pciefd)
+
+#if IS_ENABLED(CONFIG_CAN_KVASER_PCIEFD_KUNIT_TEST)
+#include "kvaser_pciefd_kunit.c"
+#endif /* CONFIG_CAN_KVASER_PCIEFD_KUNIT_TEST */
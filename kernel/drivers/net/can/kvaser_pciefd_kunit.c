@@ -0,0 +1,1873 @@
+// SPDX-License-Identifier: GPL-2.0 OR BSD-2-Clause
+/* KUnit tests for the Kvaser PCIe FD driver. This file is included at the end
+ * of kvaser_pciefd.c, so that the static helpers can be tested directly.
+ */
+
+#include <kunit/test.h>
+#include <linux/delay.h>
+#include <linux/sizes.h>
+#include <linux/vmalloc.h>
+#include <linux/workqueue.h>
+
+/* Whole MHz clocks of the current boards, odd clocks and a slow 1 MHz clock */
+static const u32 kvaser_pciefd_test_freqs[] = {
+	80000000, 100000000, 24000000, 40500000, 33333333, 1000000,
+};
+
+/* Exact reference, ticks * NSEC_PER_SEC / freq rounded down */
+static u64 kvaser_pciefd_test_ticks_to_ns(u64 ticks, u32 freq)
+{
+	u32 rem;
+	u64 sec = div_u64_rem(ticks, freq, &rem);
+
+	return sec * NSEC_PER_SEC + div_u64((u64)rem * NSEC_PER_SEC, freq);
+}
+
+static void kvaser_pciefd_test_init_ts(struct kvaser_pciefd *pcie, u32 freq)
+{
+	memset(pcie, 0, sizeof(*pcie));
+	pcie->freq = freq;
+	kvaser_pciefd_init_timestamp(pcie);
+}
+
+static void kvaser_pciefd_test_expect_ticks(struct kunit *test,
+					    struct kvaser_pciefd *pcie,
+					    u64 ticks)
+{
+	s64 ns = ktime_to_ns(kvaser_pciefd_ticks_to_ktime(pcie, ticks));
+	s64 ref = kvaser_pciefd_test_ticks_to_ns(ticks, pcie->freq);
+
+	/* The mult/shift part rounds down, allow one ns either way */
+	KUNIT_EXPECT_LE_MSG(test, abs(ns - ref), 1,
+			    "freq %u ticks %llu: got %lld expected %lld",
+			    pcie->freq, ticks, ns, ref);
+}
+
+static void kvaser_pciefd_ticks_to_ktime_test(struct kunit *test)
+{
+	struct kvaser_pciefd *pcie;
+	int i;
+
+	pcie = kunit_kzalloc(test, sizeof(*pcie), GFP_KERNEL);
+	KUNIT_ASSERT_NOT_NULL(test, pcie);
+
+	for (i = 0; i < ARRAY_SIZE(kvaser_pciefd_test_freqs); i++) {
+		u64 freq = kvaser_pciefd_test_freqs[i];
+		const u64 ticks[] = {
+			0, 1, freq - 1, freq, freq + 1, 2 * freq - 1,
+			10 * freq + freq / 3, 3600 * freq + 12345,
+			/* Days and years of uptime */
+			86400 * freq + freq / 2, 365ULL * 86400 * freq + 7,
+			1ULL << 40, 1ULL << 52,
+		};
+		int j;
+
+		kvaser_pciefd_test_init_ts(pcie, freq);
+		for (j = 0; j < ARRAY_SIZE(ticks); j++)
+			kvaser_pciefd_test_expect_ticks(test, pcie, ticks[j]);
+	}
+}
+
+/* Walk the ticks across second boundaries in uneven steps. The result has to
+ * stay exact and monotonic while the base moves along.
+ */
+static void kvaser_pciefd_ticks_to_ktime_monotonic_test(struct kunit *test)
+{
+	struct kvaser_pciefd *pcie;
+	int i;
+
+	pcie = kunit_kzalloc(test, sizeof(*pcie), GFP_KERNEL);
+	KUNIT_ASSERT_NOT_NULL(test, pcie);
+
+	for (i = 0; i < ARRAY_SIZE(kvaser_pciefd_test_freqs); i++) {
+		u32 freq = kvaser_pciefd_test_freqs[i];
+		u64 step = max(freq / 7U, 1U);
+		u64 ticks = 5 * (u64)freq - 3 * step;
+		s64 prev = -1;
+		int j;
+
+		kvaser_pciefd_test_init_ts(pcie, freq);
+		for (j = 0; j < 64; j++, ticks += step) {
+			s64 ns = ktime_to_ns(kvaser_pciefd_ticks_to_ktime(pcie,
+									  ticks));
+
+			KUNIT_EXPECT_GT(test, ns, prev);
+			kvaser_pciefd_test_expect_ticks(test, pcie, ticks);
+			prev = ns;
+		}
+	}
+}
+
+/* The device clock restarts from zero when the FPGA is reset, and a 64-bit
+ * counter eventually wraps. Ticks below the base move the base back.
+ */
+static void kvaser_pciefd_ticks_to_ktime_wrap_test(struct kunit *test)
+{
+	struct kvaser_pciefd *pcie;
+	int i;
+
+	pcie = kunit_kzalloc(test, sizeof(*pcie), GFP_KERNEL);
+	KUNIT_ASSERT_NOT_NULL(test, pcie);
+
+	for (i = 0; i < ARRAY_SIZE(kvaser_pciefd_test_freqs); i++) {
+		u64 freq = kvaser_pciefd_test_freqs[i];
+
+		kvaser_pciefd_test_init_ts(pcie, freq);
+
+		/* Reset back into an earlier second */
+		kvaser_pciefd_test_expect_ticks(test, pcie, 1000 * freq + 17);
+		kvaser_pciefd_test_expect_ticks(test, pcie, 3);
+		KUNIT_EXPECT_EQ(test, pcie->ts_base_ticks, 0ULL);
+
+		/* Reset within the same second as the base */
+		kvaser_pciefd_test_expect_ticks(test, pcie, 42 * freq + freq / 2);
+		kvaser_pciefd_test_expect_ticks(test, pcie, 42 * freq + freq / 4);
+		KUNIT_EXPECT_EQ(test, pcie->ts_base_ticks, 42 * freq);
+
+		/* Back from years of uptime into the first second */
+		kvaser_pciefd_test_expect_ticks(test, pcie,
+						(1ULL << 52) - 1);
+		kvaser_pciefd_test_expect_ticks(test, pcie, freq - 1);
+		KUNIT_EXPECT_EQ(test, pcie->ts_base_ticks, 0ULL);
+		kvaser_pciefd_test_expect_ticks(test, pcie, freq);
+		KUNIT_EXPECT_EQ(test, pcie->ts_base_ticks, freq);
+	}
+}
+
+/* Simulated board behind the register accessors and the DMA buffers. It
+ * models the SYSID block, the shared receive buffer (SRB) with its two DMA
+ * buffers, the KCAN Tx FIFOs with the reset and flush handshake, and the ACK,
+ * status, error and end of flush packets the driver depends on. The PCI, SRB
+ * and KCAN interrupt enable registers gate a simulated IRQ line.
+ *
+ * Like a real interrupt, the IRQ handler runs from a work item when the line
+ * is asserted. In direct mode the test runs it instead, so that benchmarks
+ * time the handler alone.
+ */
+#define KVASER_PCIEFD_SIM_BAR_SIZE SZ_2M
+#define KVASER_PCIEFD_SIM_CHANNELS 2U
+#define KVASER_PCIEFD_SIM_TX_FIFO 32U
+#define KVASER_PCIEFD_SIM_CAN_FREQ 80000000U
+#define KVASER_PCIEFD_SIM_BUS_FREQ 250000000U
+/* Packets are 10 us apart at 80 MHz */
+#define KVASER_PCIEFD_SIM_PACKET_TICKS 800U
+#define KVASER_PCIEFD_SIM_DMA_WORDS (KVASER_PCIEFD_DMA_SIZE / 4)
+/* Size word, two header words and the 64-bit timestamp */
+#define KVASER_PCIEFD_SIM_HEADER_WORDS 5U
+#define KVASER_PCIEFD_SIM_DATA_WORDS (CANFD_MAX_DLEN / 4)
+
+struct kvaser_pciefd_sim_tx {
+	u32 header[2];
+	u32 data[KVASER_PCIEFD_SIM_DATA_WORDS];
+	unsigned int nwords;
+};
+
+struct kvaser_pciefd_sim_can {
+	/* Words of the packet being written to the Tx FIFO */
+	u32 cur[2 + KVASER_PCIEFD_SIM_DATA_WORDS];
+	unsigned int cur_words;
+	struct kvaser_pciefd_sim_tx fifo[KVASER_PCIEFD_SIM_TX_FIFO];
+	unsigned int head;
+	unsigned int count;
+	u32 irq;
+	u8 seq;
+	u8 txerr;
+	u8 rxerr;
+	bool in_reset;
+	bool bus_off;
+	/* Swallow the status and end of flush packets, the driver times out */
+	bool mute;
+};
+
+struct kvaser_pciefd_sim {
+	spinlock_t lock; /* Protects the simulated registers and DMA buffers */
+	u32 *regs;
+	void __iomem *bar;
+	struct kvaser_pciefd *pcie;
+	const struct kvaser_pciefd_address_offset *offset;
+	const struct kvaser_pciefd_irq_mask *irq_mask;
+	struct kvaser_pciefd_sim_can can[KVASER_PCIEFD_SIM_CHANNELS];
+	u32 srb_irq;
+	bool dma_ready[KVASER_PCIEFD_DMA_COUNT];
+	unsigned int dma_pos[KVASER_PCIEFD_DMA_COUNT];
+	unsigned int dma_cur;
+	unsigned int dma_packets;
+	/* Hand over a DMA buffer after this many packets, 0 waits until full */
+	unsigned int dma_batch;
+	u64 dma_dropped;
+	u64 ticks;
+	bool direct;
+	bool registered;
+	unsigned long opened;
+	struct work_struct irq_work;
+	/* Time of the first event not yet seen by the IRQ handler */
+	u64 pending_ns;
+	u64 latency_ns;
+	u64 latency_max_ns;
+	u64 latency_count;
+	struct packet_type capture;
+	struct sk_buff_head captured;
+};
+
+static struct kvaser_pciefd_sim *kvaser_pciefd_sim_active;
+
+static u32 *kvaser_pciefd_sim_reg(struct kvaser_pciefd_sim *sim, u32 off)
+{
+	return &sim->regs[off / 4];
+}
+
+static u32 *kvaser_pciefd_sim_kcan_reg(struct kvaser_pciefd_sim *sim,
+				       unsigned int ch, u32 reg)
+{
+	const struct kvaser_pciefd_address_offset *o = sim->offset;
+
+	return kvaser_pciefd_sim_reg(sim, o->kcan_ch0 +
+				     ch * (o->kcan_ch1 - o->kcan_ch0) + reg);
+}
+
+static unsigned int kvaser_pciefd_sim_ch(struct kvaser_pciefd_sim *sim,
+					 struct kvaser_pciefd_sim_can *sc)
+{
+	return sc - sim->can;
+}
+
+static struct kvaser_pciefd_sim_can *
+kvaser_pciefd_sim_kcan(struct kvaser_pciefd_sim *sim, u32 off, u32 *reg)
+{
+	const struct kvaser_pciefd_address_offset *o = sim->offset;
+	u32 span = o->kcan_ch1 - o->kcan_ch0;
+	unsigned int ch;
+
+	if (off < o->kcan_ch0)
+		return NULL;
+
+	ch = (off - o->kcan_ch0) / span;
+	if (ch >= KVASER_PCIEFD_SIM_CHANNELS)
+		return NULL;
+
+	*reg = (off - o->kcan_ch0) % span;
+	return &sim->can[ch];
+}
+
+static u32 kvaser_pciefd_sim_pci_irq(struct kvaser_pciefd_sim *sim)
+{
+	const struct kvaser_pciefd_address_offset *o = sim->offset;
+	u32 irq = 0;
+	int i;
+
+	if (sim->srb_irq &
+	    *kvaser_pciefd_sim_reg(sim, o->kcan_srb + KVASER_PCIEFD_SRB_IEN_REG))
+		irq |= sim->irq_mask->kcan_rx0;
+
+	for (i = 0; i < KVASER_PCIEFD_SIM_CHANNELS; i++) {
+		if (sim->can[i].irq &
+		    *kvaser_pciefd_sim_kcan_reg(sim, i, KVASER_PCIEFD_KCAN_IEN_REG))
+			irq |= sim->irq_mask->kcan_tx[i];
+	}
+
+	return irq;
+}
+
+static bool kvaser_pciefd_sim_irq_line(struct kvaser_pciefd_sim *sim)
+{
+	return kvaser_pciefd_sim_pci_irq(sim) &
+	       *kvaser_pciefd_sim_reg(sim, sim->offset->pci_ien);
+}
+
+static void kvaser_pciefd_sim_event(struct kvaser_pciefd_sim *sim)
+{
+	if (!sim->pending_ns)
+		sim->pending_ns = ktime_get_ns();
+	if (!sim->direct)
+		queue_work(system_highpri_wq, &sim->irq_work);
+}
+
+/* Hand the DMA buffer over to the driver and continue in the other one */
+static void kvaser_pciefd_sim_dma_complete(struct kvaser_pciefd_sim *sim)
+{
+	unsigned int buf = sim->dma_cur;
+
+	if (!sim->dma_ready[buf] || !sim->dma_pos[buf])
+		return;
+
+	sim->srb_irq |= KVASER_PCIEFD_SRB_IRQ_DPD0 << buf;
+	sim->dma_ready[buf] = false;
+	sim->dma_cur = buf ^ 1;
+	sim->dma_packets = 0;
+}
+
+/* Write a packet the way the SRB DMA does. The size word counts the whole
+ * packet, and a zero size word ends the buffer.
+ */
+static void kvaser_pciefd_sim_write_packet(__le32 *p, u32 header0, u32 header1,
+					   u64 ticks, const void *data,
+					   unsigned int nwords)
+{
+	__le64 timestamp = cpu_to_le64(ticks);
+
+	p[0] = cpu_to_le32(KVASER_PCIEFD_SIM_HEADER_WORDS + nwords);
+	p[1] = cpu_to_le32(header0);
+	p[2] = cpu_to_le32(header1);
+	memcpy(&p[3], &timestamp, sizeof(timestamp));
+	memcpy(&p[KVASER_PCIEFD_SIM_HEADER_WORDS], data, nwords * 4);
+	p[KVASER_PCIEFD_SIM_HEADER_WORDS + nwords] = 0;
+}
+
+static bool kvaser_pciefd_sim_put(struct kvaser_pciefd_sim *sim, u32 header0,
+				  u32 header1, const void *data,
+				  unsigned int nwords)
+{
+	const struct kvaser_pciefd_address_offset *o = sim->offset;
+	unsigned int size = KVASER_PCIEFD_SIM_HEADER_WORDS + nwords;
+	unsigned int buf = sim->dma_cur;
+	__le32 *p;
+
+	if (!(*kvaser_pciefd_sim_reg(sim, o->kcan_srb + KVASER_PCIEFD_SRB_CTRL_REG) &
+	      KVASER_PCIEFD_SRB_CTRL_DMA_ENABLE)) {
+		sim->dma_dropped++;
+		return false;
+	}
+
+	/* Leave room for the terminating size word */
+	if (sim->dma_pos[buf] + size + 1 > KVASER_PCIEFD_SIM_DMA_WORDS) {
+		kvaser_pciefd_sim_dma_complete(sim);
+		buf = sim->dma_cur;
+	}
+
+	if (!sim->dma_ready[buf]) {
+		sim->srb_irq |= KVASER_PCIEFD_SRB_IRQ_DOF0 << buf;
+		sim->dma_dropped++;
+		kvaser_pciefd_sim_event(sim);
+		return false;
+	}
+
+	sim->ticks += KVASER_PCIEFD_SIM_PACKET_TICKS;
+	p = (__le32 *)sim->pcie->dma_data[buf] + sim->dma_pos[buf];
+	kvaser_pciefd_sim_write_packet(p, header0, header1, sim->ticks, data,
+				       nwords);
+	sim->dma_pos[buf] += size;
+
+	if (sim->dma_batch && ++sim->dma_packets >= sim->dma_batch)
+		kvaser_pciefd_sim_dma_complete(sim);
+
+	kvaser_pciefd_sim_event(sim);
+	return true;
+}
+
+static u32 kvaser_pciefd_sim_header1(u8 type, unsigned int ch)
+{
+	return (u32)type << KVASER_PCIEFD_PACKET_TYPE_SHIFT |
+	       (u32)ch << KVASER_PCIEFD_PACKET_CHID_SHIFT;
+}
+
+static void kvaser_pciefd_sim_status(struct kvaser_pciefd_sim *sim,
+				     struct kvaser_pciefd_sim_can *sc,
+				     u32 flags, bool autonomous)
+{
+	u32 header0 = sc->txerr | sc->rxerr << KVASER_PCIEFD_SPACK_RXERR_SHIFT |
+		      flags;
+	u32 header1 = kvaser_pciefd_sim_header1(KVASER_PCIEFD_PACK_TYPE_STATUS,
+						kvaser_pciefd_sim_ch(sim, sc)) |
+		      sc->seq;
+
+	if (sc->bus_off)
+		header0 |= KVASER_PCIEFD_SPACK_BOFF;
+	if (autonomous)
+		header1 |= KVASER_PCIEFD_SPACK_AUTO;
+
+	kvaser_pciefd_sim_put(sim, header0, header1, NULL, 0);
+}
+
+static void kvaser_pciefd_sim_ctrl_ack(struct kvaser_pciefd_sim *sim,
+				       struct kvaser_pciefd_sim_can *sc,
+				       u8 type)
+{
+	kvaser_pciefd_sim_put(sim, 0,
+			      kvaser_pciefd_sim_header1(type,
+							kvaser_pciefd_sim_ch(sim, sc)),
+			      NULL, 0);
+}
+
+/* Send up to n packets from the Tx FIFO and acknowledge them */
+static unsigned int kvaser_pciefd_sim_send(struct kvaser_pciefd_sim *sim,
+					   struct kvaser_pciefd_sim_can *sc,
+					   unsigned int n, u32 ack_flags)
+{
+	u32 header1 = kvaser_pciefd_sim_header1(KVASER_PCIEFD_PACK_TYPE_ACK,
+						kvaser_pciefd_sim_ch(sim, sc));
+	unsigned int sent = 0;
+
+	/* A controller in reset mode only flushes */
+	if (sc->in_reset && !(ack_flags & KVASER_PCIEFD_APACKET_FLU))
+		return 0;
+
+	while (sent < n && sc->count) {
+		struct kvaser_pciefd_sim_tx *tx = &sc->fifo[sc->head];
+		u32 seq = tx->header[1] & KVASER_PCIEFD_PACKET_SEQ_MASK;
+
+		kvaser_pciefd_sim_put(sim, seq | ack_flags, header1, NULL, 0);
+		sc->head = (sc->head + 1) % KVASER_PCIEFD_SIM_TX_FIFO;
+		sc->count--;
+		sent++;
+	}
+
+	return sent;
+}
+
+static void kvaser_pciefd_sim_fifo_commit(struct kvaser_pciefd_sim *sim,
+					  struct kvaser_pciefd_sim_can *sc)
+{
+	struct kvaser_pciefd_sim_tx *tx;
+	u8 dlc;
+
+	if (sc->count >= KVASER_PCIEFD_SIM_TX_FIFO) {
+		sc->irq |= KVASER_PCIEFD_KCAN_IRQ_TOF;
+		return;
+	}
+
+	tx = &sc->fifo[(sc->head + sc->count) % KVASER_PCIEFD_SIM_TX_FIFO];
+	tx->header[0] = sc->cur[0];
+	tx->header[1] = sc->cur[1];
+	/* A packet without data is completed with a dummy word */
+	dlc = (tx->header[1] >> KVASER_PCIEFD_RPACKET_DLC_SHIFT) & 0xf;
+	tx->nwords = min(DIV_ROUND_UP(can_fd_dlc2len(dlc), 4U),
+			 sc->cur_words - 2);
+	memcpy(tx->data, &sc->cur[2], tx->nwords * 4);
+	sc->count++;
+}
+
+static void kvaser_pciefd_sim_set_mode(struct kvaser_pciefd_sim *sim,
+				       struct kvaser_pciefd_sim_can *sc,
+				       u32 *mode, u32 value)
+{
+	bool was_reset = *mode & KVASER_PCIEFD_KCAN_MODE_RM;
+
+	*mode = value;
+
+	if (!was_reset && (value & KVASER_PCIEFD_KCAN_MODE_RM)) {
+		sc->in_reset = true;
+		if (!sc->mute)
+			kvaser_pciefd_sim_status(sim, sc,
+						 KVASER_PCIEFD_SPACK_IRM |
+						 KVASER_PCIEFD_SPACK_RMCD,
+						 true);
+	} else if (was_reset && !(value & KVASER_PCIEFD_KCAN_MODE_RM)) {
+		/* Bus on, the error counters start over */
+		sc->in_reset = false;
+		sc->bus_off = false;
+		sc->txerr = 0;
+		sc->rxerr = 0;
+		if (!sc->mute)
+			kvaser_pciefd_sim_status(sim, sc,
+						 KVASER_PCIEFD_SPACK_RMCD,
+						 true);
+	}
+}
+
+static void kvaser_pciefd_sim_kcan_write(struct kvaser_pciefd_sim *sim,
+					 struct kvaser_pciefd_sim_can *sc,
+					 u32 reg, u32 value)
+{
+	unsigned int ch = kvaser_pciefd_sim_ch(sim, sc);
+	u32 *mode = kvaser_pciefd_sim_kcan_reg(sim, ch,
+					       KVASER_PCIEFD_KCAN_MODE_REG);
+
+	switch (reg) {
+	case KVASER_PCIEFD_KCAN_FIFO_REG:
+	case KVASER_PCIEFD_KCAN_FIFO_LAST_REG:
+		if (sc->cur_words < ARRAY_SIZE(sc->cur))
+			sc->cur[sc->cur_words++] = value;
+		if (reg == KVASER_PCIEFD_KCAN_FIFO_LAST_REG) {
+			if (sc->cur_words > 2)
+				kvaser_pciefd_sim_fifo_commit(sim, sc);
+			sc->cur_words = 0;
+		}
+		break;
+
+	case KVASER_PCIEFD_KCAN_CTRL_REG:
+		if (sc->mute)
+			break;
+		/* GENMASK() is an unsigned long, compare the command as a u32 */
+		value &= GENMASK(31, 29);
+		if (value == KVASER_PCIEFD_KCAN_CTRL_EFLUSH)
+			kvaser_pciefd_sim_ctrl_ack(sim, sc,
+						   KVASER_PCIEFD_PACK_TYPE_EFLUSH_ACK);
+		else if (value == KVASER_PCIEFD_KCAN_CTRL_EFRAME)
+			kvaser_pciefd_sim_ctrl_ack(sim, sc,
+						   KVASER_PCIEFD_PACK_TYPE_EFRAME_ACK);
+		break;
+
+	case KVASER_PCIEFD_KCAN_CMD_REG:
+		sc->seq = (value >> KVASER_PCIEFD_KCAN_CMD_SEQ_SHIFT) &
+			  KVASER_PCIEFD_PACKET_SEQ_MASK;
+		if (value & KVASER_PCIEFD_KCAN_CMD_AT) {
+			/* Abort, flush and reset */
+			*mode |= KVASER_PCIEFD_KCAN_MODE_RM;
+			sc->in_reset = true;
+			sc->cur_words = 0;
+			kvaser_pciefd_sim_send(sim, sc, KVASER_PCIEFD_SIM_TX_FIFO,
+					       KVASER_PCIEFD_APACKET_FLU);
+			if (!sc->mute)
+				kvaser_pciefd_sim_status(sim, sc,
+							 KVASER_PCIEFD_SPACK_IDET |
+							 KVASER_PCIEFD_SPACK_IRM,
+							 true);
+		}
+		if (value & KVASER_PCIEFD_KCAN_CMD_SRQ)
+			kvaser_pciefd_sim_status(sim, sc, sc->in_reset ?
+						 KVASER_PCIEFD_SPACK_IRM : 0,
+						 false);
+		break;
+
+	case KVASER_PCIEFD_KCAN_IRQ_REG:
+		/* Write one to clear */
+		sc->irq &= ~value;
+		break;
+
+	case KVASER_PCIEFD_KCAN_MODE_REG:
+		kvaser_pciefd_sim_set_mode(sim, sc, mode, value);
+		break;
+
+	default:
+		*kvaser_pciefd_sim_kcan_reg(sim, ch, reg) = value;
+		break;
+	}
+}
+
+static u32 kvaser_pciefd_sim_kcan_read(struct kvaser_pciefd_sim *sim,
+				       struct kvaser_pciefd_sim_can *sc, u32 reg)
+{
+	unsigned int ch = kvaser_pciefd_sim_ch(sim, sc);
+	u32 mode = *kvaser_pciefd_sim_kcan_reg(sim, ch,
+					       KVASER_PCIEFD_KCAN_MODE_REG);
+	u32 stat;
+
+	switch (reg) {
+	case KVASER_PCIEFD_KCAN_IRQ_REG:
+		return sc->irq;
+
+	case KVASER_PCIEFD_KCAN_TX_NR_PACKETS_REG:
+		return KVASER_PCIEFD_SIM_TX_FIFO <<
+		       KVASER_PCIEFD_KCAN_TX_NR_PACKETS_MAX_SHIFT | sc->count;
+
+	case KVASER_PCIEFD_KCAN_STAT_REG:
+		stat = (u32)sc->seq << KVASER_PCIEFD_KCAN_STAT_SEQNO_SHIFT |
+		       KVASER_PCIEFD_KCAN_STAT_FD | KVASER_PCIEFD_KCAN_STAT_CAP;
+		/* A controller in reset mode does not transmit */
+		if (sc->in_reset || !sc->count)
+			stat |= KVASER_PCIEFD_KCAN_STAT_IDLE;
+		if (sc->in_reset)
+			stat |= KVASER_PCIEFD_KCAN_STAT_IRM;
+		if (mode & KVASER_PCIEFD_KCAN_MODE_RM)
+			stat |= KVASER_PCIEFD_KCAN_STAT_RMR;
+		if (sc->bus_off)
+			stat |= KVASER_PCIEFD_KCAN_STAT_BOFF;
+		return stat;
+
+	default:
+		return *kvaser_pciefd_sim_kcan_reg(sim, ch, reg);
+	}
+}
+
+static u32 kvaser_pciefd_sim_reg_read(struct kvaser_pciefd_sim *sim, u32 off)
+{
+	const struct kvaser_pciefd_address_offset *o = sim->offset;
+	struct kvaser_pciefd_sim_can *sc;
+	u32 reg;
+
+	if (off == o->pci_irq)
+		return kvaser_pciefd_sim_pci_irq(sim);
+
+	if (off == o->kcan_srb + KVASER_PCIEFD_SRB_IRQ_REG)
+		return sim->srb_irq;
+
+	if (off == o->kcan_srb + KVASER_PCIEFD_SRB_STAT_REG) {
+		if (*kvaser_pciefd_sim_reg(sim, o->kcan_srb + KVASER_PCIEFD_SRB_CTRL_REG) &
+		    KVASER_PCIEFD_SRB_CTRL_DMA_ENABLE)
+			return KVASER_PCIEFD_SRB_STAT_DMA;
+		return KVASER_PCIEFD_SRB_STAT_DMA | KVASER_PCIEFD_SRB_STAT_DI;
+	}
+
+	/* Packets only go through the DMA buffers */
+	if (off == o->kcan_srb + KVASER_PCIEFD_SRB_RX_NR_PACKETS_REG ||
+	    off == o->kcan_srb_fifo + KVASER_PCIEFD_SRB_FIFO_LAST_REG)
+		return 0;
+
+	sc = kvaser_pciefd_sim_kcan(sim, off, &reg);
+	if (sc)
+		return kvaser_pciefd_sim_kcan_read(sim, sc, reg);
+
+	return *kvaser_pciefd_sim_reg(sim, off);
+}
+
+static void kvaser_pciefd_sim_reg_write(struct kvaser_pciefd_sim *sim, u32 off,
+					u32 value)
+{
+	const struct kvaser_pciefd_address_offset *o = sim->offset;
+	bool line = kvaser_pciefd_sim_irq_line(sim);
+	struct kvaser_pciefd_sim_can *sc;
+	u32 reg;
+	int i;
+
+	if (off == o->kcan_srb + KVASER_PCIEFD_SRB_CMD_REG) {
+		for (i = 0; i < KVASER_PCIEFD_DMA_COUNT; i++) {
+			if (!(value & (KVASER_PCIEFD_SRB_CMD_RDB0 << i)))
+				continue;
+			/* The buffer is handed back empty */
+			if (sim->pcie->dma_data[i])
+				*(__le32 *)sim->pcie->dma_data[i] = 0;
+			sim->dma_pos[i] = 0;
+			sim->dma_ready[i] = true;
+		}
+	} else if (off == o->kcan_srb + KVASER_PCIEFD_SRB_IRQ_REG) {
+		/* Write one to clear */
+		sim->srb_irq &= ~value;
+	} else {
+		sc = kvaser_pciefd_sim_kcan(sim, off, &reg);
+		if (sc)
+			kvaser_pciefd_sim_kcan_write(sim, sc, reg, value);
+		else
+			*kvaser_pciefd_sim_reg(sim, off) = value;
+	}
+
+	/* An interrupt enabled with its source already pending */
+	if (!line && kvaser_pciefd_sim_irq_line(sim))
+		kvaser_pciefd_sim_event(sim);
+}
+
+static bool kvaser_pciefd_sim_offset(struct kvaser_pciefd_sim *sim,
+				     const void __iomem *addr, u32 *off)
+{
+	unsigned long base, pos = (__force unsigned long)addr;
+
+	if (!sim)
+		return false;
+
+	base = (__force unsigned long)sim->bar;
+	if (pos < base || pos >= base + KVASER_PCIEFD_SIM_BAR_SIZE)
+		return false;
+
+	*off = pos - base;
+	return true;
+}
+
+static u32 kvaser_pciefd_sim_read(const void __iomem *addr)
+{
+	struct kvaser_pciefd_sim *sim = READ_ONCE(kvaser_pciefd_sim_active);
+	unsigned long flags;
+	u32 off, value;
+
+	if (!kvaser_pciefd_sim_offset(sim, addr, &off))
+		return ioread32(addr);
+
+	spin_lock_irqsave(&sim->lock, flags);
+	value = kvaser_pciefd_sim_reg_read(sim, off);
+	spin_unlock_irqrestore(&sim->lock, flags);
+
+	return value;
+}
+
+static void kvaser_pciefd_sim_write_rep(void __iomem *addr, const void *buf,
+					unsigned long count)
+{
+	struct kvaser_pciefd_sim *sim = READ_ONCE(kvaser_pciefd_sim_active);
+	const u32 *words = buf;
+	unsigned long flags;
+	u32 off;
+
+	if (!kvaser_pciefd_sim_offset(sim, addr, &off)) {
+		iowrite32_rep(addr, buf, count);
+		return;
+	}
+
+	spin_lock_irqsave(&sim->lock, flags);
+	while (count--)
+		kvaser_pciefd_sim_reg_write(sim, off, *words++);
+	spin_unlock_irqrestore(&sim->lock, flags);
+}
+
+static void kvaser_pciefd_sim_write(u32 value, void __iomem *addr)
+{
+	struct kvaser_pciefd_sim *sim = READ_ONCE(kvaser_pciefd_sim_active);
+	u32 off;
+
+	if (!kvaser_pciefd_sim_offset(sim, addr, &off)) {
+		iowrite32(value, addr);
+		return;
+	}
+
+	kvaser_pciefd_sim_write_rep(addr, &value, 1);
+}
+
+static void kvaser_pciefd_sim_raw_write(u32 value, void __iomem *addr)
+{
+	struct kvaser_pciefd_sim *sim = READ_ONCE(kvaser_pciefd_sim_active);
+	u32 off;
+
+	if (!kvaser_pciefd_sim_offset(sim, addr, &off)) {
+		__raw_writel(value, addr);
+		return;
+	}
+
+	kvaser_pciefd_sim_write_rep(addr, &value, 1);
+}
+
+/* Run the IRQ handler until the line is released. A partly filled DMA buffer
+ * is handed over first, as the SRB does after its timeout.
+ */
+static unsigned int kvaser_pciefd_sim_service(struct kvaser_pciefd_sim *sim)
+{
+	unsigned int irqs = 0;
+	unsigned long flags;
+
+	for (;;) {
+		u64 start_ns;
+		bool line;
+
+		spin_lock_irqsave(&sim->lock, flags);
+		kvaser_pciefd_sim_dma_complete(sim);
+		line = kvaser_pciefd_sim_irq_line(sim);
+		start_ns = sim->pending_ns;
+		sim->pending_ns = 0;
+		spin_unlock_irqrestore(&sim->lock, flags);
+
+		if (!line)
+			break;
+
+		/* Frames are passed to the stack when bottom halves are
+		 * enabled again, like on return from a hard interrupt
+		 */
+		local_bh_disable();
+		kvaser_pciefd_irq_handler(0, sim->pcie);
+		local_bh_enable();
+		irqs++;
+
+		if (start_ns) {
+			u64 delta_ns = ktime_get_ns() - start_ns;
+
+			spin_lock_irqsave(&sim->lock, flags);
+			sim->latency_ns += delta_ns;
+			sim->latency_max_ns = max(sim->latency_max_ns, delta_ns);
+			sim->latency_count++;
+			spin_unlock_irqrestore(&sim->lock, flags);
+		}
+	}
+
+	return irqs;
+}
+
+static void kvaser_pciefd_sim_irq_work(struct work_struct *work)
+{
+	struct kvaser_pciefd_sim *sim =
+		container_of(work, struct kvaser_pciefd_sim, irq_work);
+
+	kvaser_pciefd_sim_service(sim);
+}
+
+/* Wait until the IRQ work has handled everything that is pending */
+static void kvaser_pciefd_sim_sync(struct kvaser_pciefd_sim *sim)
+{
+	while (flush_work(&sim->irq_work))
+		;
+}
+
+static void kvaser_pciefd_sim_set_direct(struct kvaser_pciefd_sim *sim,
+					 bool direct)
+{
+	unsigned long flags;
+
+	spin_lock_irqsave(&sim->lock, flags);
+	sim->direct = direct;
+	spin_unlock_irqrestore(&sim->lock, flags);
+
+	if (direct)
+		cancel_work_sync(&sim->irq_work);
+}
+
+static void kvaser_pciefd_sim_rx(struct kvaser_pciefd_sim *sim, unsigned int ch,
+				 const struct canfd_frame *cf, bool fd)
+{
+	u32 header0 = cf->can_id & CAN_EFF_MASK;
+	u32 header1 = kvaser_pciefd_sim_header1(KVASER_PCIEFD_PACK_TYPE_DATA, ch) |
+		      can_fd_len2dlc(cf->len) << KVASER_PCIEFD_RPACKET_DLC_SHIFT;
+	unsigned int nwords = DIV_ROUND_UP(cf->len, 4);
+	unsigned long flags;
+
+	if (cf->can_id & CAN_EFF_FLAG)
+		header0 |= KVASER_PCIEFD_RPACKET_IDE;
+	if (cf->can_id & CAN_RTR_FLAG) {
+		header0 |= KVASER_PCIEFD_RPACKET_RTR;
+		nwords = 0;
+	}
+	if (fd) {
+		header1 |= KVASER_PCIEFD_RPACKET_FDF;
+		if (cf->flags & CANFD_BRS)
+			header1 |= KVASER_PCIEFD_RPACKET_BRS;
+		if (cf->flags & CANFD_ESI)
+			header1 |= KVASER_PCIEFD_RPACKET_ESI;
+	}
+
+	spin_lock_irqsave(&sim->lock, flags);
+	kvaser_pciefd_sim_put(sim, header0, header1, cf->data, nwords);
+	spin_unlock_irqrestore(&sim->lock, flags);
+}
+
+/* Report a bus error with new error counters, flags go to the first word */
+static void kvaser_pciefd_sim_error(struct kvaser_pciefd_sim *sim,
+				    unsigned int ch, u8 txerr, u8 rxerr,
+				    u32 flags)
+{
+	struct kvaser_pciefd_sim_can *sc = &sim->can[ch];
+	unsigned long irq_flags;
+
+	spin_lock_irqsave(&sim->lock, irq_flags);
+	sc->txerr = txerr;
+	sc->rxerr = rxerr;
+	sc->bus_off = flags & KVASER_PCIEFD_SPACK_BOFF;
+	kvaser_pciefd_sim_put(sim, txerr | rxerr << KVASER_PCIEFD_SPACK_RXERR_SHIFT |
+			      flags,
+			      kvaser_pciefd_sim_header1(KVASER_PCIEFD_PACK_TYPE_ERROR, ch),
+			      NULL, 0);
+	spin_unlock_irqrestore(&sim->lock, irq_flags);
+}
+
+static unsigned int kvaser_pciefd_sim_transmit(struct kvaser_pciefd_sim *sim,
+					       unsigned int ch, unsigned int n,
+					       u32 ack_flags)
+{
+	unsigned long flags;
+	unsigned int sent;
+
+	spin_lock_irqsave(&sim->lock, flags);
+	sent = kvaser_pciefd_sim_send(sim, &sim->can[ch], n, ack_flags);
+	spin_unlock_irqrestore(&sim->lock, flags);
+
+	return sent;
+}
+
+static void kvaser_pciefd_sim_raise(struct kvaser_pciefd_sim *sim,
+				    unsigned int ch, u32 irq)
+{
+	unsigned long flags;
+	bool line;
+
+	spin_lock_irqsave(&sim->lock, flags);
+	line = kvaser_pciefd_sim_irq_line(sim);
+	sim->can[ch].irq |= irq;
+	if (!line && kvaser_pciefd_sim_irq_line(sim))
+		kvaser_pciefd_sim_event(sim);
+	spin_unlock_irqrestore(&sim->lock, flags);
+}
+
+static void kvaser_pciefd_sim_set_mute(struct kvaser_pciefd_sim *sim,
+				       unsigned int ch, bool mute)
+{
+	unsigned long flags;
+
+	spin_lock_irqsave(&sim->lock, flags);
+	sim->can[ch].mute = mute;
+	spin_unlock_irqrestore(&sim->lock, flags);
+}
+
+static int kvaser_pciefd_sim_capture_rcv(struct sk_buff *skb,
+					 struct net_device *netdev,
+					 struct packet_type *pt,
+					 struct net_device *orig_dev)
+{
+	struct kvaser_pciefd_sim *sim =
+		container_of(pt, struct kvaser_pciefd_sim, capture);
+	/* The clone shares the hardware timestamp */
+	struct sk_buff *clone = skb_clone(skb, GFP_ATOMIC);
+
+	if (clone)
+		skb_queue_tail(&sim->captured, clone);
+	consume_skb(skb);
+
+	return NET_RX_SUCCESS;
+}
+
+/* Keep the frames passed to the stack on a channel, echoed Tx frames too */
+static void kvaser_pciefd_sim_capture(struct kvaser_pciefd_sim *sim,
+				      unsigned int ch)
+{
+	sim->capture.type = htons(ETH_P_ALL);
+	sim->capture.dev = sim->pcie->can[ch]->can.dev;
+	sim->capture.func = kvaser_pciefd_sim_capture_rcv;
+	dev_add_pack(&sim->capture);
+}
+
+static const struct kvaser_pciefd_driver_data *const kvaser_pciefd_sim_boards[] = {
+	&kvaser_pciefd_altera_driver_data,
+	&kvaser_pciefd_sf2_driver_data,
+};
+
+static void
+kvaser_pciefd_sim_board_desc(const struct kvaser_pciefd_driver_data *const *data,
+			     char *desc)
+{
+	strscpy(desc, *data == &kvaser_pciefd_altera_driver_data ? "altera" : "sf2",
+		KUNIT_PARAM_DESC_SIZE);
+}
+
+KUNIT_ARRAY_PARAM(kvaser_pciefd_sim_board, kvaser_pciefd_sim_boards,
+		  kvaser_pciefd_sim_board_desc);
+
+/* Probe a simulated two channel board with the register layout given by the
+ * test parameter. This follows kvaser_pciefd_probe(), except for the PCI
+ * device, the IRQ and the DMA mapping.
+ */
+static struct kvaser_pciefd_sim *kvaser_pciefd_sim_setup(struct kunit *test)
+{
+	const struct kvaser_pciefd_driver_data *const *board = test->param_value;
+	const struct kvaser_pciefd_address_offset *o;
+	struct kvaser_pciefd_sim *sim;
+	struct kvaser_pciefd *pcie;
+	int i;
+
+	sim = kunit_kzalloc(test, sizeof(*sim), GFP_KERNEL);
+	KUNIT_ASSERT_NOT_NULL(test, sim);
+	spin_lock_init(&sim->lock);
+	INIT_WORK(&sim->irq_work, kvaser_pciefd_sim_irq_work);
+	skb_queue_head_init(&sim->captured);
+	sim->offset = (*board)->address_offset;
+	sim->irq_mask = (*board)->irq_mask;
+	sim->regs = vzalloc(KVASER_PCIEFD_SIM_BAR_SIZE);
+	KUNIT_ASSERT_NOT_NULL(test, sim->regs);
+	sim->bar = (void __iomem __force *)sim->regs;
+	test->priv = sim;
+	o = sim->offset;
+
+	*kvaser_pciefd_sim_reg(sim, o->sysid + KVASER_PCIEFD_SYSID_VERSION_REG) =
+		KVASER_PCIEFD_SIM_CHANNELS << KVASER_PCIEFD_SYSID_VERSION_NRCHAN_SHIFT |
+		1 << KVASER_PCIEFD_SYSID_VERSION_MAJOR_SHIFT | 19;
+	*kvaser_pciefd_sim_reg(sim, o->sysid + KVASER_PCIEFD_SYSID_CANFREQ_REG) =
+		KVASER_PCIEFD_SIM_CAN_FREQ;
+	*kvaser_pciefd_sim_reg(sim, o->sysid + KVASER_PCIEFD_SYSID_BUSFREQ_REG) =
+		KVASER_PCIEFD_SIM_BUS_FREQ;
+	*kvaser_pciefd_sim_reg(sim, o->sysid + KVASER_PCIEFD_SYSID_BUILD_REG) =
+		1234 << KVASER_PCIEFD_SYSID_BUILD_SHIFT;
+	/* The controllers come out of reset in reset mode */
+	for (i = 0; i < KVASER_PCIEFD_SIM_CHANNELS; i++) {
+		*kvaser_pciefd_sim_kcan_reg(sim, i, KVASER_PCIEFD_KCAN_MODE_REG) =
+			KVASER_PCIEFD_KCAN_MODE_RM;
+		sim->can[i].in_reset = true;
+	}
+
+	pcie = kunit_kzalloc(test, sizeof(*pcie), GFP_KERNEL);
+	KUNIT_ASSERT_NOT_NULL(test, pcie);
+	pcie->pci = kunit_kzalloc(test, sizeof(*pcie->pci), GFP_KERNEL);
+	KUNIT_ASSERT_NOT_NULL(test, pcie->pci);
+	pcie->pci->dev.init_name = "kvaser_pciefd_sim";
+	pcie->driver_data = *board;
+	pcie->reg_base = sim->bar;
+	u64_stats_init(&pcie->stats.syncp);
+	for (i = 0; i < KVASER_PCIEFD_DMA_COUNT; i++) {
+		pcie->dma_data[i] = kunit_kzalloc(test, KVASER_PCIEFD_DMA_SIZE,
+						  GFP_KERNEL);
+		KUNIT_ASSERT_NOT_NULL(test, pcie->dma_data[i]);
+	}
+	sim->pcie = pcie;
+	WRITE_ONCE(kvaser_pciefd_sim_active, sim);
+
+	KUNIT_ASSERT_EQ(test, kvaser_pciefd_setup_board(pcie), 0);
+	KUNIT_ASSERT_EQ(test, pcie->nr_channels, KVASER_PCIEFD_SIM_CHANNELS);
+	KUNIT_ASSERT_EQ(test, pcie->freq, KVASER_PCIEFD_SIM_CAN_FREQ);
+
+	/* The register part of kvaser_pciefd_setup_dma() */
+	KVASER_PCIEFD_SRB_DMA_DISABLE(pcie);
+	KVASER_PCIEFD_SRB_CMD_SET(pcie, KVASER_PCIEFD_SRB_CMD_FOR |
+					KVASER_PCIEFD_SRB_CMD_RDB0 |
+					KVASER_PCIEFD_SRB_CMD_RDB1);
+	KUNIT_ASSERT_TRUE(test, KVASER_PCIEFD_SRB_STAT_GET(pcie) &
+				KVASER_PCIEFD_SRB_STAT_DI);
+	KVASER_PCIEFD_SRB_DMA_ENABLE(pcie);
+
+	KUNIT_ASSERT_EQ(test, kvaser_pciefd_setup_can_ctrls(pcie), 0);
+	for (i = 0; i < pcie->nr_channels; i++) {
+		struct kvaser_pciefd_can *can = pcie->can[i];
+
+		KUNIT_EXPECT_EQ(test, can->can.echo_skb_max,
+				KVASER_PCIEFD_CAN_TX_MAX_COUNT);
+		/* The PCI device is not registered, leave it out of sysfs */
+		SET_NETDEV_DEV(can->can.dev, NULL);
+		can->can.ctrlmode |= CAN_CTRLMODE_FD;
+		can->can.dev->mtu = CANFD_MTU;
+		can->can.bittiming.bitrate = 500000;
+		can->can.data_bittiming.bitrate = 2000000;
+	}
+	KUNIT_ASSERT_EQ(test, kvaser_pciefd_reg_candev(pcie), 0);
+	sim->registered = true;
+
+	KVASER_PCIEFD_SRB_IRQ_SET(pcie, KVASER_PCIEFD_SRB_IRQ_DPD0 |
+					KVASER_PCIEFD_SRB_IRQ_DPD1);
+	KVASER_PCIEFD_SRB_IEN_ENABLE_ALL(pcie);
+	KVASER_PCIEFD_PCI_IEN_ENABLE_ALL(pcie);
+	KVASER_PCIEFD_SRB_CMD_SET(pcie, KVASER_PCIEFD_SRB_CMD_RDB0);
+	KVASER_PCIEFD_SRB_CMD_SET(pcie, KVASER_PCIEFD_SRB_CMD_RDB1);
+
+	return sim;
+}
+
+static void kvaser_pciefd_sim_exit(struct kunit *test)
+{
+	struct kvaser_pciefd_sim *sim = test->priv;
+	struct kvaser_pciefd *pcie;
+	int i;
+
+	if (!sim)
+		return;
+
+	pcie = sim->pcie;
+	if (sim->capture.func)
+		dev_remove_pack(&sim->capture);
+	skb_queue_purge(&sim->captured);
+
+	if (pcie) {
+		/* Take down channels left open, the handshake needs the IRQ */
+		kvaser_pciefd_sim_set_direct(sim, false);
+		for (i = 0; i < pcie->nr_channels; i++) {
+			if (test_bit(i, &sim->opened))
+				kvaser_pciefd_stop(pcie->can[i]->can.dev);
+		}
+		kvaser_pciefd_sim_set_direct(sim, true);
+
+		for (i = 0; i < pcie->nr_channels; i++) {
+			if (pcie->can[i])
+				del_timer_sync(&pcie->can[i]->bec_poll_timer);
+		}
+		KVASER_PCIEFD_PCI_IEN_DISABLE_ALL(pcie);
+
+		if (sim->registered)
+			kvaser_pciefd_remove_all_ctrls(pcie);
+		else
+			kvaser_pciefd_teardown_can_ctrls(pcie);
+		KVASER_PCIEFD_SRB_DMA_DISABLE(pcie);
+	}
+
+	WRITE_ONCE(kvaser_pciefd_sim_active, NULL);
+	vfree(sim->regs);
+}
+
+static void kvaser_pciefd_sim_open(struct kunit *test,
+				   struct kvaser_pciefd_sim *sim,
+				   unsigned int ch)
+{
+	struct kvaser_pciefd_can *can = sim->pcie->can[ch];
+
+	KUNIT_ASSERT_EQ(test, kvaser_pciefd_open(can->can.dev), 0);
+	set_bit(ch, &sim->opened);
+	kvaser_pciefd_sim_sync(sim);
+	KUNIT_ASSERT_EQ(test, can->can.state, CAN_STATE_ERROR_ACTIVE);
+}
+
+static int kvaser_pciefd_sim_stop(struct kvaser_pciefd_sim *sim,
+				  unsigned int ch)
+{
+	int ret;
+
+	ret = kvaser_pciefd_stop(sim->pcie->can[ch]->can.dev);
+	clear_bit(ch, &sim->opened);
+	kvaser_pciefd_sim_sync(sim);
+
+	return ret;
+}
+
+static struct sk_buff *kvaser_pciefd_sim_alloc_skb(struct kunit *test,
+						   struct kvaser_pciefd_can *can,
+						   const struct canfd_frame *frame,
+						   bool fd)
+{
+	struct canfd_frame *cf;
+	struct sk_buff *skb;
+
+	if (fd)
+		skb = alloc_canfd_skb(can->can.dev, &cf);
+	else
+		skb = alloc_can_skb(can->can.dev, (struct can_frame **)&cf);
+	KUNIT_ASSERT_NOT_NULL(test, skb);
+
+	cf->can_id = frame->can_id;
+	cf->len = frame->len;
+	if (fd)
+		cf->flags = frame->flags;
+	memcpy(cf->data, frame->data, frame->len);
+
+	return skb;
+}
+
+static netdev_tx_t kvaser_pciefd_sim_xmit_skb(struct kvaser_pciefd_can *can,
+					      struct sk_buff *skb)
+{
+	netdev_tx_t ret;
+
+	/* The stack transmits with bottom halves disabled */
+	local_bh_disable();
+	ret = kvaser_pciefd_start_xmit(skb, can->can.dev);
+	local_bh_enable();
+
+	if (ret == NETDEV_TX_BUSY)
+		kfree_skb(skb);
+
+	return ret;
+}
+
+static netdev_tx_t kvaser_pciefd_sim_xmit(struct kunit *test,
+					  struct kvaser_pciefd_can *can,
+					  const struct canfd_frame *frame,
+					  bool fd)
+{
+	return kvaser_pciefd_sim_xmit_skb(can,
+					  kvaser_pciefd_sim_alloc_skb(test, can,
+								      frame, fd));
+}
+
+static void kvaser_pciefd_sim_fill_frame(struct canfd_frame *cf, canid_t id,
+					 u8 len, u8 flags)
+{
+	int i;
+
+	memset(cf, 0, sizeof(*cf));
+	cf->can_id = id;
+	cf->len = len;
+	cf->flags = flags;
+	for (i = 0; i < len; i++)
+		cf->data[i] = id + i;
+}
+
+static struct sk_buff *kvaser_pciefd_sim_captured(struct kunit *test,
+						  struct kvaser_pciefd_sim *sim)
+{
+	struct sk_buff *skb = skb_dequeue(&sim->captured);
+
+	KUNIT_ASSERT_NOT_NULL(test, skb);
+
+	return skb;
+}
+
+/* Check a captured frame and its hardware timestamp, then free it */
+static void kvaser_pciefd_sim_expect_frame(struct kunit *test,
+					   struct kvaser_pciefd_sim *sim,
+					   const struct canfd_frame *ref,
+					   bool fd, u64 ticks)
+{
+	struct sk_buff *skb = kvaser_pciefd_sim_captured(test, sim);
+	const struct canfd_frame *cf = (const struct canfd_frame *)skb->data;
+	s64 ns = ktime_to_ns(skb_hwtstamps(skb)->hwtstamp);
+	s64 ref_ns = kvaser_pciefd_test_ticks_to_ns(ticks,
+						    KVASER_PCIEFD_SIM_CAN_FREQ);
+
+	KUNIT_EXPECT_EQ(test, can_is_canfd_skb(skb), fd);
+	KUNIT_EXPECT_EQ(test, cf->can_id, ref->can_id);
+	KUNIT_EXPECT_EQ(test, cf->len, ref->len);
+	if (fd)
+		KUNIT_EXPECT_EQ(test, cf->flags & (CANFD_BRS | CANFD_ESI),
+				ref->flags & (CANFD_BRS | CANFD_ESI));
+	if (!(ref->can_id & CAN_RTR_FLAG))
+		KUNIT_EXPECT_EQ(test, memcmp(cf->data, ref->data, ref->len), 0);
+	KUNIT_EXPECT_LE(test, abs(ns - ref_ns), 1);
+
+	kfree_skb(skb);
+}
+
+/* Data, error and unexpected packets in one DMA buffer, decoded by the IRQ
+ * handler into frames with hardware timestamps
+ */
+static void kvaser_pciefd_sim_read_buffer_test(struct kunit *test)
+{
+	struct kvaser_pciefd_sim *sim = kvaser_pciefd_sim_setup(test);
+	struct kvaser_pciefd *pcie = sim->pcie;
+	struct net_device *netdev = pcie->can[0]->can.dev;
+	struct kvaser_pciefd_can *can1 = pcie->can[1];
+	static const bool fd[] = { false, false, true, true };
+	struct canfd_frame frames[4];
+	unsigned long flags;
+	u64 ticks;
+	int i;
+
+	kvaser_pciefd_sim_set_direct(sim, true);
+	kvaser_pciefd_sim_capture(sim, 0);
+
+	kvaser_pciefd_sim_fill_frame(&frames[0], 0x123, 8, 0);
+	kvaser_pciefd_sim_fill_frame(&frames[1], CAN_EFF_FLAG | CAN_RTR_FLAG |
+				     0x1abcdef, 4, 0);
+	kvaser_pciefd_sim_fill_frame(&frames[2], CAN_EFF_FLAG | 0x1fffffff,
+				     64, CANFD_BRS | CANFD_ESI);
+	kvaser_pciefd_sim_fill_frame(&frames[3], 0x7ff, 12, CANFD_BRS);
+
+	ticks = sim->ticks;
+	for (i = 0; i < ARRAY_SIZE(frames); i++)
+		kvaser_pciefd_sim_rx(sim, 0, &frames[i], fd[i]);
+	kvaser_pciefd_sim_error(sim, 1, 100, 0, 0);
+	spin_lock_irqsave(&sim->lock, flags);
+	kvaser_pciefd_sim_ctrl_ack(sim, &sim->can[0],
+				   KVASER_PCIEFD_PACK_TYPE_BUS_LOAD);
+	spin_unlock_irqrestore(&sim->lock, flags);
+
+	/* All in one buffer and one interrupt */
+	KUNIT_EXPECT_EQ(test, kvaser_pciefd_sim_service(sim), 1U);
+
+	for (i = 0; i < ARRAY_SIZE(frames); i++) {
+		ticks += KVASER_PCIEFD_SIM_PACKET_TICKS;
+		kvaser_pciefd_sim_expect_frame(test, sim, &frames[i], fd[i],
+					       ticks);
+	}
+	KUNIT_EXPECT_EQ(test, netdev->stats.rx_packets, 4UL);
+	KUNIT_EXPECT_EQ(test, netdev->stats.rx_bytes, 8UL + 64 + 12);
+
+	KUNIT_EXPECT_EQ(test, can1->can.state, CAN_STATE_ERROR_WARNING);
+	KUNIT_EXPECT_EQ(test, can1->bec.txerr, 100);
+	KUNIT_EXPECT_EQ(test, can1->can.can_stats.bus_error, 1U);
+	KUNIT_EXPECT_EQ(test, can1->can.dev->stats.rx_errors, 1UL);
+
+	KUNIT_EXPECT_EQ(test, pcie->stats.unexpected_packets, 1ULL);
+	KUNIT_EXPECT_EQ(test, pcie->stats.dma_buffers, 1ULL);
+	KUNIT_EXPECT_EQ(test, pcie->stats.dma_packets, 6ULL);
+	KUNIT_EXPECT_EQ(test, pcie->stats.irqs, 1ULL);
+	KUNIT_EXPECT_EQ(test, sim->srb_irq, 0U);
+	KUNIT_EXPECT_TRUE(test, sim->dma_ready[0]);
+	KUNIT_EXPECT_TRUE(test, sim->dma_ready[1]);
+}
+
+static int kvaser_pciefd_sim_read_buffer(struct kvaser_pciefd *pcie)
+{
+	int ret;
+
+	local_bh_disable();
+	ret = kvaser_pciefd_read_buffer(pcie, 0);
+	local_bh_enable();
+
+	return ret;
+}
+
+/* The parser stops at a malformed packet of a DMA buffer */
+static void kvaser_pciefd_sim_read_buffer_malformed_test(struct kunit *test)
+{
+	struct kvaser_pciefd_sim *sim = kvaser_pciefd_sim_setup(test);
+	struct kvaser_pciefd *pcie = sim->pcie;
+	struct net_device *netdev = pcie->can[0]->can.dev;
+	u32 header1 = kvaser_pciefd_sim_header1(KVASER_PCIEFD_PACK_TYPE_DATA, 0) |
+		      8 << KVASER_PCIEFD_RPACKET_DLC_SHIFT;
+	static const u32 data[2] = { 0x03020100, 0x07060504 };
+	__le32 *buf = pcie->dma_data[0];
+
+	/* The buffers are written here, keep the simulation off them */
+	kvaser_pciefd_sim_set_direct(sim, true);
+
+	/* A size word one too large, the packet after it is never reached */
+	kvaser_pciefd_sim_write_packet(buf, 0x100, header1, 1, data, 2);
+	kvaser_pciefd_sim_write_packet(buf + 7, 0x101, header1, 2, data, 2);
+	buf[7] = cpu_to_le32(8);
+	kvaser_pciefd_sim_write_packet(buf + 14, 0x102, header1, 3, data, 2);
+	KUNIT_EXPECT_EQ(test, kvaser_pciefd_sim_read_buffer(pcie), -EIO);
+	KUNIT_EXPECT_EQ(test, netdev->stats.rx_packets, 2UL);
+
+	/* Unknown packet type */
+	kvaser_pciefd_sim_write_packet(buf, 0, kvaser_pciefd_sim_header1(0xf, 0),
+				       4, NULL, 0);
+	KUNIT_EXPECT_EQ(test, kvaser_pciefd_sim_read_buffer(pcie), -EIO);
+
+	/* Channel beyond the channels of the board */
+	kvaser_pciefd_sim_write_packet(buf, 0x100,
+				       kvaser_pciefd_sim_header1(KVASER_PCIEFD_PACK_TYPE_DATA,
+								 KVASER_PCIEFD_SIM_CHANNELS),
+				       5, NULL, 0);
+	KUNIT_EXPECT_EQ(test, kvaser_pciefd_sim_read_buffer(pcie), -EIO);
+	KUNIT_EXPECT_EQ(test, netdev->stats.rx_packets, 2UL);
+
+	/* An empty buffer */
+	buf[0] = 0;
+	KUNIT_EXPECT_EQ(test, kvaser_pciefd_sim_read_buffer(pcie), 0);
+	KUNIT_EXPECT_EQ(test, pcie->stats.dma_buffers, 4ULL);
+	KUNIT_EXPECT_EQ(test, pcie->stats.dma_packets, 1ULL);
+}
+
+/* Frames written to the Tx FIFO, their acknowledgments and the echo */
+static void kvaser_pciefd_sim_xmit_test(struct kunit *test)
+{
+	struct kvaser_pciefd_sim *sim = kvaser_pciefd_sim_setup(test);
+	struct kvaser_pciefd_can *can = sim->pcie->can[0];
+	struct net_device *netdev = can->can.dev;
+	struct kvaser_pciefd_sim_can *sc = &sim->can[0];
+	static const bool fd[] = { false, false, true, true };
+	struct canfd_frame frames[4];
+	u64 ticks;
+	int i;
+
+	kvaser_pciefd_sim_open(test, sim, 0);
+	kvaser_pciefd_sim_set_direct(sim, true);
+	kvaser_pciefd_sim_capture(sim, 0);
+
+	kvaser_pciefd_sim_fill_frame(&frames[0], 0x7ff, 8, 0);
+	kvaser_pciefd_sim_fill_frame(&frames[1], CAN_EFF_FLAG | CAN_RTR_FLAG |
+				     0x1fffffff, 0, 0);
+	kvaser_pciefd_sim_fill_frame(&frames[2], CAN_EFF_FLAG | 0x12345, 64,
+				     CANFD_BRS);
+	kvaser_pciefd_sim_fill_frame(&frames[3], 0x42, 12, 0);
+
+	for (i = 0; i < ARRAY_SIZE(frames); i++)
+		KUNIT_EXPECT_EQ(test, kvaser_pciefd_sim_xmit(test, can, &frames[i],
+							     fd[i]),
+				NETDEV_TX_OK);
+
+	KUNIT_ASSERT_EQ(test, sc->count, 4U);
+	for (i = 0; i < ARRAY_SIZE(frames); i++) {
+		struct kvaser_pciefd_sim_tx *tx =
+			&sc->fifo[(sc->head + i) % KVASER_PCIEFD_SIM_TX_FIFO];
+		canid_t id = frames[i].can_id;
+
+		KUNIT_EXPECT_EQ(test, tx->header[0] & CAN_EFF_MASK,
+				id & CAN_EFF_MASK);
+		KUNIT_EXPECT_EQ(test, !!(tx->header[0] & KVASER_PCIEFD_RPACKET_IDE),
+				!!(id & CAN_EFF_FLAG));
+		KUNIT_EXPECT_EQ(test, !!(tx->header[0] & KVASER_PCIEFD_RPACKET_RTR),
+				!!(id & CAN_RTR_FLAG));
+		KUNIT_EXPECT_EQ(test, (tx->header[1] >> KVASER_PCIEFD_RPACKET_DLC_SHIFT) & 0xf,
+				(u32)can_fd_len2dlc(frames[i].len));
+		KUNIT_EXPECT_EQ(test, !!(tx->header[1] & KVASER_PCIEFD_RPACKET_FDF),
+				fd[i]);
+		KUNIT_EXPECT_EQ(test, !!(tx->header[1] & KVASER_PCIEFD_RPACKET_BRS),
+				!!(frames[i].flags & CANFD_BRS));
+		KUNIT_EXPECT_TRUE(test, tx->header[1] & KVASER_PCIEFD_TPACKET_AREQ);
+		KUNIT_EXPECT_EQ(test, tx->header[1] & KVASER_PCIEFD_PACKET_SEQ_MASK,
+				(u32)i);
+		KUNIT_EXPECT_EQ(test, tx->nwords, DIV_ROUND_UP(frames[i].len, 4U));
+		KUNIT_EXPECT_EQ(test, memcmp(tx->data, frames[i].data,
+					     frames[i].len), 0);
+	}
+
+	/* Echoed with the timestamp of the acknowledgment */
+	ticks = sim->ticks;
+	KUNIT_EXPECT_EQ(test, kvaser_pciefd_sim_transmit(sim, 0, 4, 0), 4U);
+	KUNIT_EXPECT_EQ(test, kvaser_pciefd_sim_service(sim), 1U);
+	KUNIT_EXPECT_EQ(test, netdev->stats.tx_packets, 4UL);
+	KUNIT_EXPECT_EQ(test, netdev->stats.tx_bytes, 8UL + 64 + 12);
+	for (i = 0; i < ARRAY_SIZE(frames); i++) {
+		ticks += KVASER_PCIEFD_SIM_PACKET_TICKS;
+		kvaser_pciefd_sim_expect_frame(test, sim, &frames[i], fd[i],
+					       ticks);
+	}
+	for (i = 0; i < can->can.echo_skb_max; i++)
+		KUNIT_EXPECT_NULL(test, can->can.echo_skb[i]);
+
+	/* Not acknowledged, and lost arbitration */
+	kvaser_pciefd_sim_xmit(test, can, &frames[0], false);
+	kvaser_pciefd_sim_xmit(test, can, &frames[0], false);
+	kvaser_pciefd_sim_transmit(sim, 0, 1, KVASER_PCIEFD_APACKET_NACK);
+	kvaser_pciefd_sim_transmit(sim, 0, 1, KVASER_PCIEFD_APACKET_NACK |
+				   KVASER_PCIEFD_APACKET_ABL);
+	kvaser_pciefd_sim_service(sim);
+	KUNIT_EXPECT_EQ(test, netdev->stats.tx_packets, 4UL);
+	KUNIT_EXPECT_EQ(test, netdev->stats.tx_errors, 2UL);
+	KUNIT_EXPECT_EQ(test, can->stats.nacks, 1ULL);
+	KUNIT_EXPECT_EQ(test, can->stats.arbitration_lost, 1ULL);
+	KUNIT_EXPECT_EQ(test, can->can.can_stats.arbitration_lost, 1U);
+	skb_queue_purge(&sim->captured);
+
+	/* The queue stops when all echo slots are in use */
+	for (i = 0; i < can->can.echo_skb_max; i++)
+		KUNIT_EXPECT_EQ(test, kvaser_pciefd_sim_xmit(test, can, &frames[0],
+							     false),
+				NETDEV_TX_OK);
+	KUNIT_EXPECT_TRUE(test, netif_tx_queue_stopped(netdev_get_tx_queue(netdev, 0)));
+	KUNIT_EXPECT_EQ(test, kvaser_pciefd_sim_xmit(test, can, &frames[0], false),
+			NETDEV_TX_BUSY);
+	KUNIT_EXPECT_EQ(test, sc->count, can->can.echo_skb_max);
+
+	/* One acknowledgment wakes it */
+	kvaser_pciefd_sim_transmit(sim, 0, 1, 0);
+	kvaser_pciefd_sim_service(sim);
+	KUNIT_EXPECT_FALSE(test, netif_tx_queue_stopped(netdev_get_tx_queue(netdev, 0)));
+	KUNIT_EXPECT_EQ(test, kvaser_pciefd_sim_xmit(test, can, &frames[0], false),
+			NETDEV_TX_OK);
+
+	/* Stop flushes whatever is left in the FIFO */
+	kvaser_pciefd_sim_set_direct(sim, false);
+	KUNIT_EXPECT_EQ(test, kvaser_pciefd_sim_stop(sim, 0), 0);
+	KUNIT_EXPECT_EQ(test, can->stats.flushed_packets,
+			(u64)can->can.echo_skb_max);
+}
+
+/* Like the stack, only hand a frame to start_xmit if its Tx queue runs */
+static netdev_tx_t kvaser_pciefd_sim_xmit_mq(struct kunit *test,
+					     struct kvaser_pciefd_can *can,
+					     const struct canfd_frame *frame)
+{
+	struct net_device *netdev = can->can.dev;
+	struct sk_buff *skb;
+	u16 queue;
+
+	skb = kvaser_pciefd_sim_alloc_skb(test, can, frame, false);
+	queue = kvaser_txq_select(netdev, skb, &kvaser_pciefd_txq_params);
+	skb_set_queue_mapping(skb, queue);
+	if (netif_tx_queue_stopped(netdev_get_tx_queue(netdev, queue))) {
+		kfree_skb(skb);
+		return NETDEV_TX_BUSY;
+	}
+
+	return kvaser_pciefd_sim_xmit_skb(can, skb);
+}
+
+/* A backlog of bulk frames does not hold back a frame of the top priority
+ * class. It goes out behind at most the share of the bulk queue.
+ */
+static void kvaser_pciefd_sim_tx_priority_test(struct kunit *test)
+{
+	unsigned int queues = kvaser_pciefd_txq_params.queues;
+	struct kvaser_pciefd_sim *sim;
+	struct kvaser_pciefd_can *can;
+	struct net_device *netdev;
+	struct canfd_frame bulk, top;
+	unsigned int i, nbulk, bulk_limit;
+	u64 ticks;
+
+	kvaser_pciefd_txq_params.queues = KVASER_TXQ_MAX_QUEUES;
+	sim = kvaser_pciefd_sim_setup(test);
+	kvaser_pciefd_txq_params.queues = queues;
+	can = sim->pcie->can[0];
+	netdev = can->can.dev;
+	KUNIT_ASSERT_EQ(test, netdev->real_num_tx_queues, KVASER_TXQ_MAX_QUEUES);
+
+	kvaser_pciefd_sim_open(test, sim, 0);
+	kvaser_pciefd_sim_set_direct(sim, true);
+	kvaser_pciefd_sim_capture(sim, 0);
+
+	kvaser_pciefd_sim_fill_frame(&bulk, CAN_SFF_MASK, 8, 0);
+	kvaser_pciefd_sim_fill_frame(&top, 0x001, 8, 0);
+	bulk_limit = kvaser_txq_limit(netdev, can->can.echo_skb_max,
+				      KVASER_TXQ_MAX_QUEUES - 1);
+	KUNIT_ASSERT_LT(test, bulk_limit, can->can.echo_skb_max);
+
+	/* Keep the bulk queue busy, the frames past its share stay queued */
+	nbulk = 0;
+	for (i = 0; i < can->can.echo_skb_max; i++)
+		if (kvaser_pciefd_sim_xmit_mq(test, can, &bulk) == NETDEV_TX_OK)
+			nbulk++;
+	KUNIT_EXPECT_EQ(test, nbulk, bulk_limit);
+	KUNIT_EXPECT_TRUE(test, netif_tx_queue_stopped(netdev_get_tx_queue(netdev,
+						KVASER_TXQ_MAX_QUEUES - 1)));
+	KUNIT_EXPECT_FALSE(test, netif_tx_queue_stopped(netdev_get_tx_queue(netdev, 0)));
+
+	KUNIT_ASSERT_EQ(test, kvaser_pciefd_sim_xmit_mq(test, can, &top),
+			NETDEV_TX_OK);
+	KUNIT_EXPECT_EQ(test, sim->can[0].count, bulk_limit + 1);
+
+	/* The top frame is acknowledged right after the bulk frames that were
+	 * already in the FIFO, whatever the length of the bulk backlog
+	 */
+	ticks = sim->ticks;
+	KUNIT_EXPECT_EQ(test, kvaser_pciefd_sim_transmit(sim, 0, bulk_limit + 1, 0),
+			bulk_limit + 1);
+	kvaser_pciefd_sim_service(sim);
+	for (i = 0; i < bulk_limit; i++) {
+		ticks += KVASER_PCIEFD_SIM_PACKET_TICKS;
+		kvaser_pciefd_sim_expect_frame(test, sim, &bulk, false, ticks);
+	}
+	ticks += KVASER_PCIEFD_SIM_PACKET_TICKS;
+	kvaser_pciefd_sim_expect_frame(test, sim, &top, false, ticks);
+	KUNIT_EXPECT_TRUE(test, skb_queue_empty(&sim->captured));
+
+	/* The acknowledgments wake the bulk queue again */
+	KUNIT_EXPECT_FALSE(test, netif_tx_queue_stopped(netdev_get_tx_queue(netdev,
+						KVASER_TXQ_MAX_QUEUES - 1)));
+	KUNIT_EXPECT_EQ(test, kvaser_pciefd_sim_xmit_mq(test, can, &bulk),
+			NETDEV_TX_OK);
+}
+
+/* Reset mode, abort and end of flush handshakes of bus on and stop */
+static void kvaser_pciefd_sim_bus_on_flush_test(struct kunit *test)
+{
+	struct kvaser_pciefd_sim *sim = kvaser_pciefd_sim_setup(test);
+	struct kvaser_pciefd_can *can = sim->pcie->can[0];
+	struct net_device *netdev = can->can.dev;
+	struct kvaser_pciefd_sim_can *sc = &sim->can[0];
+	struct canfd_frame cf;
+	u32 mode;
+	int i;
+
+	kvaser_pciefd_sim_open(test, sim, 0);
+	mode = KVASER_PCIEFD_KCAN_MODE_GET(can);
+	KUNIT_EXPECT_FALSE(test, sc->in_reset);
+	KUNIT_EXPECT_FALSE(test, mode & KVASER_PCIEFD_KCAN_MODE_RM);
+	KUNIT_EXPECT_FALSE(test, mode & KVASER_PCIEFD_KCAN_MODE_CCM);
+	KUNIT_EXPECT_TRUE(test, mode & KVASER_PCIEFD_KCAN_MODE_EEN);
+	KUNIT_EXPECT_TRUE(test, mode & KVASER_PCIEFD_KCAN_MODE_EPEN);
+	KUNIT_EXPECT_EQ(test, *kvaser_pciefd_sim_kcan_reg(sim, 0, KVASER_PCIEFD_KCAN_IEN_REG),
+			(u32)(KVASER_PCIEFD_KCAN_IRQ_TOF | KVASER_PCIEFD_KCAN_IRQ_ABD |
+			      KVASER_PCIEFD_KCAN_IRQ_TAE | KVASER_PCIEFD_KCAN_IRQ_TAL |
+			      KVASER_PCIEFD_KCAN_IRQ_FDIC | KVASER_PCIEFD_KCAN_IRQ_BPP |
+			      KVASER_PCIEFD_KCAN_IRQ_TAR));
+	/* The other channel stays in reset */
+	KUNIT_EXPECT_TRUE(test, sim->can[1].in_reset);
+
+	/* Stop with frames in the Tx FIFO, they are flushed */
+	kvaser_pciefd_sim_fill_frame(&cf, 0x10, 8, 0);
+	for (i = 0; i < 3; i++)
+		kvaser_pciefd_sim_xmit(test, can, &cf, false);
+	KUNIT_EXPECT_EQ(test, sc->count, 3U);
+	KUNIT_EXPECT_EQ(test, kvaser_pciefd_sim_stop(sim, 0), 0);
+	KUNIT_EXPECT_EQ(test, can->can.state, CAN_STATE_STOPPED);
+	KUNIT_EXPECT_EQ(test, can->stats.flushed_packets, 3ULL);
+	KUNIT_EXPECT_EQ(test, sc->count, 0U);
+	KUNIT_EXPECT_TRUE(test, sc->in_reset);
+	for (i = 0; i < can->can.echo_skb_max; i++)
+		KUNIT_EXPECT_NULL(test, can->can.echo_skb[i]);
+
+	/* Again from an idle controller in reset mode, then a restart */
+	kvaser_pciefd_sim_open(test, sim, 0);
+	KUNIT_EXPECT_EQ(test, kvaser_pciefd_set_mode(netdev, CAN_MODE_START), 0);
+	kvaser_pciefd_sim_sync(sim);
+	KUNIT_EXPECT_EQ(test, can->can.state, CAN_STATE_ERROR_ACTIVE);
+	KUNIT_EXPECT_FALSE(test, sc->in_reset);
+
+	/* A controller that never ends the flush */
+	kvaser_pciefd_sim_set_mute(sim, 0, true);
+	KUNIT_EXPECT_EQ(test, kvaser_pciefd_sim_stop(sim, 0), -ETIMEDOUT);
+	KUNIT_EXPECT_EQ(test, can->can.state, CAN_STATE_STOPPED);
+
+	/* It recovers on the next bus on */
+	kvaser_pciefd_sim_set_mute(sim, 0, false);
+	kvaser_pciefd_sim_open(test, sim, 0);
+	KUNIT_EXPECT_EQ(test, kvaser_pciefd_sim_stop(sim, 0), 0);
+}
+
+/* Error passive, the error counter poll and bus off */
+static void kvaser_pciefd_sim_bus_error_test(struct kunit *test)
+{
+	struct kvaser_pciefd_sim *sim = kvaser_pciefd_sim_setup(test);
+	struct kvaser_pciefd_can *can = sim->pcie->can[0];
+	struct net_device *netdev = can->can.dev;
+	struct kvaser_pciefd_sim_can *sc = &sim->can[0];
+	unsigned int poll_ms = READ_ONCE(bec_poll_fast_ms);
+	unsigned long flags;
+	int i;
+
+	kvaser_pciefd_sim_open(test, sim, 0);
+
+	WRITE_ONCE(bec_poll_fast_ms, 5);
+	kvaser_pciefd_sim_error(sim, 0, 130, 0, 0);
+	kvaser_pciefd_sim_sync(sim);
+	KUNIT_EXPECT_EQ(test, can->can.state, CAN_STATE_ERROR_PASSIVE);
+	KUNIT_EXPECT_EQ(test, netdev->stats.rx_errors, 1UL);
+
+	/* The counters recover and the poll notices */
+	spin_lock_irqsave(&sim->lock, flags);
+	sc->txerr = 0;
+	spin_unlock_irqrestore(&sim->lock, flags);
+	for (i = 0; i < 100 && can->can.state != CAN_STATE_ERROR_ACTIVE; i++) {
+		msleep(10);
+		kvaser_pciefd_sim_sync(sim);
+	}
+	WRITE_ONCE(bec_poll_fast_ms, poll_ms);
+	KUNIT_EXPECT_EQ(test, can->can.state, CAN_STATE_ERROR_ACTIVE);
+	KUNIT_EXPECT_EQ(test, can->bec.txerr, 0);
+	KUNIT_EXPECT_EQ(test, can->err_rep_cnt, 0);
+
+	/* Bus off without restart_ms takes the controller off the bus */
+	kvaser_pciefd_sim_error(sim, 0, 255, 0, KVASER_PCIEFD_SPACK_BOFF);
+	kvaser_pciefd_sim_sync(sim);
+	KUNIT_EXPECT_EQ(test, can->can.state, CAN_STATE_BUS_OFF);
+	KUNIT_EXPECT_EQ(test, can->can.can_stats.bus_off, 1U);
+	KUNIT_EXPECT_TRUE(test, sc->in_reset);
+	KUNIT_EXPECT_TRUE(test, completion_done(&can->flush_comp));
+	KUNIT_EXPECT_TRUE(test, netif_tx_queue_stopped(netdev_get_tx_queue(netdev, 0)));
+
+	KUNIT_EXPECT_EQ(test, kvaser_pciefd_set_mode(netdev, CAN_MODE_START), 0);
+	kvaser_pciefd_sim_sync(sim);
+	KUNIT_EXPECT_EQ(test, can->can.state, CAN_STATE_ERROR_ACTIVE);
+	KUNIT_EXPECT_FALSE(test, sc->bus_off);
+	KUNIT_EXPECT_FALSE(test, netif_tx_queue_stopped(netdev_get_tx_queue(netdev, 0)));
+	KUNIT_EXPECT_EQ(test, kvaser_pciefd_sim_stop(sim, 0), 0);
+}
+
+/* The PCI, SRB and KCAN interrupt enables gate the IRQ line */
+static void kvaser_pciefd_sim_irq_mask_test(struct kunit *test)
+{
+	struct kvaser_pciefd_sim *sim = kvaser_pciefd_sim_setup(test);
+	struct kvaser_pciefd *pcie = sim->pcie;
+	const struct kvaser_pciefd_irq_mask *irq_mask = pcie->driver_data->irq_mask;
+	struct kvaser_pciefd_can *can = pcie->can[1];
+	struct net_device *netdev = pcie->can[0]->can.dev;
+	unsigned int i, sent;
+	struct canfd_frame cf;
+
+	kvaser_pciefd_sim_open(test, sim, 1);
+	kvaser_pciefd_sim_set_direct(sim, true);
+
+	/* Tx FIFO overflow is enabled, Rx FIFO overflow is not */
+	kvaser_pciefd_sim_raise(sim, 1, KVASER_PCIEFD_KCAN_IRQ_ROF);
+	KUNIT_EXPECT_EQ(test, KVASER_PCIEFD_PCI_IRQ_GET(pcie), 0U);
+	KUNIT_EXPECT_EQ(test, kvaser_pciefd_sim_service(sim), 0U);
+	kvaser_pciefd_sim_raise(sim, 1, KVASER_PCIEFD_KCAN_IRQ_TOF);
+	KUNIT_EXPECT_EQ(test, KVASER_PCIEFD_PCI_IRQ_GET(pcie),
+			irq_mask->kcan_tx[1]);
+	KUNIT_EXPECT_EQ(test, kvaser_pciefd_sim_service(sim), 1U);
+	KUNIT_EXPECT_EQ(test, can->stats.tx_fifo_overflows, 1ULL);
+	/* The handler reads and clears all pending channel interrupts */
+	KUNIT_EXPECT_EQ(test, can->stats.rx_fifo_overflows, 1ULL);
+	KUNIT_EXPECT_EQ(test, sim->can[1].irq, 0U);
+
+	/* Nothing is delivered with the board interrupts disabled */
+	KVASER_PCIEFD_PCI_IEN_DISABLE_ALL(pcie);
+	kvaser_pciefd_sim_fill_frame(&cf, 0x100, 8, 0);
+	kvaser_pciefd_sim_rx(sim, 0, &cf, false);
+	KUNIT_EXPECT_EQ(test, kvaser_pciefd_sim_service(sim), 0U);
+	KUNIT_EXPECT_EQ(test, KVASER_PCIEFD_PCI_IRQ_GET(pcie), irq_mask->kcan_rx0);
+	KUNIT_EXPECT_EQ(test, netdev->stats.rx_packets, 0UL);
+	KVASER_PCIEFD_PCI_IEN_ENABLE_ALL(pcie);
+	KUNIT_EXPECT_EQ(test, kvaser_pciefd_sim_service(sim), 1U);
+	KUNIT_EXPECT_EQ(test, netdev->stats.rx_packets, 1UL);
+
+	/* Both DMA buffers filled and not handed back, the rest overflows */
+	sent = 2 * KVASER_PCIEFD_SIM_DMA_WORDS /
+	       (KVASER_PCIEFD_SIM_HEADER_WORDS + 2) + 8;
+	for (i = 0; i < sent; i++)
+		kvaser_pciefd_sim_rx(sim, 0, &cf, false);
+	KUNIT_EXPECT_GT(test, sim->dma_dropped, 0ULL);
+	kvaser_pciefd_sim_service(sim);
+	KUNIT_EXPECT_EQ(test, pcie->stats.dma_overflows, 1ULL);
+	KUNIT_EXPECT_EQ(test, netdev->stats.rx_packets,
+			(unsigned long)(1 + sent - sim->dma_dropped));
+
+	/* And the buffers are back in use */
+	kvaser_pciefd_sim_rx(sim, 0, &cf, false);
+	KUNIT_EXPECT_EQ(test, kvaser_pciefd_sim_service(sim), 1U);
+	KUNIT_EXPECT_EQ(test, netdev->stats.rx_packets,
+			(unsigned long)(2 + sent - sim->dma_dropped));
+}
+
+struct kvaser_pciefd_sim_profile {
+	const char *name;
+	canid_t id;
+	u8 len;
+	bool fd;
+};
+
+static const struct kvaser_pciefd_sim_profile kvaser_pciefd_sim_profiles[] = {
+	{ "classic 11-bit 8 bytes", 0x123, 8, false },
+	{ "classic 29-bit 0 bytes", CAN_EFF_FLAG | 0x1234567, 0, false },
+	{ "fd 29-bit 64 bytes", CAN_EFF_FLAG | 0x1234567, 64, true },
+};
+
+#define KVASER_PCIEFD_SIM_BENCH_BUFFERS 256U
+#define KVASER_PCIEFD_SIM_BENCH_FRAMES 4096U
+#define KVASER_PCIEFD_SIM_BENCH_IRQS 256U
+
+static u64 kvaser_pciefd_sim_rate(u64 count, u64 ns)
+{
+	return div64_u64(count * NSEC_PER_SEC, max(ns, 1ULL));
+}
+
+/* Receive throughput with full DMA buffers. The time covers the IRQ handler
+ * and passing the frames to the stack, which has no listeners.
+ */
+static void kvaser_pciefd_sim_rx_bench(struct kunit *test)
+{
+	struct kvaser_pciefd_sim *sim = kvaser_pciefd_sim_setup(test);
+	struct net_device *netdev = sim->pcie->can[0]->can.dev;
+	int p;
+
+	kvaser_pciefd_sim_set_direct(sim, true);
+
+	for (p = 0; p < ARRAY_SIZE(kvaser_pciefd_sim_profiles); p++) {
+		const struct kvaser_pciefd_sim_profile *prof =
+			&kvaser_pciefd_sim_profiles[p];
+		unsigned long rx_packets = netdev->stats.rx_packets;
+		u64 frames = 0, decoded, total_ns = 0;
+		struct canfd_frame cf;
+		unsigned int b;
+
+		kvaser_pciefd_sim_fill_frame(&cf, prof->id, prof->len,
+					     prof->fd ? CANFD_BRS : 0);
+		for (b = 0; b < KVASER_PCIEFD_SIM_BENCH_BUFFERS; b++) {
+			unsigned int cur = sim->dma_cur;
+			u64 start_ns;
+
+			/* The frame that does not fit hands the buffer over */
+			while (sim->dma_cur == cur) {
+				kvaser_pciefd_sim_rx(sim, 0, &cf, prof->fd);
+				frames++;
+			}
+
+			start_ns = ktime_get_ns();
+			local_bh_disable();
+			kvaser_pciefd_irq_handler(0, sim->pcie);
+			local_bh_enable();
+			total_ns += ktime_get_ns() - start_ns;
+			cond_resched();
+		}
+		decoded = netdev->stats.rx_packets - rx_packets;
+		kvaser_pciefd_sim_service(sim);
+
+		KUNIT_EXPECT_EQ(test, netdev->stats.rx_packets - rx_packets,
+				(unsigned long)frames);
+		kunit_info(test, "rx %s: %llu ns/frame, %llu frames/s, %llu frames/irq\n",
+			   prof->name, div64_u64(total_ns, max(decoded, 1ULL)),
+			   kvaser_pciefd_sim_rate(decoded, total_ns),
+			   div64_u64(decoded, KVASER_PCIEFD_SIM_BENCH_BUFFERS));
+	}
+	KUNIT_EXPECT_EQ(test, sim->dma_dropped, 0ULL);
+	KUNIT_EXPECT_EQ(test, sim->pcie->stats.dma_overflows, 0ULL);
+}
+
+/* Transmit cost, start_xmit() per frame and the handling of the ACK packets
+ * per frame, a Tx FIFO full of frames acknowledged per interrupt
+ */
+static void kvaser_pciefd_sim_tx_bench(struct kunit *test)
+{
+	struct kvaser_pciefd_sim *sim = kvaser_pciefd_sim_setup(test);
+	struct kvaser_pciefd_can *can = sim->pcie->can[0];
+	struct net_device *netdev = can->can.dev;
+	int p;
+
+	kvaser_pciefd_sim_open(test, sim, 0);
+	kvaser_pciefd_sim_set_direct(sim, true);
+
+	for (p = 0; p < ARRAY_SIZE(kvaser_pciefd_sim_profiles); p++) {
+		const struct kvaser_pciefd_sim_profile *prof =
+			&kvaser_pciefd_sim_profiles[p];
+		unsigned long tx_packets = netdev->stats.tx_packets;
+		u64 xmit_ns = 0, ack_ns = 0;
+		struct canfd_frame cf;
+		unsigned int i;
+
+		kvaser_pciefd_sim_fill_frame(&cf, prof->id, prof->len,
+					     prof->fd ? CANFD_BRS : 0);
+		for (i = 0; i < KVASER_PCIEFD_SIM_BENCH_FRAMES; i++) {
+			struct sk_buff *skb;
+			u64 start_ns;
+
+			skb = kvaser_pciefd_sim_alloc_skb(test, can, &cf, prof->fd);
+			start_ns = ktime_get_ns();
+			KUNIT_ASSERT_EQ(test, kvaser_pciefd_sim_xmit_skb(can, skb),
+					NETDEV_TX_OK);
+			xmit_ns += ktime_get_ns() - start_ns;
+
+			if (sim->can[0].count < can->can.echo_skb_max)
+				continue;
+
+			kvaser_pciefd_sim_transmit(sim, 0, KVASER_PCIEFD_SIM_TX_FIFO, 0);
+			start_ns = ktime_get_ns();
+			kvaser_pciefd_sim_service(sim);
+			ack_ns += ktime_get_ns() - start_ns;
+			cond_resched();
+		}
+		kvaser_pciefd_sim_transmit(sim, 0, KVASER_PCIEFD_SIM_TX_FIFO, 0);
+		kvaser_pciefd_sim_service(sim);
+
+		KUNIT_EXPECT_EQ(test, netdev->stats.tx_packets - tx_packets,
+				(unsigned long)KVASER_PCIEFD_SIM_BENCH_FRAMES);
+		kunit_info(test, "tx %s: xmit %llu ns/frame, %llu frames/s, ack %llu ns/frame\n",
+			   prof->name,
+			   div64_u64(xmit_ns, KVASER_PCIEFD_SIM_BENCH_FRAMES),
+			   kvaser_pciefd_sim_rate(KVASER_PCIEFD_SIM_BENCH_FRAMES,
+						  xmit_ns),
+			   div64_u64(ack_ns, KVASER_PCIEFD_SIM_BENCH_FRAMES));
+	}
+	KUNIT_EXPECT_EQ(test, can->stats.tx_fifo_overflows, 0ULL);
+}
+
+/* IRQ handler time from the irq_timing counters for growing batches of frames
+ * per DMA buffer, then the time from a packet written to the DMA buffer until
+ * the handler has run from the IRQ work
+ */
+static void kvaser_pciefd_sim_irq_latency_bench(struct kunit *test)
+{
+	static const unsigned int batches[] = { 1, 8, 32, 128 };
+	struct kvaser_pciefd_sim *sim = kvaser_pciefd_sim_setup(test);
+	struct kvaser_pciefd *pcie = sim->pcie;
+	bool timing = READ_ONCE(irq_timing);
+	struct canfd_frame cf;
+	unsigned long flags;
+	unsigned int i, j;
+	int b;
+
+	kvaser_pciefd_sim_fill_frame(&cf, 0x123, 8, 0);
+	kvaser_pciefd_sim_set_direct(sim, true);
+	WRITE_ONCE(irq_timing, true);
+
+	for (b = 0; b < ARRAY_SIZE(batches); b++) {
+		u64 irqs = pcie->stats.irqs;
+
+		pcie->stats.irq_time_ns = 0;
+		pcie->stats.irq_time_max_ns = 0;
+		spin_lock_irqsave(&sim->lock, flags);
+		sim->dma_batch = batches[b];
+		spin_unlock_irqrestore(&sim->lock, flags);
+
+		for (i = 0; i < KVASER_PCIEFD_SIM_BENCH_IRQS; i++) {
+			for (j = 0; j < batches[b]; j++)
+				kvaser_pciefd_sim_rx(sim, 0, &cf, false);
+			kvaser_pciefd_sim_service(sim);
+			cond_resched();
+		}
+
+		irqs = pcie->stats.irqs - irqs;
+		KUNIT_EXPECT_EQ(test, irqs, (u64)KVASER_PCIEFD_SIM_BENCH_IRQS);
+		kunit_info(test, "irq handler, %u frames/irq: %llu ns avg, %llu ns max\n",
+			   batches[b], div64_u64(pcie->stats.irq_time_ns, max(irqs, 1ULL)),
+			   pcie->stats.irq_time_max_ns);
+	}
+	WRITE_ONCE(irq_timing, timing);
+
+	spin_lock_irqsave(&sim->lock, flags);
+	sim->dma_batch = 1;
+	sim->latency_ns = 0;
+	sim->latency_max_ns = 0;
+	sim->latency_count = 0;
+	spin_unlock_irqrestore(&sim->lock, flags);
+	kvaser_pciefd_sim_set_direct(sim, false);
+
+	for (i = 0; i < KVASER_PCIEFD_SIM_BENCH_IRQS; i++) {
+		kvaser_pciefd_sim_rx(sim, 0, &cf, false);
+		kvaser_pciefd_sim_sync(sim);
+	}
+
+	KUNIT_EXPECT_EQ(test, sim->latency_count, (u64)KVASER_PCIEFD_SIM_BENCH_IRQS);
+	kunit_info(test, "irq latency, packet to handled: %llu ns avg, %llu ns max\n",
+		   div64_u64(sim->latency_ns, max(sim->latency_count, 1ULL)),
+		   sim->latency_max_ns);
+}
+
+static struct kunit_case kvaser_pciefd_test_cases[] = {
+	KUNIT_CASE(kvaser_pciefd_ticks_to_ktime_test),
+	KUNIT_CASE(kvaser_pciefd_ticks_to_ktime_monotonic_test),
+	KUNIT_CASE(kvaser_pciefd_ticks_to_ktime_wrap_test),
+	{}
+};
+
+static struct kunit_suite kvaser_pciefd_test_suite = {
+	.name = "kvaser_pciefd",
+	.test_cases = kvaser_pciefd_test_cases,
+};
+
+static struct kunit_case kvaser_pciefd_sim_test_cases[] = {
+	KUNIT_CASE_PARAM(kvaser_pciefd_sim_read_buffer_test,
+			 kvaser_pciefd_sim_board_gen_params),
+	KUNIT_CASE_PARAM(kvaser_pciefd_sim_read_buffer_malformed_test,
+			 kvaser_pciefd_sim_board_gen_params),
+	KUNIT_CASE_PARAM(kvaser_pciefd_sim_xmit_test,
+			 kvaser_pciefd_sim_board_gen_params),
+	KUNIT_CASE_PARAM(kvaser_pciefd_sim_tx_priority_test,
+			 kvaser_pciefd_sim_board_gen_params),
+	KUNIT_CASE_PARAM(kvaser_pciefd_sim_bus_on_flush_test,
+			 kvaser_pciefd_sim_board_gen_params),
+	KUNIT_CASE_PARAM(kvaser_pciefd_sim_bus_error_test,
+			 kvaser_pciefd_sim_board_gen_params),
+	KUNIT_CASE_PARAM(kvaser_pciefd_sim_irq_mask_test,
+			 kvaser_pciefd_sim_board_gen_params),
+	KUNIT_CASE_PARAM(kvaser_pciefd_sim_rx_bench,
+			 kvaser_pciefd_sim_board_gen_params),
+	KUNIT_CASE_PARAM(kvaser_pciefd_sim_tx_bench,
+			 kvaser_pciefd_sim_board_gen_params),
+	KUNIT_CASE_PARAM(kvaser_pciefd_sim_irq_latency_bench,
+			 kvaser_pciefd_sim_board_gen_params),
+	{}
+};
+
+static struct kunit_suite kvaser_pciefd_sim_test_suite = {
+	.name = "kvaser_pciefd_sim",
+	.exit = kvaser_pciefd_sim_exit,
+	.test_cases = kvaser_pciefd_sim_test_cases,
+};
+
+kunit_test_suites(&kvaser_pciefd_test_suite, &kvaser_pciefd_sim_test_suite);
@@ -0,0 +1,327 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+/* Tx queue selection, Tx queue flow control and SO_TXTIME scheduling shared
+ * by kvaser_pciefd and kvaser_usb.
+ *
+ * The two drivers are separate modules with no common core module, so the
+ * helpers are static inline. Each driver defines its module parameters with
+ * KVASER_TXQ_MODULE_PARAMS().
+ */
+
+#ifndef KVASER_TXQ_H
+#define KVASER_TXQ_H
+
+#include <linux/version.h>
+#include <linux/can.h>
+#include <linux/hrtimer.h>
+#include <linux/interrupt.h>
+#include <linux/kernel.h>
+#include <linux/moduleparam.h>
+#include <linux/netdevice.h>
+#include <linux/skbuff.h>
+#include <linux/u64_stats_sync.h>
+#include <net/sock.h>
+
+#define KVASER_TXQ_MAX_QUEUES	4U
+#define KVASER_TXQ_MAX_TXTIME	64U
+
+struct kvaser_txq_params {
+	unsigned int queues;
+	unsigned int ids[KVASER_TXQ_MAX_QUEUES - 1];
+	int ids_num;
+};
+
+/* Defines the tx_queues and tx_queue_ids module parameters in @params */
+#define KVASER_TXQ_MODULE_PARAMS(params)					\
+	static struct kvaser_txq_params params = { .queues = 1 };		\
+	module_param_named(tx_queues, params.queues, uint, 0444);		\
+	MODULE_PARM_DESC(tx_queues,						\
+			 "Number of Tx queues per channel, selected by CAN ID priority class (1-4, default 1)"); \
+	module_param_array_named(tx_queue_ids, params.ids, uint,		\
+				 &params.ids_num, 0644);			\
+	MODULE_PARM_DESC(tx_queue_ids,						\
+			 "Ascending 11-bit CAN ID limits between the Tx queues, extended IDs are classed by their base ID (default even split)")
+
+/* Number of Tx queues to allocate for a channel */
+static inline unsigned int
+kvaser_txq_num_queues(const struct kvaser_txq_params *params)
+{
+	return clamp_t(unsigned int, params->queues, 1, KVASER_TXQ_MAX_QUEUES);
+}
+
+/* Tx queue 0 carries the highest priority class and may use all @max Tx
+ * slots of the device. Each following queue is stopped earlier, so that the
+ * lowest priority class is the first one to be throttled.
+ */
+static inline unsigned int kvaser_txq_limit(const struct net_device *netdev,
+					    unsigned int max,
+					    unsigned int queue)
+{
+	unsigned int nqueues = netdev->real_num_tx_queues;
+
+	return max(1U, max * (nqueues - queue) / nqueues);
+}
+
+/* Stop the queues whose share of the @max Tx slots is used up, @count slots
+ * being in use. Must be called under the lock that serializes @count with
+ * kvaser_txq_wake(), so that a wake is never lost.
+ */
+static inline void kvaser_txq_stop(struct net_device *netdev,
+				   unsigned int count, unsigned int max)
+{
+	unsigned int i;
+
+	for (i = 0; i < netdev->real_num_tx_queues; i++)
+		if (count >= kvaser_txq_limit(netdev, max, i))
+			netif_stop_subqueue(netdev, i);
+}
+
+static inline void kvaser_txq_wake(struct net_device *netdev,
+				   unsigned int count, unsigned int max)
+{
+	unsigned int i;
+
+	for (i = 0; i < netdev->real_num_tx_queues; i++)
+		if (count < kvaser_txq_limit(netdev, max, i))
+			netif_wake_subqueue(netdev, i);
+}
+
+/* CAN arbitration is won by the lowest identifier, map it to the lowest
+ * (highest priority) Tx queue. Extended frames are classed by their 11-bit
+ * base identifier, which is arbitrated first. For ndo_select_queue.
+ */
+static inline u16 kvaser_txq_select(const struct net_device *netdev,
+				    const struct sk_buff *skb,
+				    const struct kvaser_txq_params *params)
+{
+	const struct canfd_frame *cf = (struct canfd_frame *)skb->data;
+	unsigned int nqueues = netdev->real_num_tx_queues;
+	unsigned int queue;
+	u32 id;
+
+	if (nqueues <= 1 || skb->len < CAN_MTU)
+		return 0;
+
+	if (cf->can_id & CAN_EFF_FLAG)
+		id = (cf->can_id & CAN_EFF_MASK) >> 18;
+	else
+		id = cf->can_id & CAN_SFF_MASK;
+
+	for (queue = 0; queue < nqueues - 1; queue++) {
+		unsigned int limit;
+
+		if (queue < READ_ONCE(params->ids_num))
+			limit = READ_ONCE(params->ids[queue]);
+		else
+			limit = (queue + 1) * (CAN_SFF_MASK + 1) / nqueues;
+
+		if (id < limit)
+			break;
+	}
+
+	return queue;
+}
+
+/* SO_TXTIME counters, updated with the queue lock held. Lateness is
+ * measured when a frame is released to the driver's start_xmit.
+ */
+struct kvaser_txtime_stats {
+	struct u64_stats_sync syncp;
+	u64 frames;
+	u64 late_ns;
+	u64 late_max_ns;
+	u64 missed;
+	u64 dropped;
+};
+
+/* SO_TXTIME frames of a channel, sorted by launch time in CLOCK_MONOTONIC.
+ * The launch time is kept by a host hrtimer and is not mapped to the device
+ * timestamp base, so a frame reaches the bus after its launch time by the
+ * host to device latency.
+ */
+struct kvaser_txtime {
+	struct net_device *netdev;
+	struct sk_buff_head queue;
+	struct hrtimer timer;
+	struct tasklet_struct tasklet;
+	struct kvaser_txtime_stats stats;
+};
+
+/* Must be called with the queue lock held */
+static inline void kvaser_txtime_account(struct kvaser_txtime *txtime,
+					 ktime_t late)
+{
+	struct kvaser_txtime_stats *stats = &txtime->stats;
+	u64 ns = ktime_to_ns(late);
+
+	u64_stats_update_begin(&stats->syncp);
+	stats->frames++;
+	stats->late_ns += ns;
+	if (ns > stats->late_max_ns)
+		stats->late_max_ns = ns;
+	u64_stats_update_end(&stats->syncp);
+}
+
+static inline enum hrtimer_restart kvaser_txtime_timer(struct hrtimer *timer)
+{
+	struct kvaser_txtime *txtime =
+		container_of(timer, struct kvaser_txtime, timer);
+
+	tasklet_schedule(&txtime->tasklet);
+
+	return HRTIMER_NORESTART;
+}
+
+/* Release the frames whose launch time has come. The launch time is cleared
+ * so that start_xmit sends them right away.
+ */
+static inline void kvaser_txtime_tasklet(unsigned long data)
+{
+	struct kvaser_txtime *txtime = (struct kvaser_txtime *)data;
+	struct sk_buff_head queue;
+	struct sk_buff *skb;
+	ktime_t now;
+
+	__skb_queue_head_init(&queue);
+
+	spin_lock(&txtime->queue.lock);
+	now = ktime_get();
+	while ((skb = skb_peek(&txtime->queue)) &&
+	       ktime_compare(skb->tstamp, now) <= 0) {
+		__skb_unlink(skb, &txtime->queue);
+		kvaser_txtime_account(txtime, ktime_sub(now, skb->tstamp));
+		skb->tstamp = ns_to_ktime(0);
+		__skb_queue_tail(&queue, skb);
+	}
+
+	if (skb)
+		hrtimer_start(&txtime->timer, skb->tstamp, HRTIMER_MODE_ABS);
+	spin_unlock(&txtime->queue.lock);
+
+	while ((skb = __skb_dequeue(&queue)))
+		dev_queue_xmit(skb);
+}
+
+static inline void kvaser_txtime_init(struct kvaser_txtime *txtime,
+				      struct net_device *netdev)
+{
+	txtime->netdev = netdev;
+	skb_queue_head_init(&txtime->queue);
+	u64_stats_init(&txtime->stats.syncp);
+#if (LINUX_VERSION_CODE >= KERNEL_VERSION(6, 13, 0))
+	hrtimer_setup(&txtime->timer, kvaser_txtime_timer, CLOCK_MONOTONIC,
+		      HRTIMER_MODE_ABS);
+#else
+	hrtimer_init(&txtime->timer, CLOCK_MONOTONIC, HRTIMER_MODE_ABS);
+	txtime->timer.function = kvaser_txtime_timer;
+#endif /* LINUX_VERSION_CODE >= KERNEL_VERSION 6.13.0 */
+	tasklet_init(&txtime->tasklet, kvaser_txtime_tasklet,
+		     (unsigned long)txtime);
+}
+
+#if (LINUX_VERSION_CODE >= KERNEL_VERSION(4, 19, 0))
+/* The launch time is in the clock selected with SO_TXTIME */
+static inline ktime_t kvaser_txtime_to_mono(const struct sk_buff *skb)
+{
+	ktime_t now;
+
+	switch (skb->sk->sk_clockid) {
+	case CLOCK_REALTIME:
+		now = ktime_get_real();
+		break;
+	case CLOCK_TAI:
+		now = ktime_get_clocktai();
+		break;
+	case CLOCK_BOOTTIME:
+		now = ktime_get_boottime();
+		break;
+	default:
+		return skb->tstamp;
+	}
+
+	return ktime_add(ktime_get(), ktime_sub(skb->tstamp, now));
+}
+#endif /* LINUX_VERSION_CODE >= KERNEL_VERSION 4.19.0 */
+
+/* Hold back a frame from a SO_TXTIME socket until its launch time. Frames
+ * that are already due are sent right away. Returns true if the skb was
+ * consumed.
+ */
+static inline bool kvaser_txtime_hold(struct kvaser_txtime *txtime,
+				      struct sk_buff *skb)
+{
+#if (LINUX_VERSION_CODE >= KERNEL_VERSION(4, 19, 0))
+	struct kvaser_txtime_stats *stats = &txtime->stats;
+	struct sk_buff *pos;
+	ktime_t launch, now;
+
+	if (!ktime_to_ns(skb->tstamp) || !skb->sk ||
+	    !sock_flag(skb->sk, SOCK_TXTIME))
+		return false;
+
+	launch = kvaser_txtime_to_mono(skb);
+	now = ktime_get();
+
+	spin_lock_bh(&txtime->queue.lock);
+	if (ktime_compare(launch, now) <= 0) {
+		u64_stats_update_begin(&stats->syncp);
+		stats->missed++;
+		u64_stats_update_end(&stats->syncp);
+		kvaser_txtime_account(txtime, ktime_sub(now, launch));
+		spin_unlock_bh(&txtime->queue.lock);
+		skb->tstamp = ns_to_ktime(0);
+		return false;
+	}
+
+	if (skb_queue_len(&txtime->queue) >= KVASER_TXQ_MAX_TXTIME) {
+		u64_stats_update_begin(&stats->syncp);
+		stats->dropped++;
+		u64_stats_update_end(&stats->syncp);
+		spin_unlock_bh(&txtime->queue.lock);
+		txtime->netdev->stats.tx_dropped++;
+		dev_kfree_skb_any(skb);
+		return true;
+	}
+
+	/* Keep the queue sorted, frames with equal launch times in order */
+	skb->tstamp = launch;
+	skb_queue_reverse_walk(&txtime->queue, pos) {
+		if (ktime_compare(pos->tstamp, launch) <= 0)
+			break;
+	}
+	__skb_queue_after(&txtime->queue, pos, skb);
+
+	if (skb_peek(&txtime->queue) == skb)
+		hrtimer_start(&txtime->timer, launch, HRTIMER_MODE_ABS);
+	spin_unlock_bh(&txtime->queue.lock);
+
+	return true;
+#else
+	return false;
+#endif /* LINUX_VERSION_CODE >= KERNEL_VERSION 4.19.0 */
+}
+
+static inline void kvaser_txtime_flush(struct kvaser_txtime *txtime)
+{
+	/* An empty queue keeps the tasklet from rearming the timer */
+	skb_queue_purge(&txtime->queue);
+	hrtimer_cancel(&txtime->timer);
+	tasklet_kill(&txtime->tasklet);
+}
+
+static inline void kvaser_txtime_read_stats(const struct kvaser_txtime *txtime,
+					    struct kvaser_txtime_stats *stats)
+{
+	const struct kvaser_txtime_stats *src = &txtime->stats;
+	unsigned int start;
+
+	do {
+		start = u64_stats_fetch_begin(&src->syncp);
+		stats->frames = src->frames;
+		stats->late_ns = src->late_ns;
+		stats->late_max_ns = src->late_max_ns;
+		stats->missed = src->missed;
+		stats->dropped = src->dropped;
+	} while (u64_stats_fetch_retry(&src->syncp, start));
+}
+
+#endif /* KVASER_TXQ_H */
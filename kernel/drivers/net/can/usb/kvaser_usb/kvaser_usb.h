@@ -21,19 +21,30 @@
  * - UsbcanII: Based on Renesas M16C, running firmware labeled as 'helios'
  */
 
+#include <linux/atomic.h>
 #include <linux/completion.h>
+#include <linux/hrtimer.h>
+#include <linux/interrupt.h>
+#include <linux/mutex.h>
 #include <linux/spinlock.h>
 #include <linux/types.h>
 #include <linux/usb.h>
+#include <linux/workqueue.h>
 
 #include <linux/can.h>
 #include <linux/can/dev.h>
 
-#define KVASER_USB_MAX_RX_URBS			4
+#include "../../kvaser_txq.h"
+#include "kvaser_usb_netlink.h"
+
+#define KVASER_USB_MAX_RX_URBS			8
 #define KVASER_USB_MAX_TX_URBS			128
 #define KVASER_USB_TIMEOUT			1000 /* msecs */
 #define KVASER_USB_RX_BUFFER_SIZE		3072
+#define KVASER_USB_RX_BUFFER_MAX		16384
+#define KVASER_USB_RX_ADAPT_MS			250
 #define KVASER_USB_MAX_NET_DEVICES		5
+#define KVASER_USB_MAX_PERIODIC			KVASER_USB_PERIODIC_SLOTS
 
 /* Kvaser USB device quirks */
 #define KVASER_USB_QUIRK_HAS_SILENT_MODE	BIT(0)
@@ -47,6 +58,15 @@
 #define KVASER_USB_HYDRA_CAP_EXT_CMD		BIT(2)
 #define KVASER_USB_CAP_STATIC_LISTEN_MODE	BIT(3)
 
+/* Cyclic frames are loaded through the "kvaser_usb" generic netlink family,
+ * see kvaser_usb_netlink.h, and sent by a host hrtimer through the regular
+ * transmit path.
+ */
+#define KVASER_USB_PERIODIC_MIN_PERIOD_US	100
+#define KVASER_USB_PERIODIC_MAX_PERIOD_US	(60 * USEC_PER_SEC)
+
+struct dentry;
+struct seq_file;
 struct kvaser_usb_dev_cfg;
 
 enum kvaser_usb_leaf_family {
@@ -58,23 +78,43 @@ enum kvaser_usb_leaf_family {
 struct kvaser_usb_dev_card_data_hydra {
 	u8 channel_to_he[KVASER_USB_MAX_NET_DEVICES];
 	u8 sysdbg_he;
-	spinlock_t transid_lock; /* lock for transid */
-	u16 transid;
-	/* lock for usb_rx_leftover and usb_rx_leftover_len */
-	spinlock_t usb_rx_leftover_lock;
+	atomic_t transid;
+	/* Only accessed from the Rx URB completion, see
+	 * kvaser_usb_hydra_read_bulk_callback()
+	 */
 	u8 usb_rx_leftover[KVASER_USB_HYDRA_MAX_CMD_LEN];
 	u8 usb_rx_leftover_len;
+	atomic64_t usb_rx_leftovers;
+};
+/* Leaf parser counters, exported in debugfs */
+struct kvaser_usb_dev_card_data_leaf {
+	atomic64_t placeholders;
+	atomic64_t log_messages;
+	atomic64_t chip_state_events;
+	atomic64_t error_events;
+	atomic64_t clock_overflows;
 };
 struct kvaser_usb_dev_card_data {
 	u32 ctrlmode_supported;
 	u32 capabilities;
 	struct kvaser_usb_dev_card_data_hydra hydra;
+	struct kvaser_usb_dev_card_data_leaf leaf;
 };
 
 /* Context for an outstanding, not yet ACKed, transmission */
 struct kvaser_usb_tx_urb_context {
 	struct kvaser_usb_net_priv *priv;
 	u32 echo_index;
+	/* Bytes reported to BQL, released on Tx acknowledge */
+	unsigned int bql_bytes;
+	u16 queue;
+};
+
+/* A cyclic frame, sent by the host */
+struct kvaser_usb_periodic {
+	struct sk_buff *skb;
+	ktime_t period;
+	ktime_t next;
 };
 
 struct kvaser_usb_busparams {
@@ -85,6 +125,42 @@ struct kvaser_usb_busparams {
 	u8 nsamples;
 } __packed;
 
+/* Transfer counters, exported in debugfs */
+struct kvaser_usb_stats {
+	atomic64_t rx_urbs;
+	atomic64_t rx_bytes;
+	atomic64_t rx_urb_errors;
+	atomic64_t tx_urbs;
+	atomic64_t tx_bytes;
+	atomic64_t tx_urb_errors;
+	atomic64_t tx_busy;
+	atomic64_t cmd_format_errors;
+	/* Rx completions that filled their buffer */
+	atomic64_t rx_urbs_full;
+	/* Rx URBs added under load, and additions refused by the Rx pool */
+	atomic64_t rx_grows;
+	atomic64_t rx_pool_exhausted;
+	/* Rx URBs retired when idle, and Rx buffers reallocated to resize */
+	atomic64_t rx_shrinks;
+	atomic64_t rx_resizes;
+	/* Time from resume until every running channel is back on bus */
+	atomic64_t pm_resumes;
+	atomic64_t pm_resume_last_us;
+	atomic64_t pm_resume_max_us;
+	/* Probe duration, and whether the probe cache skipped discovery */
+	atomic64_t probe_us;
+	atomic64_t probe_cache_hit;
+};
+
+/* Per command id counters, exported in debugfs. Hydra extended commands
+ * are accounted by their cmd_no_ext, which does not overlap the standard
+ * command ids.
+ */
+struct kvaser_usb_cmd_stats {
+	atomic64_t count;
+	atomic64_t time_ns;
+};
+
 struct kvaser_usb {
 	struct usb_device *udev;
 	struct usb_interface *intf;
@@ -100,13 +176,44 @@ struct kvaser_usb {
 	 * also used as a sentinel for marking free tx contexts.
 	 */
 	u32 fw_version;
+	/* Card identity, filled in by dev_get_card_info() */
+	u32 serial_number;
+	u8 ean[8];
 	unsigned int nchannels;
 	unsigned int max_tx_urbs;
 	struct kvaser_usb_dev_card_data card_data;
 
+	/* Rx URBs only run while a channel is open or a command reply is
+	 * awaited, see kvaser_usb_rx_get(). @rx_lock protects the fields
+	 * below.
+	 */
+	struct mutex rx_lock;
+	unsigned int rx_users;
+	unsigned int rx_urbs;
 	bool rxinitdone;
-	void *rxbuf[KVASER_USB_MAX_RX_URBS];
-	dma_addr_t rxbuf_dma[KVASER_USB_MAX_RX_URBS];
+	struct urb *rx_urb[KVASER_USB_MAX_RX_URBS];
+	/* URBs held back by their completion, to be resized or retired by
+	 * rx_adjust_work
+	 */
+	unsigned long rx_parked;
+	struct work_struct rx_adjust_work;
+
+	/* Rx buffer size and URB count targets, set by rx_adapt_work from
+	 * the load seen during the last KVASER_USB_RX_ADAPT_MS
+	 */
+	unsigned int rx_size;
+	unsigned int rx_urbs_target;
+	struct delayed_work rx_adapt_work;
+	u64 rx_adapt_urbs;
+	u64 rx_adapt_bytes;
+	u64 rx_adapt_full;
+	unsigned int rx_adapt_fill; /* per mille of the buffer size */
+	unsigned int rx_adapt_rate; /* completions per second */
+
+	struct kvaser_usb_stats stats;
+	struct kvaser_usb_cmd_stats cmd_stats[256];
+	u32 cmd_timing; /* Measure command handling time when non-zero */
+	struct dentry *debugfs_dir;
 };
 
 struct kvaser_usb_net_priv {
@@ -122,9 +229,25 @@ struct kvaser_usb_net_priv {
 
 	struct completion start_comp, stop_comp, flush_comp,
 			  get_busparams_comp;
+	/* Stops a channel whose start_comp never came, see async_open */
+	struct delayed_work start_check_work;
+	/* Channel was running when the device was suspended */
+	bool pm_running;
 	struct usb_anchor tx_submitted;
 
 	struct kvaser_usb_busparams busparams_nominal, busparams_data;
+	/* busparams_* hold what the device has confirmed */
+	bool busparams_nominal_valid, busparams_data_valid;
+	/* CAN FD mode written along with busparams_data */
+	u32 busparams_data_ctrlmode;
+
+	/* lock for periodic, taken from the periodic_tasklet */
+	spinlock_t periodic_lock;
+	struct hrtimer periodic_timer;
+	struct tasklet_struct periodic_tasklet;
+	struct kvaser_usb_periodic periodic[KVASER_USB_MAX_PERIODIC];
+
+	struct kvaser_txtime txtime;
 
 	spinlock_t tx_contexts_lock; /* lock for active_tx_contexts */
 	int active_tx_contexts;
@@ -142,6 +265,7 @@ struct kvaser_usb_net_priv {
  *
  * @dev_setup_endpoints:	setup USB in and out endpoints
  * @dev_init_card:		initialize card
+ * @dev_map_channels:		query the firmware addresses of the channels
  * @dev_init_channel:		initialize channel
  * @dev_remove_channel:		uninitialize channel
  * @dev_get_software_info:	get software info
@@ -151,11 +275,17 @@ struct kvaser_usb_net_priv {
  *
  * @dev_set_opt_mode:		set ctrlmod
  * @dev_start_chip:		start the CAN controller
+ * @dev_start_chip_async:	start the CAN controller without waiting, the
+ *				reply completes start_comp
  * @dev_stop_chip:		stop the CAN controller
  * @dev_reset_chip:		reset the CAN controller
  * @dev_flush_queue:		flush outstanding CAN messages
  * @dev_read_bulk_callback:	handle incoming commands
+ * @dev_rx_reset:		drop Rx state kept between transfers, called
+ *				before new Rx URBs are submitted
  * @dev_frame_to_cmd:		translate struct can_frame into device command
+ *
+ * @dev_debugfs_show:		print device specific state in debugfs
  */
 struct kvaser_usb_dev_ops {
 	int (*dev_set_mode)(struct net_device *netdev, enum can_mode mode);
@@ -169,6 +299,7 @@ struct kvaser_usb_dev_ops {
 				    struct can_berr_counter *bec);
 	int (*dev_setup_endpoints)(struct kvaser_usb *dev);
 	int (*dev_init_card)(struct kvaser_usb *dev);
+	int (*dev_map_channels)(struct kvaser_usb *dev);
 	int (*dev_init_channel)(struct kvaser_usb_net_priv *priv);
 	void (*dev_remove_channel)(struct kvaser_usb_net_priv *priv);
 	int (*dev_get_software_info)(struct kvaser_usb *dev);
@@ -177,14 +308,17 @@ struct kvaser_usb_dev_ops {
 	int (*dev_get_capabilities)(struct kvaser_usb *dev);
 	int (*dev_set_opt_mode)(const struct kvaser_usb_net_priv *priv);
 	int (*dev_start_chip)(struct kvaser_usb_net_priv *priv);
+	int (*dev_start_chip_async)(struct kvaser_usb_net_priv *priv);
 	int (*dev_stop_chip)(struct kvaser_usb_net_priv *priv);
 	int (*dev_reset_chip)(struct kvaser_usb *dev, int channel);
 	int (*dev_flush_queue)(struct kvaser_usb_net_priv *priv);
 	void (*dev_read_bulk_callback)(struct kvaser_usb *dev, void *buf,
 				       int len);
+	void (*dev_rx_reset)(struct kvaser_usb *dev);
 	void *(*dev_frame_to_cmd)(const struct kvaser_usb_net_priv *priv,
 				  const struct sk_buff *skb, int *cmd_len,
 				  u16 transid);
+	void (*dev_debugfs_show)(struct kvaser_usb *dev, struct seq_file *m);
 };
 
 struct kvaser_usb_driver_info {
@@ -205,6 +339,13 @@ extern const struct kvaser_usb_dev_ops kvaser_usb_leaf_dev_ops;
 
 void kvaser_usb_unlink_tx_urbs(struct kvaser_usb_net_priv *priv);
 
+void kvaser_usb_tx_wake_queues(struct kvaser_usb_net_priv *priv);
+
+void kvaser_usb_start_chip_confirmed(struct kvaser_usb_net_priv *priv);
+
+void kvaser_usb_tx_completed_queue(struct kvaser_usb_net_priv *priv,
+				   const struct kvaser_usb_tx_urb_context *context);
+
 int kvaser_usb_recv_cmd(const struct kvaser_usb *dev, void *cmd, int len,
 			int *actual_len);
 
@@ -213,8 +354,14 @@ int kvaser_usb_send_cmd(const struct kvaser_usb *dev, void *cmd, int len);
 int kvaser_usb_send_cmd_async(struct kvaser_usb_net_priv *priv, void *cmd,
 			      int len);
 
+int kvaser_usb_netif_rx(struct sk_buff *skb);
+
 int kvaser_usb_can_rx_over_error(struct net_device *netdev);
 
+u64 kvaser_usb_cmd_stats_begin(const struct kvaser_usb *dev);
+
+void kvaser_usb_cmd_stats_end(struct kvaser_usb *dev, u8 cmd_no, u64 start_ns);
+
 extern const struct can_bittiming_const kvaser_usb_flexc_bittiming_const;
 
 #endif /* KVASER_USB_H */
@@ -12,17 +12,29 @@
  */
 
 #include <linux/completion.h>
+#include <linux/debugfs.h>
 #include <linux/device.h>
 #include <linux/ethtool.h>
 #include <linux/gfp.h>
 #include <linux/if.h>
 #include <linux/kernel.h>
+#include <linux/ktime.h>
+#include <linux/list.h>
+#include <linux/math64.h>
 #include <linux/module.h>
+#include <linux/mutex.h>
 #include <linux/netdevice.h>
+#include <linux/rtnetlink.h>
+#include <linux/seq_file.h>
+#include <linux/slab.h>
 #include <linux/spinlock.h>
+#include <linux/string.h>
 #include <linux/types.h>
 #include <linux/usb.h>
 
+#include <net/genetlink.h>
+#include <net/sock.h>
+
 #include <linux/can.h>
 #include <linux/can/dev.h>
 #include <linux/can/error.h>
@@ -267,6 +279,111 @@ static const struct usb_device_id kvaser_usb_table[] = {
 };
 MODULE_DEVICE_TABLE(usb, kvaser_usb_table);
 
+static struct dentry *kvaser_usb_debugfs_root;
+
+static unsigned int max_tx_inflight;
+module_param(max_tx_inflight, uint, 0644);
+MODULE_PARM_DESC(max_tx_inflight,
+		 "Maximum number of Tx frames queued in the device per channel, 0 for the firmware limit (default 0)");
+
+static bool busparams_force_verify;
+module_param(busparams_force_verify, bool, 0644);
+MODULE_PARM_DESC(busparams_force_verify,
+		 "Always write and read back bus parameters, even when unchanged (default off)");
+
+static bool async_open;
+module_param(async_open, bool, 0644);
+MODULE_PARM_DESC(async_open,
+		 "Return from open once the start command is sent, the Tx queue is started by the device reply (default off)");
+
+KVASER_TXQ_MODULE_PARAMS(kvaser_usb_txq_params);
+
+static bool probe_cache;
+module_param(probe_cache, bool, 0644);
+MODULE_PARM_DESC(probe_cache,
+		 "Reuse the discovery results of a device seen before with the same serial number and firmware (default off)");
+
+#define KVASER_USB_PROBE_CACHE_MAX	32
+
+/* Discovery results that only depend on the device and its firmware */
+struct kvaser_usb_probe_cache_entry {
+	struct list_head list;
+	u16 id_vendor;
+	u16 id_product;
+	u32 serial_number;
+	u8 ean[8];
+	u32 fw_version;
+	unsigned int max_tx_urbs;
+	u32 ctrlmode_supported;
+	u32 capabilities;
+	u8 channel_to_he[KVASER_USB_MAX_NET_DEVICES];
+	u8 sysdbg_he;
+};
+
+/* Most recently used first */
+static LIST_HEAD(kvaser_usb_probe_cache_list);
+static DEFINE_MUTEX(kvaser_usb_probe_cache_lock);
+static unsigned int kvaser_usb_probe_cache_len;
+static u64 kvaser_usb_probe_cache_hits;
+static u64 kvaser_usb_probe_cache_misses;
+static u64 kvaser_usb_probe_cache_invalidations;
+
+static unsigned int rx_pool_buffers;
+module_param(rx_pool_buffers, uint, 0644);
+MODULE_PARM_DESC(rx_pool_buffers,
+		 "Maximum number of Rx URB buffers shared by all devices, each device is always granted one, 0 for no limit (default 0)");
+
+static atomic_t kvaser_usb_rx_pool_used = ATOMIC_INIT(0);
+
+static unsigned int rx_buffer_min = 512;
+module_param(rx_buffer_min, uint, 0644);
+MODULE_PARM_DESC(rx_buffer_min,
+		 "Smallest Rx transfer size in bytes, rounded down to whole packets (default 512)");
+
+static unsigned int rx_buffer_max = KVASER_USB_RX_BUFFER_SIZE;
+module_param(rx_buffer_max, uint, 0644);
+MODULE_PARM_DESC(rx_buffer_max,
+		 "Largest Rx transfer size in bytes, rounded down to whole packets, at most 16384 (default 3072)");
+
+static unsigned int rx_urbs_min = 2;
+module_param(rx_urbs_min, uint, 0644);
+MODULE_PARM_DESC(rx_urbs_min,
+		 "Smallest number of Rx URBs per device (default 2)");
+
+static unsigned int rx_urbs_max = 4;
+module_param(rx_urbs_max, uint, 0644);
+MODULE_PARM_DESC(rx_urbs_max,
+		 "Largest number of Rx URBs per device, at most 8 (default 4)");
+
+struct kvaser_usb_stat_desc {
+	const char *name;
+	size_t offset;
+};
+
+#define KVASER_USB_STAT(_name) \
+	{ #_name, offsetof(struct kvaser_usb_stats, _name) }
+
+static const struct kvaser_usb_stat_desc kvaser_usb_stat_descs[] = {
+	KVASER_USB_STAT(rx_urbs),
+	KVASER_USB_STAT(rx_bytes),
+	KVASER_USB_STAT(rx_urb_errors),
+	KVASER_USB_STAT(tx_urbs),
+	KVASER_USB_STAT(tx_bytes),
+	KVASER_USB_STAT(tx_urb_errors),
+	KVASER_USB_STAT(tx_busy),
+	KVASER_USB_STAT(cmd_format_errors),
+	KVASER_USB_STAT(rx_urbs_full),
+	KVASER_USB_STAT(rx_grows),
+	KVASER_USB_STAT(rx_pool_exhausted),
+	KVASER_USB_STAT(rx_shrinks),
+	KVASER_USB_STAT(rx_resizes),
+	KVASER_USB_STAT(pm_resumes),
+	KVASER_USB_STAT(pm_resume_last_us),
+	KVASER_USB_STAT(pm_resume_max_us),
+	KVASER_USB_STAT(probe_us),
+	KVASER_USB_STAT(probe_cache_hit),
+};
+
 int kvaser_usb_send_cmd(const struct kvaser_usb *dev, void *cmd, int len)
 {
 	return usb_bulk_msg(dev->udev,
@@ -322,6 +439,25 @@ int kvaser_usb_send_cmd_async(struct kvaser_usb_net_priv *priv, void *cmd,
 	return 0;
 }
 
+/* CAN skbs get no flow hash from the flow dissector, which disables RPS.
+ * Each channel is a net device with its own rps_cpus mask, so any constant
+ * hash does: it steers all frames of the channel to the same CPU of that
+ * mask, which keeps them in order.
+ */
+#define KVASER_USB_RX_HASH	1
+
+static void kvaser_usb_set_rx_hash(struct sk_buff *skb)
+{
+	skb_set_hash(skb, KVASER_USB_RX_HASH, PKT_HASH_TYPE_L4);
+}
+
+int kvaser_usb_netif_rx(struct sk_buff *skb)
+{
+	kvaser_usb_set_rx_hash(skb);
+
+	return netif_rx(skb);
+}
+
 int kvaser_usb_can_rx_over_error(struct net_device *netdev)
 {
 	struct net_device_stats *stats = &netdev->stats;
@@ -341,11 +477,94 @@ int kvaser_usb_can_rx_over_error(struct net_device *netdev)
 	cf->can_id |= CAN_ERR_CRTL;
 	cf->data[1] = CAN_ERR_CRTL_RX_OVERFLOW;
 
-	netif_rx(skb);
+	kvaser_usb_netif_rx(skb);
 
 	return 0;
 }
 
+u64 kvaser_usb_cmd_stats_begin(const struct kvaser_usb *dev)
+{
+	return READ_ONCE(dev->cmd_timing) ? ktime_get_ns() : 0;
+}
+
+void kvaser_usb_cmd_stats_end(struct kvaser_usb *dev, u8 cmd_no, u64 start_ns)
+{
+	struct kvaser_usb_cmd_stats *cmd_stats = &dev->cmd_stats[cmd_no];
+
+	atomic64_inc(&cmd_stats->count);
+	if (start_ns)
+		atomic64_add(ktime_get_ns() - start_ns, &cmd_stats->time_ns);
+}
+
+struct kvaser_usb_rx_limits {
+	unsigned int maxp;
+	unsigned int size_min;
+	unsigned int size_max;
+	unsigned int urbs_min;
+	unsigned int urbs_max;
+};
+
+/* Rx transfers are kept to whole packets, the leaf parser relies on
+ * commands not crossing a wMaxPacketSize boundary.
+ */
+static void kvaser_usb_rx_limits(const struct kvaser_usb *dev,
+				 struct kvaser_usb_rx_limits *l)
+{
+	l->maxp = usb_endpoint_maxp(dev->bulk_in);
+	l->size_max = clamp_t(unsigned int, READ_ONCE(rx_buffer_max), l->maxp,
+			      KVASER_USB_RX_BUFFER_MAX);
+	l->size_max = rounddown(l->size_max, l->maxp);
+	l->size_min = clamp_t(unsigned int, READ_ONCE(rx_buffer_min), l->maxp,
+			      l->size_max);
+	l->size_min = rounddown(l->size_min, l->maxp);
+	l->urbs_max = clamp_t(unsigned int, READ_ONCE(rx_urbs_max), 1,
+			      KVASER_USB_MAX_RX_URBS);
+	l->urbs_min = clamp_t(unsigned int, READ_ONCE(rx_urbs_min), 1,
+			      l->urbs_max);
+}
+
+/* Hold back a completed URB whose buffer no longer has the target size,
+ * or which is the last one above the target count. It is then resized or
+ * retired by kvaser_usb_rx_adjust_work(), without any data in flight.
+ */
+static bool kvaser_usb_rx_park(struct kvaser_usb *dev, struct urb *urb)
+{
+	unsigned int nurbs = READ_ONCE(dev->rx_urbs);
+	unsigned int i;
+
+	for (i = 0; i < nurbs; i++)
+		if (dev->rx_urb[i] == urb)
+			break;
+
+	if (i == nurbs)
+		return false;
+
+	if (urb->transfer_buffer_length == READ_ONCE(dev->rx_size) &&
+	    (i != nurbs - 1 || i < READ_ONCE(dev->rx_urbs_target)))
+		return false;
+
+	set_bit(i, &dev->rx_parked);
+	schedule_work(&dev->rx_adjust_work);
+
+	return true;
+}
+
+static int kvaser_usb_rx_submit(struct kvaser_usb *dev, struct urb *urb,
+				gfp_t gfp)
+{
+	int err;
+
+	/* The URB left the anchor on completion, it must be back on it for
+	 * kvaser_usb_free_rx_urbs() to kill it before the buffer is freed.
+	 */
+	usb_anchor_urb(urb, &dev->rx_submitted);
+	err = usb_submit_urb(urb, gfp);
+	if (err)
+		usb_unanchor_urb(urb);
+
+	return err;
+}
+
 static void kvaser_usb_read_bulk_callback(struct urb *urb)
 {
 	struct kvaser_usb *dev = urb->context;
@@ -362,21 +581,30 @@ static void kvaser_usb_read_bulk_callback(struct urb *urb)
 	case -ESHUTDOWN:
 		return;
 	default:
+		atomic64_inc(&dev->stats.rx_urb_errors);
 		dev_info(&dev->intf->dev, "Rx URB aborted (%d)\n", urb->status);
 		goto resubmit_urb;
 	}
 
+	atomic64_inc(&dev->stats.rx_urbs);
+	atomic64_add(urb->actual_length, &dev->stats.rx_bytes);
+	if (urb->actual_length == urb->transfer_buffer_length)
+		atomic64_inc(&dev->stats.rx_urbs_full);
+
 	ops->dev_read_bulk_callback(dev, urb->transfer_buffer,
 				    urb->actual_length);
 
 resubmit_urb:
+	if (kvaser_usb_rx_park(dev, urb))
+		return;
+
 	usb_fill_bulk_urb(urb, dev->udev,
 			  usb_rcvbulkpipe(dev->udev,
 					  dev->bulk_in->bEndpointAddress),
-			  urb->transfer_buffer, KVASER_USB_RX_BUFFER_SIZE,
+			  urb->transfer_buffer, urb->transfer_buffer_length,
 			  kvaser_usb_read_bulk_callback, dev);
 
-	err = usb_submit_urb(urb, GFP_ATOMIC);
+	err = kvaser_usb_rx_submit(dev, urb, GFP_ATOMIC);
 	if (err == -ENODEV) {
 		for (i = 0; i < dev->nchannels; i++) {
 			if (!dev->nets[i])
@@ -385,76 +613,315 @@ resubmit_urb:
 			netif_device_detach(dev->nets[i]->netdev);
 		}
 	} else if (err) {
+		atomic64_inc(&dev->stats.rx_urb_errors);
 		dev_err(&dev->intf->dev,
 			"Failed resubmitting read bulk urb: %d\n", err);
 	}
 }
 
+static bool kvaser_usb_rx_pool_take(bool force)
+{
+	unsigned int limit = READ_ONCE(rx_pool_buffers);
+
+	if (force || !limit) {
+		atomic_inc(&kvaser_usb_rx_pool_used);
+		return true;
+	}
+
+	if (atomic_inc_return(&kvaser_usb_rx_pool_used) > (int)limit) {
+		atomic_dec(&kvaser_usb_rx_pool_used);
+		return false;
+	}
+
+	return true;
+}
+
+static int kvaser_usb_rx_alloc_buf(struct kvaser_usb *dev, struct urb *urb,
+				   unsigned int size)
+{
+	dma_addr_t buf_dma;
+	u8 *buf;
+
+	buf = usb_alloc_coherent(dev->udev, size, GFP_KERNEL, &buf_dma);
+	if (!buf)
+		return -ENOMEM;
+
+	usb_fill_bulk_urb(urb, dev->udev,
+			  usb_rcvbulkpipe(dev->udev,
+					  dev->bulk_in->bEndpointAddress),
+			  buf, size, kvaser_usb_read_bulk_callback, dev);
+	urb->transfer_dma = buf_dma;
+	urb->transfer_flags |= URB_NO_TRANSFER_DMA_MAP;
+
+	return 0;
+}
+
+static void kvaser_usb_rx_free_buf(struct kvaser_usb *dev, struct urb *urb)
+{
+	usb_free_coherent(dev->udev, urb->transfer_buffer_length,
+			  urb->transfer_buffer, urb->transfer_dma);
+}
+
+/* Must be called with rx_lock held */
+static int kvaser_usb_rx_add_urb(struct kvaser_usb *dev)
+{
+	struct urb *urb;
+	int err;
+
+	if (dev->rx_urbs >= KVASER_USB_MAX_RX_URBS)
+		return -ENOSPC;
+
+	if (!kvaser_usb_rx_pool_take(!dev->rx_urbs)) {
+		atomic64_inc(&dev->stats.rx_pool_exhausted);
+		return -ENOSPC;
+	}
+
+	urb = usb_alloc_urb(0, GFP_KERNEL);
+	if (!urb) {
+		err = -ENOMEM;
+		goto err_pool;
+	}
+
+	err = kvaser_usb_rx_alloc_buf(dev, urb, dev->rx_size);
+	if (err) {
+		dev_warn(&dev->intf->dev, "No memory left for USB buffer\n");
+		goto err_urb;
+	}
+
+	/* Visible to kvaser_usb_rx_park() before the first completion */
+	dev->rx_urb[dev->rx_urbs] = urb;
+	WRITE_ONCE(dev->rx_urbs, dev->rx_urbs + 1);
+
+	err = kvaser_usb_rx_submit(dev, urb, GFP_KERNEL);
+	if (err) {
+		WRITE_ONCE(dev->rx_urbs, dev->rx_urbs - 1);
+		dev->rx_urb[dev->rx_urbs] = NULL;
+		kvaser_usb_rx_free_buf(dev, urb);
+		goto err_urb;
+	}
+
+	return 0;
+
+err_urb:
+	usb_free_urb(urb);
+err_pool:
+	atomic_dec(&kvaser_usb_rx_pool_used);
+
+	return err;
+}
+
+/* Must be called with rx_lock held, and URB @i not submitted */
+static void kvaser_usb_rx_free_urb(struct kvaser_usb *dev, unsigned int i)
+{
+	kvaser_usb_rx_free_buf(dev, dev->rx_urb[i]);
+	usb_free_urb(dev->rx_urb[i]);
+	dev->rx_urb[i] = NULL;
+	atomic_dec(&kvaser_usb_rx_pool_used);
+}
+
+/* Must be called with rx_lock held */
 static int kvaser_usb_setup_rx_urbs(struct kvaser_usb *dev)
 {
+	struct kvaser_usb_rx_limits l;
 	int i, err = 0;
 
 	if (dev->rxinitdone)
 		return 0;
 
-	for (i = 0; i < KVASER_USB_MAX_RX_URBS; i++) {
-		struct urb *urb = NULL;
-		u8 *buf = NULL;
-		dma_addr_t buf_dma;
+	/* Start small, kvaser_usb_rx_adapt_work() grows under load */
+	kvaser_usb_rx_limits(dev, &l);
+	WRITE_ONCE(dev->rx_size, l.size_min);
+	WRITE_ONCE(dev->rx_urbs_target, l.urbs_min);
+
+	/* Nothing left by the previous Rx URBs belongs to the new ones */
+	if (dev->driver_info->ops->dev_rx_reset)
+		dev->driver_info->ops->dev_rx_reset(dev);
 
-		urb = usb_alloc_urb(0, GFP_KERNEL);
-		if (!urb) {
-			err = -ENOMEM;
+	for (i = 0; i < l.urbs_min; i++) {
+		err = kvaser_usb_rx_add_urb(dev);
+		if (err)
 			break;
+	}
+
+	if (!dev->rx_urbs) {
+		dev_warn(&dev->intf->dev, "Cannot setup read URBs, error %d\n",
+			 err);
+		return err;
+	} else if (dev->rx_urbs < l.urbs_min) {
+		dev_warn(&dev->intf->dev, "RX performances may be slow\n");
+	}
+
+	dev->rx_adapt_urbs = atomic64_read(&dev->stats.rx_urbs);
+	dev->rx_adapt_bytes = atomic64_read(&dev->stats.rx_bytes);
+	dev->rx_adapt_full = atomic64_read(&dev->stats.rx_urbs_full);
+	dev->rx_adapt_fill = 0;
+	dev->rx_adapt_rate = 0;
+
+	WRITE_ONCE(dev->rxinitdone, true);
+	schedule_delayed_work(&dev->rx_adapt_work,
+			      msecs_to_jiffies(KVASER_USB_RX_ADAPT_MS));
+
+	return 0;
+}
+
+/* Must be called with rx_lock held */
+static void kvaser_usb_free_rx_urbs(struct kvaser_usb *dev)
+{
+	unsigned int i;
+
+	WRITE_ONCE(dev->rxinitdone, false);
+	cancel_delayed_work_sync(&dev->rx_adapt_work);
+
+	usb_kill_anchored_urbs(&dev->rx_submitted);
+
+	for (i = 0; i < dev->rx_urbs; i++)
+		kvaser_usb_rx_free_urb(dev, i);
+	WRITE_ONCE(dev->rx_urbs, 0);
+	dev->rx_parked = 0;
+}
+
+/* Resize or retire the parked URBs, and add URBs up to the target count */
+static void kvaser_usb_rx_adjust_work(struct work_struct *work)
+{
+	struct kvaser_usb *dev = container_of(work, struct kvaser_usb,
+					      rx_adjust_work);
+	unsigned int size, target;
+	unsigned int i;
+	int err;
+
+	mutex_lock(&dev->rx_lock);
+	if (!dev->rxinitdone)
+		goto out;
+
+	size = READ_ONCE(dev->rx_size);
+	target = READ_ONCE(dev->rx_urbs_target);
+
+	for (i = dev->rx_urbs; i-- > 0;) {
+		struct urb *urb = dev->rx_urb[i];
+		unsigned int old_size = urb->transfer_buffer_length;
+		void *old_buf = urb->transfer_buffer;
+		dma_addr_t old_dma = urb->transfer_dma;
+
+		if (!test_bit(i, &dev->rx_parked))
+			continue;
+
+		if (i == dev->rx_urbs - 1 && i >= target) {
+			clear_bit(i, &dev->rx_parked);
+			WRITE_ONCE(dev->rx_urbs, i);
+			kvaser_usb_rx_free_urb(dev, i);
+			atomic64_inc(&dev->stats.rx_shrinks);
+			continue;
 		}
 
-		buf = usb_alloc_coherent(dev->udev, KVASER_USB_RX_BUFFER_SIZE,
-					 GFP_KERNEL, &buf_dma);
-		if (!buf) {
-			dev_warn(&dev->intf->dev,
-				 "No memory left for USB buffer\n");
-			usb_free_urb(urb);
-			err = -ENOMEM;
-			break;
+		/* Keep the old buffer if a new one cannot be allocated */
+		if (old_size != size &&
+		    !kvaser_usb_rx_alloc_buf(dev, urb, size)) {
+			usb_free_coherent(dev->udev, old_size, old_buf, old_dma);
+			atomic64_inc(&dev->stats.rx_resizes);
 		}
 
-		usb_fill_bulk_urb(urb, dev->udev,
-				  usb_rcvbulkpipe
-					(dev->udev,
-					 dev->bulk_in->bEndpointAddress),
-				  buf, KVASER_USB_RX_BUFFER_SIZE,
-				  kvaser_usb_read_bulk_callback, dev);
-		urb->transfer_dma = buf_dma;
-		urb->transfer_flags |= URB_NO_TRANSFER_DMA_MAP;
-		usb_anchor_urb(urb, &dev->rx_submitted);
-
-		err = usb_submit_urb(urb, GFP_KERNEL);
+		clear_bit(i, &dev->rx_parked);
+		err = kvaser_usb_rx_submit(dev, urb, GFP_KERNEL);
 		if (err) {
-			usb_unanchor_urb(urb);
-			usb_free_coherent(dev->udev,
-					  KVASER_USB_RX_BUFFER_SIZE, buf,
-					  buf_dma);
-			usb_free_urb(urb);
-			break;
+			set_bit(i, &dev->rx_parked);
+			if (err != -ENODEV)
+				dev_err(&dev->intf->dev,
+					"Failed resubmitting read bulk urb: %d\n",
+					err);
 		}
+	}
 
-		dev->rxbuf[i] = buf;
-		dev->rxbuf_dma[i] = buf_dma;
-
-		usb_free_urb(urb);
+	while (dev->rx_urbs < target) {
+		if (kvaser_usb_rx_add_urb(dev))
+			break;
+		atomic64_inc(&dev->stats.rx_grows);
 	}
 
-	if (i == 0) {
-		dev_warn(&dev->intf->dev, "Cannot setup read URBs, error %d\n",
-			 err);
-		return err;
-	} else if (i < KVASER_USB_MAX_RX_URBS) {
-		dev_warn(&dev->intf->dev, "RX performances may be slow\n");
+out:
+	mutex_unlock(&dev->rx_lock);
+}
+
+/* Set the Rx buffer size and URB count targets from the completions seen
+ * since the last run. When more than a quarter of the completions filled
+ * their buffer, the device had more to send: larger buffers are tried
+ * first to batch more commands per completion, then more URBs. Below an
+ * eighth of fill on average, URBs are retired first, then buffers shrink.
+ */
+static void kvaser_usb_rx_adapt_work(struct work_struct *work)
+{
+	struct kvaser_usb *dev = container_of(work, struct kvaser_usb,
+					      rx_adapt_work.work);
+	unsigned int size = READ_ONCE(dev->rx_size);
+	unsigned int target = READ_ONCE(dev->rx_urbs_target);
+	struct kvaser_usb_rx_limits l;
+	u64 urbs, bytes, full, n;
+
+	if (!READ_ONCE(dev->rxinitdone))
+		return;
+
+	kvaser_usb_rx_limits(dev, &l);
+
+	urbs = atomic64_read(&dev->stats.rx_urbs);
+	bytes = atomic64_read(&dev->stats.rx_bytes);
+	full = atomic64_read(&dev->stats.rx_urbs_full);
+	n = urbs - dev->rx_adapt_urbs;
+
+	dev->rx_adapt_fill = n ? min_t(u64, 1000,
+				       div64_u64((bytes - dev->rx_adapt_bytes) *
+						 1000, n * size)) : 0;
+	dev->rx_adapt_rate = div_u64(n * MSEC_PER_SEC, KVASER_USB_RX_ADAPT_MS);
+
+	if (n && (full - dev->rx_adapt_full) * 4 > n) {
+		if (size < l.size_max)
+			size = min(size * 2, l.size_max);
+		else if (target < l.urbs_max)
+			target++;
+	} else if (dev->rx_adapt_fill < 125) {
+		if (target > l.urbs_min)
+			target--;
+		else if (size > l.size_min)
+			size = max(rounddown(size / 2, l.maxp), l.size_min);
 	}
 
-	dev->rxinitdone = true;
+	dev->rx_adapt_urbs = urbs;
+	dev->rx_adapt_bytes = bytes;
+	dev->rx_adapt_full = full;
 
-	return 0;
+	/* The module parameters may have changed */
+	WRITE_ONCE(dev->rx_size, clamp(size, l.size_min, l.size_max));
+	WRITE_ONCE(dev->rx_urbs_target, clamp(target, l.urbs_min, l.urbs_max));
+
+	if (READ_ONCE(dev->rx_urbs_target) > READ_ONCE(dev->rx_urbs))
+		schedule_work(&dev->rx_adjust_work);
+
+	schedule_delayed_work(&dev->rx_adapt_work,
+			      msecs_to_jiffies(KVASER_USB_RX_ADAPT_MS));
+}
+
+/* Take a reference on the Rx URBs, the first one allocates them from the
+ * Rx pool. Replies to commands are only received while a reference is
+ * held.
+ */
+static int kvaser_usb_rx_get(struct kvaser_usb *dev)
+{
+	int err;
+
+	mutex_lock(&dev->rx_lock);
+	err = kvaser_usb_setup_rx_urbs(dev);
+	if (!err)
+		dev->rx_users++;
+	mutex_unlock(&dev->rx_lock);
+
+	return err;
+}
+
+/* The last reference returns the Rx URB buffers to the Rx pool */
+static void kvaser_usb_rx_put(struct kvaser_usb *dev)
+{
+	mutex_lock(&dev->rx_lock);
+	if (!WARN_ON(!dev->rx_users) && !--dev->rx_users)
+		kvaser_usb_free_rx_urbs(dev);
+	mutex_unlock(&dev->rx_lock);
 }
 
 static int kvaser_usb_open(struct net_device *netdev)
@@ -468,25 +935,79 @@ static int kvaser_usb_open(struct net_device *netdev)
 	if (err)
 		return err;
 
+	err = kvaser_usb_rx_get(dev);
+	if (err)
+		goto error_close;
+
 	err = ops->dev_set_opt_mode(priv);
 	if (err)
 		goto error;
 
-	err = ops->dev_start_chip(priv);
+	if (READ_ONCE(async_open) && ops->dev_start_chip_async) {
+		/* Keep frames back and stay CAN_STATE_STOPPED until the device
+		 * confirms the start, see kvaser_usb_start_chip_confirmed()
+		 */
+		netif_tx_stop_all_queues(netdev);
+		err = ops->dev_start_chip_async(priv);
+		if (!err)
+			schedule_delayed_work(&priv->start_check_work,
+					      msecs_to_jiffies(KVASER_USB_TIMEOUT));
+	} else {
+		err = ops->dev_start_chip(priv);
+		if (!err)
+			priv->can.state = CAN_STATE_ERROR_ACTIVE;
+	}
 	if (err) {
 		netdev_warn(netdev, "Cannot start device, error %d\n", err);
 		goto error;
 	}
 
-	priv->can.state = CAN_STATE_ERROR_ACTIVE;
-
 	return 0;
 
 error:
+	kvaser_usb_rx_put(dev);
+error_close:
 	close_candev(netdev);
 	return err;
 }
 
+/* Called by the subdrivers when the device replies to the first start
+ * command after open, the channel is on the bus from now on.
+ */
+void kvaser_usb_start_chip_confirmed(struct kvaser_usb_net_priv *priv)
+{
+	struct net_device *netdev = priv->netdev;
+	unsigned long flags;
+
+	spin_lock_irqsave(&priv->tx_contexts_lock, flags);
+	/* A late reply to a failed open must not revive the channel */
+	if (netif_running(netdev) && priv->can.state == CAN_STATE_STOPPED) {
+		priv->can.state = CAN_STATE_ERROR_ACTIVE;
+		netif_carrier_on(netdev);
+	}
+	netif_tx_start_all_queues(netdev);
+	complete(&priv->start_comp);
+	spin_unlock_irqrestore(&priv->tx_contexts_lock, flags);
+}
+
+static void kvaser_usb_start_check_work(struct work_struct *work)
+{
+	struct kvaser_usb_net_priv *priv =
+		container_of(work, struct kvaser_usb_net_priv,
+			     start_check_work.work);
+	unsigned long flags;
+
+	spin_lock_irqsave(&priv->tx_contexts_lock, flags);
+	if (!completion_done(&priv->start_comp)) {
+		/* Report the link as down, a late reply still brings it up */
+		priv->can.state = CAN_STATE_STOPPED;
+		netif_carrier_off(priv->netdev);
+		netdev_err(priv->netdev,
+			   "Device did not confirm start, channel stays stopped\n");
+	}
+	spin_unlock_irqrestore(&priv->tx_contexts_lock, flags);
+}
+
 static void kvaser_usb_reset_tx_urb_contexts(struct kvaser_usb_net_priv *priv)
 {
 	int i, max_tx_urbs;
@@ -496,6 +1017,9 @@ static void kvaser_usb_reset_tx_urb_contexts(struct kvaser_usb_net_priv *priv)
 	priv->active_tx_contexts = 0;
 	for (i = 0; i < max_tx_urbs; i++)
 		priv->tx_contexts[i].echo_index = max_tx_urbs;
+
+	for (i = 0; i < priv->netdev->num_tx_queues; i++)
+		netdev_tx_reset_queue(netdev_get_tx_queue(priv->netdev, i));
 }
 
 /* This method might sleep. Do not call it in the atomic context
@@ -511,11 +1035,9 @@ static void kvaser_usb_unlink_all_urbs(struct kvaser_usb *dev)
 {
 	int i;
 
-	usb_kill_anchored_urbs(&dev->rx_submitted);
-
-	for (i = 0; i < KVASER_USB_MAX_RX_URBS; i++)
-		usb_free_coherent(dev->udev, KVASER_USB_RX_BUFFER_SIZE,
-				  dev->rxbuf[i], dev->rxbuf_dma[i]);
+	mutex_lock(&dev->rx_lock);
+	kvaser_usb_free_rx_urbs(dev);
+	mutex_unlock(&dev->rx_lock);
 
 	for (i = 0; i < dev->nchannels; i++) {
 		struct kvaser_usb_net_priv *priv = dev->nets[i];
@@ -525,6 +1047,8 @@ static void kvaser_usb_unlink_all_urbs(struct kvaser_usb *dev)
 	}
 }
 
+static void kvaser_usb_periodic_flush(struct kvaser_usb_net_priv *priv);
+
 static int kvaser_usb_close(struct net_device *netdev)
 {
 	struct kvaser_usb_net_priv *priv = netdev_priv(netdev);
@@ -532,7 +1056,12 @@ static int kvaser_usb_close(struct net_device *netdev)
 	const struct kvaser_usb_dev_ops *ops = dev->driver_info->ops;
 	int err;
 
-	netif_stop_queue(netdev);
+	kvaser_usb_periodic_flush(priv);
+
+	cancel_delayed_work_sync(&priv->start_check_work);
+	netif_tx_stop_all_queues(netdev);
+
+	kvaser_txtime_flush(&priv->txtime);
 
 	err = ops->dev_flush_queue(priv);
 	if (err)
@@ -543,6 +1072,10 @@ static int kvaser_usb_close(struct net_device *netdev)
 		if (err)
 			netdev_warn(netdev, "Cannot reset card, error %d\n",
 				    err);
+
+		/* The reset may restore the default bus parameters */
+		priv->busparams_nominal_valid = false;
+		priv->busparams_data_valid = false;
 	}
 
 	err = ops->dev_stop_chip(priv);
@@ -552,6 +1085,8 @@ static int kvaser_usb_close(struct net_device *netdev)
 	/* reset tx contexts */
 	kvaser_usb_unlink_tx_urbs(priv);
 
+	kvaser_usb_rx_put(dev);
+
 	priv->can.state = CAN_STATE_STOPPED;
 	close_candev(priv->netdev);
 
@@ -579,25 +1114,41 @@ static int kvaser_usb_set_bittiming(struct net_device *netdev)
 	else
 		busparams.nsamples = 1;
 
+	/* Skip the write and the readback if the device already runs these */
+	if (priv->busparams_nominal_valid && !READ_ONCE(busparams_force_verify) &&
+	    !memcmp(&busparams, &priv->busparams_nominal,
+		    sizeof(priv->busparams_nominal)))
+		return 0;
+
+	/* A nominal write may reset the data phase, rewrite it as well */
+	priv->busparams_nominal_valid = false;
+	priv->busparams_data_valid = false;
+
 	err = ops->dev_set_bittiming(netdev, &busparams);
 	if (err)
 		return err;
 
-	err = kvaser_usb_setup_rx_urbs(priv->dev);
+	err = kvaser_usb_rx_get(priv->dev);
 	if (err)
 		return err;
 
 	err = ops->dev_get_busparams(priv);
+	kvaser_usb_rx_put(priv->dev);
 	if (err) {
 		/* Treat EOPNOTSUPP as success */
-		if (err == -EOPNOTSUPP)
+		if (err == -EOPNOTSUPP) {
+			priv->busparams_nominal = busparams;
+			priv->busparams_nominal_valid = true;
 			err = 0;
+		}
 		return err;
 	}
 
 	if (memcmp(&busparams, &priv->busparams_nominal,
 		   sizeof(priv->busparams_nominal)) != 0)
 		err = -EINVAL;
+	else
+		priv->busparams_nominal_valid = true;
 
 	return err;
 }
@@ -609,6 +1160,8 @@ static int kvaser_usb_set_data_bittiming(struct net_device *netdev)
 	const struct kvaser_usb_dev_ops *ops = dev->driver_info->ops;
 	struct can_bittiming *dbt = &priv->can.data_bittiming;
 	struct kvaser_usb_busparams busparams;
+	u32 ctrlmode = priv->can.ctrlmode &
+		       (CAN_CTRLMODE_FD | CAN_CTRLMODE_FD_NON_ISO);
 	int tseg1 = dbt->prop_seg + dbt->phase_seg1;
 	int tseg2 = dbt->phase_seg2;
 	int sjw = dbt->sjw;
@@ -624,21 +1177,34 @@ static int kvaser_usb_set_data_bittiming(struct net_device *netdev)
 	busparams.tseg2 = (u8)tseg2;
 	busparams.nsamples = 1;
 
+	if (priv->busparams_data_valid && !READ_ONCE(busparams_force_verify) &&
+	    priv->busparams_data_ctrlmode == ctrlmode &&
+	    !memcmp(&busparams, &priv->busparams_data,
+		    sizeof(priv->busparams_data)))
+		return 0;
+
+	priv->busparams_data_valid = false;
+
 	err = ops->dev_set_data_bittiming(netdev, &busparams);
 	if (err)
 		return err;
 
-	err = kvaser_usb_setup_rx_urbs(priv->dev);
+	err = kvaser_usb_rx_get(priv->dev);
 	if (err)
 		return err;
 
 	err = ops->dev_get_data_busparams(priv);
+	kvaser_usb_rx_put(priv->dev);
 	if (err)
 		return err;
 
 	if (memcmp(&busparams, &priv->busparams_data,
-		   sizeof(priv->busparams_data)) != 0)
+		   sizeof(priv->busparams_data)) != 0) {
 		err = -EINVAL;
+	} else {
+		priv->busparams_data_ctrlmode = ctrlmode;
+		priv->busparams_data_valid = true;
+	}
 
 	return err;
 }
@@ -660,9 +1226,61 @@ static void kvaser_usb_write_bulk_callback(struct urb *urb)
 	if (!netif_device_present(netdev))
 		return;
 
-	if (urb->status)
+	if (urb->status) {
+		atomic64_inc(&priv->dev->stats.tx_urb_errors);
 		netdev_info(netdev, "Tx URB aborted (%d)\n", urb->status);
+	}
+}
+
+/* Number of Tx contexts that may be in use before the queue is stopped.
+ * BQL limits the queue further, based on how fast the device acknowledges.
+ */
+static int kvaser_usb_tx_inflight_limit(const struct kvaser_usb *dev)
+{
+	unsigned int limit = READ_ONCE(max_tx_inflight);
+
+	if (!limit || limit > dev->max_tx_urbs)
+		limit = dev->max_tx_urbs;
+
+	return limit;
+}
+
+static void kvaser_usb_tx_stop_queues(struct kvaser_usb_net_priv *priv)
+{
+	kvaser_txq_stop(priv->netdev, priv->active_tx_contexts,
+			kvaser_usb_tx_inflight_limit(priv->dev));
+}
+
+/* Must be called with tx_contexts_lock held */
+void kvaser_usb_tx_wake_queues(struct kvaser_usb_net_priv *priv)
+{
+	kvaser_txq_wake(priv->netdev, priv->active_tx_contexts,
+			kvaser_usb_tx_inflight_limit(priv->dev));
+}
+
+void kvaser_usb_tx_completed_queue(struct kvaser_usb_net_priv *priv,
+				   const struct kvaser_usb_tx_urb_context *context)
+{
+	netdev_tx_completed_queue(netdev_get_tx_queue(priv->netdev,
+						      context->queue),
+				  1, context->bql_bytes);
+}
+
+#if (LINUX_VERSION_CODE >= KERNEL_VERSION(4, 19, 0))
+#if (LINUX_VERSION_CODE >= KERNEL_VERSION(5, 2, 0))
+static u16 kvaser_usb_select_queue(struct net_device *netdev,
+				   struct sk_buff *skb,
+				   struct net_device *sb_dev)
+#else
+static u16 kvaser_usb_select_queue(struct net_device *netdev,
+				   struct sk_buff *skb,
+				   struct net_device *sb_dev,
+				   select_queue_fallback_t fallback)
+#endif /* LINUX_VERSION_CODE >= KERNEL_VERSION 5.2.0 */
+{
+	return kvaser_txq_select(netdev, skb, &kvaser_usb_txq_params);
 }
+#endif /* LINUX_VERSION_CODE >= KERNEL_VERSION 4.19.0 */
 
 static netdev_tx_t kvaser_usb_start_xmit(struct sk_buff *skb,
 					 struct net_device *netdev)
@@ -690,6 +1308,9 @@ static netdev_tx_t kvaser_usb_start_xmit(struct sk_buff *skb,
 	}
 #endif /* LINUX_VERSION_CODE >= KERNEL_VERSION 6.0.0 */
 
+	if (kvaser_txtime_hold(&priv->txtime, skb))
+		return NETDEV_TX_OK;
+
 	urb = usb_alloc_urb(0, GFP_ATOMIC);
 	if (!urb) {
 		stats->tx_dropped++;
@@ -704,18 +1325,23 @@ static netdev_tx_t kvaser_usb_start_xmit(struct sk_buff *skb,
 
 			context->echo_index = i;
 			++priv->active_tx_contexts;
-			if (priv->active_tx_contexts >= (int)dev->max_tx_urbs)
-				netif_stop_queue(netdev);
+			kvaser_usb_tx_stop_queues(priv);
 
 			break;
 		}
 	}
+	/* Each queue is only stopped once it reaches its own limit, so
+	 * queues running in parallel can race for the last free contexts.
+	 * The loser waits for an acknowledge, like any stopped queue. It is
+	 * stopped under the lock, so the wake from that acknowledge is not
+	 * lost.
+	 */
+	if (!context)
+		netif_stop_subqueue(netdev, skb_get_queue_mapping(skb));
 	spin_unlock_irqrestore(&priv->tx_contexts_lock, flags);
 
-	/* This should never happen; it implies a flow control bug */
 	if (!context) {
-		netdev_warn(netdev, "cannot find free context\n");
-
+		atomic64_inc(&dev->stats.tx_busy);
 		ret = NETDEV_TX_BUSY;
 		goto freeurb;
 	}
@@ -728,14 +1354,24 @@ static netdev_tx_t kvaser_usb_start_xmit(struct sk_buff *skb,
 
 		context->echo_index = dev->max_tx_urbs;
 		--priv->active_tx_contexts;
-		netif_wake_queue(netdev);
+		kvaser_usb_tx_wake_queues(priv);
 
 		spin_unlock_irqrestore(&priv->tx_contexts_lock, flags);
 		goto freeurb;
 	}
 
 	context->priv = priv;
+	context->bql_bytes = cmd_len;
+	context->queue = skb_get_queue_mapping(skb);
 
+	/* Account before submitting, the acknowledge may arrive at any time */
+	netdev_tx_sent_queue(netdev_get_tx_queue(netdev, context->queue),
+			     context->bql_bytes);
+
+	/* can_get_echo_skb() calls netif_rx() itself, hash the echo skb here
+	 * so that it is steered like the received frames
+	 */
+	kvaser_usb_set_rx_hash(skb);
 #if (LINUX_VERSION_CODE >= KERNEL_VERSION(5, 12, 0))
 	can_put_echo_skb(skb, netdev, context->echo_index, 0);
 #else
@@ -758,9 +1394,10 @@ static netdev_tx_t kvaser_usb_start_xmit(struct sk_buff *skb,
 #else
 		can_free_echo_skb(netdev, context->echo_index);
 #endif /* LINUX_VERSION_CODE >= 5.12.0) */
+		kvaser_usb_tx_completed_queue(priv, context);
 		context->echo_index = dev->max_tx_urbs;
 		--priv->active_tx_contexts;
-		netif_wake_queue(netdev);
+		kvaser_usb_tx_wake_queues(priv);
 
 		spin_unlock_irqrestore(&priv->tx_contexts_lock, flags);
 
@@ -768,6 +1405,7 @@ static netdev_tx_t kvaser_usb_start_xmit(struct sk_buff *skb,
 		kfree(buf);
 
 		stats->tx_dropped++;
+		atomic64_inc(&dev->stats.tx_urb_errors);
 
 		if (err == -ENODEV)
 			netif_device_detach(netdev);
@@ -777,6 +1415,9 @@ static netdev_tx_t kvaser_usb_start_xmit(struct sk_buff *skb,
 		goto freeurb;
 	}
 
+	atomic64_inc(&dev->stats.tx_urbs);
+	atomic64_add(cmd_len, &dev->stats.tx_bytes);
+
 	ret = NETDEV_TX_OK;
 
 freeurb:
@@ -784,31 +1425,713 @@ freeurb:
 	return ret;
 }
 
-static const struct net_device_ops kvaser_usb_netdev_ops = {
-	.ndo_open = kvaser_usb_open,
-	.ndo_stop = kvaser_usb_close,
-	.ndo_start_xmit = kvaser_usb_start_xmit,
-	.ndo_change_mtu = can_change_mtu,
-};
-
-#if (LINUX_VERSION_CODE >= KERNEL_VERSION(6, 0, 0))
-static const struct net_device_ops kvaser_usb_netdev_ops_hwts = {
-	.ndo_open = kvaser_usb_open,
-	.ndo_stop = kvaser_usb_close,
-	.ndo_eth_ioctl = can_eth_ioctl_hwts,
-	.ndo_start_xmit = kvaser_usb_start_xmit,
-	.ndo_change_mtu = can_change_mtu,
-};
+static enum hrtimer_restart kvaser_usb_periodic_timer(struct hrtimer *timer)
+{
+	struct kvaser_usb_net_priv *priv =
+		container_of(timer, struct kvaser_usb_net_priv, periodic_timer);
 
-static const struct ethtool_ops kvaser_usb_ethtool_ops = {
-	.get_ts_info = ethtool_op_get_ts_info,
-};
+	tasklet_schedule(&priv->periodic_tasklet);
 
-static const struct ethtool_ops kvaser_usb_ethtool_ops_hwts = {
-	.get_ts_info = can_ethtool_op_get_ts_info_hwts,
-};
+	return HRTIMER_NORESTART;
+}
+
+/* Queue a copy of the frames that are due at @now, and advance their
+ * deadlines. Returns false if no slot is in use, otherwise @expires is set
+ * to the next deadline. Must be called with periodic_lock held.
+ */
+static bool kvaser_usb_periodic_due(struct kvaser_usb_net_priv *priv,
+				    ktime_t now, struct sk_buff_head *queue,
+				    ktime_t *expires)
+{
+	bool rearm = false;
+	int i;
+
+	for (i = 0; i < KVASER_USB_MAX_PERIODIC; i++) {
+		struct kvaser_usb_periodic *periodic = &priv->periodic[i];
+		struct sk_buff *skb;
+
+		if (!periodic->skb)
+			continue;
+
+		if (ktime_compare(periodic->next, now) <= 0) {
+			skb = skb_copy(periodic->skb, GFP_ATOMIC);
+			if (skb)
+				__skb_queue_tail(queue, skb);
+			else
+				priv->netdev->stats.tx_dropped++;
+
+			periodic->next = ktime_add(periodic->next,
+						   periodic->period);
+			/* Skip missed periods rather than sending a burst */
+			if (ktime_compare(periodic->next, now) <= 0)
+				periodic->next = ktime_add(now, periodic->period);
+		}
+
+		if (!rearm || ktime_compare(periodic->next, *expires) < 0)
+			*expires = periodic->next;
+		rearm = true;
+	}
+
+	return rearm;
+}
+
+/* Queue the frames that are due, and rearm the timer for the next deadline.
+ * The frames go through dev_queue_xmit(), so they share the qdisc and echo
+ * handling with frames from CAN_RAW.
+ */
+static void kvaser_usb_periodic_tasklet(unsigned long data)
+{
+	struct kvaser_usb_net_priv *priv = (struct kvaser_usb_net_priv *)data;
+	struct sk_buff_head queue;
+	struct sk_buff *skb;
+	ktime_t expires;
+
+	__skb_queue_head_init(&queue);
+
+	spin_lock(&priv->periodic_lock);
+	if (kvaser_usb_periodic_due(priv, ktime_get(), &queue, &expires))
+		hrtimer_start(&priv->periodic_timer, expires, HRTIMER_MODE_ABS);
+	spin_unlock(&priv->periodic_lock);
+
+	while ((skb = __skb_dequeue(&queue)))
+		dev_queue_xmit(skb);
+}
+
+static void kvaser_usb_periodic_init(struct kvaser_usb_net_priv *priv)
+{
+	spin_lock_init(&priv->periodic_lock);
+#if (LINUX_VERSION_CODE >= KERNEL_VERSION(6, 13, 0))
+	hrtimer_setup(&priv->periodic_timer, kvaser_usb_periodic_timer,
+		      CLOCK_MONOTONIC, HRTIMER_MODE_ABS);
+#else
+	hrtimer_init(&priv->periodic_timer, CLOCK_MONOTONIC, HRTIMER_MODE_ABS);
+	priv->periodic_timer.function = kvaser_usb_periodic_timer;
+#endif /* LINUX_VERSION_CODE >= KERNEL_VERSION 6.13.0 */
+	tasklet_init(&priv->periodic_tasklet, kvaser_usb_periodic_tasklet,
+		     (unsigned long)priv);
+}
+
+static int kvaser_usb_periodic_del(struct kvaser_usb_net_priv *priv,
+				   unsigned int slot)
+{
+	struct sk_buff *skb;
+
+	if (slot >= KVASER_USB_MAX_PERIODIC)
+		return -EINVAL;
+
+	spin_lock_bh(&priv->periodic_lock);
+	skb = priv->periodic[slot].skb;
+	priv->periodic[slot].skb = NULL;
+	spin_unlock_bh(&priv->periodic_lock);
+
+	if (!skb)
+		return -ENOENT;
+
+	kfree_skb(skb);
+
+	return 0;
+}
+
+static void kvaser_usb_periodic_flush(struct kvaser_usb_net_priv *priv)
+{
+	unsigned int i;
+
+	for (i = 0; i < KVASER_USB_MAX_PERIODIC; i++)
+		kvaser_usb_periodic_del(priv, i);
+
+	/* The tasklet does not rearm the timer once the table is empty */
+	hrtimer_cancel(&priv->periodic_timer);
+	tasklet_kill(&priv->periodic_tasklet);
+}
+
+static int kvaser_usb_periodic_add(struct kvaser_usb_net_priv *priv,
+				   unsigned int slot, u32 period_us,
+				   const struct canfd_frame *frame, bool fd)
+{
+	struct net_device *netdev = priv->netdev;
+	struct kvaser_usb_periodic *periodic;
+	struct canfd_frame *cf;
+	struct sk_buff *skb, *old;
+
+	if (slot >= KVASER_USB_MAX_PERIODIC ||
+	    period_us < KVASER_USB_PERIODIC_MIN_PERIOD_US ||
+	    period_us > KVASER_USB_PERIODIC_MAX_PERIOD_US)
+		return -EINVAL;
+
+	if (frame->can_id & CAN_ERR_FLAG ||
+	    (!(frame->can_id & CAN_EFF_FLAG) &&
+	     (frame->can_id & CAN_EFF_MASK) > CAN_SFF_MASK))
+		return -EINVAL;
+
+	if (fd) {
+		if (!(priv->can.ctrlmode & CAN_CTRLMODE_FD) ||
+		    frame->len > CANFD_MAX_DLEN ||
+		    frame->can_id & CAN_RTR_FLAG)
+			return -EINVAL;
+
+		skb = alloc_canfd_skb(netdev, &cf);
+	} else {
+		if (frame->len > CAN_MAX_DLEN)
+			return -EINVAL;
+
+		skb = alloc_can_skb(netdev, (struct can_frame **)&cf);
+	}
+	if (!skb)
+		return -ENOMEM;
+
+	memcpy(cf, frame, fd ? CANFD_MTU : CAN_MTU);
+#ifdef CANFD_FDF
+	if (fd)
+		cf->flags |= CANFD_FDF;
+#endif /* CANFD_FDF */
+
+	spin_lock_bh(&priv->periodic_lock);
+	periodic = &priv->periodic[slot];
+	old = periodic->skb;
+	periodic->skb = skb;
+	periodic->period = ns_to_ktime((u64)period_us * NSEC_PER_USEC);
+	periodic->next = ktime_get();
+	hrtimer_start(&priv->periodic_timer, periodic->next, HRTIMER_MODE_ABS);
+	spin_unlock_bh(&priv->periodic_lock);
+
+	kfree_skb(old);
+
+	netdev_dbg(netdev, "Periodic slot %u, %u us\n", slot, period_us);
+
+	return 0;
+}
+
+static const struct net_device_ops kvaser_usb_netdev_ops = {
+	.ndo_open = kvaser_usb_open,
+	.ndo_stop = kvaser_usb_close,
+	.ndo_start_xmit = kvaser_usb_start_xmit,
+#if (LINUX_VERSION_CODE >= KERNEL_VERSION(4, 19, 0))
+	.ndo_select_queue = kvaser_usb_select_queue,
+#endif /* LINUX_VERSION_CODE >= KERNEL_VERSION 4.19.0 */
+	.ndo_change_mtu = can_change_mtu,
+};
+
+#if (LINUX_VERSION_CODE >= KERNEL_VERSION(6, 0, 0))
+static const struct net_device_ops kvaser_usb_netdev_ops_hwts = {
+	.ndo_open = kvaser_usb_open,
+	.ndo_stop = kvaser_usb_close,
+	.ndo_eth_ioctl = can_eth_ioctl_hwts,
+	.ndo_start_xmit = kvaser_usb_start_xmit,
+	.ndo_select_queue = kvaser_usb_select_queue,
+	.ndo_change_mtu = can_change_mtu,
+};
+
+static const struct ethtool_ops kvaser_usb_ethtool_ops = {
+	.get_ts_info = ethtool_op_get_ts_info,
+};
+
+static const struct ethtool_ops kvaser_usb_ethtool_ops_hwts = {
+	.get_ts_info = can_ethtool_op_get_ts_info_hwts,
+};
+
+#endif /* LINUX_VERSION_CODE >= KERNEL_VERSION 6.0.0 */
+
+#if (LINUX_VERSION_CODE >= KERNEL_VERSION(5, 2, 0))
+static struct genl_family kvaser_usb_genl_family;
+
+static bool kvaser_usb_is_netdev(const struct net_device *netdev)
+{
+#if (LINUX_VERSION_CODE >= KERNEL_VERSION(6, 0, 0))
+	if (netdev->netdev_ops == &kvaser_usb_netdev_ops_hwts)
+		return true;
+#endif /* LINUX_VERSION_CODE >= KERNEL_VERSION 6.0.0 */
+	return netdev->netdev_ops == &kvaser_usb_netdev_ops;
+}
+
+/* Must be called with RTNL held */
+static struct kvaser_usb_net_priv *
+kvaser_usb_genl_get_priv(struct genl_info *info)
+{
+	struct net_device *netdev;
+
+	if (!info->attrs[KVASER_USB_A_IFINDEX]) {
+		GENL_SET_ERR_MSG(info, "Missing interface index");
+		return ERR_PTR(-EINVAL);
+	}
+
+	netdev = __dev_get_by_index(genl_info_net(info),
+				    nla_get_u32(info->attrs[KVASER_USB_A_IFINDEX]));
+	if (!netdev)
+		return ERR_PTR(-ENODEV);
+
+	if (!kvaser_usb_is_netdev(netdev)) {
+		GENL_SET_ERR_MSG(info, "Not a kvaser_usb interface");
+		return ERR_PTR(-EOPNOTSUPP);
+	}
+
+	return netdev_priv(netdev);
+}
+
+static int kvaser_usb_genl_periodic_add(struct sk_buff *skb,
+					struct genl_info *info)
+{
+	struct nlattr *attr = info->attrs[KVASER_USB_A_FRAME];
+	struct kvaser_usb_net_priv *priv;
+	struct canfd_frame frame = { };
+	int err;
+
+	if (!info->attrs[KVASER_USB_A_SLOT] ||
+	    !info->attrs[KVASER_USB_A_PERIOD_US] || !attr) {
+		GENL_SET_ERR_MSG(info, "Missing slot, period or frame");
+		return -EINVAL;
+	}
+
+	if (nla_len(attr) != CAN_MTU && nla_len(attr) != CANFD_MTU) {
+		GENL_SET_ERR_MSG(info, "Frame is neither a can_frame nor a canfd_frame");
+		return -EINVAL;
+	}
+
+	nla_memcpy(&frame, attr, sizeof(frame));
+
+	rtnl_lock();
+	priv = kvaser_usb_genl_get_priv(info);
+	if (IS_ERR(priv))
+		err = PTR_ERR(priv);
+	else if (!netif_running(priv->netdev))
+		err = -ENETDOWN;
+	else
+		err = kvaser_usb_periodic_add(priv,
+					      nla_get_u32(info->attrs[KVASER_USB_A_SLOT]),
+					      nla_get_u32(info->attrs[KVASER_USB_A_PERIOD_US]),
+					      &frame, nla_len(attr) == CANFD_MTU);
+	rtnl_unlock();
+
+	return err;
+}
+
+static int kvaser_usb_genl_periodic_del(struct sk_buff *skb,
+					struct genl_info *info)
+{
+	struct kvaser_usb_net_priv *priv;
+	int err;
+
+	if (!info->attrs[KVASER_USB_A_SLOT]) {
+		GENL_SET_ERR_MSG(info, "Missing slot");
+		return -EINVAL;
+	}
+
+	rtnl_lock();
+	priv = kvaser_usb_genl_get_priv(info);
+	if (IS_ERR(priv))
+		err = PTR_ERR(priv);
+	else
+		err = kvaser_usb_periodic_del(priv,
+					      nla_get_u32(info->attrs[KVASER_USB_A_SLOT]));
+	rtnl_unlock();
+
+	return err;
+}
+
+static int kvaser_usb_genl_periodic_flush(struct sk_buff *skb,
+					  struct genl_info *info)
+{
+	struct kvaser_usb_net_priv *priv;
+	int err = 0;
+
+	rtnl_lock();
+	priv = kvaser_usb_genl_get_priv(info);
+	if (IS_ERR(priv))
+		err = PTR_ERR(priv);
+	else
+		kvaser_usb_periodic_flush(priv);
+	rtnl_unlock();
+
+	return err;
+}
+
+static int kvaser_usb_genl_put_periodic(struct sk_buff *msg,
+					struct kvaser_usb_net_priv *priv)
+{
+	unsigned int i;
+	int err = 0;
+
+	spin_lock_bh(&priv->periodic_lock);
+	for (i = 0; i < KVASER_USB_MAX_PERIODIC; i++) {
+		struct kvaser_usb_periodic *periodic = &priv->periodic[i];
+		struct nlattr *nest;
+
+		if (!periodic->skb)
+			continue;
+
+		nest = nla_nest_start(msg, KVASER_USB_A_PERIODIC);
+		if (!nest ||
+		    nla_put_u32(msg, KVASER_USB_A_SLOT, i) ||
+		    nla_put_u32(msg, KVASER_USB_A_PERIOD_US,
+				ktime_to_us(periodic->period)) ||
+		    nla_put(msg, KVASER_USB_A_FRAME, periodic->skb->len,
+			    periodic->skb->data)) {
+			err = -EMSGSIZE;
+			break;
+		}
+		nla_nest_end(msg, nest);
+	}
+	spin_unlock_bh(&priv->periodic_lock);
+
+	return err;
+}
+
+static int kvaser_usb_genl_periodic_get(struct sk_buff *skb,
+					struct genl_info *info)
+{
+	struct kvaser_usb_net_priv *priv;
+	struct sk_buff *msg;
+	void *hdr;
+	int err;
+
+	msg = genlmsg_new(NLMSG_DEFAULT_SIZE, GFP_KERNEL);
+	if (!msg)
+		return -ENOMEM;
+
+	hdr = genlmsg_put_reply(msg, info, &kvaser_usb_genl_family, 0,
+				KVASER_USB_CMD_PERIODIC_GET);
+	if (!hdr) {
+		nlmsg_free(msg);
+		return -EMSGSIZE;
+	}
+
+	rtnl_lock();
+	priv = kvaser_usb_genl_get_priv(info);
+	if (IS_ERR(priv))
+		err = PTR_ERR(priv);
+	else
+		err = kvaser_usb_genl_put_periodic(msg, priv);
+	rtnl_unlock();
+
+	if (err) {
+		nlmsg_free(msg);
+		return err;
+	}
+
+	genlmsg_end(msg, hdr);
+
+	return genlmsg_reply(msg, info);
+}
+
+static const struct nla_policy kvaser_usb_genl_policy[KVASER_USB_A_MAX + 1] = {
+	[KVASER_USB_A_IFINDEX] = { .type = NLA_U32 },
+	[KVASER_USB_A_SLOT] = { .type = NLA_U32 },
+	[KVASER_USB_A_PERIOD_US] = { .type = NLA_U32 },
+	[KVASER_USB_A_FRAME] = { .type = NLA_BINARY, .len = CANFD_MTU },
+};
+
+static const struct genl_ops kvaser_usb_genl_ops[] = {
+	{
+		.cmd = KVASER_USB_CMD_PERIODIC_ADD,
+		.flags = GENL_ADMIN_PERM,
+		.doit = kvaser_usb_genl_periodic_add,
+	},
+	{
+		.cmd = KVASER_USB_CMD_PERIODIC_DEL,
+		.flags = GENL_ADMIN_PERM,
+		.doit = kvaser_usb_genl_periodic_del,
+	},
+	{
+		.cmd = KVASER_USB_CMD_PERIODIC_FLUSH,
+		.flags = GENL_ADMIN_PERM,
+		.doit = kvaser_usb_genl_periodic_flush,
+	},
+	{
+		.cmd = KVASER_USB_CMD_PERIODIC_GET,
+		.doit = kvaser_usb_genl_periodic_get,
+	},
+};
+
+static struct genl_family kvaser_usb_genl_family = {
+	.name = KVASER_USB_GENL_NAME,
+	.version = KVASER_USB_GENL_VERSION,
+	.maxattr = KVASER_USB_A_MAX,
+	.policy = kvaser_usb_genl_policy,
+	.netnsok = true,
+	.module = THIS_MODULE,
+	.ops = kvaser_usb_genl_ops,
+	.n_ops = ARRAY_SIZE(kvaser_usb_genl_ops),
+};
+#endif /* LINUX_VERSION_CODE >= KERNEL_VERSION 5.2.0 */
+
+/* Like DEFINE_SHOW_ATTRIBUTE(), which is not available before v4.16 */
+#define KVASER_USB_DEBUGFS_SHOW_FOPS(__name)				\
+static int kvaser_usb_debugfs_##__name##_open(struct inode *inode,	\
+					      struct file *file)	\
+{									\
+	return single_open(file, kvaser_usb_debugfs_##__name##_show,	\
+			   inode->i_private);				\
+}									\
+									\
+static const struct file_operations kvaser_usb_debugfs_##__name##_fops = { \
+	.owner = THIS_MODULE,						\
+	.open = kvaser_usb_debugfs_##__name##_open,			\
+	.read = seq_read,						\
+	.llseek = seq_lseek,						\
+	.release = single_release,					\
+}
+
+/* SO_TXTIME counters are kept per channel, report the device total.
+ * Lateness is measured at release to the device.
+ */
+static void kvaser_usb_debugfs_txtime_show(struct kvaser_usb *dev,
+					   struct seq_file *m)
+{
+	struct kvaser_txtime_stats sum = { }, stats;
+	unsigned int i;
+
+	for (i = 0; i < dev->nchannels; i++) {
+		if (!dev->nets[i])
+			continue;
+
+		kvaser_txtime_read_stats(&dev->nets[i]->txtime, &stats);
+		sum.frames += stats.frames;
+		sum.late_ns += stats.late_ns;
+		sum.late_max_ns = max(sum.late_max_ns, stats.late_max_ns);
+		sum.missed += stats.missed;
+		sum.dropped += stats.dropped;
+	}
+
+	seq_printf(m, "txtime_frames: %llu\n", sum.frames);
+	seq_printf(m, "txtime_late_ns: %llu\n", sum.late_ns);
+	seq_printf(m, "txtime_late_max_ns: %llu\n", sum.late_max_ns);
+	seq_printf(m, "txtime_missed: %llu\n", sum.missed);
+	seq_printf(m, "txtime_dropped: %llu\n", sum.dropped);
+}
+
+static int kvaser_usb_debugfs_stats_show(struct seq_file *m, void *v)
+{
+	struct kvaser_usb *dev = m->private;
+	const struct kvaser_usb_dev_ops *ops = dev->driver_info->ops;
+	unsigned int i;
+
+	for (i = 0; i < ARRAY_SIZE(kvaser_usb_stat_descs); i++) {
+		const atomic64_t *counter = (void *)&dev->stats +
+					    kvaser_usb_stat_descs[i].offset;
+
+		seq_printf(m, "%s: %lld\n", kvaser_usb_stat_descs[i].name,
+			   atomic64_read(counter));
+	}
+
+	kvaser_usb_debugfs_txtime_show(dev, m);
+
+	if (ops->dev_debugfs_show)
+		ops->dev_debugfs_show(dev, m);
+
+	return 0;
+}
+
+KVASER_USB_DEBUGFS_SHOW_FOPS(stats);
+
+static int kvaser_usb_debugfs_commands_show(struct seq_file *m, void *v)
+{
+	struct kvaser_usb *dev = m->private;
+	unsigned int i;
+
+	seq_puts(m, "cmd count time_ns\n");
+	for (i = 0; i < ARRAY_SIZE(dev->cmd_stats); i++) {
+		s64 count = atomic64_read(&dev->cmd_stats[i].count);
+
+		if (!count)
+			continue;
+
+		seq_printf(m, "%u %lld %lld\n", i, count,
+			   atomic64_read(&dev->cmd_stats[i].time_ns));
+	}
+
+	return 0;
+}
+
+KVASER_USB_DEBUGFS_SHOW_FOPS(commands);
+
+static int kvaser_usb_debugfs_rx_adapt_show(struct seq_file *m, void *v)
+{
+	struct kvaser_usb *dev = m->private;
+	struct kvaser_usb_rx_limits l;
+
+	kvaser_usb_rx_limits(dev, &l);
+
+	seq_printf(m, "size: %u (%u-%u)\n", READ_ONCE(dev->rx_size),
+		   l.size_min, l.size_max);
+	seq_printf(m, "urbs: %u target %u (%u-%u)\n", READ_ONCE(dev->rx_urbs),
+		   READ_ONCE(dev->rx_urbs_target), l.urbs_min, l.urbs_max);
+	seq_printf(m, "parked: 0x%lx\n", READ_ONCE(dev->rx_parked));
+	seq_printf(m, "fill_permille: %u\n", READ_ONCE(dev->rx_adapt_fill));
+	seq_printf(m, "completions_per_s: %u\n",
+		   READ_ONCE(dev->rx_adapt_rate));
+
+	return 0;
+}
+
+KVASER_USB_DEBUGFS_SHOW_FOPS(rx_adapt);
+
+static void kvaser_usb_debugfs_init(struct kvaser_usb *dev)
+{
+	if (IS_ERR_OR_NULL(kvaser_usb_debugfs_root))
+		return;
+
+	dev->debugfs_dir = debugfs_create_dir(dev_name(&dev->intf->dev),
+					      kvaser_usb_debugfs_root);
+	if (IS_ERR_OR_NULL(dev->debugfs_dir))
+		return;
+
+	debugfs_create_file("stats", 0444, dev->debugfs_dir, dev,
+			    &kvaser_usb_debugfs_stats_fops);
+	debugfs_create_file("commands", 0444, dev->debugfs_dir, dev,
+			    &kvaser_usb_debugfs_commands_fops);
+	debugfs_create_file("rx_adapt", 0444, dev->debugfs_dir, dev,
+			    &kvaser_usb_debugfs_rx_adapt_fops);
+	debugfs_create_u32("cmd_timing", 0644, dev->debugfs_dir,
+			   &dev->cmd_timing);
+}
+
+/* Must be called with kvaser_usb_probe_cache_lock held */
+static struct kvaser_usb_probe_cache_entry *
+kvaser_usb_probe_cache_find(const struct kvaser_usb *dev)
+{
+	const struct usb_device_descriptor *desc = &dev->udev->descriptor;
+	struct kvaser_usb_probe_cache_entry *entry;
+
+	list_for_each_entry(entry, &kvaser_usb_probe_cache_list, list) {
+		if (entry->id_vendor == le16_to_cpu(desc->idVendor) &&
+		    entry->id_product == le16_to_cpu(desc->idProduct) &&
+		    entry->serial_number == dev->serial_number &&
+		    !memcmp(entry->ean, dev->ean, sizeof(entry->ean)))
+			return entry;
+	}
+
+	return NULL;
+}
+
+/* Must be called with kvaser_usb_probe_cache_lock held */
+static void kvaser_usb_probe_cache_del(struct kvaser_usb_probe_cache_entry *entry)
+{
+	list_del(&entry->list);
+	kfree(entry);
+	kvaser_usb_probe_cache_len--;
+}
+
+/* Restore the discovery results of a device probed before. The queries
+ * that provide the identity and firmware version the cache is keyed on are
+ * always sent, see kvaser_usb_probe_identify(). An entry with another
+ * firmware version is dropped.
+ */
+static bool kvaser_usb_probe_cache_load(struct kvaser_usb *dev)
+{
+	struct kvaser_usb_probe_cache_entry *entry;
+	bool hit = false;
+
+	if (!probe_cache || !dev->serial_number)
+		return false;
+
+	mutex_lock(&kvaser_usb_probe_cache_lock);
+	entry = kvaser_usb_probe_cache_find(dev);
+	if (entry && entry->fw_version != dev->fw_version) {
+		kvaser_usb_probe_cache_del(entry);
+		kvaser_usb_probe_cache_invalidations++;
+		entry = NULL;
+	}
+
+	if (entry) {
+		dev->max_tx_urbs = entry->max_tx_urbs;
+		dev->card_data.ctrlmode_supported = entry->ctrlmode_supported;
+		dev->card_data.capabilities = entry->capabilities;
+		memcpy(dev->card_data.hydra.channel_to_he, entry->channel_to_he,
+		       sizeof(entry->channel_to_he));
+		dev->card_data.hydra.sysdbg_he = entry->sysdbg_he;
+		list_move(&entry->list, &kvaser_usb_probe_cache_list);
+		kvaser_usb_probe_cache_hits++;
+		hit = true;
+	} else {
+		kvaser_usb_probe_cache_misses++;
+	}
+	mutex_unlock(&kvaser_usb_probe_cache_lock);
+
+	return hit;
+}
+
+static void kvaser_usb_probe_cache_store(const struct kvaser_usb *dev)
+{
+	const struct usb_device_descriptor *desc = &dev->udev->descriptor;
+	struct kvaser_usb_probe_cache_entry *entry, *old;
+
+	if (!probe_cache || !dev->serial_number)
+		return;
+
+	entry = kzalloc(sizeof(*entry), GFP_KERNEL);
+	if (!entry)
+		return;
+
+	entry->id_vendor = le16_to_cpu(desc->idVendor);
+	entry->id_product = le16_to_cpu(desc->idProduct);
+	entry->serial_number = dev->serial_number;
+	memcpy(entry->ean, dev->ean, sizeof(entry->ean));
+	entry->fw_version = dev->fw_version;
+	entry->max_tx_urbs = dev->max_tx_urbs;
+	entry->ctrlmode_supported = dev->card_data.ctrlmode_supported;
+	entry->capabilities = dev->card_data.capabilities;
+	memcpy(entry->channel_to_he, dev->card_data.hydra.channel_to_he,
+	       sizeof(entry->channel_to_he));
+	entry->sysdbg_he = dev->card_data.hydra.sysdbg_he;
+
+	mutex_lock(&kvaser_usb_probe_cache_lock);
+	old = kvaser_usb_probe_cache_find(dev);
+	if (old)
+		kvaser_usb_probe_cache_del(old);
+	if (kvaser_usb_probe_cache_len >= KVASER_USB_PROBE_CACHE_MAX)
+		kvaser_usb_probe_cache_del
+			(list_last_entry(&kvaser_usb_probe_cache_list,
+					 struct kvaser_usb_probe_cache_entry,
+					 list));
+	list_add(&entry->list, &kvaser_usb_probe_cache_list);
+	kvaser_usb_probe_cache_len++;
+	mutex_unlock(&kvaser_usb_probe_cache_lock);
+}
+
+static void kvaser_usb_probe_cache_clear(void)
+{
+	struct kvaser_usb_probe_cache_entry *entry, *tmp;
+
+	mutex_lock(&kvaser_usb_probe_cache_lock);
+	list_for_each_entry_safe(entry, tmp, &kvaser_usb_probe_cache_list,
+				 list)
+		kvaser_usb_probe_cache_del(entry);
+	mutex_unlock(&kvaser_usb_probe_cache_lock);
+}
+
+static int kvaser_usb_debugfs_probe_cache_show(struct seq_file *m, void *v)
+{
+	struct kvaser_usb_probe_cache_entry *entry;
+
+	mutex_lock(&kvaser_usb_probe_cache_lock);
+	seq_printf(m, "hits: %llu\n", kvaser_usb_probe_cache_hits);
+	seq_printf(m, "misses: %llu\n", kvaser_usb_probe_cache_misses);
+	seq_printf(m, "invalidations: %llu\n",
+		   kvaser_usb_probe_cache_invalidations);
+	seq_printf(m, "entries: %u\n", kvaser_usb_probe_cache_len);
+	list_for_each_entry(entry, &kvaser_usb_probe_cache_list, list)
+		seq_printf(m, "%04x:%04x %8phN %u fw %d.%d.%d\n",
+			   entry->id_vendor, entry->id_product, entry->ean,
+			   entry->serial_number,
+			   (entry->fw_version >> 24) & 0xff,
+			   (entry->fw_version >> 16) & 0xff,
+			   entry->fw_version & 0xffff);
+	mutex_unlock(&kvaser_usb_probe_cache_lock);
+
+	return 0;
+}
+
+KVASER_USB_DEBUGFS_SHOW_FOPS(probe_cache);
+
+static int kvaser_usb_debugfs_rx_pool_show(struct seq_file *m, void *v)
+{
+	seq_printf(m, "used: %d\n", atomic_read(&kvaser_usb_rx_pool_used));
+	seq_printf(m, "limit: %u\n", READ_ONCE(rx_pool_buffers));
+
+	return 0;
+}
+
+KVASER_USB_DEBUGFS_SHOW_FOPS(rx_pool);
 
-#endif /* LINUX_VERSION_CODE >= KERNEL_VERSION 6.0.0 */
 static void kvaser_usb_remove_interfaces(struct kvaser_usb *dev)
 {
 	const struct kvaser_usb_dev_ops *ops = dev->driver_info->ops;
@@ -822,6 +2145,7 @@ static void kvaser_usb_remove_interfaces(struct kvaser_usb *dev)
 	}
 
 	kvaser_usb_unlink_all_urbs(dev);
+	cancel_work_sync(&dev->rx_adjust_work);
 
 	for (i = 0; i < dev->nchannels; i++) {
 		if (!dev->nets[i])
@@ -848,7 +2172,13 @@ static int kvaser_usb_init_one(struct kvaser_usb *dev, int channel)
 			return err;
 	}
 
-#if (LINUX_VERSION_CODE >= KERNEL_VERSION(4, 18, 0))
+#if (LINUX_VERSION_CODE >= KERNEL_VERSION(4, 19, 0))
+	netdev = alloc_candev_mqs(struct_size(priv, tx_contexts,
+					      dev->max_tx_urbs),
+				  dev->max_tx_urbs,
+				  kvaser_txq_num_queues(&kvaser_usb_txq_params),
+				  1);
+#elif (LINUX_VERSION_CODE >= KERNEL_VERSION(4, 18, 0))
 	netdev = alloc_candev(struct_size(priv, tx_contexts, dev->max_tx_urbs),
 			      dev->max_tx_urbs);
 #else
@@ -868,6 +2198,8 @@ static int kvaser_usb_init_one(struct kvaser_usb *dev, int channel)
 	init_completion(&priv->stop_comp);
 	init_completion(&priv->flush_comp);
 	init_completion(&priv->get_busparams_comp);
+	INIT_DELAYED_WORK(&priv->start_check_work,
+			  kvaser_usb_start_check_work);
 	priv->can.ctrlmode_supported = 0;
 
 	priv->dev = dev;
@@ -877,6 +2209,10 @@ static int kvaser_usb_init_one(struct kvaser_usb *dev, int channel)
 	spin_lock_init(&priv->tx_contexts_lock);
 	kvaser_usb_reset_tx_urb_contexts(priv);
 
+	kvaser_usb_periodic_init(priv);
+
+	kvaser_txtime_init(&priv->txtime, netdev);
+
 	priv->can.state = CAN_STATE_STOPPED;
 	priv->can.clock.freq = dev->cfg->clock.freq;
 	priv->can.bittiming_const = dev->cfg->bittiming_const;
@@ -936,19 +2272,98 @@ static int kvaser_usb_init_one(struct kvaser_usb *dev, int channel)
 	err = register_candev(netdev);
 	if (err) {
 		dev_err(&dev->intf->dev, "Failed to register CAN device\n");
-		goto err;
+		goto err_remove;
 	}
 
 	netdev_dbg(netdev, "device registered\n");
 
 	return 0;
 
+err_remove:
+	if (ops->dev_remove_channel)
+		ops->dev_remove_channel(priv);
 err:
 	free_candev(netdev);
 	dev->nets[channel] = NULL;
 	return err;
 }
 
+static int kvaser_usb_probe_query(struct kvaser_usb *dev,
+				  int (*query)(struct kvaser_usb *dev),
+				  const char *what)
+{
+	int err;
+
+	if (!query)
+		return 0;
+
+	err = query(dev);
+	if (err)
+		dev_err(&dev->intf->dev, "Cannot get %s, error %d\n", what,
+			err);
+
+	return err;
+}
+
+/* The queries that provide the identity and firmware version the probe
+ * cache is keyed on. The hydra software details carry the firmware version,
+ * the leaf family reports it in the software info.
+ */
+static int kvaser_usb_probe_identify(struct kvaser_usb *dev)
+{
+	const struct kvaser_usb_dev_ops *ops = dev->driver_info->ops;
+	int err;
+
+	if (ops->dev_get_software_details)
+		err = kvaser_usb_probe_query(dev, ops->dev_get_software_details,
+					     "software details");
+	else
+		err = kvaser_usb_probe_query(dev, ops->dev_get_software_info,
+					     "software info");
+	if (err)
+		return err;
+
+	return kvaser_usb_probe_query(dev, ops->dev_get_card_info, "card info");
+}
+
+/* Queries the firmware for everything probe needs. Without the probe cache
+ * the queries are sent in the order the driver always used, otherwise the
+ * ones already sent by kvaser_usb_probe_identify() are skipped.
+ */
+static int kvaser_usb_probe_discover(struct kvaser_usb *dev, bool identified)
+{
+	const struct kvaser_usb_dev_ops *ops = dev->driver_info->ops;
+	int err;
+
+	err = kvaser_usb_probe_query(dev, ops->dev_map_channels,
+				     "channel mapping");
+	if (err)
+		return err;
+
+	if (!identified || ops->dev_get_software_details) {
+		err = kvaser_usb_probe_query(dev, ops->dev_get_software_info,
+					     "software info");
+		if (err)
+			return err;
+	}
+
+	if (!identified) {
+		err = kvaser_usb_probe_query(dev,
+					     ops->dev_get_software_details,
+					     "software details");
+		if (err)
+			return err;
+
+		err = kvaser_usb_probe_query(dev, ops->dev_get_card_info,
+					     "card info");
+		if (err)
+			return err;
+	}
+
+	return kvaser_usb_probe_query(dev, ops->dev_get_capabilities,
+				      "capabilities");
+}
+
 static int kvaser_usb_probe(struct usb_interface *intf,
 			    const struct usb_device_id *id)
 {
@@ -957,6 +2372,10 @@ static int kvaser_usb_probe(struct usb_interface *intf,
 	int i;
 	const struct kvaser_usb_driver_info *driver_info;
 	const struct kvaser_usb_dev_ops *ops;
+	ktime_t start = ktime_get();
+	bool identified = false;
+	bool cached = false;
+	s64 probe_us;
 
 	driver_info = (const struct kvaser_usb_driver_info *)id->driver_info;
 	if (!driver_info)
@@ -979,6 +2398,9 @@ static int kvaser_usb_probe(struct usb_interface *intf,
 	dev->udev = interface_to_usbdev(intf);
 
 	init_usb_anchor(&dev->rx_submitted);
+	mutex_init(&dev->rx_lock);
+	INIT_WORK(&dev->rx_adjust_work, kvaser_usb_rx_adjust_work);
+	INIT_DELAYED_WORK(&dev->rx_adapt_work, kvaser_usb_rx_adapt_work);
 
 	usb_set_intfdata(intf, dev);
 
@@ -991,20 +2413,21 @@ static int kvaser_usb_probe(struct usb_interface *intf,
 		return err;
 	}
 
-	err = ops->dev_get_software_info(dev);
-	if (err) {
-		dev_err(&intf->dev,
-			"Cannot get software info, error %d\n", err);
-		return err;
+	if (probe_cache) {
+		err = kvaser_usb_probe_identify(dev);
+		if (err)
+			return err;
+
+		identified = true;
+		cached = kvaser_usb_probe_cache_load(dev);
 	}
 
-	if (ops->dev_get_software_details) {
-		err = ops->dev_get_software_details(dev);
-		if (err) {
-			dev_err(&intf->dev,
-				"Cannot get software details, error %d\n", err);
+	if (!cached) {
+		err = kvaser_usb_probe_discover(dev, identified);
+		if (err)
 			return err;
-		}
+
+		kvaser_usb_probe_cache_store(dev);
 	}
 
 	if (WARN_ON(!dev->cfg))
@@ -1017,22 +2440,6 @@ static int kvaser_usb_probe(struct usb_interface *intf,
 
 	dev_dbg(&intf->dev, "Max outstanding tx = %d URBs\n", dev->max_tx_urbs);
 
-	err = ops->dev_get_card_info(dev);
-	if (err) {
-		dev_err(&intf->dev, "Cannot get card info, error %d\n", err);
-		return err;
-	}
-
-	if (ops->dev_get_capabilities) {
-		err = ops->dev_get_capabilities(dev);
-		if (err) {
-			dev_err(&intf->dev,
-				"Cannot get capabilities, error %d\n", err);
-			kvaser_usb_remove_interfaces(dev);
-			return err;
-		}
-	}
-
 	for (i = 0; i < dev->nchannels; i++) {
 		err = kvaser_usb_init_one(dev, i);
 		if (err) {
@@ -1041,6 +2448,14 @@ static int kvaser_usb_probe(struct usb_interface *intf,
 		}
 	}
 
+	kvaser_usb_debugfs_init(dev);
+
+	probe_us = ktime_us_delta(ktime_get(), start);
+	atomic64_set(&dev->stats.probe_us, probe_us);
+	atomic64_set(&dev->stats.probe_cache_hit, cached);
+	dev_dbg(&intf->dev, "Probed in %lld us%s\n", probe_us,
+		cached ? " (cached discovery)" : "");
+
 	return 0;
 }
 
@@ -1053,19 +2468,233 @@ static void kvaser_usb_disconnect(struct usb_interface *intf)
 	if (!dev)
 		return;
 
+	debugfs_remove_recursive(dev->debugfs_dir);
 	kvaser_usb_remove_interfaces(dev);
 }
 
+/* Stop the running channels and all URBs, but keep the netdevs and their
+ * configuration, so that resume does not need a new probe.
+ */
+static int kvaser_usb_suspend(struct usb_interface *intf, pm_message_t message)
+{
+	struct kvaser_usb *dev = usb_get_intfdata(intf);
+	const struct kvaser_usb_dev_ops *ops;
+	int i;
+
+	if (!dev)
+		return 0;
+
+	ops = dev->driver_info->ops;
+
+	rtnl_lock();
+	for (i = 0; i < dev->nchannels; i++) {
+		struct kvaser_usb_net_priv *priv = dev->nets[i];
+		int err;
+
+		if (!priv)
+			continue;
+
+		priv->pm_running = netif_running(priv->netdev);
+		if (!priv->pm_running)
+			continue;
+
+		netif_device_detach(priv->netdev);
+		cancel_delayed_work_sync(&priv->start_check_work);
+		hrtimer_cancel(&priv->periodic_timer);
+		tasklet_kill(&priv->periodic_tasklet);
+		kvaser_txtime_flush(&priv->txtime);
+
+		err = ops->dev_stop_chip(priv);
+		if (err)
+			netdev_dbg(priv->netdev,
+				   "Cannot stop device on suspend, error %d\n",
+				   err);
+		priv->can.state = CAN_STATE_STOPPED;
+	}
+
+	kvaser_usb_unlink_all_urbs(dev);
+	rtnl_unlock();
+
+	return 0;
+}
+
+/* Restart the channels that were running at suspend. A channel that cannot
+ * be restarted is attached in CAN_STATE_STOPPED with its Tx queues stopped,
+ * so that it can be restarted by taking the interface down and up. The
+ * first error is returned, after a failed reset_resume the USB core rebinds
+ * the driver.
+ */
+static int kvaser_usb_restore(struct kvaser_usb *dev, bool reset)
+{
+	const struct kvaser_usb_dev_ops *ops = dev->driver_info->ops;
+	ktime_t start = ktime_get();
+	bool restarted = false;
+	s64 us, max;
+	int ret = 0;
+	int i;
+
+	rtnl_lock();
+	for (i = 0; i < dev->nchannels; i++) {
+		struct kvaser_usb_net_priv *priv = dev->nets[i];
+		struct net_device *netdev;
+		int err;
+
+		if (!priv || !priv->pm_running)
+			continue;
+
+		netdev = priv->netdev;
+		priv->pm_running = false;
+
+		mutex_lock(&dev->rx_lock);
+		err = kvaser_usb_setup_rx_urbs(dev);
+		mutex_unlock(&dev->rx_lock);
+		if (!err)
+			err = kvaser_usb_set_bittiming(netdev);
+		if (!err && priv->can.ctrlmode & CAN_CTRLMODE_FD)
+			err = kvaser_usb_set_data_bittiming(netdev);
+		if (!err)
+			err = ops->dev_set_opt_mode(priv);
+		if (!err)
+			err = ops->dev_start_chip(priv);
+		if (err) {
+			netdev_warn(netdev, "Cannot restart device on resume, error %d\n",
+				    err);
+			priv->can.state = CAN_STATE_STOPPED;
+			netif_device_attach(netdev);
+			netif_tx_stop_all_queues(netdev);
+			if (!ret)
+				ret = err;
+			continue;
+		}
+
+		priv->can.state = CAN_STATE_ERROR_ACTIVE;
+		netif_device_attach(netdev);
+		tasklet_schedule(&priv->periodic_tasklet);
+		restarted = true;
+	}
+	rtnl_unlock();
+
+	if (!restarted)
+		return ret;
+
+	us = ktime_us_delta(ktime_get(), start);
+	atomic64_inc(&dev->stats.pm_resumes);
+	atomic64_set(&dev->stats.pm_resume_last_us, us);
+	max = atomic64_read(&dev->stats.pm_resume_max_us);
+	if (us > max)
+		atomic64_set(&dev->stats.pm_resume_max_us, us);
+
+	dev_dbg(&dev->intf->dev, "%s: channels back on bus after %lld us\n",
+		reset ? "reset_resume" : "resume", us);
+
+	return ret;
+}
+
+static int kvaser_usb_resume(struct usb_interface *intf)
+{
+	struct kvaser_usb *dev = usb_get_intfdata(intf);
+
+	if (!dev)
+		return 0;
+
+	return kvaser_usb_restore(dev, false);
+}
+
+static int kvaser_usb_reset_resume(struct usb_interface *intf)
+{
+	struct kvaser_usb *dev = usb_get_intfdata(intf);
+	const struct kvaser_usb_dev_ops *ops;
+	int err;
+	int i;
+
+	if (!dev)
+		return 0;
+
+	ops = dev->driver_info->ops;
+
+	/* The device lost its state, e.g. the hydra channel mapping and the
+	 * bus parameters
+	 */
+	for (i = 0; i < dev->nchannels; i++) {
+		if (!dev->nets[i])
+			continue;
+
+		dev->nets[i]->busparams_nominal_valid = false;
+		dev->nets[i]->busparams_data_valid = false;
+	}
+
+	err = ops->dev_init_card(dev);
+	if (!err && ops->dev_map_channels)
+		err = ops->dev_map_channels(dev);
+	if (err) {
+		dev_err(&intf->dev,
+			"Failed to initialize card on reset_resume, error %d\n",
+			err);
+		return err;
+	}
+
+	return kvaser_usb_restore(dev, true);
+}
+
 static struct usb_driver kvaser_usb_driver = {
 	.name = KBUILD_MODNAME,
 	.probe = kvaser_usb_probe,
 	.disconnect = kvaser_usb_disconnect,
+	.suspend = kvaser_usb_suspend,
+	.resume = kvaser_usb_resume,
+	.reset_resume = kvaser_usb_reset_resume,
 	.id_table = kvaser_usb_table,
 };
 
-module_usb_driver(kvaser_usb_driver);
+static int __init kvaser_usb_init(void)
+{
+	int err;
+
+	kvaser_usb_debugfs_root = debugfs_create_dir(KBUILD_MODNAME, NULL);
+	if (!IS_ERR_OR_NULL(kvaser_usb_debugfs_root)) {
+		debugfs_create_file("probe_cache", 0444,
+				    kvaser_usb_debugfs_root, NULL,
+				    &kvaser_usb_debugfs_probe_cache_fops);
+		debugfs_create_file("rx_pool", 0444, kvaser_usb_debugfs_root,
+				    NULL, &kvaser_usb_debugfs_rx_pool_fops);
+	}
+
+#if (LINUX_VERSION_CODE >= KERNEL_VERSION(5, 2, 0))
+	err = genl_register_family(&kvaser_usb_genl_family);
+	if (err) {
+		debugfs_remove_recursive(kvaser_usb_debugfs_root);
+		return err;
+	}
+#endif /* LINUX_VERSION_CODE >= KERNEL_VERSION 5.2.0 */
+
+	err = usb_register(&kvaser_usb_driver);
+	if (err) {
+#if (LINUX_VERSION_CODE >= KERNEL_VERSION(5, 2, 0))
+		genl_unregister_family(&kvaser_usb_genl_family);
+#endif /* LINUX_VERSION_CODE >= KERNEL_VERSION 5.2.0 */
+		debugfs_remove_recursive(kvaser_usb_debugfs_root);
+	}
+
+	return err;
+}
+module_init(kvaser_usb_init);
+
+static void __exit kvaser_usb_exit(void)
+{
+	usb_deregister(&kvaser_usb_driver);
+#if (LINUX_VERSION_CODE >= KERNEL_VERSION(5, 2, 0))
+	genl_unregister_family(&kvaser_usb_genl_family);
+#endif /* LINUX_VERSION_CODE >= KERNEL_VERSION 5.2.0 */
+	debugfs_remove_recursive(kvaser_usb_debugfs_root);
+	kvaser_usb_probe_cache_clear();
+}
+module_exit(kvaser_usb_exit);
 
 MODULE_AUTHOR("Olivier Sobrie <olivier@sobrie.be>");
 MODULE_AUTHOR("Kvaser AB <support@kvaser.com>");
 MODULE_DESCRIPTION("CAN driver for Kvaser CAN/USB devices");
 MODULE_LICENSE("GPL v2");
+
+#if IS_ENABLED(CONFIG_CAN_KVASER_USB_KUNIT_TEST)
+#include "kvaser_usb_core_kunit.c"
+#endif /* CONFIG_CAN_KVASER_USB_KUNIT_TEST */
@@ -0,0 +1,245 @@
+// SPDX-License-Identifier: GPL-2.0 OR BSD-2-Clause
+/* KUnit tests for the Kvaser USB core. This file is included at the end of
+ * kvaser_usb_core.c, so that the static helpers can be tested directly.
+ */
+
+#include <kunit/test.h>
+
+#define KVASER_USB_CORE_TEST_US(us)	ns_to_ktime((u64)(us) * NSEC_PER_USEC)
+
+static const struct net_device_ops kvaser_usb_core_test_netdev_ops = {
+};
+
+/* A registered channel that is never brought up, so the frames the periodic
+ * tasklet may queue are dropped by the noop qdisc
+ */
+static struct kvaser_usb_net_priv *kvaser_usb_core_test_priv(struct kunit *test)
+{
+	struct kvaser_usb_net_priv *priv;
+	struct net_device *netdev;
+
+	netdev = alloc_candev(sizeof(*priv), 1);
+	KUNIT_ASSERT_NOT_NULL(test, netdev);
+	netdev->netdev_ops = &kvaser_usb_core_test_netdev_ops;
+	priv = netdev_priv(netdev);
+	priv->netdev = netdev;
+	kvaser_usb_periodic_init(priv);
+
+	if (register_candev(netdev)) {
+		free_candev(netdev);
+		KUNIT_FAIL(test, "register_candev failed");
+		return NULL;
+	}
+	test->priv = priv;
+
+	return priv;
+}
+
+static void kvaser_usb_core_test_exit(struct kunit *test)
+{
+	struct kvaser_usb_net_priv *priv = test->priv;
+
+	if (!priv)
+		return;
+
+	kvaser_usb_periodic_flush(priv);
+	unregister_candev(priv->netdev);
+	free_candev(priv->netdev);
+}
+
+static void kvaser_usb_core_test_frame(struct canfd_frame *cf, canid_t id,
+				       u8 len)
+{
+	int i;
+
+	memset(cf, 0, sizeof(*cf));
+	cf->can_id = id;
+	cf->len = len;
+	for (i = 0; i < len; i++)
+		cf->data[i] = id + i;
+}
+
+/* Stop the timer and the tasklet, so that the test alone advances the
+ * schedule
+ */
+static void kvaser_usb_core_test_hold(struct kvaser_usb_net_priv *priv)
+{
+	hrtimer_cancel(&priv->periodic_timer);
+	tasklet_kill(&priv->periodic_tasklet);
+}
+
+/* Runs the schedule at @now, returns the number of frames that were due
+ * and checks the next deadline
+ */
+static int kvaser_usb_core_test_due(struct kunit *test,
+				    struct kvaser_usb_net_priv *priv,
+				    ktime_t now, ktime_t expect_next)
+{
+	struct sk_buff_head queue;
+	ktime_t expires;
+	int n;
+
+	__skb_queue_head_init(&queue);
+	spin_lock_bh(&priv->periodic_lock);
+	KUNIT_EXPECT_TRUE(test, kvaser_usb_periodic_due(priv, now, &queue,
+							&expires));
+	spin_unlock_bh(&priv->periodic_lock);
+	KUNIT_EXPECT_EQ(test, ktime_to_ns(expires), ktime_to_ns(expect_next));
+
+	n = skb_queue_len(&queue);
+	__skb_queue_purge(&queue);
+
+	return n;
+}
+
+static void kvaser_usb_core_periodic_period_test(struct kunit *test)
+{
+	struct kvaser_usb_net_priv *priv = kvaser_usb_core_test_priv(test);
+	struct canfd_frame cf;
+	ktime_t t0;
+
+	KUNIT_ASSERT_NOT_NULL(test, priv);
+
+	kvaser_usb_core_test_frame(&cf, 0x123, 8);
+	KUNIT_ASSERT_EQ(test, kvaser_usb_periodic_add(priv, 0, 1000, &cf, false),
+			0);
+	kvaser_usb_core_test_frame(&cf, 0x456, 2);
+	KUNIT_ASSERT_EQ(test, kvaser_usb_periodic_add(priv, 5, 2500, &cf, false),
+			0);
+	kvaser_usb_core_test_hold(priv);
+
+	t0 = ktime_get();
+	priv->periodic[0].next = t0;
+	priv->periodic[5].next = t0;
+
+	/* Both are due at once, then each follows its own period */
+	KUNIT_EXPECT_EQ(test, kvaser_usb_core_test_due(test, priv, t0,
+			ktime_add(t0, KVASER_USB_CORE_TEST_US(1000))), 2);
+	KUNIT_EXPECT_EQ(test, kvaser_usb_core_test_due(test, priv,
+			ktime_add(t0, KVASER_USB_CORE_TEST_US(999)),
+			ktime_add(t0, KVASER_USB_CORE_TEST_US(1000))), 0);
+	KUNIT_EXPECT_EQ(test, kvaser_usb_core_test_due(test, priv,
+			ktime_add(t0, KVASER_USB_CORE_TEST_US(1000)),
+			ktime_add(t0, KVASER_USB_CORE_TEST_US(2000))), 1);
+	KUNIT_EXPECT_EQ(test, kvaser_usb_core_test_due(test, priv,
+			ktime_add(t0, KVASER_USB_CORE_TEST_US(2000)),
+			ktime_add(t0, KVASER_USB_CORE_TEST_US(2500))), 1);
+	KUNIT_EXPECT_EQ(test, kvaser_usb_core_test_due(test, priv,
+			ktime_add(t0, KVASER_USB_CORE_TEST_US(2500)),
+			ktime_add(t0, KVASER_USB_CORE_TEST_US(3000))), 1);
+
+	/* Missed periods are skipped, not sent as a burst */
+	KUNIT_EXPECT_EQ(test, kvaser_usb_core_test_due(test, priv,
+			ktime_add(t0, KVASER_USB_CORE_TEST_US(20000)),
+			ktime_add(t0, KVASER_USB_CORE_TEST_US(21000))), 2);
+	KUNIT_EXPECT_EQ(test, ktime_to_ns(priv->periodic[5].next),
+			ktime_to_ns(ktime_add(t0,
+					      KVASER_USB_CORE_TEST_US(22500))));
+}
+
+static void kvaser_usb_core_periodic_slot_test(struct kunit *test)
+{
+	struct kvaser_usb_net_priv *priv = kvaser_usb_core_test_priv(test);
+	const struct canfd_frame *queued;
+	struct canfd_frame cf;
+
+	KUNIT_ASSERT_NOT_NULL(test, priv);
+
+	kvaser_usb_core_test_frame(&cf, 0x7ff, 8);
+	KUNIT_EXPECT_EQ(test, kvaser_usb_periodic_add(priv,
+						      KVASER_USB_MAX_PERIODIC,
+						      1000, &cf, false),
+			-EINVAL);
+	KUNIT_EXPECT_EQ(test, kvaser_usb_periodic_add(priv, 0,
+						      KVASER_USB_PERIODIC_MIN_PERIOD_US - 1,
+						      &cf, false),
+			-EINVAL);
+	KUNIT_EXPECT_EQ(test, kvaser_usb_periodic_add(priv, 0,
+						      KVASER_USB_PERIODIC_MAX_PERIOD_US + 1,
+						      &cf, false),
+			-EINVAL);
+
+	/* An 11-bit identifier out of range, and CAN FD while it is off */
+	cf.can_id = 0x800;
+	KUNIT_EXPECT_EQ(test, kvaser_usb_periodic_add(priv, 0, 1000, &cf,
+						      false),
+			-EINVAL);
+	kvaser_usb_core_test_frame(&cf, 0x1, CANFD_MAX_DLEN);
+	KUNIT_EXPECT_EQ(test, kvaser_usb_periodic_add(priv, 0, 1000, &cf,
+						      true),
+			-EINVAL);
+	KUNIT_EXPECT_EQ(test, kvaser_usb_periodic_add(priv, 0, 1000, &cf,
+						      false),
+			-EINVAL);
+
+	priv->can.ctrlmode |= CAN_CTRLMODE_FD;
+	KUNIT_ASSERT_EQ(test, kvaser_usb_periodic_add(priv, 3, 1000, &cf,
+						      true),
+			0);
+	KUNIT_ASSERT_NOT_NULL(test, priv->periodic[3].skb);
+	KUNIT_EXPECT_TRUE(test, can_is_canfd_skb(priv->periodic[3].skb));
+	queued = (const struct canfd_frame *)priv->periodic[3].skb->data;
+	KUNIT_EXPECT_EQ(test, queued->can_id, cf.can_id);
+	KUNIT_EXPECT_EQ(test, queued->len, cf.len);
+	KUNIT_EXPECT_EQ(test, memcmp(queued->data, cf.data, cf.len), 0);
+	KUNIT_EXPECT_EQ(test, ktime_to_us(priv->periodic[3].period), 1000);
+
+	/* Adding to a slot in use replaces its frame and period */
+	kvaser_usb_core_test_frame(&cf, 0x12345678 | CAN_EFF_FLAG, 4);
+	KUNIT_ASSERT_EQ(test, kvaser_usb_periodic_add(priv, 3, 5000, &cf,
+						      false),
+			0);
+	KUNIT_EXPECT_FALSE(test, can_is_canfd_skb(priv->periodic[3].skb));
+	queued = (const struct canfd_frame *)priv->periodic[3].skb->data;
+	KUNIT_EXPECT_EQ(test, queued->can_id, cf.can_id);
+	KUNIT_EXPECT_EQ(test, ktime_to_us(priv->periodic[3].period), 5000);
+
+	KUNIT_EXPECT_EQ(test, kvaser_usb_periodic_del(priv, 3), 0);
+	KUNIT_EXPECT_NULL(test, priv->periodic[3].skb);
+	KUNIT_EXPECT_EQ(test, kvaser_usb_periodic_del(priv, 3), -ENOENT);
+	KUNIT_EXPECT_EQ(test, kvaser_usb_periodic_del(priv,
+						      KVASER_USB_MAX_PERIODIC),
+			-EINVAL);
+}
+
+/* kvaser_usb_close() stops all slots through kvaser_usb_periodic_flush() */
+static void kvaser_usb_core_periodic_stop_test(struct kunit *test)
+{
+	struct kvaser_usb_net_priv *priv = kvaser_usb_core_test_priv(test);
+	struct canfd_frame cf;
+	int i;
+
+	KUNIT_ASSERT_NOT_NULL(test, priv);
+
+	kvaser_usb_core_test_frame(&cf, 0x100, 8);
+	for (i = 0; i < KVASER_USB_MAX_PERIODIC; i++)
+		KUNIT_ASSERT_EQ(test, kvaser_usb_periodic_add(priv, i,
+							      KVASER_USB_PERIODIC_MIN_PERIOD_US,
+							      &cf, false),
+				0);
+
+	kvaser_usb_periodic_flush(priv);
+
+	for (i = 0; i < KVASER_USB_MAX_PERIODIC; i++)
+		KUNIT_EXPECT_NULL(test, priv->periodic[i].skb);
+	KUNIT_EXPECT_FALSE(test, hrtimer_active(&priv->periodic_timer));
+
+	/* With no slot left, the tasklet does not rearm the timer */
+	kvaser_usb_periodic_tasklet((unsigned long)priv);
+	KUNIT_EXPECT_FALSE(test, hrtimer_active(&priv->periodic_timer));
+}
+
+static struct kunit_case kvaser_usb_core_test_cases[] = {
+	KUNIT_CASE(kvaser_usb_core_periodic_period_test),
+	KUNIT_CASE(kvaser_usb_core_periodic_slot_test),
+	KUNIT_CASE(kvaser_usb_core_periodic_stop_test),
+	{}
+};
+
+static struct kunit_suite kvaser_usb_core_test_suite = {
+	.name = "kvaser_usb_core",
+	.exit = kvaser_usb_core_test_exit,
+	.test_cases = kvaser_usb_core_test_cases,
+};
+
+kunit_test_suite(kvaser_usb_core_test_suite);
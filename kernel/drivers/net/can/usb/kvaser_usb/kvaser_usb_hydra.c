@@ -8,9 +8,11 @@
  *
  * Known issues:
  *  - Transition from CAN_STATE_ERROR_WARNING to CAN_STATE_ERROR_ACTIVE is only
- *    reported after a call to do_get_berr_counter(), since firmware does not
- *    distinguish between ERROR_WARNING and ERROR_ACTIVE.
- *  - Hardware timestamps are not set for CAN Tx frames.
+ *    reported after the error counters are refreshed, by do_get_berr_counter()
+ *    or the berr_poll_ms poll, since firmware does not distinguish between
+ *    ERROR_WARNING and ERROR_ACTIVE.
+ *  - Hardware timestamps are only set for CAN Tx frames on devices using
+ *    extended commands, since CMD_TX_ACKNOWLEDGE carries no timestamp.
  */
 
 #include <linux/version.h>
@@ -19,7 +21,9 @@
 #include <linux/gfp.h>
 #include <linux/jiffies.h>
 #include <linux/kernel.h>
+#include <linux/moduleparam.h>
 #include <linux/netdevice.h>
+#include <linux/seq_file.h>
 #include <linux/spinlock.h>
 #include <linux/string.h>
 #include <linux/types.h>
@@ -29,6 +33,7 @@
 #define MEGA   1000000UL
 #endif /* LINUX_VERSION_CODE >= 5.15.0) */
 #include <linux/usb.h>
+#include <linux/workqueue.h>
 #if (LINUX_VERSION_CODE < KERNEL_VERSION(6, 0, 0))
 #define CAN_ERR_CNT 0
 #endif /* LINUX_VERSION_CODE < KERNEL_VERSION 6.0.0 */
@@ -51,6 +56,19 @@ static const struct kvaser_usb_dev_cfg kvaser_usb_hydra_dev_cfg_rt;
 #define KVASER_USB_HYDRA_MAX_TRANSID		0xff
 #define KVASER_USB_HYDRA_MIN_TRANSID		0x01
 
+/* Minimum time between error counter refreshes triggered by readers */
+#define KVASER_USB_HYDRA_BERR_REFRESH_MS	100
+
+static unsigned int berr_poll_ms;
+module_param(berr_poll_ms, uint, 0644);
+MODULE_PARM_DESC(berr_poll_ms,
+		 "Background error counter refresh interval in ms while the channel is started, 0 to disable (default 0)");
+
+static bool berr_wait_fresh;
+module_param(berr_wait_fresh, bool, 0644);
+MODULE_PARM_DESC(berr_wait_fresh,
+		 "Let error counter reads wait for a fresh reply from the device instead of returning the cached value (default off)");
+
 /* Minihydra command IDs */
 #define CMD_SET_BUSPARAMS_REQ			16
 #define CMD_GET_BUSPARAMS_REQ			17
@@ -381,8 +399,23 @@ struct kvaser_cmd_ext {
 	} __packed;
 } __packed;
 
+/* Bytes needed to read the size of any command, and the fixed part of an
+ * extended command
+ */
+#define KVASER_USB_HYDRA_CMD_SIZE_BYTES \
+	(offsetof(struct kvaser_cmd_ext, len) + sizeof(__le16))
+#define KVASER_USB_HYDRA_CMD_EXT_HEADER_LEN \
+	offsetof(struct kvaser_cmd_ext, rx_can)
+
 struct kvaser_usb_net_hydra_priv {
+	struct kvaser_usb_net_priv *net;
 	int pending_get_busparams_type;
+	/* Error counter refresh, see kvaser_usb_hydra_get_berr_counter() */
+	struct delayed_work berr_poll_work;
+	struct completion berr_comp;
+	unsigned long berr_req_jiffies;
+	/* Transaction id of the latest CMD_GET_CHIP_STATE_REQ, 0 if none */
+	u16 berr_transid;
 };
 static const struct can_bittiming_const kvaser_usb_hydra_kcan_bittiming_c = {
 	.name = "kvaser_usb_kcan",
@@ -485,19 +518,21 @@ static u8 kvaser_usb_hydra_channel_from_cmd(const struct kvaser_usb *dev,
 
 static u16 kvaser_usb_hydra_get_next_transid(struct kvaser_usb *dev)
 {
-	unsigned long flags;
-	u16 transid;
 	struct kvaser_usb_dev_card_data_hydra *card_data =
 							&dev->card_data.hydra;
+	int old;
+	int transid;
 
-	spin_lock_irqsave(&card_data->transid_lock, flags);
-	transid = card_data->transid;
-	if (transid >= KVASER_USB_HYDRA_MAX_TRANSID)
-		transid = KVASER_USB_HYDRA_MIN_TRANSID;
-	else
-		transid++;
-	card_data->transid = transid;
-	spin_unlock_irqrestore(&card_data->transid_lock, flags);
+	/* Lock free: each successful cmpxchg hands out a unique value until
+	 * the counter wraps.
+	 */
+	do {
+		old = atomic_read(&card_data->transid);
+		if (old >= KVASER_USB_HYDRA_MAX_TRANSID)
+			transid = KVASER_USB_HYDRA_MIN_TRANSID;
+		else
+			transid = old + 1;
+	} while (atomic_cmpxchg(&card_data->transid, old, transid) != old);
 
 	return transid;
 }
@@ -514,6 +549,20 @@ static size_t kvaser_usb_hydra_cmd_size(struct kvaser_cmd *cmd)
 	return ret;
 }
 
+/* Size of a received command, or 0 if an extended command carries a length
+ * that cannot be valid. Requires KVASER_USB_HYDRA_CMD_SIZE_BYTES of cmd.
+ */
+static size_t kvaser_usb_hydra_cmd_size_checked(struct kvaser_cmd *cmd)
+{
+	size_t cmd_len = kvaser_usb_hydra_cmd_size(cmd);
+
+	if (cmd_len < KVASER_USB_HYDRA_CMD_EXT_HEADER_LEN ||
+	    cmd_len > KVASER_USB_HYDRA_MAX_CMD_LEN)
+		return 0;
+
+	return cmd_len;
+}
+
 static struct kvaser_usb_net_priv *
 kvaser_usb_hydra_net_priv_from_cmd(const struct kvaser_usb *dev,
 				   const struct kvaser_cmd *cmd)
@@ -530,6 +579,13 @@ kvaser_usb_hydra_net_priv_from_cmd(const struct kvaser_usb *dev,
 	return priv;
 }
 
+static ktime_t
+kvaser_usb_hydra_ktime_from_ticks(const struct kvaser_usb_dev_cfg *cfg,
+				  u64 ticks)
+{
+	return ns_to_ktime(div_u64(ticks * 1000, cfg->timestamp_freq));
+}
+
 static ktime_t
 kvaser_usb_hydra_ktime_from_rx_cmd(const struct kvaser_usb_dev_cfg *cfg,
 				   const struct kvaser_cmd *cmd)
@@ -546,7 +602,7 @@ kvaser_usb_hydra_ktime_from_rx_cmd(const struct kvaser_usb_dev_cfg *cfg,
 		ticks += (u64)(le16_to_cpu(cmd->rx_can.timestamp[2])) << 32;
 	}
 
-	return ns_to_ktime(div_u64(ticks * 1000, cfg->timestamp_freq));
+	return kvaser_usb_hydra_ktime_from_ticks(cfg, ticks);
 }
 
 static int kvaser_usb_hydra_send_simple_cmd(struct kvaser_usb *dev,
@@ -589,8 +645,8 @@ end:
 }
 
 static int
-kvaser_usb_hydra_send_simple_cmd_async(struct kvaser_usb_net_priv *priv,
-				       u8 cmd_no)
+__kvaser_usb_hydra_send_simple_cmd_async(struct kvaser_usb_net_priv *priv,
+					 u8 cmd_no, u16 transid)
 {
 	struct kvaser_cmd *cmd;
 	struct kvaser_usb *dev = priv->dev;
@@ -606,8 +662,7 @@ kvaser_usb_hydra_send_simple_cmd_async(struct kvaser_usb_net_priv *priv,
 
 	kvaser_usb_hydra_set_cmd_dest_he
 		(cmd, dev->card_data.hydra.channel_to_he[priv->channel]);
-	kvaser_usb_hydra_set_cmd_transid
-				(cmd, kvaser_usb_hydra_get_next_transid(dev));
+	kvaser_usb_hydra_set_cmd_transid(cmd, transid);
 
 	err = kvaser_usb_send_cmd_async(priv, cmd, cmd_len);
 	if (err)
@@ -616,6 +671,15 @@ kvaser_usb_hydra_send_simple_cmd_async(struct kvaser_usb_net_priv *priv,
 	return err;
 }
 
+static int
+kvaser_usb_hydra_send_simple_cmd_async(struct kvaser_usb_net_priv *priv,
+				       u8 cmd_no)
+{
+	return __kvaser_usb_hydra_send_simple_cmd_async
+			(priv, cmd_no,
+			 kvaser_usb_hydra_get_next_transid(priv->dev));
+}
+
 /* This function is used for synchronously waiting on hydra control commands.
  * Note: Compared to kvaser_usb_hydra_read_bulk_callback(), we never need to
  *       handle partial hydra commands. Since hydra control commands are always
@@ -648,11 +712,12 @@ static int kvaser_usb_hydra_wait_cmd(const struct kvaser_usb *dev, u8 cmd_no,
 
 		while (pos < actual_len) {
 			struct kvaser_cmd *tmp_cmd;
-			size_t cmd_len;
+			size_t cmd_len = 0;
 
 			tmp_cmd = buf + pos;
-			cmd_len = kvaser_usb_hydra_cmd_size(tmp_cmd);
-			if (pos + cmd_len > actual_len) {
+			if (actual_len - pos >= KVASER_USB_HYDRA_CMD_SIZE_BYTES)
+				cmd_len = kvaser_usb_hydra_cmd_size_checked(tmp_cmd);
+			if (!cmd_len || pos + cmd_len > actual_len) {
 				dev_err_ratelimited(&dev->intf->dev,
 						    "Format error\n");
 				break;
@@ -837,12 +902,14 @@ static void kvaser_usb_hydra_start_chip_reply(const struct kvaser_usb *dev,
 	if (!priv)
 		return;
 
-	if (completion_done(&priv->start_comp) &&
-	    netif_queue_stopped(priv->netdev)) {
-		netif_wake_queue(priv->netdev);
+	if (completion_done(&priv->start_comp)) {
+		unsigned long irq_flags;
+
+		spin_lock_irqsave(&priv->tx_contexts_lock, irq_flags);
+		kvaser_usb_tx_wake_queues(priv);
+		spin_unlock_irqrestore(&priv->tx_contexts_lock, irq_flags);
 	} else {
-		netif_start_queue(priv->netdev);
-		complete(&priv->start_comp);
+		kvaser_usb_start_chip_confirmed(priv);
 	}
 }
 
@@ -986,15 +1053,17 @@ static void kvaser_usb_hydra_update_state(struct kvaser_usb_net_priv *priv,
 		cf->data[7] = bec->rxerr;
 	}
 
-	netif_rx(skb);
+	kvaser_usb_netif_rx(skb);
 }
 
 static void kvaser_usb_hydra_state_event(const struct kvaser_usb *dev,
 					 const struct kvaser_cmd *cmd)
 {
 	struct kvaser_usb_net_priv *priv;
+	struct kvaser_usb_net_hydra_priv *hydra;
 	struct can_berr_counter bec;
 	u8 bus_status;
+	u16 transid;
 
 	priv = kvaser_usb_hydra_net_priv_from_cmd(dev, cmd);
 	if (!priv)
@@ -1007,6 +1076,14 @@ static void kvaser_usb_hydra_state_event(const struct kvaser_usb *dev,
 	kvaser_usb_hydra_update_state(priv, bus_status, &bec);
 	priv->bec.txerr = bec.txerr;
 	priv->bec.rxerr = bec.rxerr;
+
+	/* Only the reply to our own request has fresh counters, chip state
+	 * events sent on the device's own initiative must not end the wait.
+	 */
+	hydra = priv->sub_priv;
+	transid = kvaser_usb_hydra_get_cmd_transid(cmd);
+	if (hydra && transid && transid == READ_ONCE(hydra->berr_transid))
+		complete(&hydra->berr_comp);
 }
 
 static void kvaser_usb_hydra_error_event_parameter(const struct kvaser_usb *dev,
@@ -1141,7 +1218,7 @@ kvaser_usb_hydra_error_frame(struct kvaser_usb_net_priv *priv,
 		cf->data[7] = bec.rxerr;
 	}
 
-	netif_rx(skb);
+	kvaser_usb_netif_rx(skb);
 
 	priv->bec.txerr = bec.txerr;
 	priv->bec.rxerr = bec.rxerr;
@@ -1174,7 +1251,7 @@ static void kvaser_usb_hydra_one_shot_fail(struct kvaser_usb_net_priv *priv,
 	}
 
 	stats->tx_errors++;
-	netif_rx(skb);
+	kvaser_usb_netif_rx(skb);
 }
 
 static void kvaser_usb_hydra_tx_acknowledge(const struct kvaser_usb *dev,
@@ -1186,6 +1263,8 @@ static void kvaser_usb_hydra_tx_acknowledge(const struct kvaser_usb *dev,
 	unsigned int len;
 	bool one_shot_fail = false;
 	bool is_err_frame = false;
+	bool has_hwtstamp = false;
+	ktime_t hwtstamp = ns_to_ktime(0);
 	u16 transid = kvaser_usb_hydra_get_cmd_transid(cmd);
 
 	priv = kvaser_usb_hydra_net_priv_from_cmd(dev, cmd);
@@ -1207,12 +1286,26 @@ static void kvaser_usb_hydra_tx_acknowledge(const struct kvaser_usb *dev,
 
 		is_err_frame = flags & KVASER_USB_HYDRA_CF_FLAG_TX_ACK &&
 			       flags & KVASER_USB_HYDRA_CF_FLAG_ERROR_FRAME;
+
+		hwtstamp = kvaser_usb_hydra_ktime_from_ticks
+				(dev->cfg, le64_to_cpu(cmd_ext->tx_ack.timestamp));
+		has_hwtstamp = true;
 	}
 
 	context = &priv->tx_contexts[transid % dev->max_tx_urbs];
 
 	spin_lock_irqsave(&priv->tx_contexts_lock, irq_flags);
 
+	/* echo_index equals max_tx_urbs for a context that is not in use */
+	if (context->echo_index < dev->max_tx_urbs) {
+		struct sk_buff *skb = priv->can.echo_skb[context->echo_index];
+
+		if (has_hwtstamp && skb)
+			skb_hwtstamps(skb)->hwtstamp = hwtstamp;
+
+		kvaser_usb_tx_completed_queue(priv, context);
+	}
+
 #if (LINUX_VERSION_CODE >= KERNEL_VERSION(5, 12, 0))
 	len = can_get_echo_skb(priv->netdev, context->echo_index, NULL);
 #else
@@ -1220,7 +1313,7 @@ static void kvaser_usb_hydra_tx_acknowledge(const struct kvaser_usb *dev,
 #endif /* LINUX_VERSION_CODE >= 5.12.0) */
 	context->echo_index = dev->max_tx_urbs;
 	--priv->active_tx_contexts;
-	netif_wake_queue(priv->netdev);
+	kvaser_usb_tx_wake_queues(priv);
 
 	spin_unlock_irqrestore(&priv->tx_contexts_lock, irq_flags);
 
@@ -1300,7 +1393,7 @@ static void kvaser_usb_hydra_rx_msg_std(const struct kvaser_usb *dev,
 	}
 	stats->rx_packets++;
 
-	netif_rx(skb);
+	kvaser_usb_netif_rx(skb);
 }
 
 static void kvaser_usb_hydra_rx_msg_ext(const struct kvaser_usb *dev,
@@ -1388,7 +1481,7 @@ static void kvaser_usb_hydra_rx_msg_ext(const struct kvaser_usb *dev,
 	}
 	stats->rx_packets++;
 
-	netif_rx(skb);
+	kvaser_usb_netif_rx(skb);
 }
 
 static void kvaser_usb_hydra_handle_cmd_std(const struct kvaser_usb *dev,
@@ -1458,14 +1551,24 @@ static void kvaser_usb_hydra_handle_cmd_ext(const struct kvaser_usb *dev,
 	}
 }
 
-static void kvaser_usb_hydra_handle_cmd(const struct kvaser_usb *dev,
+static void kvaser_usb_hydra_handle_cmd(struct kvaser_usb *dev,
 					const struct kvaser_cmd *cmd)
 {
-		if (cmd->header.cmd_no == CMD_EXTENDED)
-			kvaser_usb_hydra_handle_cmd_ext
-					(dev, (struct kvaser_cmd_ext *)cmd);
-		else
-			kvaser_usb_hydra_handle_cmd_std(dev, cmd);
+	u64 start_ns = kvaser_usb_cmd_stats_begin(dev);
+	u8 cmd_no;
+
+	if (cmd->header.cmd_no == CMD_EXTENDED) {
+		const struct kvaser_cmd_ext *cmd_ext =
+					(const struct kvaser_cmd_ext *)cmd;
+
+		cmd_no = cmd_ext->cmd_no_ext;
+		kvaser_usb_hydra_handle_cmd_ext(dev, cmd_ext);
+	} else {
+		cmd_no = cmd->header.cmd_no;
+		kvaser_usb_hydra_handle_cmd_std(dev, cmd);
+	}
+
+	kvaser_usb_cmd_stats_end(dev, cmd_no, start_ns);
 }
 
 static void *
@@ -1740,18 +1843,60 @@ static int kvaser_usb_hydra_set_data_bittiming(const struct net_device *netdev,
 	return err;
 }
 
+static void kvaser_usb_hydra_berr_request(struct kvaser_usb_net_priv *priv)
+{
+	struct kvaser_usb_net_hydra_priv *hydra = priv->sub_priv;
+	u16 transid = kvaser_usb_hydra_get_next_transid(priv->dev);
+
+	hydra->berr_req_jiffies = jiffies;
+	WRITE_ONCE(hydra->berr_transid, transid);
+	__kvaser_usb_hydra_send_simple_cmd_async(priv, CMD_GET_CHIP_STATE_REQ,
+						 transid);
+}
+
+static void kvaser_usb_hydra_berr_poll_work(struct work_struct *work)
+{
+	struct kvaser_usb_net_hydra_priv *hydra =
+		container_of(work, struct kvaser_usb_net_hydra_priv,
+			     berr_poll_work.work);
+	struct kvaser_usb_net_priv *priv = hydra->net;
+	unsigned int interval = READ_ONCE(berr_poll_ms);
+
+	if (!interval || priv->can.state == CAN_STATE_STOPPED)
+		return;
+
+	kvaser_usb_hydra_berr_request(priv);
+	schedule_delayed_work(&hydra->berr_poll_work,
+			      msecs_to_jiffies(interval));
+}
+
+/* priv->bec is a cache, updated by CMD_CHIP_STATE_EVENT and error frames.
+ * Return it right away and ask the device for fresh values in the
+ * background, at most once per KVASER_USB_HYDRA_BERR_REFRESH_MS, unless
+ * berr_wait_fresh is set.
+ */
 static int kvaser_usb_hydra_get_berr_counter(const struct net_device *netdev,
 					     struct can_berr_counter *bec)
 {
 	struct kvaser_usb_net_priv *priv = netdev_priv(netdev);
-	int err;
+	struct kvaser_usb_net_hydra_priv *hydra = priv->sub_priv;
 
-	err = kvaser_usb_hydra_send_simple_cmd(priv->dev,
-					       CMD_GET_CHIP_STATE_REQ,
-					       priv->channel);
-	if (err)
-		return err;
+	/* Rx URBs are not running, nothing would process the reply */
+	if (priv->can.state == CAN_STATE_STOPPED)
+		goto out;
+
+	if (berr_wait_fresh) {
+		reinit_completion(&hydra->berr_comp);
+		kvaser_usb_hydra_berr_request(priv);
+		if (!wait_for_completion_timeout(&hydra->berr_comp,
+						 msecs_to_jiffies(KVASER_USB_TIMEOUT)))
+			return -ETIMEDOUT;
+	} else if (time_after(jiffies, hydra->berr_req_jiffies +
+			      msecs_to_jiffies(KVASER_USB_HYDRA_BERR_REFRESH_MS))) {
+		kvaser_usb_hydra_berr_request(priv);
+	}
 
+out:
 	*bec = priv->bec;
 
 	return 0;
@@ -1785,22 +1930,26 @@ static int kvaser_usb_hydra_setup_endpoints(struct kvaser_usb *dev)
 
 static int kvaser_usb_hydra_init_card(struct kvaser_usb *dev)
 {
-	int err;
-	unsigned int i;
 	struct kvaser_usb_dev_card_data_hydra *card_data =
 							&dev->card_data.hydra;
 
-	card_data->transid = KVASER_USB_HYDRA_MIN_TRANSID;
-	spin_lock_init(&card_data->transid_lock);
+	atomic_set(&card_data->transid, KVASER_USB_HYDRA_MIN_TRANSID);
 
 	memset(card_data->usb_rx_leftover, 0, KVASER_USB_HYDRA_MAX_CMD_LEN);
 	card_data->usb_rx_leftover_len = 0;
-	spin_lock_init(&card_data->usb_rx_leftover_lock);
 
 	memset(card_data->channel_to_he, KVASER_USB_HYDRA_HE_ADDRESS_ILLEGAL,
 	       sizeof(card_data->channel_to_he));
 	card_data->sysdbg_he = 0;
 
+	return 0;
+}
+
+static int kvaser_usb_hydra_map_channels(struct kvaser_usb *dev)
+{
+	int err;
+	unsigned int i;
+
 	for (i = 0; i < KVASER_USB_MAX_NET_DEVICES; i++) {
 		err = kvaser_usb_hydra_map_channel
 					(dev,
@@ -1832,11 +1981,23 @@ static int kvaser_usb_hydra_init_channel(struct kvaser_usb_net_priv *priv)
 	if (!hydra)
 		return -ENOMEM;
 
+	hydra->net = priv;
+	init_completion(&hydra->berr_comp);
+	INIT_DELAYED_WORK(&hydra->berr_poll_work,
+			  kvaser_usb_hydra_berr_poll_work);
 	priv->sub_priv = hydra;
 
 	return 0;
 }
 
+static void kvaser_usb_hydra_remove_channel(struct kvaser_usb_net_priv *priv)
+{
+	struct kvaser_usb_net_hydra_priv *hydra = priv->sub_priv;
+
+	if (hydra)
+		cancel_delayed_work_sync(&hydra->berr_poll_work);
+}
+
 static int kvaser_usb_hydra_get_software_info(struct kvaser_usb *dev)
 {
 	struct kvaser_cmd cmd;
@@ -1940,6 +2101,8 @@ static int kvaser_usb_hydra_get_card_info(struct kvaser_usb *dev)
 	if (err)
 		return err;
 
+	dev->serial_number = le32_to_cpu(cmd.card_info.serial_number);
+	memcpy(dev->ean, cmd.card_info.ean, sizeof(dev->ean));
 	dev->nchannels = cmd.card_info.nchannels;
 	if (dev->nchannels > KVASER_USB_MAX_NET_DEVICES)
 		return -EINVAL;
@@ -2039,8 +2202,11 @@ static int kvaser_usb_hydra_set_opt_mode(const struct kvaser_usb_net_priv *priv)
 	return err;
 }
 
-static int kvaser_usb_hydra_start_chip(struct kvaser_usb_net_priv *priv)
+static int
+kvaser_usb_hydra_start_chip_async(struct kvaser_usb_net_priv *priv)
 {
+	struct kvaser_usb_net_hydra_priv *hydra = priv->sub_priv;
+	unsigned int interval = READ_ONCE(berr_poll_ms);
 	int err;
 
 	reinit_completion(&priv->start_comp);
@@ -2050,6 +2216,24 @@ static int kvaser_usb_hydra_start_chip(struct kvaser_usb_net_priv *priv)
 	if (err)
 		return err;
 
+	/* Let the first reader trigger a refresh */
+	hydra->berr_req_jiffies = jiffies -
+		msecs_to_jiffies(KVASER_USB_HYDRA_BERR_REFRESH_MS) - 1;
+	if (interval)
+		schedule_delayed_work(&hydra->berr_poll_work,
+				      msecs_to_jiffies(interval));
+
+	return 0;
+}
+
+static int kvaser_usb_hydra_start_chip(struct kvaser_usb_net_priv *priv)
+{
+	int err;
+
+	err = kvaser_usb_hydra_start_chip_async(priv);
+	if (err)
+		return err;
+
 	if (!wait_for_completion_timeout(&priv->start_comp,
 					 msecs_to_jiffies(KVASER_USB_TIMEOUT)))
 		return -ETIMEDOUT;
@@ -2059,10 +2243,13 @@ static int kvaser_usb_hydra_start_chip(struct kvaser_usb_net_priv *priv)
 
 static int kvaser_usb_hydra_stop_chip(struct kvaser_usb_net_priv *priv)
 {
+	struct kvaser_usb_net_hydra_priv *hydra = priv->sub_priv;
 	int err;
 
 	reinit_completion(&priv->stop_comp);
 
+	cancel_delayed_work_sync(&hydra->berr_poll_work);
+
 	/* Make sure we do not report invalid BUS_OFF from CMD_CHIP_STATE_EVENT
 	 * see comment in kvaser_usb_hydra_update_state()
 	 */
@@ -2098,75 +2285,118 @@ static int kvaser_usb_hydra_flush_queue(struct kvaser_usb_net_priv *priv)
 	return 0;
 }
 
-/* A single extended hydra command can be transmitted in multiple transfers
- * We have to buffer partial hydra commands, and handle them on next callback.
+/* Complete a command split across transfers, using the start of buf.
+ * Returns the number of bytes consumed from buf, or -EPROTO if the stream
+ * is out of sync and the rest of the transfer must be dropped.
  */
-static void kvaser_usb_hydra_read_bulk_callback(struct kvaser_usb *dev,
-						void *buf, int len)
+static int kvaser_usb_hydra_rx_leftover(struct kvaser_usb *dev, void *buf,
+					int len)
 {
-	unsigned long irq_flags;
-	struct kvaser_cmd *cmd;
-	int pos = 0;
-	size_t cmd_len;
 	struct kvaser_usb_dev_card_data_hydra *card_data =
 							&dev->card_data.hydra;
-	int usb_rx_leftover_len;
-	spinlock_t *usb_rx_leftover_lock = &card_data->usb_rx_leftover_lock;
+	struct kvaser_cmd *cmd = (struct kvaser_cmd *)card_data->usb_rx_leftover;
+	int leftover_len = card_data->usb_rx_leftover_len;
+	int remaining_bytes;
+	size_t cmd_len;
+	int pos = 0;
 
-	spin_lock_irqsave(usb_rx_leftover_lock, irq_flags);
-	usb_rx_leftover_len = card_data->usb_rx_leftover_len;
-	if (usb_rx_leftover_len) {
-		int remaining_bytes;
+	/* The size is unknown until the size field is complete */
+	if (leftover_len < KVASER_USB_HYDRA_CMD_SIZE_BYTES) {
+		remaining_bytes = min_t(int, len,
+					KVASER_USB_HYDRA_CMD_SIZE_BYTES -
+					leftover_len);
+		memcpy(card_data->usb_rx_leftover + leftover_len, buf,
+		       remaining_bytes);
+		pos += remaining_bytes;
+		leftover_len += remaining_bytes;
 
-		cmd = (struct kvaser_cmd *)card_data->usb_rx_leftover;
+		if (leftover_len < KVASER_USB_HYDRA_CMD_SIZE_BYTES) {
+			card_data->usb_rx_leftover_len = leftover_len;
+			return pos;
+		}
+	}
 
-		cmd_len = kvaser_usb_hydra_cmd_size(cmd);
+	cmd_len = kvaser_usb_hydra_cmd_size_checked(cmd);
+	if (cmd_len <= leftover_len) {
+		card_data->usb_rx_leftover_len = 0;
+		return -EPROTO;
+	}
 
-		remaining_bytes = min_t(unsigned int, len,
-					cmd_len - usb_rx_leftover_len);
-		/* Make sure we do not overflow usb_rx_leftover */
-		if (remaining_bytes + usb_rx_leftover_len >
-						KVASER_USB_HYDRA_MAX_CMD_LEN) {
-			dev_err(&dev->intf->dev, "Format error\n");
-			spin_unlock_irqrestore(usb_rx_leftover_lock, irq_flags);
-			return;
-		}
+	remaining_bytes = min_t(int, len - pos, cmd_len - leftover_len);
+	memcpy(card_data->usb_rx_leftover + leftover_len, buf + pos,
+	       remaining_bytes);
+	pos += remaining_bytes;
+	leftover_len += remaining_bytes;
 
-		memcpy(card_data->usb_rx_leftover + usb_rx_leftover_len, buf,
-		       remaining_bytes);
-		pos += remaining_bytes;
+	if (leftover_len == cmd_len) {
+		card_data->usb_rx_leftover_len = 0;
+		kvaser_usb_hydra_handle_cmd(dev, cmd);
+	} else {
+		/* Command still not complete */
+		card_data->usb_rx_leftover_len = leftover_len;
+	}
 
-		if (remaining_bytes + usb_rx_leftover_len == cmd_len) {
-			kvaser_usb_hydra_handle_cmd(dev, cmd);
-			usb_rx_leftover_len = 0;
-		} else {
-			/* Command still not complete */
-			usb_rx_leftover_len += remaining_bytes;
+	return pos;
+}
+
+/* A partial command left by the previous Rx URBs would be completed with
+ * the start of an unrelated transfer
+ */
+static void kvaser_usb_hydra_rx_reset(struct kvaser_usb *dev)
+{
+	dev->card_data.hydra.usb_rx_leftover_len = 0;
+}
+
+/* A single extended hydra command can be transmitted in multiple transfers
+ * We have to buffer partial hydra commands, and handle them on next callback.
+ *
+ * Bulk in completions for a device are serialized, so the leftover buffer is
+ * owned by this function and needs no locking. It is only reset while no Rx
+ * URB is submitted, by kvaser_usb_hydra_init_card() and
+ * kvaser_usb_hydra_rx_reset().
+ */
+static void kvaser_usb_hydra_read_bulk_callback(struct kvaser_usb *dev,
+						void *buf, int len)
+{
+	struct kvaser_usb_dev_card_data_hydra *card_data =
+							&dev->card_data.hydra;
+	struct kvaser_cmd *cmd;
+	size_t cmd_len;
+	int pos = 0;
+
+	if (unlikely(card_data->usb_rx_leftover_len)) {
+		pos = kvaser_usb_hydra_rx_leftover(dev, buf, len);
+		if (pos < 0) {
+			atomic64_inc(&dev->stats.cmd_format_errors);
+			dev_err_ratelimited(&dev->intf->dev, "Format error\n");
+			return;
 		}
-		card_data->usb_rx_leftover_len = usb_rx_leftover_len;
 	}
-	spin_unlock_irqrestore(usb_rx_leftover_lock, irq_flags);
 
 	while (pos < len) {
 		cmd = buf + pos;
 
-		cmd_len = kvaser_usb_hydra_cmd_size(cmd);
-
-		if (pos + cmd_len > len) {
-			/* We got first part of a command */
-			int leftover_bytes;
-
-			leftover_bytes = len - pos;
-			/* Make sure we do not overflow usb_rx_leftover */
-			if (leftover_bytes > KVASER_USB_HYDRA_MAX_CMD_LEN) {
-				dev_err(&dev->intf->dev, "Format error\n");
+		/* A command too short to hold its size field is partial */
+		if (len - pos < KVASER_USB_HYDRA_CMD_SIZE_BYTES) {
+			cmd_len = KVASER_USB_HYDRA_MAX_CMD_LEN;
+		} else {
+			cmd_len = kvaser_usb_hydra_cmd_size_checked(cmd);
+			if (!cmd_len) {
+				atomic64_inc(&dev->stats.cmd_format_errors);
+				dev_err_ratelimited(&dev->intf->dev,
+						    "Format error\n");
 				return;
 			}
-			spin_lock_irqsave(usb_rx_leftover_lock, irq_flags);
-			memcpy(card_data->usb_rx_leftover, buf + pos,
-			       leftover_bytes);
-			card_data->usb_rx_leftover_len = leftover_bytes;
-			spin_unlock_irqrestore(usb_rx_leftover_lock, irq_flags);
+		}
+
+		if (pos + cmd_len > len) {
+			/* We got first part of a command. cmd_len is at most
+			 * KVASER_USB_HYDRA_MAX_CMD_LEN, so the partial command
+			 * always fits in usb_rx_leftover.
+			 */
+			memcpy(card_data->usb_rx_leftover, buf + pos, len - pos);
+			card_data->usb_rx_leftover_len = len - pos;
+			atomic64_inc(&card_data->usb_rx_leftovers);
 			break;
 		}
 
@@ -2192,6 +2422,16 @@ kvaser_usb_hydra_frame_to_cmd(const struct kvaser_usb_net_priv *priv,
 	return buf;
 }
 
+static void kvaser_usb_hydra_debugfs_show(struct kvaser_usb *dev,
+					  struct seq_file *m)
+{
+	struct kvaser_usb_dev_card_data_hydra *card_data =
+							&dev->card_data.hydra;
+
+	seq_printf(m, "usb_rx_leftovers: %lld\n",
+		   atomic64_read(&card_data->usb_rx_leftovers));
+}
+
 const struct kvaser_usb_dev_ops kvaser_usb_hydra_dev_ops = {
 	.dev_set_mode = kvaser_usb_hydra_set_mode,
 	.dev_set_bittiming = kvaser_usb_hydra_set_bittiming,
@@ -2201,18 +2441,23 @@ const struct kvaser_usb_dev_ops kvaser_usb_hydra_dev_ops = {
 	.dev_get_berr_counter = kvaser_usb_hydra_get_berr_counter,
 	.dev_setup_endpoints = kvaser_usb_hydra_setup_endpoints,
 	.dev_init_card = kvaser_usb_hydra_init_card,
+	.dev_map_channels = kvaser_usb_hydra_map_channels,
 	.dev_init_channel = kvaser_usb_hydra_init_channel,
+	.dev_remove_channel = kvaser_usb_hydra_remove_channel,
 	.dev_get_software_info = kvaser_usb_hydra_get_software_info,
 	.dev_get_software_details = kvaser_usb_hydra_get_software_details,
 	.dev_get_card_info = kvaser_usb_hydra_get_card_info,
 	.dev_get_capabilities = kvaser_usb_hydra_get_capabilities,
 	.dev_set_opt_mode = kvaser_usb_hydra_set_opt_mode,
 	.dev_start_chip = kvaser_usb_hydra_start_chip,
+	.dev_start_chip_async = kvaser_usb_hydra_start_chip_async,
 	.dev_stop_chip = kvaser_usb_hydra_stop_chip,
 	.dev_reset_chip = NULL,
 	.dev_flush_queue = kvaser_usb_hydra_flush_queue,
 	.dev_read_bulk_callback = kvaser_usb_hydra_read_bulk_callback,
+	.dev_rx_reset = kvaser_usb_hydra_rx_reset,
 	.dev_frame_to_cmd = kvaser_usb_hydra_frame_to_cmd,
+	.dev_debugfs_show = kvaser_usb_hydra_debugfs_show,
 };
 
 static const struct kvaser_usb_dev_cfg kvaser_usb_hydra_dev_cfg_kcan = {
@@ -2240,3 +2485,7 @@ static const struct kvaser_usb_dev_cfg kvaser_usb_hydra_dev_cfg_rt = {
 	.bittiming_const = &kvaser_usb_hydra_rt_bittiming_c,
 	.data_bittiming_const = &kvaser_usb_hydra_rtd_bittiming_c,
 };
+
+#if IS_ENABLED(CONFIG_CAN_KVASER_USB_KUNIT_TEST)
+#include "kvaser_usb_hydra_kunit.c"
+#endif /* CONFIG_CAN_KVASER_USB_KUNIT_TEST */
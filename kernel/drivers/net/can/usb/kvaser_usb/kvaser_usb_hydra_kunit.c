@@ -0,0 +1,699 @@
+// SPDX-License-Identifier: GPL-2.0 OR BSD-2-Clause
+/* KUnit tests for the Kvaser USB hydra subdriver. This file is included at
+ * the end of kvaser_usb_hydra.c, so that the static helpers can be tested
+ * directly.
+ */
+
+#include <kunit/test.h>
+#include <linux/kthread.h>
+#include <linux/prandom.h>
+
+#define KVASER_USB_HYDRA_TEST_TRANSIDS \
+		(KVASER_USB_HYDRA_MAX_TRANSID - KVASER_USB_HYDRA_MIN_TRANSID + 1)
+#define KVASER_USB_HYDRA_TEST_ALLOCS		(64 * 1024)
+#define KVASER_USB_HYDRA_TEST_MIN_THREADS	4
+
+struct kvaser_usb_hydra_test_transid {
+	struct kvaser_usb *dev;
+	atomic_t *hits;
+	atomic_t running;
+	atomic_t invalid;
+	struct completion start;
+	struct completion done;
+};
+
+static int kvaser_usb_hydra_test_transid_thread(void *data)
+{
+	struct kvaser_usb_hydra_test_transid *ctx = data;
+	int i;
+
+	wait_for_completion(&ctx->start);
+
+	for (i = 0; i < KVASER_USB_HYDRA_TEST_ALLOCS; i++) {
+		u16 transid = kvaser_usb_hydra_get_next_transid(ctx->dev);
+
+		if (transid < KVASER_USB_HYDRA_MIN_TRANSID ||
+		    transid > KVASER_USB_HYDRA_MAX_TRANSID)
+			atomic_inc(&ctx->invalid);
+		else
+			atomic_inc(&ctx->hits[transid]);
+	}
+
+	if (atomic_dec_and_test(&ctx->running))
+		complete(&ctx->done);
+
+	return 0;
+}
+
+static void kvaser_usb_hydra_transid_wrap_test(struct kunit *test)
+{
+	struct kvaser_usb *dev;
+	int i;
+
+	dev = kunit_kzalloc(test, sizeof(*dev), GFP_KERNEL);
+	KUNIT_ASSERT_NOT_NULL(test, dev);
+
+	atomic_set(&dev->card_data.hydra.transid,
+		   KVASER_USB_HYDRA_MAX_TRANSID - 1);
+	KUNIT_EXPECT_EQ(test, kvaser_usb_hydra_get_next_transid(dev),
+			KVASER_USB_HYDRA_MAX_TRANSID);
+	KUNIT_EXPECT_EQ(test, kvaser_usb_hydra_get_next_transid(dev),
+			KVASER_USB_HYDRA_MIN_TRANSID);
+
+	/* One full lap hands out every transid once and never 0 */
+	for (i = 1; i < KVASER_USB_HYDRA_TEST_TRANSIDS; i++)
+		KUNIT_EXPECT_EQ(test, kvaser_usb_hydra_get_next_transid(dev),
+				KVASER_USB_HYDRA_MIN_TRANSID + i);
+	KUNIT_EXPECT_EQ(test, kvaser_usb_hydra_get_next_transid(dev),
+			KVASER_USB_HYDRA_MIN_TRANSID);
+
+	/* The transid must survive the round trip through the header field */
+	for (i = KVASER_USB_HYDRA_MIN_TRANSID;
+	     i <= KVASER_USB_HYDRA_MAX_TRANSID; i++) {
+		struct kvaser_cmd cmd = { };
+
+		kvaser_usb_hydra_set_cmd_transid(&cmd, i);
+		KUNIT_EXPECT_EQ(test, kvaser_usb_hydra_get_cmd_transid(&cmd), i);
+	}
+}
+
+/* Hammer the allocator from several threads. The transids handed out are
+ * consecutive modulo the transid space, so after the run every transid has
+ * been handed out the same number of times, give or take one. A duplicate
+ * inside a lap would show up as one transid hit more often than the others.
+ */
+static void kvaser_usb_hydra_transid_stress_test(struct kunit *test)
+{
+	struct kvaser_usb_hydra_test_transid *ctx;
+	unsigned int nthreads;
+	u64 total, expected;
+	int lo = INT_MAX, hi = 0;
+	int i;
+
+	nthreads = max_t(unsigned int, num_online_cpus(),
+			 KVASER_USB_HYDRA_TEST_MIN_THREADS);
+
+	ctx = kunit_kzalloc(test, sizeof(*ctx), GFP_KERNEL);
+	KUNIT_ASSERT_NOT_NULL(test, ctx);
+	ctx->dev = kunit_kzalloc(test, sizeof(*ctx->dev), GFP_KERNEL);
+	KUNIT_ASSERT_NOT_NULL(test, ctx->dev);
+	ctx->hits = kunit_kcalloc(test, KVASER_USB_HYDRA_MAX_TRANSID + 1,
+				  sizeof(*ctx->hits), GFP_KERNEL);
+	KUNIT_ASSERT_NOT_NULL(test, ctx->hits);
+
+	atomic_set(&ctx->dev->card_data.hydra.transid,
+		   KVASER_USB_HYDRA_MIN_TRANSID);
+	atomic_set(&ctx->running, nthreads);
+	init_completion(&ctx->start);
+	init_completion(&ctx->done);
+
+	for (i = 0; i < nthreads; i++) {
+		struct task_struct *task;
+
+		task = kthread_run(kvaser_usb_hydra_test_transid_thread, ctx,
+				   "kvaser_transid/%d", i);
+		if (IS_ERR(task)) {
+			/* Let the started threads finish before failing */
+			if (!atomic_sub_and_test(nthreads - i, &ctx->running)) {
+				complete_all(&ctx->start);
+				wait_for_completion(&ctx->done);
+			}
+			KUNIT_FAIL(test, "kthread_run failed: %ld",
+				   PTR_ERR(task));
+			return;
+		}
+	}
+
+	complete_all(&ctx->start);
+	wait_for_completion(&ctx->done);
+
+	KUNIT_EXPECT_EQ(test, atomic_read(&ctx->invalid), 0);
+	KUNIT_EXPECT_EQ(test, atomic_read(&ctx->hits[0]), 0);
+
+	for (i = KVASER_USB_HYDRA_MIN_TRANSID;
+	     i <= KVASER_USB_HYDRA_MAX_TRANSID; i++) {
+		lo = min(lo, atomic_read(&ctx->hits[i]));
+		hi = max(hi, atomic_read(&ctx->hits[i]));
+	}
+
+	total = (u64)nthreads * KVASER_USB_HYDRA_TEST_ALLOCS;
+	expected = div_u64(total, KVASER_USB_HYDRA_TEST_TRANSIDS);
+	KUNIT_EXPECT_LE_MSG(test, hi - lo, 1,
+			    "%u threads: transid hits range %d..%d",
+			    nthreads, lo, hi);
+	KUNIT_EXPECT_EQ(test, (u64)lo, expected);
+}
+
+/* Byte streams fed to kvaser_usb_hydra_read_bulk_callback() on a device with
+ * one channel. The candev is registered, so that unregistering it flushes
+ * the frames passed to the stack before it is freed.
+ */
+#define KVASER_USB_HYDRA_TEST_STREAM_SIZE	(64 * 1024)
+#define KVASER_USB_HYDRA_TEST_ROUNDS		16
+#define KVASER_USB_HYDRA_TEST_SEED		0x4b76736bULL
+#define KVASER_USB_HYDRA_TEST_FD_LEN \
+	(KVASER_USB_HYDRA_CMD_EXT_HEADER_LEN + \
+	 offsetof(struct kvaser_cmd_ext_rx_can, kcan_payload) + CANFD_MAX_DLEN)
+
+enum kvaser_usb_hydra_test_cmd {
+	KVASER_USB_HYDRA_TEST_STD,
+	KVASER_USB_HYDRA_TEST_FD,
+	/* A CAN FD frame padded to KVASER_USB_HYDRA_MAX_CMD_LEN */
+	KVASER_USB_HYDRA_TEST_EXT_MAX,
+	/* Handled without a frame */
+	KVASER_USB_HYDRA_TEST_IGNORED,
+	KVASER_USB_HYDRA_TEST_MIXED,
+};
+
+struct kvaser_usb_hydra_test_stream {
+	u8 *buf;
+	int len;
+	/* Offsets where the commands start, and the end of the stream */
+	int *bounds;
+	int ncmds;
+	unsigned long rx_packets;
+	unsigned long rx_bytes;
+	s64 count[256];
+};
+
+static const struct net_device_ops kvaser_usb_hydra_test_netdev_ops = {
+};
+
+static struct kvaser_usb *kvaser_usb_hydra_test_dev(struct kunit *test)
+{
+	struct kvaser_usb_net_priv *priv;
+	struct net_device *netdev;
+	struct kvaser_usb *dev;
+
+	dev = kunit_kzalloc(test, sizeof(*dev), GFP_KERNEL);
+	KUNIT_ASSERT_NOT_NULL(test, dev);
+	dev->intf = kunit_kzalloc(test, sizeof(*dev->intf), GFP_KERNEL);
+	KUNIT_ASSERT_NOT_NULL(test, dev->intf);
+	dev->intf->dev.init_name = "kvaser_usb_hydra_test";
+	dev->cfg = &kvaser_usb_hydra_dev_cfg_kcan;
+
+	netdev = alloc_candev(sizeof(*priv), 1);
+	KUNIT_ASSERT_NOT_NULL(test, netdev);
+	netdev->netdev_ops = &kvaser_usb_hydra_test_netdev_ops;
+	priv = netdev_priv(netdev);
+	priv->netdev = netdev;
+	priv->dev = dev;
+	priv->can.clock.freq = dev->cfg->clock.freq;
+	priv->can.bittiming_const = dev->cfg->bittiming_const;
+	/* Commands from he_addr 0 map to channel 0 */
+	dev->nets[0] = priv;
+	dev->nchannels = 1;
+	test->priv = dev;
+
+	if (register_candev(netdev)) {
+		dev->nets[0] = NULL;
+		free_candev(netdev);
+		KUNIT_FAIL(test, "register_candev failed");
+		return NULL;
+	}
+
+	return dev;
+}
+
+static void kvaser_usb_hydra_test_exit(struct kunit *test)
+{
+	struct kvaser_usb *dev = test->priv;
+
+	if (!dev || !dev->nets[0])
+		return;
+
+	unregister_candev(dev->nets[0]->netdev);
+	free_candev(dev->nets[0]->netdev);
+}
+
+static int kvaser_usb_hydra_test_put_std(u8 *buf, int pos, u8 cmd_no,
+					 u32 id, u8 dlc)
+{
+	struct kvaser_cmd *cmd = (struct kvaser_cmd *)(buf + pos);
+	int i;
+
+	memset(cmd, 0, sizeof(*cmd));
+	cmd->header.cmd_no = cmd_no;
+	if (cmd_no == CMD_RX_MESSAGE) {
+		cmd->rx_can.id = cpu_to_le32(id);
+		cmd->rx_can.dlc = dlc;
+		for (i = 0; i < dlc; i++)
+			cmd->rx_can.data[i] = id + i;
+	}
+
+	return pos + sizeof(*cmd);
+}
+
+/* An extended command of @cmd_len bytes, a CAN FD frame if it fits */
+static int kvaser_usb_hydra_test_put_ext(u8 *buf, int pos, u16 cmd_len,
+					 u32 id, u8 len)
+{
+	struct kvaser_cmd_ext *cmd = (struct kvaser_cmd_ext *)(buf + pos);
+	int i;
+
+	memset(cmd, 0, min_t(int, cmd_len, sizeof(*cmd)));
+	cmd->header.cmd_no = CMD_EXTENDED;
+	cmd->len = cpu_to_le16(cmd_len);
+	cmd->cmd_no_ext = CMD_RX_MESSAGE_FD;
+	if (cmd_len >= KVASER_USB_HYDRA_TEST_FD_LEN) {
+		cmd->rx_can.flags = cpu_to_le32(KVASER_USB_HYDRA_CF_FLAG_FDF |
+						KVASER_USB_HYDRA_CF_FLAG_EXTENDED_ID |
+						KVASER_USB_HYDRA_CF_FLAG_BRS);
+		cmd->rx_can.id = cpu_to_le32(id);
+		cmd->rx_can.kcan_header =
+			cpu_to_le32(can_fd_len2dlc(len) <<
+				    KVASER_USB_KCAN_DATA_DLC_SHIFT);
+		for (i = 0; i < len; i++)
+			cmd->rx_can.kcan_payload[i] = id + i;
+	}
+	if (cmd_len > sizeof(*cmd))
+		memset(buf + pos + sizeof(*cmd), 0, cmd_len - sizeof(*cmd));
+
+	return pos + cmd_len;
+}
+
+static int kvaser_usb_hydra_test_put(struct kvaser_usb_hydra_test_stream *s,
+				     int pos,
+				     enum kvaser_usb_hydra_test_cmd type,
+				     u32 id)
+{
+	switch (type) {
+	case KVASER_USB_HYDRA_TEST_STD:
+		s->rx_packets++;
+		s->rx_bytes += 8;
+		s->count[CMD_RX_MESSAGE]++;
+		return kvaser_usb_hydra_test_put_std(s->buf, pos, CMD_RX_MESSAGE,
+						     id & CAN_SFF_MASK, 8);
+
+	case KVASER_USB_HYDRA_TEST_FD:
+	case KVASER_USB_HYDRA_TEST_EXT_MAX:
+		s->rx_packets++;
+		s->rx_bytes += CANFD_MAX_DLEN;
+		s->count[CMD_RX_MESSAGE_FD]++;
+		return kvaser_usb_hydra_test_put_ext(s->buf, pos,
+						     type == KVASER_USB_HYDRA_TEST_FD ?
+						     KVASER_USB_HYDRA_TEST_FD_LEN :
+						     KVASER_USB_HYDRA_MAX_CMD_LEN,
+						     id & CAN_EFF_MASK,
+						     CANFD_MAX_DLEN);
+
+	default:
+		s->count[CMD_SET_BUSPARAMS_RESP]++;
+		return kvaser_usb_hydra_test_put_std(s->buf, pos,
+						     CMD_SET_BUSPARAMS_RESP, 0, 0);
+	}
+}
+
+/* Fill a stream of up to @size bytes with commands of @type, or a random
+ * mix of them
+ */
+static struct kvaser_usb_hydra_test_stream *
+kvaser_usb_hydra_test_stream(struct kunit *test,
+			     enum kvaser_usb_hydra_test_cmd type, int size,
+			     struct rnd_state *rnd)
+{
+	struct kvaser_usb_hydra_test_stream *s;
+	int pos = 0;
+
+	s = kunit_kzalloc(test, sizeof(*s), GFP_KERNEL);
+	KUNIT_ASSERT_NOT_NULL(test, s);
+	s->buf = kunit_kzalloc(test, size, GFP_KERNEL);
+	KUNIT_ASSERT_NOT_NULL(test, s->buf);
+	s->bounds = kunit_kcalloc(test, size / sizeof(struct kvaser_cmd) + 1,
+				  sizeof(*s->bounds), GFP_KERNEL);
+	KUNIT_ASSERT_NOT_NULL(test, s->bounds);
+
+	while (pos + KVASER_USB_HYDRA_MAX_CMD_LEN <= size) {
+		enum kvaser_usb_hydra_test_cmd t = type;
+
+		if (t == KVASER_USB_HYDRA_TEST_MIXED)
+			t = prandom_u32_state(rnd) % KVASER_USB_HYDRA_TEST_MIXED;
+
+		s->bounds[s->ncmds++] = pos;
+		pos = kvaser_usb_hydra_test_put(s, pos, t,
+						prandom_u32_state(rnd));
+	}
+	s->bounds[s->ncmds] = pos;
+	s->len = pos;
+
+	return s;
+}
+
+static void kvaser_usb_hydra_test_callback(struct kvaser_usb *dev, void *buf,
+					   int len)
+{
+	/* Frames reach the stack when bottom halves are enabled again, like
+	 * on return from the URB completion
+	 */
+	local_bh_disable();
+	kvaser_usb_hydra_read_bulk_callback(dev, buf, len);
+	local_bh_enable();
+}
+
+/* Feed the stream in transfers of 1..@max_chunk bytes, each in a buffer of
+ * its own so that reads past the transfer are caught by KASAN. Returns how
+ * many transfers ended inside a command that started in the same transfer,
+ * which is what usb_rx_leftovers counts.
+ */
+static int kvaser_usb_hydra_test_feed(struct kunit *test,
+				      struct kvaser_usb *dev,
+				      const struct kvaser_usb_hydra_test_stream *s,
+				      int max_chunk, struct rnd_state *rnd)
+{
+	int partial = 0;
+	int pos = 0;
+	int b = 0;
+
+	while (pos < s->len) {
+		int chunk = min_t(int, s->len - pos,
+				  1 + prandom_u32_state(rnd) % max_chunk);
+		u8 *xfer = kmemdup(s->buf + pos, chunk, GFP_KERNEL);
+		int start = pos;
+
+		KUNIT_ASSERT_NOT_NULL(test, xfer);
+		kvaser_usb_hydra_test_callback(dev, xfer, chunk);
+		kfree(xfer);
+
+		pos += chunk;
+		while (s->bounds[b] < pos)
+			b++;
+		if (s->bounds[b] != pos && s->bounds[b - 1] >= start)
+			partial++;
+	}
+
+	return partial;
+}
+
+static void kvaser_usb_hydra_test_expect(struct kunit *test,
+					 struct kvaser_usb *dev,
+					 const struct kvaser_usb_hydra_test_stream *s,
+					 int rounds)
+{
+	struct net_device *netdev = dev->nets[0]->netdev;
+	int id;
+
+	KUNIT_EXPECT_EQ(test, atomic64_read(&dev->stats.cmd_format_errors), 0);
+	KUNIT_EXPECT_EQ(test, dev->card_data.hydra.usb_rx_leftover_len, 0);
+	KUNIT_EXPECT_EQ(test, netdev->stats.rx_packets,
+			s->rx_packets * rounds);
+	KUNIT_EXPECT_EQ(test, netdev->stats.rx_bytes, s->rx_bytes * rounds);
+	for (id = 0; id < ARRAY_SIZE(s->count); id++)
+		KUNIT_EXPECT_EQ_MSG(test, atomic64_read(&dev->cmd_stats[id].count),
+				    s->count[id] * rounds, "command %d", id);
+}
+
+/* Every split of a command across transfers is put back together, from
+ * single bytes up to several commands per transfer
+ */
+static void kvaser_usb_hydra_random_split_test(struct kunit *test)
+{
+	static const int max_chunks[] = {
+		1, 5, KVASER_USB_HYDRA_CMD_SIZE_BYTES + 1,
+		KVASER_USB_HYDRA_MAX_CMD_LEN + 1, KVASER_USB_RX_BUFFER_SIZE,
+	};
+	struct kvaser_usb_hydra_test_stream *s;
+	struct rnd_state rnd;
+	int partial = 0;
+	int i;
+
+	prandom_seed_state(&rnd, KVASER_USB_HYDRA_TEST_SEED);
+	s = kvaser_usb_hydra_test_stream(test, KVASER_USB_HYDRA_TEST_MIXED,
+					 8 * 1024, &rnd);
+
+	for (i = 0; i < ARRAY_SIZE(max_chunks); i++) {
+		struct kvaser_usb *dev = kvaser_usb_hydra_test_dev(test);
+		int n;
+
+		KUNIT_ASSERT_NOT_NULL(test, dev);
+		n = kvaser_usb_hydra_test_feed(test, dev, s, max_chunks[i],
+					       &rnd);
+		kvaser_usb_hydra_test_expect(test, dev, s, 1);
+		KUNIT_EXPECT_EQ_MSG(test,
+				    atomic64_read(&dev->card_data.hydra.usb_rx_leftovers),
+				    n, "transfers of up to %d bytes",
+				    max_chunks[i]);
+		partial += n;
+
+		kvaser_usb_hydra_test_exit(test);
+		test->priv = NULL;
+	}
+
+	/* The splits must have hit commands, or the test proves nothing */
+	KUNIT_EXPECT_GE(test, partial, s->ncmds);
+}
+
+/* Extended commands of exactly KVASER_USB_HYDRA_MAX_CMD_LEN fill the
+ * leftover buffer when split at any byte
+ */
+static void kvaser_usb_hydra_max_len_split_test(struct kunit *test)
+{
+	struct kvaser_usb *dev = kvaser_usb_hydra_test_dev(test);
+	struct kvaser_usb_hydra_test_stream *s;
+	struct rnd_state rnd;
+	int split;
+
+	KUNIT_ASSERT_NOT_NULL(test, dev);
+	prandom_seed_state(&rnd, KVASER_USB_HYDRA_TEST_SEED);
+	s = kvaser_usb_hydra_test_stream(test, KVASER_USB_HYDRA_TEST_EXT_MAX,
+					 2 * KVASER_USB_HYDRA_MAX_CMD_LEN, &rnd);
+	KUNIT_ASSERT_EQ(test, s->ncmds, 2);
+
+	for (split = 1; split < s->len; split++) {
+		kvaser_usb_hydra_test_callback(dev, s->buf, split);
+		kvaser_usb_hydra_test_callback(dev, s->buf + split,
+					       s->len - split);
+	}
+
+	kvaser_usb_hydra_test_expect(test, dev, s, s->len - 1);
+	KUNIT_EXPECT_EQ(test,
+			atomic64_read(&dev->card_data.hydra.usb_rx_leftovers),
+			s->len - 2);
+}
+
+/* Extended command lengths outside KVASER_USB_HYDRA_CMD_EXT_HEADER_LEN ..
+ * KVASER_USB_HYDRA_MAX_CMD_LEN drop the rest of the transfer
+ */
+static void kvaser_usb_hydra_malformed_len_test(struct kunit *test)
+{
+	static const u16 lens[] = {
+		0, 1, KVASER_USB_HYDRA_CMD_EXT_HEADER_LEN - 1,
+		KVASER_USB_HYDRA_MAX_CMD_LEN + 1, 0xffff,
+	};
+	struct kvaser_usb *dev = kvaser_usb_hydra_test_dev(test);
+	struct net_device *netdev;
+	u8 *buf;
+	int i;
+
+	KUNIT_ASSERT_NOT_NULL(test, dev);
+	netdev = dev->nets[0]->netdev;
+	buf = kunit_kzalloc(test, KVASER_USB_RX_BUFFER_SIZE, GFP_KERNEL);
+	KUNIT_ASSERT_NOT_NULL(test, buf);
+
+	for (i = 0; i < ARRAY_SIZE(lens); i++) {
+		struct kvaser_cmd_ext *cmd;
+		int pos;
+
+		/* A good frame, the bad length, and a frame never reached */
+		pos = kvaser_usb_hydra_test_put_std(buf, 0, CMD_RX_MESSAGE,
+						    0x100 + i, 8);
+		cmd = (struct kvaser_cmd_ext *)(buf + pos);
+		kvaser_usb_hydra_test_put_ext(buf, pos,
+					      KVASER_USB_HYDRA_TEST_FD_LEN,
+					      i, CANFD_MAX_DLEN);
+		cmd->len = cpu_to_le16(lens[i]);
+		pos = kvaser_usb_hydra_test_put_std(buf, pos +
+						    KVASER_USB_HYDRA_TEST_FD_LEN,
+						    CMD_RX_MESSAGE, 0x200 + i, 8);
+		kvaser_usb_hydra_test_callback(dev, buf, pos);
+
+		KUNIT_EXPECT_EQ_MSG(test,
+				    atomic64_read(&dev->stats.cmd_format_errors),
+				    i + 1, "length %u", lens[i]);
+		KUNIT_EXPECT_EQ_MSG(test, netdev->stats.rx_packets,
+				    (unsigned long)i + 1, "length %u", lens[i]);
+		KUNIT_EXPECT_EQ(test, dev->card_data.hydra.usb_rx_leftover_len,
+				0);
+	}
+	KUNIT_EXPECT_EQ(test, atomic64_read(&dev->cmd_stats[CMD_RX_MESSAGE_FD].count),
+			0);
+}
+
+/* A bad length that only becomes known once a leftover is completed. Before
+ * the length was checked there, it overflowed usb_rx_leftover.
+ */
+static void kvaser_usb_hydra_leftover_format_error_test(struct kunit *test)
+{
+	static const u16 lens[] = {
+		0, KVASER_USB_HYDRA_CMD_EXT_HEADER_LEN - 1,
+		KVASER_USB_HYDRA_MAX_CMD_LEN + 1, 0xffff,
+	};
+	static const int splits[] = { 1, KVASER_USB_HYDRA_CMD_SIZE_BYTES - 1,
+				      KVASER_USB_HYDRA_CMD_SIZE_BYTES };
+	struct kvaser_usb *dev = kvaser_usb_hydra_test_dev(test);
+	struct kvaser_usb_hydra_test_stream *s;
+	struct net_device *netdev;
+	struct rnd_state rnd;
+	int errors = 0;
+	int i, j;
+	u8 *buf;
+
+	KUNIT_ASSERT_NOT_NULL(test, dev);
+	netdev = dev->nets[0]->netdev;
+	buf = kunit_kzalloc(test, KVASER_USB_RX_BUFFER_SIZE, GFP_KERNEL);
+	KUNIT_ASSERT_NOT_NULL(test, buf);
+	prandom_seed_state(&rnd, KVASER_USB_HYDRA_TEST_SEED);
+	s = kvaser_usb_hydra_test_stream(test, KVASER_USB_HYDRA_TEST_STD,
+					 KVASER_USB_HYDRA_MAX_CMD_LEN, &rnd);
+
+	for (i = 0; i < ARRAY_SIZE(lens); i++) {
+		for (j = 0; j < ARRAY_SIZE(splits); j++) {
+			unsigned long rx_packets = netdev->stats.rx_packets;
+			struct kvaser_cmd_ext *cmd;
+			int pos;
+
+			pos = kvaser_usb_hydra_test_put_std(buf, 0,
+							    CMD_RX_MESSAGE,
+							    0x100, 8);
+			cmd = (struct kvaser_cmd_ext *)(buf + pos);
+			kvaser_usb_hydra_test_put_ext(buf, pos,
+						      KVASER_USB_HYDRA_TEST_FD_LEN,
+						      0, CANFD_MAX_DLEN);
+			cmd->len = cpu_to_le16(lens[i]);
+
+			/* Ends inside the size field or right after it */
+			kvaser_usb_hydra_test_callback(dev, buf, pos + splits[j]);
+			if (splits[j] < KVASER_USB_HYDRA_CMD_SIZE_BYTES) {
+				KUNIT_EXPECT_EQ(test,
+						dev->card_data.hydra.usb_rx_leftover_len,
+						splits[j]);
+				kvaser_usb_hydra_test_callback(dev,
+							       buf + pos + splits[j],
+							       KVASER_USB_HYDRA_TEST_FD_LEN -
+							       splits[j]);
+			}
+			errors++;
+
+			KUNIT_EXPECT_EQ_MSG(test,
+					    atomic64_read(&dev->stats.cmd_format_errors),
+					    errors, "length %u split %d",
+					    lens[i], splits[j]);
+			KUNIT_EXPECT_EQ(test,
+					dev->card_data.hydra.usb_rx_leftover_len,
+					0);
+			KUNIT_EXPECT_EQ(test, netdev->stats.rx_packets,
+					rx_packets + 1);
+
+			/* The next transfer starts in sync */
+			kvaser_usb_hydra_test_callback(dev, s->buf, s->len);
+			KUNIT_EXPECT_EQ(test, netdev->stats.rx_packets,
+					rx_packets + 1 + s->rx_packets);
+		}
+	}
+	KUNIT_EXPECT_EQ(test, atomic64_read(&dev->cmd_stats[CMD_RX_MESSAGE_FD].count),
+			0);
+}
+
+struct kvaser_usb_hydra_test_profile {
+	const char *name;
+	enum kvaser_usb_hydra_test_cmd type;
+	/* Random transfer sizes up to the Rx buffer size, else full buffers */
+	bool random_split;
+};
+
+static const struct kvaser_usb_hydra_test_profile kvaser_usb_hydra_test_profiles[] = {
+	{ "std 8 bytes", KVASER_USB_HYDRA_TEST_STD, false },
+	{ "fd 64 bytes", KVASER_USB_HYDRA_TEST_FD, false },
+	{ "ext max length", KVASER_USB_HYDRA_TEST_EXT_MAX, false },
+	{ "mixed", KVASER_USB_HYDRA_TEST_MIXED, false },
+	{ "mixed random split", KVASER_USB_HYDRA_TEST_MIXED, true },
+};
+
+/* Parser throughput. The time covers the callback and passing the frames to
+ * the stack, which has no listeners. The figures are only reported, a
+ * wall-clock limit would not hold on debug or virtualized kernels.
+ */
+static void kvaser_usb_hydra_read_bulk_bench(struct kunit *test)
+{
+	int p;
+
+	for (p = 0; p < ARRAY_SIZE(kvaser_usb_hydra_test_profiles); p++) {
+		const struct kvaser_usb_hydra_test_profile *prof =
+			&kvaser_usb_hydra_test_profiles[p];
+		struct kvaser_usb_hydra_test_stream *s;
+		struct kvaser_usb *dev;
+		struct rnd_state rnd;
+		u64 cmds, ns_per_cmd;
+		u64 total_ns = 0;
+		int round;
+		int id;
+
+		dev = kvaser_usb_hydra_test_dev(test);
+		KUNIT_ASSERT_NOT_NULL(test, dev);
+		WRITE_ONCE(dev->cmd_timing, 1);
+		prandom_seed_state(&rnd, KVASER_USB_HYDRA_TEST_SEED);
+		s = kvaser_usb_hydra_test_stream(test, prof->type,
+						 KVASER_USB_HYDRA_TEST_STREAM_SIZE,
+						 &rnd);
+
+		for (round = 0; round < KVASER_USB_HYDRA_TEST_ROUNDS; round++) {
+			int pos = 0;
+
+			while (pos < s->len) {
+				int chunk = KVASER_USB_RX_BUFFER_SIZE;
+				u64 start_ns;
+
+				if (prof->random_split)
+					chunk = 1 + prandom_u32_state(&rnd) % chunk;
+				chunk = min(chunk, s->len - pos);
+
+				start_ns = ktime_get_ns();
+				kvaser_usb_hydra_test_callback(dev, s->buf + pos,
+							       chunk);
+				total_ns += ktime_get_ns() - start_ns;
+				pos += chunk;
+			}
+			cond_resched();
+		}
+
+		kvaser_usb_hydra_test_expect(test, dev, s,
+					     KVASER_USB_HYDRA_TEST_ROUNDS);
+
+		cmds = (u64)s->ncmds * KVASER_USB_HYDRA_TEST_ROUNDS;
+		ns_per_cmd = div64_u64(total_ns, cmds);
+		kunit_info(test, "%s: %llu ns/cmd, %llu cmds/s, %lld leftovers\n",
+			   prof->name, ns_per_cmd,
+			   div64_u64(cmds * NSEC_PER_SEC, max(total_ns, 1ULL)),
+			   atomic64_read(&dev->card_data.hydra.usb_rx_leftovers));
+		for (id = 0; id < ARRAY_SIZE(dev->cmd_stats); id++) {
+			s64 count = atomic64_read(&dev->cmd_stats[id].count);
+
+			if (count)
+				kunit_info(test, "%s: command %d, %lld ns/cmd\n",
+					   prof->name, id,
+					   div64_s64(atomic64_read(&dev->cmd_stats[id].time_ns),
+						     count));
+		}
+
+		kvaser_usb_hydra_test_exit(test);
+		test->priv = NULL;
+	}
+}
+
+static struct kunit_case kvaser_usb_hydra_test_cases[] = {
+	KUNIT_CASE(kvaser_usb_hydra_transid_wrap_test),
+	KUNIT_CASE(kvaser_usb_hydra_transid_stress_test),
+	KUNIT_CASE(kvaser_usb_hydra_random_split_test),
+	KUNIT_CASE(kvaser_usb_hydra_max_len_split_test),
+	KUNIT_CASE(kvaser_usb_hydra_malformed_len_test),
+	KUNIT_CASE(kvaser_usb_hydra_leftover_format_error_test),
+	KUNIT_CASE(kvaser_usb_hydra_read_bulk_bench),
+	{}
+};
+
+static struct kunit_suite kvaser_usb_hydra_test_suite = {
+	.name = "kvaser_usb_hydra",
+	.exit = kvaser_usb_hydra_test_exit,
+	.test_cases = kvaser_usb_hydra_test_cases,
+};
+
+kunit_test_suite(kvaser_usb_hydra_test_suite);
@@ -16,7 +16,9 @@
 #include <linux/gfp.h>
 #include <linux/jiffies.h>
 #include <linux/kernel.h>
+#include <linux/moduleparam.h>
 #include <linux/netdevice.h>
+#include <linux/seq_file.h>
 #include <linux/spinlock.h>
 #include <linux/string.h>
 #include <linux/types.h>
@@ -49,6 +51,20 @@
 
 #define MAX_USBCAN_NET_DEVICES		2
 
+/* Chip state polling interval while errors are reported, doubled up to
+ * chip_state_poll_max_ms as long as the polled state does not change
+ */
+#define KVASER_USB_LEAF_CHIP_STATE_POLL_MS	500
+
+/* kvaser_usb_net_leaf_priv chip_state_flags bits */
+#define KVASER_USB_LEAF_CHIP_STATE_OUTSTANDING	0
+#define KVASER_USB_LEAF_CHIP_STATE_URB_BUSY	1
+
+static unsigned int chip_state_poll_max_ms = 4000;
+module_param(chip_state_poll_max_ms, uint, 0644);
+MODULE_PARM_DESC(chip_state_poll_max_ms,
+		 "Longest chip state polling interval in ms while the error state is stable (default 4000)");
+
 /* Command header size */
 #define CMD_HEADER_LEN			2
 
@@ -444,6 +460,20 @@ struct kvaser_usb_net_leaf_priv {
 
 	struct delayed_work chip_state_req_work;
 
+	/* Preallocated CMD_GET_CHIP_STATE, at most one request is
+	 * outstanding, see kvaser_usb_leaf_chip_state_req_work()
+	 */
+	struct kvaser_cmd *chip_state_cmd;
+	struct urb *chip_state_urb;
+	unsigned long chip_state_flags;
+	unsigned long chip_state_req_jiffies;
+	unsigned int chip_state_poll_ms;
+	u8 chip_state_status;
+	u8 chip_state_txerr;
+	u8 chip_state_rxerr;
+	atomic64_t chip_state_requests;
+	atomic64_t chip_state_coalesced;
+
 	/* started but not reported as bus-on yet */
 	bool joining_bus;
 };
@@ -604,6 +634,17 @@ kvaser_usb_leaf_frame_to_cmd(const struct kvaser_usb_net_priv *priv,
 	return cmd;
 }
 
+/* Advance past a zero-length placeholder to the next wMaxPacketSize
+ * boundary, see kvaser_usb_leaf_read_bulk_callback(). A placeholder that
+ * already sits on a boundary must still move to the next one, or the
+ * parser would spin on it forever.
+ */
+static int kvaser_usb_leaf_skip_placeholder(const struct kvaser_usb *dev,
+					    int pos)
+{
+	return round_up(pos + 1, le16_to_cpu(dev->bulk_in->wMaxPacketSize));
+}
+
 static int kvaser_usb_leaf_wait_cmd(const struct kvaser_usb *dev, u8 id,
 				    struct kvaser_cmd *cmd)
 {
@@ -633,13 +674,13 @@ static int kvaser_usb_leaf_wait_cmd(const struct kvaser_usb *dev, u8 id,
 			 * for further details.
 			 */
 			if (tmp->len == 0) {
-				pos = round_up(pos,
-					       le16_to_cpu
-						(dev->bulk_in->wMaxPacketSize));
+				pos = kvaser_usb_leaf_skip_placeholder(dev,
+								       pos);
 				continue;
 			}
 
-			if (pos + tmp->len > actual_len) {
+			if (tmp->len < CMD_HEADER_LEN ||
+			    pos + tmp->len > actual_len) {
 				dev_err_ratelimited(&dev->intf->dev,
 						    "Format error\n");
 				break;
@@ -775,6 +816,8 @@ static int kvaser_usb_leaf_get_card_info(struct kvaser_usb *dev)
 	if (err)
 		return err;
 
+	dev->serial_number = le32_to_cpu(cmd.u.cardinfo.serial_number);
+	memcpy(dev->ean, cmd.u.cardinfo.ean, sizeof(dev->ean));
 	dev->nchannels = cmd.u.cardinfo.nchannels;
 	if (dev->nchannels > KVASER_USB_MAX_NET_DEVICES ||
 	    (dev->driver_info->family == KVASER_USBCAN &&
@@ -930,7 +973,7 @@ static void kvaser_usb_leaf_tx_acknowledge(const struct kvaser_usb *dev,
 		if (skb) {
 			cf->can_id |= CAN_ERR_RESTARTED;
 
-			netif_rx(skb);
+			kvaser_usb_netif_rx(skb);
 		} else {
 			netdev_err(priv->netdev,
 				   "No memory left for err_skb\n");
@@ -944,6 +987,10 @@ static void kvaser_usb_leaf_tx_acknowledge(const struct kvaser_usb *dev,
 
 	spin_lock_irqsave(&priv->tx_contexts_lock, flags);
 
+	/* echo_index equals max_tx_urbs for a context that is not in use */
+	if (context->echo_index < dev->max_tx_urbs)
+		kvaser_usb_tx_completed_queue(priv, context);
+
 	stats->tx_packets++;
 #if (LINUX_VERSION_CODE >= KERNEL_VERSION(5, 12, 0))
 	stats->tx_bytes += can_get_echo_skb(priv->netdev,
@@ -953,7 +1000,7 @@ static void kvaser_usb_leaf_tx_acknowledge(const struct kvaser_usb *dev,
 #endif /* LINUX_VERSION_CODE >= 5.12.0) */
 	context->echo_index = dev->max_tx_urbs;
 	--priv->active_tx_contexts;
-	netif_wake_queue(priv->netdev);
+	kvaser_usb_tx_wake_queues(priv);
 
 	spin_unlock_irqrestore(&priv->tx_contexts_lock, flags);
 }
@@ -979,14 +1026,109 @@ static int kvaser_usb_leaf_simple_cmd_async(struct kvaser_usb_net_priv *priv,
 	return err;
 }
 
+static void kvaser_usb_leaf_chip_state_req_callback(struct urb *urb)
+{
+	struct kvaser_usb_net_leaf_priv *leaf = urb->context;
+
+	if (urb->status) {
+		/* The request did not reach the device, no reply will come */
+		clear_bit(KVASER_USB_LEAF_CHIP_STATE_OUTSTANDING,
+			  &leaf->chip_state_flags);
+		if (urb->status != -ENOENT && urb->status != -ESHUTDOWN)
+			netdev_warn(leaf->net->netdev,
+				    "urb status received: %d\n", urb->status);
+	}
+
+	clear_bit_unlock(KVASER_USB_LEAF_CHIP_STATE_URB_BUSY,
+			 &leaf->chip_state_flags);
+}
+
+/* Send CMD_GET_CHIP_STATE from the preallocated URB. While a request is
+ * outstanding, i.e. its CMD_CHIP_STATE_EVENT has not been received yet,
+ * no new one is sent. The request is only repeated if the reply did not
+ * come within KVASER_USB_TIMEOUT. Requests made while the URB is still in
+ * flight are deferred, never dropped.
+ */
 static void kvaser_usb_leaf_chip_state_req_work(struct work_struct *work)
 {
 	struct kvaser_usb_net_leaf_priv *leaf =
 		container_of(work, struct kvaser_usb_net_leaf_priv,
 			     chip_state_req_work.work);
 	struct kvaser_usb_net_priv *priv = leaf->net;
+	unsigned long timeout;
+	int err;
 
-	kvaser_usb_leaf_simple_cmd_async(priv, CMD_GET_CHIP_STATE);
+	if (test_bit(KVASER_USB_LEAF_CHIP_STATE_OUTSTANDING,
+		     &leaf->chip_state_flags)) {
+		timeout = leaf->chip_state_req_jiffies +
+			  msecs_to_jiffies(KVASER_USB_TIMEOUT);
+		if (time_before(jiffies, timeout)) {
+			atomic64_inc(&leaf->chip_state_coalesced);
+			schedule_delayed_work(&leaf->chip_state_req_work,
+					      timeout - jiffies);
+			return;
+		}
+	}
+
+	/* The reply can overtake the completion of the request URB. Retry
+	 * once the URB is back instead of dropping the request.
+	 */
+	if (test_and_set_bit_lock(KVASER_USB_LEAF_CHIP_STATE_URB_BUSY,
+				  &leaf->chip_state_flags)) {
+		atomic64_inc(&leaf->chip_state_coalesced);
+		schedule_delayed_work(&leaf->chip_state_req_work, 1);
+		return;
+	}
+
+	leaf->chip_state_req_jiffies = jiffies;
+	set_bit(KVASER_USB_LEAF_CHIP_STATE_OUTSTANDING,
+		&leaf->chip_state_flags);
+
+	usb_anchor_urb(leaf->chip_state_urb, &priv->tx_submitted);
+	err = usb_submit_urb(leaf->chip_state_urb, GFP_KERNEL);
+	if (err) {
+		usb_unanchor_urb(leaf->chip_state_urb);
+		clear_bit(KVASER_USB_LEAF_CHIP_STATE_OUTSTANDING,
+			  &leaf->chip_state_flags);
+		clear_bit_unlock(KVASER_USB_LEAF_CHIP_STATE_URB_BUSY,
+				 &leaf->chip_state_flags);
+		netdev_err(priv->netdev, "Error transmitting URB\n");
+		return;
+	}
+
+	atomic64_inc(&leaf->chip_state_requests);
+}
+
+/* A chip state event ends the outstanding request. The polling interval
+ * is doubled while the state is the same as in the previous event.
+ */
+static void kvaser_usb_leaf_chip_state_event(const struct kvaser_usb *dev,
+					     const struct kvaser_usb_err_summary *es)
+{
+	struct kvaser_usb_net_leaf_priv *leaf;
+	unsigned int max_ms = max_t(unsigned int,
+				    READ_ONCE(chip_state_poll_max_ms),
+				    KVASER_USB_LEAF_CHIP_STATE_POLL_MS);
+
+	if (es->channel >= dev->nchannels)
+		return;
+
+	leaf = dev->nets[es->channel]->sub_priv;
+
+	clear_bit(KVASER_USB_LEAF_CHIP_STATE_OUTSTANDING,
+		  &leaf->chip_state_flags);
+
+	if (es->status == leaf->chip_state_status &&
+	    es->txerr == leaf->chip_state_txerr &&
+	    es->rxerr == leaf->chip_state_rxerr)
+		leaf->chip_state_poll_ms = min(leaf->chip_state_poll_ms * 2,
+					       max_ms);
+	else
+		leaf->chip_state_poll_ms = KVASER_USB_LEAF_CHIP_STATE_POLL_MS;
+
+	leaf->chip_state_status = es->status;
+	leaf->chip_state_txerr = es->txerr;
+	leaf->chip_state_rxerr = es->rxerr;
 }
 
 static void
@@ -1119,9 +1261,10 @@ static void kvaser_usb_leaf_rx_error(const struct kvaser_usb *dev,
 	 */
 	if (new_state < CAN_STATE_BUS_OFF &&
 	    (es->rxerr || es->txerr || new_state == CAN_STATE_ERROR_PASSIVE ||
-	     leaf->joining_bus))
-		schedule_delayed_work(&leaf->chip_state_req_work,
-				      msecs_to_jiffies(500));
+	     leaf->joining_bus) &&
+	    !schedule_delayed_work(&leaf->chip_state_req_work,
+				   msecs_to_jiffies(leaf->chip_state_poll_ms)))
+		atomic64_inc(&leaf->chip_state_coalesced);
 
 	skb = alloc_can_err_skb(priv->netdev, &cf);
 	if (!skb) {
@@ -1180,7 +1323,7 @@ static void kvaser_usb_leaf_rx_error(const struct kvaser_usb *dev,
 		cf->data[7] = es->rxerr;
 	}
 
-	netif_rx(skb);
+	kvaser_usb_netif_rx(skb);
 }
 
 /* For USBCAN, report error to userspace if the channels's errors counter
@@ -1234,6 +1377,7 @@ static void kvaser_usb_leaf_usbcan_rx_error(const struct kvaser_usb *dev,
 		es.status = cmd->u.usbcan.chip_state_event.status;
 		es.txerr = cmd->u.usbcan.chip_state_event.tx_errors_count;
 		es.rxerr = cmd->u.usbcan.chip_state_event.rx_errors_count;
+		kvaser_usb_leaf_chip_state_event(dev, &es);
 		kvaser_usb_leaf_usbcan_conditionally_rx_error(dev, &es);
 		break;
 
@@ -1293,6 +1437,7 @@ static void kvaser_usb_leaf_leaf_rx_error(const struct kvaser_usb *dev,
 		es.txerr = cmd->u.leaf.chip_state_event.tx_errors_count;
 		es.rxerr = cmd->u.leaf.chip_state_event.rx_errors_count;
 		es.leaf.error_factor = 0;
+		kvaser_usb_leaf_chip_state_event(dev, &es);
 		break;
 	default:
 		dev_err(&dev->intf->dev, "Invalid cmd id (%d)\n", cmd->id);
@@ -1428,7 +1573,7 @@ static void kvaser_usb_leaf_rx_can_msg(const struct kvaser_usb *dev,
 #else
 		stats->rx_bytes += cf->can_dlc;
 #endif /* LINUX_VERSION_CODE >= 5.11.0) */
-	netif_rx(skb);
+	kvaser_usb_netif_rx(skb);
 }
 
 static void kvaser_usb_leaf_error_event_parameter(const struct kvaser_usb *dev,
@@ -1513,12 +1658,14 @@ static void kvaser_usb_leaf_start_chip_reply(const struct kvaser_usb *dev,
 
 	priv = dev->nets[channel];
 
-	if (completion_done(&priv->start_comp) &&
-	    netif_queue_stopped(priv->netdev)) {
-		netif_wake_queue(priv->netdev);
+	if (completion_done(&priv->start_comp)) {
+		unsigned long flags;
+
+		spin_lock_irqsave(&priv->tx_contexts_lock, flags);
+		kvaser_usb_tx_wake_queues(priv);
+		spin_unlock_irqrestore(&priv->tx_contexts_lock, flags);
 	} else {
-		netif_start_queue(priv->netdev);
-		complete(&priv->start_comp);
+		kvaser_usb_start_chip_confirmed(priv);
 	}
 }
 
@@ -1621,10 +1768,38 @@ warn:		dev_warn(&dev->intf->dev, "Unhandled command (%d)\n", cmd->id);
 	}
 }
 
+static void kvaser_usb_leaf_count_command(struct kvaser_usb *dev,
+					  const struct kvaser_cmd *cmd)
+{
+	struct kvaser_usb_dev_card_data_leaf *leaf = &dev->card_data.leaf;
+
+	switch (cmd->id) {
+	case CMD_LEAF_LOG_MESSAGE:
+		if (dev->driver_info->family == KVASER_LEAF)
+			atomic64_inc(&leaf->log_messages);
+		break;
+
+	case CMD_CHIP_STATE_EVENT:
+		atomic64_inc(&leaf->chip_state_events);
+		break;
+
+	case CMD_CAN_ERROR_EVENT:
+	case CMD_ERROR_EVENT:
+		atomic64_inc(&leaf->error_events);
+		break;
+
+	case CMD_USBCAN_CLOCK_OVERFLOW_EVENT:
+		if (dev->driver_info->family == KVASER_USBCAN)
+			atomic64_inc(&leaf->clock_overflows);
+		break;
+	}
+}
+
 static void kvaser_usb_leaf_read_bulk_callback(struct kvaser_usb *dev,
 					       void *buf, int len)
 {
 	struct kvaser_cmd *cmd;
+	u64 start_ns;
 	int pos = 0;
 
 	while (pos <= len - CMD_HEADER_LEN) {
@@ -1640,17 +1815,22 @@ static void kvaser_usb_leaf_read_bulk_callback(struct kvaser_usb *dev,
 		 * number of events in case of a heavy rx load on the bus.
 		 */
 		if (cmd->len == 0) {
-			pos = round_up(pos, le16_to_cpu
-						(dev->bulk_in->wMaxPacketSize));
+			atomic64_inc(&dev->card_data.leaf.placeholders);
+			pos = kvaser_usb_leaf_skip_placeholder(dev, pos);
 			continue;
 		}
 
-		if (pos + cmd->len > len) {
+		/* A length shorter than the header cannot be resynchronized */
+		if (cmd->len < CMD_HEADER_LEN || pos + cmd->len > len) {
+			atomic64_inc(&dev->stats.cmd_format_errors);
 			dev_err_ratelimited(&dev->intf->dev, "Format error\n");
 			break;
 		}
 
+		start_ns = kvaser_usb_cmd_stats_begin(dev);
+		kvaser_usb_leaf_count_command(dev, cmd);
 		kvaser_usb_leaf_handle_command(dev, cmd);
+		kvaser_usb_cmd_stats_end(dev, cmd->id, start_ns);
 		pos += cmd->len;
 	}
 }
@@ -1680,17 +1860,26 @@ static int kvaser_usb_leaf_set_opt_mode(const struct kvaser_usb_net_priv *priv)
 	return rc;
 }
 
-static int kvaser_usb_leaf_start_chip(struct kvaser_usb_net_priv *priv)
+static int kvaser_usb_leaf_start_chip_async(struct kvaser_usb_net_priv *priv)
 {
 	struct kvaser_usb_net_leaf_priv *leaf = priv->sub_priv;
-	int err;
 
 	leaf->joining_bus = true;
+	leaf->chip_state_poll_ms = KVASER_USB_LEAF_CHIP_STATE_POLL_MS;
+	clear_bit(KVASER_USB_LEAF_CHIP_STATE_OUTSTANDING,
+		  &leaf->chip_state_flags);
 
 	reinit_completion(&priv->start_comp);
 
-	err = kvaser_usb_leaf_send_simple_cmd(priv->dev, CMD_START_CHIP,
-					      priv->channel);
+	return kvaser_usb_leaf_send_simple_cmd(priv->dev, CMD_START_CHIP,
+					       priv->channel);
+}
+
+static int kvaser_usb_leaf_start_chip(struct kvaser_usb_net_priv *priv)
+{
+	int err;
+
+	err = kvaser_usb_leaf_start_chip_async(priv);
 	if (err)
 		return err;
 
@@ -1764,7 +1953,29 @@ static int kvaser_usb_leaf_init_channel(struct kvaser_usb_net_priv *priv)
 	if (!leaf)
 		return -ENOMEM;
 
+	leaf->chip_state_cmd = kzalloc(sizeof(*leaf->chip_state_cmd),
+				       GFP_KERNEL);
+	if (!leaf->chip_state_cmd)
+		return -ENOMEM;
+
+	leaf->chip_state_urb = usb_alloc_urb(0, GFP_KERNEL);
+	if (!leaf->chip_state_urb) {
+		kfree(leaf->chip_state_cmd);
+		return -ENOMEM;
+	}
+
+	leaf->chip_state_cmd->len = CMD_HEADER_LEN +
+				    sizeof(struct kvaser_cmd_simple);
+	leaf->chip_state_cmd->id = CMD_GET_CHIP_STATE;
+	leaf->chip_state_cmd->u.simple.channel = priv->channel;
+	usb_fill_bulk_urb(leaf->chip_state_urb, priv->dev->udev,
+			  usb_sndbulkpipe(priv->dev->udev,
+					  priv->dev->bulk_out->bEndpointAddress),
+			  leaf->chip_state_cmd, leaf->chip_state_cmd->len,
+			  kvaser_usb_leaf_chip_state_req_callback, leaf);
+
 	leaf->net = priv;
+	leaf->chip_state_poll_ms = KVASER_USB_LEAF_CHIP_STATE_POLL_MS;
 	INIT_DELAYED_WORK(&leaf->chip_state_req_work,
 			  kvaser_usb_leaf_chip_state_req_work);
 
@@ -1777,8 +1988,13 @@ static void kvaser_usb_leaf_remove_channel(struct kvaser_usb_net_priv *priv)
 {
 	struct kvaser_usb_net_leaf_priv *leaf = priv->sub_priv;
 
-	if (leaf)
-		cancel_delayed_work_sync(&leaf->chip_state_req_work);
+	if (!leaf)
+		return;
+
+	cancel_delayed_work_sync(&leaf->chip_state_req_work);
+	usb_kill_urb(leaf->chip_state_urb);
+	usb_free_urb(leaf->chip_state_urb);
+	kfree(leaf->chip_state_cmd);
 }
 
 static int kvaser_usb_leaf_set_bittiming(const struct net_device *netdev,
@@ -1888,6 +2104,39 @@ static int kvaser_usb_leaf_setup_endpoints(struct kvaser_usb *dev)
 	return -ENODEV;
 }
 
+static void kvaser_usb_leaf_debugfs_show(struct kvaser_usb *dev,
+					 struct seq_file *m)
+{
+	struct kvaser_usb_dev_card_data_leaf *leaf = &dev->card_data.leaf;
+	unsigned int i;
+
+	seq_printf(m, "placeholders: %lld\n",
+		   atomic64_read(&leaf->placeholders));
+	seq_printf(m, "log_messages: %lld\n",
+		   atomic64_read(&leaf->log_messages));
+	seq_printf(m, "chip_state_events: %lld\n",
+		   atomic64_read(&leaf->chip_state_events));
+	seq_printf(m, "error_events: %lld\n",
+		   atomic64_read(&leaf->error_events));
+	seq_printf(m, "clock_overflows: %lld\n",
+		   atomic64_read(&leaf->clock_overflows));
+
+	for (i = 0; i < dev->nchannels; i++) {
+		struct kvaser_usb_net_leaf_priv *leaf_priv;
+
+		if (!dev->nets[i])
+			continue;
+
+		leaf_priv = dev->nets[i]->sub_priv;
+		seq_printf(m, "can%u_chip_state_requests: %lld\n", i,
+			   atomic64_read(&leaf_priv->chip_state_requests));
+		seq_printf(m, "can%u_chip_state_coalesced: %lld\n", i,
+			   atomic64_read(&leaf_priv->chip_state_coalesced));
+		seq_printf(m, "can%u_chip_state_poll_ms: %u\n", i,
+			   READ_ONCE(leaf_priv->chip_state_poll_ms));
+	}
+}
+
 const struct kvaser_usb_dev_ops kvaser_usb_leaf_dev_ops = {
 	.dev_set_mode = kvaser_usb_leaf_set_mode,
 	.dev_set_bittiming = kvaser_usb_leaf_set_bittiming,
@@ -1905,9 +2154,15 @@ const struct kvaser_usb_dev_ops kvaser_usb_leaf_dev_ops = {
 	.dev_get_capabilities = kvaser_usb_leaf_get_capabilities,
 	.dev_set_opt_mode = kvaser_usb_leaf_set_opt_mode,
 	.dev_start_chip = kvaser_usb_leaf_start_chip,
+	.dev_start_chip_async = kvaser_usb_leaf_start_chip_async,
 	.dev_stop_chip = kvaser_usb_leaf_stop_chip,
 	.dev_reset_chip = kvaser_usb_leaf_reset_chip,
 	.dev_flush_queue = kvaser_usb_leaf_flush_queue,
 	.dev_read_bulk_callback = kvaser_usb_leaf_read_bulk_callback,
 	.dev_frame_to_cmd = kvaser_usb_leaf_frame_to_cmd,
+	.dev_debugfs_show = kvaser_usb_leaf_debugfs_show,
 };
+
+#if IS_ENABLED(CONFIG_CAN_KVASER_USB_KUNIT_TEST)
+#include "kvaser_usb_leaf_kunit.c"
+#endif /* CONFIG_CAN_KVASER_USB_KUNIT_TEST */
@@ -0,0 +1,349 @@
+// SPDX-License-Identifier: GPL-2.0 OR BSD-2-Clause
+/* KUnit tests for the Kvaser USB leaf subdriver. This file is included at
+ * the end of kvaser_usb_leaf.c, so that the static helpers can be tested
+ * directly.
+ *
+ * The buffers are fed to kvaser_usb_leaf_read_bulk_callback() on a device
+ * without channels. Every handler drops commands for a channel the device
+ * does not have, so only the parser and its counters are exercised.
+ */
+
+#include <kunit/test.h>
+
+#define KVASER_USB_LEAF_TEST_BUF_SIZE		KVASER_USB_RX_BUFFER_SIZE
+/* Ignored by the handlers on the respective family, and never logged */
+#define KVASER_USB_LEAF_TEST_FILLER_LEN		4
+
+static const struct kvaser_usb_driver_info kvaser_usb_leaf_test_info_leaf = {
+	.family = KVASER_LEAF,
+	.ops = &kvaser_usb_leaf_dev_ops,
+};
+
+static const struct kvaser_usb_driver_info kvaser_usb_leaf_test_info_usbcan = {
+	.family = KVASER_USBCAN,
+	.ops = &kvaser_usb_leaf_dev_ops,
+};
+
+static struct kvaser_usb *
+kvaser_usb_leaf_test_dev(struct kunit *test,
+			 const struct kvaser_usb_driver_info *info, u16 maxp)
+{
+	struct kvaser_usb *dev;
+
+	dev = kunit_kzalloc(test, sizeof(*dev), GFP_KERNEL);
+	KUNIT_ASSERT_NOT_NULL(test, dev);
+	dev->intf = kunit_kzalloc(test, sizeof(*dev->intf), GFP_KERNEL);
+	KUNIT_ASSERT_NOT_NULL(test, dev->intf);
+	dev->intf->dev.init_name = "kvaser_usb_leaf_test";
+	dev->bulk_in = kunit_kzalloc(test, sizeof(*dev->bulk_in), GFP_KERNEL);
+	KUNIT_ASSERT_NOT_NULL(test, dev->bulk_in);
+	dev->bulk_in->wMaxPacketSize = cpu_to_le16(maxp);
+	dev->driver_info = info;
+
+	return dev;
+}
+
+static u8 kvaser_usb_leaf_test_filler_id(const struct kvaser_usb *dev)
+{
+	return dev->driver_info->family == KVASER_LEAF ?
+	       CMD_FLUSH_QUEUE_REPLY : CMD_USBCAN_CLOCK_OVERFLOW_EVENT;
+}
+
+static int kvaser_usb_leaf_test_put(u8 *buf, int pos, u8 id, u8 len)
+{
+	buf[pos] = len;
+	buf[pos + 1] = id;
+
+	return pos + len;
+}
+
+/* Fills [@pos, @end) with filler commands, returns how many */
+static int kvaser_usb_leaf_test_fill(const struct kvaser_usb *dev, u8 *buf,
+				     int pos, int end)
+{
+	u8 id = kvaser_usb_leaf_test_filler_id(dev);
+	int n = 0;
+
+	while (pos + KVASER_USB_LEAF_TEST_FILLER_LEN <= end) {
+		pos = kvaser_usb_leaf_test_put(buf, pos, id,
+					       KVASER_USB_LEAF_TEST_FILLER_LEN);
+		n++;
+	}
+
+	return n;
+}
+
+static s64 kvaser_usb_leaf_test_count(struct kvaser_usb *dev, u8 id)
+{
+	return atomic64_read(&dev->cmd_stats[id].count);
+}
+
+static u8 *kvaser_usb_leaf_test_buf(struct kunit *test)
+{
+	u8 *buf = kunit_kzalloc(test, KVASER_USB_LEAF_TEST_BUF_SIZE,
+				GFP_KERNEL);
+
+	KUNIT_ASSERT_NOT_NULL(test, buf);
+
+	return buf;
+}
+
+/* A command that does not fit before the next wMaxPacketSize boundary is
+ * moved there, with a zero length placeholder in front of it
+ */
+static void kvaser_usb_leaf_placeholder_test(struct kunit *test)
+{
+	struct kvaser_usb *dev;
+	u8 *buf = kvaser_usb_leaf_test_buf(test);
+	int n;
+
+	dev = kvaser_usb_leaf_test_dev(test, &kvaser_usb_leaf_test_info_leaf,
+				       64);
+
+	n = kvaser_usb_leaf_test_fill(dev, buf, 0, 62);
+	n += kvaser_usb_leaf_test_fill(dev, buf, 64, 128);
+	kvaser_usb_leaf_read_bulk_callback(dev, buf, 128);
+
+	KUNIT_EXPECT_EQ(test, atomic64_read(&dev->card_data.leaf.placeholders),
+			1);
+	KUNIT_EXPECT_EQ(test, kvaser_usb_leaf_test_count(dev,
+							 CMD_FLUSH_QUEUE_REPLY),
+			n);
+	KUNIT_EXPECT_EQ(test, atomic64_read(&dev->stats.cmd_format_errors), 0);
+}
+
+/* A placeholder right on a boundary skips a whole packet. Before the parser
+ * used round_up(pos + 1), this spun forever.
+ */
+static void kvaser_usb_leaf_placeholder_boundary_test(struct kunit *test)
+{
+	struct kvaser_usb *dev;
+	u8 *buf = kvaser_usb_leaf_test_buf(test);
+	int n;
+
+	dev = kvaser_usb_leaf_test_dev(test, &kvaser_usb_leaf_test_info_usbcan,
+				       64);
+
+	n = kvaser_usb_leaf_test_fill(dev, buf, 0, 64);
+	n += kvaser_usb_leaf_test_fill(dev, buf, 128, 192);
+	kvaser_usb_leaf_read_bulk_callback(dev, buf, 192);
+
+	KUNIT_EXPECT_EQ(test, atomic64_read(&dev->card_data.leaf.placeholders),
+			1);
+	KUNIT_EXPECT_EQ(test,
+			kvaser_usb_leaf_test_count(dev,
+						   CMD_USBCAN_CLOCK_OVERFLOW_EVENT),
+			n);
+	KUNIT_EXPECT_EQ(test,
+			atomic64_read(&dev->card_data.leaf.clock_overflows), n);
+}
+
+/* An all zero transfer is one placeholder per packet */
+static void kvaser_usb_leaf_placeholder_only_test(struct kunit *test)
+{
+	static const u16 maxps[] = { 64, 512 };
+	u8 *buf = kvaser_usb_leaf_test_buf(test);
+	int i;
+
+	for (i = 0; i < ARRAY_SIZE(maxps); i++) {
+		struct kvaser_usb *dev;
+
+		dev = kvaser_usb_leaf_test_dev(test,
+					       &kvaser_usb_leaf_test_info_leaf,
+					       maxps[i]);
+		kvaser_usb_leaf_read_bulk_callback(dev, buf,
+						   KVASER_USB_LEAF_TEST_BUF_SIZE);
+
+		KUNIT_EXPECT_EQ_MSG(test,
+				    atomic64_read(&dev->card_data.leaf.placeholders),
+				    KVASER_USB_LEAF_TEST_BUF_SIZE / maxps[i],
+				    "wMaxPacketSize %u", maxps[i]);
+	}
+}
+
+static void kvaser_usb_leaf_truncated_test(struct kunit *test)
+{
+	struct kvaser_usb *dev;
+	u8 *buf = kvaser_usb_leaf_test_buf(test);
+	int n;
+
+	dev = kvaser_usb_leaf_test_dev(test, &kvaser_usb_leaf_test_info_leaf,
+				       64);
+
+	/* The last command claims 8 bytes, but the transfer ends after 4 */
+	n = kvaser_usb_leaf_test_fill(dev, buf, 0, 60);
+	kvaser_usb_leaf_test_put(buf, 60, CMD_FLUSH_QUEUE_REPLY, 8);
+	kvaser_usb_leaf_read_bulk_callback(dev, buf, 64);
+
+	KUNIT_EXPECT_EQ(test, atomic64_read(&dev->stats.cmd_format_errors), 1);
+	KUNIT_EXPECT_EQ(test, kvaser_usb_leaf_test_count(dev,
+							 CMD_FLUSH_QUEUE_REPLY),
+			n);
+}
+
+/* A single byte after the last command is too short to be a command */
+static void kvaser_usb_leaf_trailing_byte_test(struct kunit *test)
+{
+	struct kvaser_usb *dev;
+	u8 *buf = kvaser_usb_leaf_test_buf(test);
+	int n;
+
+	dev = kvaser_usb_leaf_test_dev(test, &kvaser_usb_leaf_test_info_leaf,
+				       64);
+
+	n = kvaser_usb_leaf_test_fill(dev, buf, 0, 60);
+	buf[60] = 0xff;
+	kvaser_usb_leaf_read_bulk_callback(dev, buf, 61);
+
+	KUNIT_EXPECT_EQ(test, atomic64_read(&dev->stats.cmd_format_errors), 0);
+	KUNIT_EXPECT_EQ(test, kvaser_usb_leaf_test_count(dev,
+							 CMD_FLUSH_QUEUE_REPLY),
+			n);
+}
+
+/* A length of one cannot be a command, and what follows cannot be trusted */
+static void kvaser_usb_leaf_short_len_test(struct kunit *test)
+{
+	struct kvaser_usb *dev;
+	u8 *buf = kvaser_usb_leaf_test_buf(test);
+
+	dev = kvaser_usb_leaf_test_dev(test, &kvaser_usb_leaf_test_info_leaf,
+				       64);
+
+	kvaser_usb_leaf_test_put(buf, 0, CMD_FLUSH_QUEUE_REPLY, 1);
+	kvaser_usb_leaf_test_fill(dev, buf, 4, 64);
+	kvaser_usb_leaf_read_bulk_callback(dev, buf, 64);
+
+	KUNIT_EXPECT_EQ(test, atomic64_read(&dev->stats.cmd_format_errors), 1);
+	KUNIT_EXPECT_EQ(test, kvaser_usb_leaf_test_count(dev,
+							 CMD_FLUSH_QUEUE_REPLY),
+			0);
+}
+
+static void kvaser_usb_leaf_test_sizes(struct kunit *test,
+				       struct kvaser_usb *dev,
+				       const u8 *sizes, int nsizes)
+{
+	struct kvaser_cmd *cmd;
+	int id;
+
+	cmd = kunit_kzalloc(test, sizeof(*cmd), GFP_KERNEL);
+	KUNIT_ASSERT_NOT_NULL(test, cmd);
+
+	for (id = 0; id < 256; id++) {
+		u8 min_size = id < nsizes ? sizes[id] : 0;
+
+		cmd->id = id;
+
+		if (min_size == CMD_SIZE_ANY) {
+			cmd->len = CMD_HEADER_LEN;
+			KUNIT_EXPECT_EQ_MSG(test,
+					    kvaser_usb_leaf_verify_size(dev, cmd),
+					    0, "command %d", id);
+		} else if (min_size) {
+			cmd->len = CMD_HEADER_LEN + min_size;
+			KUNIT_EXPECT_EQ_MSG(test,
+					    kvaser_usb_leaf_verify_size(dev, cmd),
+					    0, "command %d", id);
+			cmd->len--;
+			KUNIT_EXPECT_EQ_MSG(test,
+					    kvaser_usb_leaf_verify_size(dev, cmd),
+					    -EIO, "command %d one byte short", id);
+		} else {
+			cmd->len = CMD_HEADER_LEN;
+			KUNIT_EXPECT_EQ_MSG(test,
+					    kvaser_usb_leaf_verify_size(dev, cmd),
+					    -EINVAL, "unknown command %d", id);
+		}
+	}
+}
+
+/* Commands shorter than their layout are dropped, unknown ones as well */
+static void kvaser_usb_leaf_verify_size_test(struct kunit *test)
+{
+	struct kvaser_usb *dev;
+
+	dev = kvaser_usb_leaf_test_dev(test, &kvaser_usb_leaf_test_info_leaf,
+				       64);
+	kvaser_usb_leaf_test_sizes(test, dev, kvaser_usb_leaf_cmd_sizes_leaf,
+				   ARRAY_SIZE(kvaser_usb_leaf_cmd_sizes_leaf));
+
+	dev = kvaser_usb_leaf_test_dev(test, &kvaser_usb_leaf_test_info_usbcan,
+				       64);
+	kvaser_usb_leaf_test_sizes(test, dev, kvaser_usb_leaf_cmd_sizes_usbcan,
+				   ARRAY_SIZE(kvaser_usb_leaf_cmd_sizes_usbcan));
+}
+
+/* Log messages are leaf only and clock overflows USBcan only, the event
+ * counters follow the family
+ */
+static void kvaser_usb_leaf_family_events_test(struct kunit *test)
+{
+	const struct kvaser_usb_driver_info *infos[] = {
+		&kvaser_usb_leaf_test_info_leaf,
+		&kvaser_usb_leaf_test_info_usbcan,
+	};
+	u8 *buf = kvaser_usb_leaf_test_buf(test);
+	int i;
+
+	for (i = 0; i < ARRAY_SIZE(infos); i++) {
+		struct kvaser_usb_dev_card_data_leaf *leaf;
+		bool is_leaf = infos[i]->family == KVASER_LEAF;
+		struct kvaser_usb *dev;
+		int pos = 0;
+
+		dev = kvaser_usb_leaf_test_dev(test, infos[i], 512);
+		leaf = &dev->card_data.leaf;
+
+		memset(buf, 0, KVASER_USB_LEAF_TEST_BUF_SIZE);
+		pos = kvaser_usb_leaf_test_put(buf, pos, CMD_LEAF_LOG_MESSAGE,
+					       24);
+		pos = kvaser_usb_leaf_test_put(buf, pos, CMD_CHIP_STATE_EVENT,
+					       16);
+		pos = kvaser_usb_leaf_test_put(buf, pos, CMD_CAN_ERROR_EVENT,
+					       16);
+		pos = kvaser_usb_leaf_test_put(buf, pos, CMD_ERROR_EVENT, 16);
+		pos = kvaser_usb_leaf_test_put(buf, pos,
+					       CMD_USBCAN_CLOCK_OVERFLOW_EVENT,
+					       8);
+		kvaser_usb_leaf_read_bulk_callback(dev, buf, pos);
+
+		KUNIT_EXPECT_EQ(test, atomic64_read(&leaf->log_messages),
+				is_leaf ? 1 : 0);
+		KUNIT_EXPECT_EQ(test, atomic64_read(&leaf->clock_overflows),
+				is_leaf ? 0 : 1);
+		KUNIT_EXPECT_EQ(test, atomic64_read(&leaf->chip_state_events),
+				1);
+		KUNIT_EXPECT_EQ(test, atomic64_read(&leaf->error_events), 2);
+		KUNIT_EXPECT_EQ(test,
+				atomic64_read(&dev->stats.cmd_format_errors),
+				0);
+		/* Every command was parsed, known or not */
+		KUNIT_EXPECT_EQ(test, kvaser_usb_leaf_test_count(dev,
+								 CMD_ERROR_EVENT),
+				1);
+		KUNIT_EXPECT_EQ(test,
+				kvaser_usb_leaf_test_count(dev,
+							   CMD_USBCAN_CLOCK_OVERFLOW_EVENT),
+				1);
+	}
+}
+
+static struct kunit_case kvaser_usb_leaf_test_cases[] = {
+	KUNIT_CASE(kvaser_usb_leaf_placeholder_test),
+	KUNIT_CASE(kvaser_usb_leaf_placeholder_boundary_test),
+	KUNIT_CASE(kvaser_usb_leaf_placeholder_only_test),
+	KUNIT_CASE(kvaser_usb_leaf_truncated_test),
+	KUNIT_CASE(kvaser_usb_leaf_trailing_byte_test),
+	KUNIT_CASE(kvaser_usb_leaf_short_len_test),
+	KUNIT_CASE(kvaser_usb_leaf_verify_size_test),
+	KUNIT_CASE(kvaser_usb_leaf_family_events_test),
+	{}
+};
+
+static struct kunit_suite kvaser_usb_leaf_test_suite = {
+	.name = "kvaser_usb_leaf",
+	.test_cases = kvaser_usb_leaf_test_cases,
+};
+
+kunit_test_suite(kvaser_usb_leaf_test_suite);
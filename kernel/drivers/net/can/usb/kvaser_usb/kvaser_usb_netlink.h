@@ -0,0 +1,52 @@
+/* SPDX-License-Identifier: GPL-2.0 WITH Linux-syscall-note */
+/* Generic netlink interface of the kvaser_usb driver, usable from user space.
+ *
+ * Periodic transmission: up to KVASER_USB_PERIODIC_SLOTS cyclic frames per
+ * CAN interface. The frames are sent by the driver through the regular
+ * transmit path, so they share the qdisc and the echo handling with frames
+ * from CAN_RAW. Slots are only accepted while the interface is up, and are
+ * all stopped when it goes down.
+ *
+ * KVASER_USB_CMD_PERIODIC_ADD:   IFINDEX, SLOT, PERIOD_US and FRAME, replaces
+ *                                the frame in a slot that is already in use
+ * KVASER_USB_CMD_PERIODIC_DEL:   IFINDEX and SLOT
+ * KVASER_USB_CMD_PERIODIC_FLUSH: IFINDEX, stops all slots
+ * KVASER_USB_CMD_PERIODIC_GET:   IFINDEX, the reply holds one nested
+ *                                KVASER_USB_A_PERIODIC per slot in use
+ *
+ * FRAME is a struct can_frame, or a struct canfd_frame for a CAN FD frame.
+ * The modifying commands require CAP_NET_ADMIN.
+ */
+
+#ifndef KVASER_USB_NETLINK_H
+#define KVASER_USB_NETLINK_H
+
+#define KVASER_USB_GENL_NAME		"kvaser_usb"
+#define KVASER_USB_GENL_VERSION		1
+
+#define KVASER_USB_PERIODIC_SLOTS	32
+
+enum kvaser_usb_genl_cmd {
+	KVASER_USB_CMD_UNSPEC,
+	KVASER_USB_CMD_PERIODIC_ADD,
+	KVASER_USB_CMD_PERIODIC_DEL,
+	KVASER_USB_CMD_PERIODIC_FLUSH,
+	KVASER_USB_CMD_PERIODIC_GET,
+
+	__KVASER_USB_CMD_MAX,
+	KVASER_USB_CMD_MAX = __KVASER_USB_CMD_MAX - 1
+};
+
+enum kvaser_usb_genl_attr {
+	KVASER_USB_A_UNSPEC,
+	KVASER_USB_A_IFINDEX,		/* u32 */
+	KVASER_USB_A_SLOT,		/* u32 */
+	KVASER_USB_A_PERIOD_US,		/* u32 */
+	KVASER_USB_A_FRAME,		/* struct can_frame or canfd_frame */
+	KVASER_USB_A_PERIODIC,		/* nested SLOT, PERIOD_US and FRAME */
+
+	__KVASER_USB_A_MAX,
+	KVASER_USB_A_MAX = __KVASER_USB_A_MAX - 1
+};
+
+#endif /* KVASER_USB_NETLINK_H */
@@ -0,0 +1,1085 @@
+// SPDX-License-Identifier: GPL-2.0 OR BSD-2-Clause
+/* Kvaser SocketCAN throughput and latency benchmark.
+ *
+ * Sends cangen style traffic on one interface and receives it on others,
+ * real or emulated, and reports frames/s, drops, CPU per frame and latency
+ * percentiles as JSON. Each frame carries its sequence number in the first
+ * four data bytes, so echoes and received copies can be matched to the
+ * send.
+ *
+ * Latencies come from the hardware timestamps the driver sets on received
+ * frames and on Tx echoes. The device clock is not the system clock, so
+ * latencies across the two clocks are reported above the fastest frame of
+ * the run, after removing the drift between the clocks. Tx echo latency,
+ * from write() to the echo reaching the socket, is on the system clock
+ * alone and absolute.
+ */
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <getopt.h>
+#include <inttypes.h>
+#include <limits.h>
+#include <net/if.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/utsname.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <linux/can.h>
+#include <linux/can/raw.h>
+#include <linux/errqueue.h>
+#include <linux/net_tstamp.h>
+
+#define KVASER_BENCH_MAX_RX		4
+#define KVASER_BENCH_MAX_PROFILES	8
+#define KVASER_BENCH_SEQ_LEN		4
+#define KVASER_BENCH_RCVBUF		(4 * 1024 * 1024)
+#define KVASER_BENCH_POLL_MS		100
+
+#define ARRAY_SIZE(a)		(sizeof(a) / sizeof((a)[0]))
+
+struct kvaser_bench_profile {
+	char name[24];
+	bool fd;
+	bool ext_id;
+	bool burst;
+};
+
+struct kvaser_bench_config {
+	const char *tx_ifname;
+	const char *rx_ifname[KVASER_BENCH_MAX_RX];
+	unsigned int n_rx;
+	struct kvaser_bench_profile profiles[KVASER_BENCH_MAX_PROFILES];
+	unsigned int n_profiles;
+	unsigned int frames;
+	unsigned int rate;
+	unsigned int burst;
+	unsigned int gap_ms;
+	unsigned int len;
+	bool no_brs;
+	unsigned int settle_ms;
+	unsigned int rx_only_s;
+	bool independent;
+	const char *label;
+	bool verbose;
+};
+
+/* The /sys/class/net/<if>/statistics counters kept per run */
+static const char * const kvaser_bench_stat_names[] = {
+	"tx_packets", "rx_packets", "tx_dropped", "rx_dropped",
+	"tx_errors", "rx_errors", "rx_over_errors", "rx_fifo_errors",
+};
+
+#define KVASER_BENCH_N_STATS	ARRAY_SIZE(kvaser_bench_stat_names)
+
+struct kvaser_bench_samples {
+	int64_t *from;
+	int64_t *to;
+	size_t n;
+	size_t size;
+};
+
+struct kvaser_bench_if {
+	const char *name;
+	int ifindex;
+	int sock;
+	bool fd_capable;
+	uint64_t stats[2][KVASER_BENCH_N_STATS];
+	/* Frames that are not our own echoes */
+	uint64_t frames;
+	uint64_t matched;
+	uint64_t duplicates;
+	uint32_t ovfl;
+	int64_t first_ns;
+	int64_t last_ns;
+	/* Hardware and software timestamps of every received frame */
+	struct kvaser_bench_samples rx;
+	/* Hardware Rx timestamp per sequence number, 0 if not seen */
+	int64_t *hw_by_seq;
+};
+
+struct kvaser_bench_run {
+	const struct kvaser_bench_config *cfg;
+	const struct kvaser_bench_profile *profile;
+	unsigned int len;
+	unsigned int n;
+	struct kvaser_bench_if tx;
+	struct kvaser_bench_if rx[KVASER_BENCH_MAX_RX];
+	unsigned int n_rx;
+	/* Per sequence number, system clock and device clock */
+	int64_t *send_ns;
+	int64_t *echo_sw_ns;
+	int64_t *echo_hw_ns;
+	uint64_t sent;
+	uint64_t busy;
+	uint64_t echoes;
+	int64_t start_ns;
+	int64_t end_ns;
+	volatile bool stop;
+};
+
+static int64_t kvaser_bench_now(clockid_t clock)
+{
+	struct timespec ts;
+
+	clock_gettime(clock, &ts);
+	return (int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static int64_t kvaser_bench_ts_ns(const struct timespec *ts)
+{
+	return (int64_t)ts->tv_sec * 1000000000 + ts->tv_nsec;
+}
+
+static int kvaser_bench_samples_add(struct kvaser_bench_samples *s,
+				    int64_t from, int64_t to)
+{
+	if (s->n == s->size) {
+		size_t size = s->size ? 2 * s->size : 4096;
+		int64_t *from_buf, *to_buf;
+
+		from_buf = realloc(s->from, size * sizeof(*from_buf));
+		if (!from_buf)
+			return -ENOMEM;
+		s->from = from_buf;
+		to_buf = realloc(s->to, size * sizeof(*to_buf));
+		if (!to_buf)
+			return -ENOMEM;
+		s->to = to_buf;
+		s->size = size;
+	}
+	s->from[s->n] = from;
+	s->to[s->n] = to;
+	s->n++;
+	return 0;
+}
+
+static void kvaser_bench_samples_free(struct kvaser_bench_samples *s)
+{
+	free(s->from);
+	free(s->to);
+	memset(s, 0, sizeof(*s));
+}
+
+/* Profile names are <classic|fd>-<11|29>-<steady|burst> */
+static int kvaser_bench_parse_profile(const char *arg,
+				      struct kvaser_bench_profile *p)
+{
+	char frame[8], id[4], mode[8];
+
+	if (sscanf(arg, "%7[a-z]-%3[0-9]-%7[a-z]", frame, id, mode) != 3)
+		return -1;
+
+	memset(p, 0, sizeof(*p));
+	if (!strcmp(frame, "fd"))
+		p->fd = true;
+	else if (strcmp(frame, "classic"))
+		return -1;
+	if (!strcmp(id, "29"))
+		p->ext_id = true;
+	else if (strcmp(id, "11"))
+		return -1;
+	if (!strcmp(mode, "burst"))
+		p->burst = true;
+	else if (strcmp(mode, "steady"))
+		return -1;
+
+	snprintf(p->name, sizeof(p->name), "%s-%s-%s", frame, id, mode);
+	return 0;
+}
+
+static void kvaser_bench_all_profiles(struct kvaser_bench_config *cfg)
+{
+	static const char * const names[KVASER_BENCH_MAX_PROFILES] = {
+		"classic-11-steady", "classic-11-burst",
+		"classic-29-steady", "classic-29-burst",
+		"fd-11-steady", "fd-11-burst",
+		"fd-29-steady", "fd-29-burst",
+	};
+	unsigned int i;
+
+	for (i = 0; i < KVASER_BENCH_MAX_PROFILES; i++)
+		kvaser_bench_parse_profile(names[i], &cfg->profiles[i]);
+	cfg->n_profiles = KVASER_BENCH_MAX_PROFILES;
+}
+
+static int kvaser_bench_read_u64(const char *path, uint64_t *val)
+{
+	unsigned long long v;
+	FILE *f;
+	int ret;
+
+	f = fopen(path, "r");
+	if (!f)
+		return -errno;
+	ret = fscanf(f, "%llu", &v) == 1 ? 0 : -EINVAL;
+	fclose(f);
+	*val = v;
+	return ret;
+}
+
+static void kvaser_bench_read_stats(struct kvaser_bench_if *bif, int when)
+{
+	char path[128];
+	unsigned int i;
+
+	for (i = 0; i < KVASER_BENCH_N_STATS; i++) {
+		snprintf(path, sizeof(path), "/sys/class/net/%s/statistics/%s",
+			 bif->name, kvaser_bench_stat_names[i]);
+		if (kvaser_bench_read_u64(path, &bif->stats[when][i]))
+			bif->stats[when][i] = 0;
+	}
+}
+
+/* Busy CPU time of the whole system, in ns. Driver work runs in interrupt,
+ * softirq and kernel thread context, which RUSAGE_SELF does not see.
+ */
+static int64_t kvaser_bench_system_cpu_ns(void)
+{
+	unsigned long long v[8] = { 0 };
+	long hz = sysconf(_SC_CLK_TCK);
+	FILE *f;
+	int n;
+
+	f = fopen("/proc/stat", "r");
+	if (!f)
+		return 0;
+	/* user nice system idle iowait irq softirq steal */
+	n = fscanf(f, "cpu %llu %llu %llu %llu %llu %llu %llu %llu", &v[0],
+		   &v[1], &v[2], &v[3], &v[4], &v[5], &v[6], &v[7]);
+	fclose(f);
+	if (n != 8 || hz <= 0)
+		return 0;
+
+	return (int64_t)(v[0] + v[1] + v[2] + v[5] + v[6] + v[7]) *
+	       (1000000000 / hz);
+}
+
+static int64_t kvaser_bench_process_cpu_ns(void)
+{
+	struct rusage ru;
+
+	getrusage(RUSAGE_SELF, &ru);
+	return ((int64_t)ru.ru_utime.tv_sec + ru.ru_stime.tv_sec) *
+	       1000000000 +
+	       ((int64_t)ru.ru_utime.tv_usec + ru.ru_stime.tv_usec) * 1000;
+}
+
+static int kvaser_bench_open(struct kvaser_bench_if *bif, bool own_msgs)
+{
+	int flags = SOF_TIMESTAMPING_RX_HARDWARE |
+		    SOF_TIMESTAMPING_RAW_HARDWARE |
+		    SOF_TIMESTAMPING_RX_SOFTWARE |
+		    SOF_TIMESTAMPING_SOFTWARE;
+	struct sockaddr_can addr = { .can_family = AF_CAN };
+	int rcvbuf = KVASER_BENCH_RCVBUF;
+	int one = 1;
+	struct ifreq ifr;
+
+	bif->sock = socket(PF_CAN, SOCK_RAW, CAN_RAW);
+	if (bif->sock < 0) {
+		perror("socket");
+		return -errno;
+	}
+
+	memset(&ifr, 0, sizeof(ifr));
+	snprintf(ifr.ifr_name, sizeof(ifr.ifr_name), "%s", bif->name);
+	if (ioctl(bif->sock, SIOCGIFINDEX, &ifr)) {
+		fprintf(stderr, "%s: %s\n", bif->name, strerror(errno));
+		return -errno;
+	}
+	bif->ifindex = ifr.ifr_ifindex;
+	if (!ioctl(bif->sock, SIOCGIFMTU, &ifr))
+		bif->fd_capable = ifr.ifr_mtu == CANFD_MTU;
+
+	if (bif->fd_capable)
+		setsockopt(bif->sock, SOL_CAN_RAW, CAN_RAW_FD_FRAMES, &one,
+			   sizeof(one));
+	if (own_msgs)
+		setsockopt(bif->sock, SOL_CAN_RAW, CAN_RAW_RECV_OWN_MSGS, &one,
+			   sizeof(one));
+	if (setsockopt(bif->sock, SOL_SOCKET, SO_TIMESTAMPING, &flags,
+		       sizeof(flags)))
+		perror("SO_TIMESTAMPING");
+	setsockopt(bif->sock, SOL_SOCKET, SO_RXQ_OVFL, &one, sizeof(one));
+	if (setsockopt(bif->sock, SOL_SOCKET, SO_RCVBUFFORCE, &rcvbuf,
+		       sizeof(rcvbuf)))
+		setsockopt(bif->sock, SOL_SOCKET, SO_RCVBUF, &rcvbuf,
+			   sizeof(rcvbuf));
+
+	addr.can_ifindex = bif->ifindex;
+	if (bind(bif->sock, (struct sockaddr *)&addr, sizeof(addr))) {
+		fprintf(stderr, "%s: bind: %s\n", bif->name, strerror(errno));
+		return -errno;
+	}
+
+	return 0;
+}
+
+static canid_t kvaser_bench_id(const struct kvaser_bench_profile *p,
+			       uint32_t seq)
+{
+	if (p->ext_id)
+		return (seq * 0x9e3779b1u & CAN_EFF_MASK) | CAN_EFF_FLAG;
+	return seq & CAN_SFF_MASK;
+}
+
+static uint32_t kvaser_bench_get_seq(const struct canfd_frame *cf)
+{
+	return cf->data[0] | cf->data[1] << 8 | cf->data[2] << 16 |
+	       (uint32_t)cf->data[3] << 24;
+}
+
+/* Reads one frame from @bif. Own echoes on the Tx socket carry
+ * MSG_CONFIRM.
+ */
+static void kvaser_bench_recv(struct kvaser_bench_run *run,
+			      struct kvaser_bench_if *bif, bool tx_socket)
+{
+	char ctrl[CMSG_SPACE(sizeof(struct scm_timestamping)) +
+		  CMSG_SPACE(sizeof(uint32_t))];
+	struct canfd_frame cf;
+	struct iovec iov = { .iov_base = &cf, .iov_len = sizeof(cf) };
+	struct msghdr msg = {
+		.msg_iov = &iov,
+		.msg_iovlen = 1,
+		.msg_control = ctrl,
+		.msg_controllen = sizeof(ctrl),
+	};
+	int64_t sw_ns = 0, hw_ns = 0;
+	struct cmsghdr *cmsg;
+	uint32_t seq;
+	ssize_t len;
+
+	len = recvmsg(bif->sock, &msg, MSG_DONTWAIT);
+	if (len < (ssize_t)CAN_MTU)
+		return;
+
+	for (cmsg = CMSG_FIRSTHDR(&msg); cmsg;
+	     cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+		if (cmsg->cmsg_level != SOL_SOCKET)
+			continue;
+		if (cmsg->cmsg_type == SO_TIMESTAMPING) {
+			struct scm_timestamping *tss =
+				(struct scm_timestamping *)CMSG_DATA(cmsg);
+
+			sw_ns = kvaser_bench_ts_ns(&tss->ts[0]);
+			hw_ns = kvaser_bench_ts_ns(&tss->ts[2]);
+		} else if (cmsg->cmsg_type == SO_RXQ_OVFL) {
+			memcpy(&bif->ovfl, CMSG_DATA(cmsg), sizeof(bif->ovfl));
+		}
+	}
+	if (!sw_ns)
+		sw_ns = kvaser_bench_now(CLOCK_REALTIME);
+
+	seq = UINT32_MAX;
+	if (cf.len >= KVASER_BENCH_SEQ_LEN && !(cf.can_id & CAN_ERR_FLAG) &&
+	    run->profile) {
+		seq = kvaser_bench_get_seq(&cf);
+		if (seq >= run->n ||
+		    cf.can_id != kvaser_bench_id(run->profile, seq))
+			seq = UINT32_MAX;
+	}
+
+	if (tx_socket && (msg.msg_flags & MSG_CONFIRM)) {
+		run->echoes++;
+		if (seq == UINT32_MAX)
+			return;
+		run->echo_sw_ns[seq] = sw_ns;
+		run->echo_hw_ns[seq] = hw_ns;
+		return;
+	}
+	if (tx_socket)
+		return;
+
+	if (!bif->frames)
+		bif->first_ns = sw_ns;
+	bif->last_ns = sw_ns;
+	bif->frames++;
+	if (hw_ns)
+		kvaser_bench_samples_add(&bif->rx, hw_ns, sw_ns);
+
+	if (seq == UINT32_MAX || run->cfg->independent)
+		return;
+	if (bif->hw_by_seq[seq]) {
+		bif->duplicates++;
+		return;
+	}
+	bif->hw_by_seq[seq] = hw_ns ?: 1;
+	bif->matched++;
+}
+
+static void *kvaser_bench_rx_thread(void *arg)
+{
+	struct kvaser_bench_run *run = arg;
+	struct pollfd pfd[KVASER_BENCH_MAX_RX + 1];
+	unsigned int i, n = 0;
+
+	if (run->profile) {
+		pfd[n].fd = run->tx.sock;
+		pfd[n++].events = POLLIN;
+	}
+	for (i = 0; i < run->n_rx; i++) {
+		pfd[n].fd = run->rx[i].sock;
+		pfd[n++].events = POLLIN;
+	}
+
+	while (!run->stop) {
+		if (poll(pfd, n, KVASER_BENCH_POLL_MS) <= 0)
+			continue;
+		for (i = 0; i < n; i++) {
+			bool tx_socket = run->profile && i == 0;
+			struct kvaser_bench_if *bif;
+
+			if (!(pfd[i].revents & POLLIN))
+				continue;
+			bif = tx_socket ? &run->tx :
+				&run->rx[i - (run->profile ? 1 : 0)];
+			kvaser_bench_recv(run, bif, tx_socket);
+		}
+	}
+	return NULL;
+}
+
+/* Blocks while the Tx queue is full, as cangen -i does */
+static int kvaser_bench_send(struct kvaser_bench_run *run,
+			     const struct canfd_frame *cf, size_t mtu,
+			     uint32_t seq)
+{
+	struct pollfd pfd = { .fd = run->tx.sock, .events = POLLOUT };
+
+	for (;;) {
+		run->send_ns[seq] = kvaser_bench_now(CLOCK_REALTIME);
+		if (write(run->tx.sock, cf, mtu) == (ssize_t)mtu)
+			return 0;
+		if (errno != ENOBUFS && errno != EAGAIN) {
+			fprintf(stderr, "%s: write: %s\n", run->tx.name,
+				strerror(errno));
+			return -errno;
+		}
+		run->busy++;
+		poll(&pfd, 1, KVASER_BENCH_POLL_MS);
+	}
+}
+
+static void kvaser_bench_sleep_until(int64_t t_ns)
+{
+	struct timespec ts = {
+		.tv_sec = t_ns / 1000000000,
+		.tv_nsec = t_ns % 1000000000,
+	};
+
+	while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) ==
+	       EINTR)
+		;
+}
+
+static int kvaser_bench_tx(struct kvaser_bench_run *run)
+{
+	const struct kvaser_bench_config *cfg = run->cfg;
+	const struct kvaser_bench_profile *p = run->profile;
+	size_t mtu = p->fd ? CANFD_MTU : CAN_MTU;
+	int64_t period = p->burst ? (int64_t)cfg->gap_ms * 1000000 :
+				    1000000000 / cfg->rate;
+	unsigned int per_slot = p->burst ? cfg->burst : 1;
+	int64_t next = kvaser_bench_now(CLOCK_MONOTONIC);
+	struct canfd_frame cf;
+	uint32_t seq = 0;
+	unsigned int i;
+	int err;
+
+	memset(&cf, 0, sizeof(cf));
+	cf.len = run->len;
+	if (p->fd && !cfg->no_brs)
+		cf.flags = CANFD_BRS;
+
+	while (seq < run->n) {
+		for (i = 0; i < per_slot && seq < run->n; i++, seq++) {
+			cf.can_id = kvaser_bench_id(p, seq);
+			cf.data[0] = seq;
+			cf.data[1] = seq >> 8;
+			cf.data[2] = seq >> 16;
+			cf.data[3] = seq >> 24;
+			memset(&cf.data[KVASER_BENCH_SEQ_LEN], seq & 0xff,
+			       run->len - KVASER_BENCH_SEQ_LEN);
+			err = kvaser_bench_send(run, &cf, mtu, seq);
+			if (err)
+				return err;
+			run->sent++;
+		}
+		next += period;
+		kvaser_bench_sleep_until(next);
+	}
+	return 0;
+}
+
+static int kvaser_bench_cmp_s64(const void *a, const void *b)
+{
+	int64_t x = *(const int64_t *)a, y = *(const int64_t *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+/* Latency from @from on one clock to @to on another, above the fastest
+ * sample. The drift between the clocks is removed with a least squares
+ * fit of the offset, so only the variable part of the latency remains.
+ */
+static void kvaser_bench_relative(const struct kvaser_bench_samples *s,
+				  int64_t *out)
+{
+	long double sx = 0, sd = 0, sxx = 0, sxd = 0, a, b = 0, den;
+	int64_t min = INT64_MAX;
+	size_t i;
+
+	if (!s->n)
+		return;
+
+	for (i = 0; i < s->n; i++) {
+		long double x = s->from[i] - s->from[0];
+		long double d = s->to[i] - s->from[i];
+
+		sx += x;
+		sd += d;
+		sxx += x * x;
+		sxd += x * d;
+	}
+	den = s->n * sxx - sx * sx;
+	if (den > 0)
+		b = (s->n * sxd - sx * sd) / den;
+	a = (sd - b * sx) / s->n;
+
+	for (i = 0; i < s->n; i++) {
+		long double x = s->from[i] - s->from[0];
+
+		out[i] = (int64_t)(s->to[i] - s->from[i] - a - b * x);
+		if (out[i] < min)
+			min = out[i];
+	}
+	for (i = 0; i < s->n; i++)
+		out[i] -= min;
+}
+
+static double kvaser_bench_percentile(const int64_t *sorted, size_t n,
+				      double pct)
+{
+	size_t i = (size_t)(pct / 100 * (n - 1) + 0.5);
+
+	return sorted[i] / 1000.0;
+}
+
+/* Percentiles in microseconds. @v is sorted in place. */
+static void kvaser_bench_json_latency(FILE *out, const char *name,
+				      int64_t *v, size_t n, const char *clock,
+				      bool last)
+{
+	fprintf(out, "        \"%s\": { \"clock\": \"%s\", \"samples\": %zu",
+		name, clock, n);
+	if (n) {
+		qsort(v, n, sizeof(*v), kvaser_bench_cmp_s64);
+		fprintf(out,
+			", \"min\": %.1f, \"p50\": %.1f, \"p90\": %.1f, \"p99\": %.1f, \"p99_9\": %.1f, \"max\": %.1f",
+			v[0] / 1000.0, kvaser_bench_percentile(v, n, 50),
+			kvaser_bench_percentile(v, n, 90),
+			kvaser_bench_percentile(v, n, 99),
+			kvaser_bench_percentile(v, n, 99.9),
+			v[n - 1] / 1000.0);
+	}
+	fprintf(out, " }%s\n", last ? "" : ",");
+}
+
+static void kvaser_bench_json_ifstats(FILE *out,
+				      const struct kvaser_bench_if *bif)
+{
+	unsigned int i;
+
+	fprintf(out, "\"counters\": {");
+	for (i = 0; i < KVASER_BENCH_N_STATS; i++)
+		fprintf(out, "%s \"%s\": %" PRIu64, i ? "," : "",
+			kvaser_bench_stat_names[i],
+			bif->stats[1][i] - bif->stats[0][i]);
+	fprintf(out, " }");
+}
+
+static double kvaser_bench_rate(uint64_t frames, int64_t ns)
+{
+	return ns > 0 ? frames * 1e9 / ns : 0;
+}
+
+static void kvaser_bench_report(FILE *out, struct kvaser_bench_run *run,
+				int64_t proc_cpu, int64_t sys_cpu, bool last)
+{
+	const struct kvaser_bench_profile *p = run->profile;
+	uint64_t frames = run->sent;
+	int64_t elapsed = run->end_ns - run->start_ns;
+	struct kvaser_bench_samples s = { 0 };
+	int64_t *v;
+	unsigned int i;
+	size_t n;
+
+	v = malloc(sizeof(*v) * (run->n + 1));
+
+	fprintf(out, "    {\n");
+	if (p) {
+		fprintf(out,
+			"      \"profile\": { \"name\": \"%s\", \"fd\": %s, \"brs\": %s, \"id_bits\": %d, \"mode\": \"%s\", \"len\": %u, \"frames\": %u",
+			p->name, p->fd ? "true" : "false",
+			p->fd && !run->cfg->no_brs ? "true" : "false",
+			p->ext_id ? 29 : 11, p->burst ? "burst" : "steady",
+			run->len, run->n);
+		if (p->burst)
+			fprintf(out, ", \"burst\": %u, \"gap_ms\": %u",
+				run->cfg->burst, run->cfg->gap_ms);
+		else
+			fprintf(out, ", \"rate\": %u", run->cfg->rate);
+		fprintf(out, " },\n");
+
+		fprintf(out,
+			"      \"tx\": { \"interface\": \"%s\", \"frames\": %" PRIu64 ", \"frames_per_s\": %.1f, \"echoes\": %" PRIu64 ", \"queue_full\": %" PRIu64 ", ",
+			run->tx.name, run->sent,
+			kvaser_bench_rate(run->sent, elapsed), run->echoes,
+			run->busy);
+		kvaser_bench_json_ifstats(out, &run->tx);
+		fprintf(out, " },\n");
+	} else {
+		fprintf(out, "      \"profile\": { \"name\": \"rx-only\", \"duration_s\": %u },\n",
+			run->cfg->rx_only_s);
+		frames = 0;
+		for (i = 0; i < run->n_rx; i++)
+			frames += run->rx[i].frames;
+	}
+
+	fprintf(out, "      \"rx\": [");
+	for (i = 0; i < run->n_rx; i++) {
+		struct kvaser_bench_if *bif = &run->rx[i];
+
+		fprintf(out,
+			"%s\n        { \"interface\": \"%s\", \"frames\": %" PRIu64 ", \"frames_per_s\": %.1f, \"socket_drops\": %u, ",
+			i ? "," : "", bif->name, bif->frames,
+			kvaser_bench_rate(bif->frames ? bif->frames - 1 : 0,
+					  bif->last_ns - bif->first_ns),
+			bif->ovfl);
+		if (p && !run->cfg->independent)
+			fprintf(out,
+				"\"matched\": %" PRIu64 ", \"lost\": %" PRIu64 ", \"duplicates\": %" PRIu64 ", ",
+				bif->matched, run->sent - bif->matched,
+				bif->duplicates);
+		kvaser_bench_json_ifstats(out, bif);
+		fprintf(out, " }");
+	}
+	fprintf(out, "%s],\n", run->n_rx ? "\n      " : "");
+
+	fprintf(out,
+		"      \"cpu\": { \"frames\": %" PRIu64 ", \"process_ns_per_frame\": %.0f, \"system_ns_per_frame\": %.0f },\n",
+		frames, frames ? (double)proc_cpu / frames : 0,
+		frames ? (double)sys_cpu / frames : 0);
+
+	fprintf(out, "      \"latency_us\": {\n");
+	if (p && v) {
+		/* write() to the echo reaching the socket */
+		for (n = 0, i = 0; i < run->n; i++) {
+			if (run->echo_sw_ns[i] && run->send_ns[i])
+				v[n++] = run->echo_sw_ns[i] - run->send_ns[i];
+		}
+		kvaser_bench_json_latency(out, "tx_echo", v, n, "system",
+					  false);
+
+		/* write() to the frame leaving on the bus */
+		for (i = 0; i < run->n; i++) {
+			if (run->echo_hw_ns[i] && run->send_ns[i])
+				kvaser_bench_samples_add(&s, run->send_ns[i],
+							 run->echo_hw_ns[i]);
+		}
+		kvaser_bench_relative(&s, v);
+		kvaser_bench_json_latency(out, "tx_hw", v, s.n,
+					  "relative", false);
+		kvaser_bench_samples_free(&s);
+	}
+	for (i = 0; i < run->n_rx; i++) {
+		struct kvaser_bench_if *bif = &run->rx[i];
+		bool last_rx = i == run->n_rx - 1;
+		char name[40];
+		int64_t *rv;
+		uint32_t seq;
+
+		/* The frame on the bus to it reaching the socket */
+		rv = malloc(sizeof(*rv) * (bif->rx.n + 1));
+		if (rv) {
+			kvaser_bench_relative(&bif->rx, rv);
+			snprintf(name, sizeof(name), "rx_%s", bif->name);
+			kvaser_bench_json_latency(out, name, rv, bif->rx.n,
+						  "relative",
+						  last_rx &&
+						  (!p || run->cfg->independent));
+			free(rv);
+		}
+
+		if (!p || run->cfg->independent || !v)
+			continue;
+
+		/* Tx on the bus to Rx, on the device clock(s) */
+		for (n = 0, seq = 0; seq < run->n; seq++) {
+			if (bif->hw_by_seq[seq] > 1 && run->echo_hw_ns[seq])
+				v[n++] = bif->hw_by_seq[seq] -
+					 run->echo_hw_ns[seq];
+		}
+		snprintf(name, sizeof(name), "bus_%s", bif->name);
+		kvaser_bench_json_latency(out, name, v, n, "device", last_rx);
+	}
+	if (!run->n_rx && p)
+		fprintf(out, "        \"rx\": null\n");
+	fprintf(out, "      }\n    }%s\n", last ? "" : ",");
+	free(v);
+}
+
+static void kvaser_bench_run_free(struct kvaser_bench_run *run)
+{
+	unsigned int i;
+
+	for (i = 0; i < run->n_rx; i++) {
+		free(run->rx[i].hw_by_seq);
+		kvaser_bench_samples_free(&run->rx[i].rx);
+		if (run->rx[i].sock >= 0)
+			close(run->rx[i].sock);
+	}
+	if (run->tx.sock >= 0)
+		close(run->tx.sock);
+	free(run->send_ns);
+	free(run->echo_sw_ns);
+	free(run->echo_hw_ns);
+}
+
+/* Runs @p, or receives for cfg->rx_only_s seconds without a profile */
+static int kvaser_bench_run(FILE *out, const struct kvaser_bench_config *cfg,
+			    const struct kvaser_bench_profile *p, bool last)
+{
+	struct kvaser_bench_run run = {
+		.cfg = cfg,
+		.profile = p,
+		.tx = { .name = cfg->tx_ifname, .sock = -1 },
+		.n_rx = cfg->n_rx,
+	};
+	int64_t proc_cpu, sys_cpu;
+	pthread_t thread;
+	unsigned int i;
+	int err;
+
+	for (i = 0; i < run.n_rx; i++) {
+		run.rx[i].name = cfg->rx_ifname[i];
+		run.rx[i].sock = -1;
+	}
+
+	if (p) {
+		run.n = cfg->frames;
+		run.len = cfg->len ?: (p->fd ? CANFD_MAX_DLEN : CAN_MAX_DLEN);
+		if (!p->fd && run.len > CAN_MAX_DLEN)
+			run.len = CAN_MAX_DLEN;
+		run.send_ns = calloc(run.n, sizeof(*run.send_ns));
+		run.echo_sw_ns = calloc(run.n, sizeof(*run.echo_sw_ns));
+		run.echo_hw_ns = calloc(run.n, sizeof(*run.echo_hw_ns));
+		if (!run.send_ns || !run.echo_sw_ns || !run.echo_hw_ns) {
+			err = -ENOMEM;
+			goto out;
+		}
+		err = kvaser_bench_open(&run.tx, true);
+		if (err)
+			goto out;
+		if (p->fd && !run.tx.fd_capable) {
+			fprintf(stderr, "%s: not in CAN FD mode, skipping %s\n",
+				run.tx.name, p->name);
+			err = 0;
+			goto out;
+		}
+		kvaser_bench_read_stats(&run.tx, 0);
+	}
+
+	for (i = 0; i < run.n_rx; i++) {
+		err = kvaser_bench_open(&run.rx[i], false);
+		if (err)
+			goto out;
+		if (p) {
+			run.rx[i].hw_by_seq = calloc(run.n, sizeof(int64_t));
+			if (!run.rx[i].hw_by_seq) {
+				err = -ENOMEM;
+				goto out;
+			}
+		}
+		kvaser_bench_read_stats(&run.rx[i], 0);
+	}
+
+	if (cfg->verbose)
+		fprintf(stderr, "running %s\n", p ? p->name : "rx-only");
+
+	err = pthread_create(&thread, NULL, kvaser_bench_rx_thread, &run);
+	if (err) {
+		err = -err;
+		goto out;
+	}
+
+	proc_cpu = kvaser_bench_process_cpu_ns();
+	sys_cpu = kvaser_bench_system_cpu_ns();
+	run.start_ns = kvaser_bench_now(CLOCK_MONOTONIC);
+	if (p)
+		err = kvaser_bench_tx(&run);
+	else
+		sleep(cfg->rx_only_s);
+	run.end_ns = kvaser_bench_now(CLOCK_MONOTONIC);
+
+	/* Echoes and Rx still in flight */
+	usleep(cfg->settle_ms * 1000);
+	run.stop = true;
+	pthread_join(thread, NULL);
+	proc_cpu = kvaser_bench_process_cpu_ns() - proc_cpu;
+	sys_cpu = kvaser_bench_system_cpu_ns() - sys_cpu;
+
+	if (p)
+		kvaser_bench_read_stats(&run.tx, 1);
+	for (i = 0; i < run.n_rx; i++)
+		kvaser_bench_read_stats(&run.rx[i], 1);
+
+	if (!err)
+		kvaser_bench_report(out, &run, proc_cpu, sys_cpu, last);
+
+out:
+	kvaser_bench_run_free(&run);
+	return err;
+}
+
+static void kvaser_bench_json_string(FILE *out, const char *s)
+{
+	for (; *s; s++) {
+		if (*s == '"' || *s == '\\')
+			fprintf(out, "\\%c", *s);
+		else if ((unsigned char)*s < 0x20)
+			fprintf(out, "\\u%04x", *s);
+		else
+			fputc(*s, out);
+	}
+}
+
+static void kvaser_bench_json_driver(FILE *out, const char *ifname)
+{
+	char path[320], link[256], version[64] = "";
+	const char *driver = "";
+	FILE *f;
+	ssize_t n;
+
+	snprintf(path, sizeof(path), "/sys/class/net/%s/device/driver",
+		 ifname);
+	n = readlink(path, link, sizeof(link) - 1);
+	if (n > 0) {
+		link[n] = '\0';
+		driver = strrchr(link, '/') ? strrchr(link, '/') + 1 : link;
+		snprintf(path, sizeof(path), "/sys/module/%s/version", driver);
+		f = fopen(path, "r");
+		if (f) {
+			if (fscanf(f, "%63s", version) != 1)
+				version[0] = '\0';
+			fclose(f);
+		}
+	}
+	fprintf(out, " \"%s\": { \"driver\": \"%s\", \"version\": \"%s\" }",
+		ifname, driver, version);
+}
+
+static void kvaser_bench_usage(const char *prog)
+{
+	fprintf(stderr,
+		"Usage: %s [options] -t TX_IF [-r RX_IF]...\n"
+		"       %s [options] -r RX_IF [-r RX_IF]...\n"
+		"  -t, --tx IF          interface to send on\n"
+		"  -r, --rx IF          interface to receive on, up to %d\n"
+		"  -p, --profile NAME   <classic|fd>-<11|29>-<steady|burst>, or all\n"
+		"                       (default all, repeat for several)\n"
+		"  -n, --frames N       frames per profile (default 10000)\n"
+		"  -R, --rate N         steady: frames/s (default 1000)\n"
+		"  -b, --burst N        burst: frames per burst (default 64)\n"
+		"  -g, --gap MS         burst: ms between burst starts (default 10)\n"
+		"  -l, --len N          payload length, at least 4 (default 8, 64 for FD)\n"
+		"  -B, --no-brs         CAN FD without bit rate switch\n"
+		"  -s, --settle MS      wait for echoes and Rx after sending (default 500)\n"
+		"  -T, --rx-time S      without -t: seconds to receive (default 10)\n"
+		"  -u, --unrelated      Rx interfaces are not on the Tx bus\n"
+		"  -L, --label TEXT     stored in the report, e.g. a commit id\n"
+		"  -o, --output FILE    write the JSON report to FILE (default stdout)\n"
+		"  -v, --verbose        print progress to stderr\n",
+		prog, prog, KVASER_BENCH_MAX_RX);
+}
+
+int main(int argc, char *argv[])
+{
+	static const struct option options[] = {
+		{ "tx", required_argument, NULL, 't' },
+		{ "rx", required_argument, NULL, 'r' },
+		{ "profile", required_argument, NULL, 'p' },
+		{ "frames", required_argument, NULL, 'n' },
+		{ "rate", required_argument, NULL, 'R' },
+		{ "burst", required_argument, NULL, 'b' },
+		{ "gap", required_argument, NULL, 'g' },
+		{ "len", required_argument, NULL, 'l' },
+		{ "no-brs", no_argument, NULL, 'B' },
+		{ "settle", required_argument, NULL, 's' },
+		{ "rx-time", required_argument, NULL, 'T' },
+		{ "unrelated", no_argument, NULL, 'u' },
+		{ "label", required_argument, NULL, 'L' },
+		{ "output", required_argument, NULL, 'o' },
+		{ "verbose", no_argument, NULL, 'v' },
+		{ "help", no_argument, NULL, 'h' },
+		{ }
+	};
+	struct kvaser_bench_config cfg = {
+		.frames = 10000,
+		.rate = 1000,
+		.burst = 64,
+		.gap_ms = 10,
+		.settle_ms = 500,
+		.rx_only_s = 10,
+	};
+	const char *output = NULL;
+	struct utsname uts;
+	FILE *out = stdout;
+	unsigned int i;
+	int opt, err = 0;
+
+	while ((opt = getopt_long(argc, argv, "t:r:p:n:R:b:g:l:Bs:T:uL:o:vh",
+				  options, NULL)) != -1) {
+		switch (opt) {
+		case 't':
+			cfg.tx_ifname = optarg;
+			break;
+		case 'r':
+			if (cfg.n_rx == KVASER_BENCH_MAX_RX) {
+				fprintf(stderr, "At most %d Rx interfaces\n",
+					KVASER_BENCH_MAX_RX);
+				return EXIT_FAILURE;
+			}
+			cfg.rx_ifname[cfg.n_rx++] = optarg;
+			break;
+		case 'p':
+			if (!strcmp(optarg, "all")) {
+				kvaser_bench_all_profiles(&cfg);
+				break;
+			}
+			if (cfg.n_profiles == KVASER_BENCH_MAX_PROFILES ||
+			    kvaser_bench_parse_profile
+					(optarg, &cfg.profiles[cfg.n_profiles])) {
+				fprintf(stderr, "Bad profile %s\n", optarg);
+				return EXIT_FAILURE;
+			}
+			cfg.n_profiles++;
+			break;
+		case 'n':
+			cfg.frames = strtoul(optarg, NULL, 0);
+			break;
+		case 'R':
+			cfg.rate = strtoul(optarg, NULL, 0);
+			break;
+		case 'b':
+			cfg.burst = strtoul(optarg, NULL, 0);
+			break;
+		case 'g':
+			cfg.gap_ms = strtoul(optarg, NULL, 0);
+			break;
+		case 'l':
+			cfg.len = strtoul(optarg, NULL, 0);
+			if (cfg.len < KVASER_BENCH_SEQ_LEN ||
+			    cfg.len > CANFD_MAX_DLEN ||
+			    (cfg.len > CAN_MAX_DLEN && cfg.len % 4)) {
+				fprintf(stderr, "Bad payload length %s\n",
+					optarg);
+				return EXIT_FAILURE;
+			}
+			break;
+		case 'B':
+			cfg.no_brs = true;
+			break;
+		case 's':
+			cfg.settle_ms = strtoul(optarg, NULL, 0);
+			break;
+		case 'T':
+			cfg.rx_only_s = strtoul(optarg, NULL, 0);
+			break;
+		case 'u':
+			cfg.independent = true;
+			break;
+		case 'L':
+			cfg.label = optarg;
+			break;
+		case 'o':
+			output = optarg;
+			break;
+		case 'v':
+			cfg.verbose = true;
+			break;
+		default:
+			kvaser_bench_usage(argv[0]);
+			return opt == 'h' ? EXIT_SUCCESS : EXIT_FAILURE;
+		}
+	}
+
+	if ((!cfg.tx_ifname && !cfg.n_rx) || optind != argc || !cfg.frames ||
+	    !cfg.rate || !cfg.burst) {
+		kvaser_bench_usage(argv[0]);
+		return EXIT_FAILURE;
+	}
+	for (i = 0; i < cfg.n_rx; i++) {
+		if (cfg.tx_ifname && !strcmp(cfg.tx_ifname, cfg.rx_ifname[i])) {
+			fprintf(stderr,
+				"%s: Rx must be on another interface than Tx\n",
+				cfg.rx_ifname[i]);
+			return EXIT_FAILURE;
+		}
+	}
+	if (cfg.tx_ifname && !cfg.n_profiles)
+		kvaser_bench_all_profiles(&cfg);
+
+	if (output) {
+		out = fopen(output, "w");
+		if (!out) {
+			perror(output);
+			return EXIT_FAILURE;
+		}
+	}
+
+	uname(&uts);
+	fprintf(out, "{\n  \"tool\": \"kvaser_bench\",\n  \"version\": 1,\n");
+	fprintf(out, "  \"label\": \"");
+	kvaser_bench_json_string(out, cfg.label ?: "");
+	fprintf(out, "\",\n");
+	fprintf(out, "  \"kernel\": \"%s\",\n", uts.release);
+	fprintf(out, "  \"time\": %lld,\n",
+		(long long)(kvaser_bench_now(CLOCK_REALTIME) / 1000000000));
+	fprintf(out, "  \"interfaces\": {");
+	if (cfg.tx_ifname)
+		kvaser_bench_json_driver(out, cfg.tx_ifname);
+	for (i = 0; i < cfg.n_rx; i++) {
+		if (cfg.tx_ifname || i)
+			fprintf(out, ",");
+		kvaser_bench_json_driver(out, cfg.rx_ifname[i]);
+	}
+	fprintf(out, " },\n  \"results\": [\n");
+
+	if (!cfg.tx_ifname) {
+		err = kvaser_bench_run(out, &cfg, NULL, true);
+	} else {
+		for (i = 0; i < cfg.n_profiles && !err; i++)
+			err = kvaser_bench_run(out, &cfg, &cfg.profiles[i],
+					       i == cfg.n_profiles - 1);
+	}
+
+	fprintf(out, "  ]\n}\n");
+	if (out != stdout)
+		fclose(out);
+
+	return err ? EXIT_FAILURE : EXIT_SUCCESS;
+}
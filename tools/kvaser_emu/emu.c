@@ -0,0 +1,504 @@
+// SPDX-License-Identifier: GPL-2.0 OR BSD-2-Clause
+/* Kvaser USB device emulator, family independent part: the IN queue, the
+ * bus timing and the generated Rx traffic.
+ *
+ * Each started channel is a bus that carries one frame at a time. Tx frames
+ * from the host and generated Rx frames take turns, a Tx frame wins a tie.
+ * A frame occupies the bus for its length in bits at the configured bit
+ * rates, ignoring stuff bits, and is reported to the host when it ends.
+ * Nothing happens between calls: kvaser_emu_in() plays the bus forward to
+ * the time it is given.
+ */
+
+#include <errno.h>
+#include <stdlib.h>
+
+#include "emu_priv.h"
+
+#define KVASER_EMU_DEFAULT_BITRATE	500000
+
+void kvaser_emu_default_config(struct kvaser_emu_config *cfg,
+			       enum kvaser_emu_family family)
+{
+	memset(cfg, 0, sizeof(*cfg));
+	cfg->family = family;
+	cfg->serial = 12345;
+
+	switch (family) {
+	case KVASER_EMU_HYDRA:
+		cfg->nchannels = 2;
+		cfg->max_packet = 512;
+		cfg->max_outstanding_tx = 200;
+		cfg->ext_cmd = true;
+		cfg->canfd = true;
+		cfg->ext_cap = true;
+		cfg->clock_mhz = 80;
+		break;
+	case KVASER_EMU_LEAF:
+		cfg->nchannels = 1;
+		cfg->max_packet = 512;
+		cfg->max_outstanding_tx = 48;
+		cfg->ext_cap = true;
+		cfg->clock_mhz = 16;
+		break;
+	case KVASER_EMU_USBCAN:
+		cfg->nchannels = 2;
+		cfg->max_packet = 64;
+		cfg->max_outstanding_tx = 16;
+		cfg->clock_mhz = 8;
+		break;
+	}
+
+	cfg->rx.len = 8;
+}
+
+struct kvaser_emu *kvaser_emu_create(const struct kvaser_emu_config *cfg)
+{
+	struct kvaser_emu *emu;
+	const struct kvaser_emu_ops *ops;
+
+	switch (cfg->family) {
+	case KVASER_EMU_HYDRA:
+		ops = &kvaser_emu_hydra_ops;
+		break;
+	case KVASER_EMU_LEAF:
+		ops = &kvaser_emu_leaf_ops;
+		break;
+	case KVASER_EMU_USBCAN:
+		ops = &kvaser_emu_usbcan_ops;
+		break;
+	default:
+		errno = EOPNOTSUPP;
+		return NULL;
+	}
+
+	if (!cfg->nchannels || cfg->nchannels > KVASER_EMU_MAX_CHANNELS ||
+	    !cfg->max_packet || !cfg->max_outstanding_tx ||
+	    cfg->max_outstanding_tx > KVASER_EMU_MAX_TX ||
+	    (cfg->family == KVASER_EMU_USBCAN && cfg->nchannels > 2)) {
+		errno = EINVAL;
+		return NULL;
+	}
+
+	emu = calloc(1, sizeof(*emu));
+	if (!emu)
+		return NULL;
+
+	emu->queue = calloc(KVASER_EMU_QUEUE_LEN, sizeof(*emu->queue));
+	if (!emu->queue) {
+		free(emu);
+		return NULL;
+	}
+
+	emu->cfg = *cfg;
+	emu->ops = ops;
+
+	return emu;
+}
+
+void kvaser_emu_destroy(struct kvaser_emu *emu)
+{
+	if (!emu)
+		return;
+
+	free(emu->queue);
+	free(emu);
+}
+
+const struct kvaser_emu_stats *kvaser_emu_stats(const struct kvaser_emu *emu)
+{
+	return &emu->stats;
+}
+
+uint8_t *kvaser_emu_queue_cmd(struct kvaser_emu *emu, size_t len)
+{
+	struct kvaser_emu_cmd *cmd;
+
+	if (len > KVASER_EMU_MAX_CMD_LEN)
+		return NULL;
+
+	if (emu->queue_count == KVASER_EMU_QUEUE_LEN) {
+		emu->stats.overruns++;
+		return NULL;
+	}
+
+	cmd = &emu->queue[(emu->queue_head + emu->queue_count) %
+			  KVASER_EMU_QUEUE_LEN];
+	emu->queue_count++;
+	memset(cmd->data, 0, len);
+	cmd->len = len;
+
+	return cmd->data;
+}
+
+void kvaser_emu_queue_tx(struct kvaser_emu *emu, unsigned int channel,
+			 const struct kvaser_emu_tx *tx)
+{
+	struct kvaser_emu_channel *ch = &emu->channels[channel];
+
+	emu->stats.tx_frames++;
+
+	/* A host that ignores max_outstanding_tx loses frames, like it
+	 * would with a real device
+	 */
+	if (ch->tx_count == KVASER_EMU_MAX_TX) {
+		emu->stats.overruns++;
+		return;
+	}
+
+	ch->tx[(ch->tx_head + ch->tx_count) % KVASER_EMU_MAX_TX] = *tx;
+	ch->tx_count++;
+}
+
+void kvaser_emu_flush_tx(struct kvaser_emu *emu, unsigned int channel)
+{
+	struct kvaser_emu_channel *ch = &emu->channels[channel];
+
+	ch->tx_head = 0;
+	ch->tx_count = 0;
+}
+
+void kvaser_emu_bus_on(struct kvaser_emu *emu, unsigned int channel,
+		       uint64_t now_ns)
+{
+	struct kvaser_emu_channel *ch = &emu->channels[channel];
+
+	if (ch->on_bus)
+		return;
+
+	ch->on_bus = true;
+	ch->bus_free_ns = now_ns;
+	ch->next_rx_ns = now_ns;
+	ch->burst_left = emu->cfg.rx.burst > 1 ? emu->cfg.rx.burst : 1;
+}
+
+void kvaser_emu_bus_off(struct kvaser_emu *emu, unsigned int channel)
+{
+	emu->channels[channel].on_bus = false;
+	kvaser_emu_flush_tx(emu, channel);
+}
+
+static uint32_t kvaser_emu_bitrate(const uint8_t *busparams)
+{
+	uint32_t bitrate = kvaser_emu_get_le32(busparams);
+
+	return bitrate ? bitrate : KVASER_EMU_DEFAULT_BITRATE;
+}
+
+/* Time on the bus, without stuff bits */
+static uint64_t kvaser_emu_frame_ns(const struct kvaser_emu_channel *ch,
+				    const struct kvaser_emu_frame *frame)
+{
+	uint64_t bitrate = kvaser_emu_bitrate(ch->busparams);
+	uint64_t data_bitrate = bitrate;
+	unsigned int nominal_bits;
+	unsigned int data_bits = 0;
+	unsigned int len = frame->rtr ? 0 : frame->len;
+
+	if (!frame->fd) {
+		/* SOF, arbitration, control, data, CRC, ACK, EOF and IFS */
+		nominal_bits = (frame->ext_id ? 67 : 47) + 8 * len;
+	} else {
+		/* SOF, arbitration and control up to BRS, CRC delimiter,
+		 * ACK, EOF and IFS at the nominal rate. ESI, DLC, data,
+		 * stuff count and CRC in the data phase.
+		 */
+		nominal_bits = (frame->ext_id ? 36 : 17) + 13;
+		data_bits = 9 + 8 * len + (len > 16 ? 21 : 17);
+		if (frame->brs)
+			data_bitrate = kvaser_emu_bitrate(ch->busparams_data);
+	}
+
+	return nominal_bits * 1000000000ULL / bitrate +
+	       data_bits * 1000000000ULL / data_bitrate;
+}
+
+/* The generated traffic counts up like cangen -I i -D i */
+static void kvaser_emu_rx_frame(const struct kvaser_emu *emu,
+				const struct kvaser_emu_channel *ch,
+				struct kvaser_emu_frame *frame)
+{
+	const struct kvaser_emu_traffic *rx = &emu->cfg.rx;
+	bool fd = rx->fd && emu->cfg.canfd;
+	unsigned int i;
+
+	memset(frame, 0, sizeof(*frame));
+	frame->ext_id = rx->ext_id;
+	frame->fd = fd;
+	frame->brs = fd && rx->brs;
+	frame->id = ch->rx_seq & (rx->ext_id ? 0x1fffffff : 0x7ff);
+	frame->len = rx->len > (fd ? 64 : 8) ? (fd ? 64 : 8) : rx->len;
+
+	for (i = 0; i < frame->len; i++)
+		frame->data[i] = ch->rx_seq >> (8 * (i % 4));
+}
+
+static bool kvaser_emu_rx_enabled(const struct kvaser_emu *emu,
+				  const struct kvaser_emu_channel *ch)
+{
+	return emu->cfg.rx.rate && ch->state != KVASER_EMU_EVENT_BUS_OFF;
+}
+
+/* End of the next frame on the channel's bus, UINT64_MAX if it is idle.
+ * @frame is the generated Rx frame, or NULL if the host's Tx frame is next.
+ */
+static uint64_t kvaser_emu_next_frame(const struct kvaser_emu *emu,
+				      const struct kvaser_emu_channel *ch,
+				      struct kvaser_emu_frame *frame,
+				      bool *is_tx)
+{
+	uint64_t tx_start = UINT64_MAX;
+	uint64_t rx_start = UINT64_MAX;
+
+	if (!ch->on_bus || ch->state == KVASER_EMU_EVENT_BUS_OFF)
+		return UINT64_MAX;
+
+	if (ch->tx_count) {
+		const struct kvaser_emu_tx *tx = &ch->tx[ch->tx_head];
+
+		tx_start = tx->ready_ns > ch->bus_free_ns ?
+			   tx->ready_ns : ch->bus_free_ns;
+	}
+
+	if (kvaser_emu_rx_enabled(emu, ch))
+		rx_start = ch->next_rx_ns > ch->bus_free_ns ?
+			   ch->next_rx_ns : ch->bus_free_ns;
+
+	if (tx_start != UINT64_MAX && tx_start <= rx_start) {
+		*is_tx = true;
+		return tx_start + kvaser_emu_frame_ns(ch,
+						      &ch->tx[ch->tx_head].frame);
+	}
+
+	if (rx_start == UINT64_MAX)
+		return UINT64_MAX;
+
+	*is_tx = false;
+	kvaser_emu_rx_frame(emu, ch, frame);
+
+	return rx_start + kvaser_emu_frame_ns(ch, frame);
+}
+
+static void kvaser_emu_schedule_rx(struct kvaser_emu *emu,
+				   struct kvaser_emu_channel *ch,
+				   uint64_t end_ns)
+{
+	const struct kvaser_emu_traffic *rx = &emu->cfg.rx;
+	uint32_t burst = rx->burst > 1 ? rx->burst : 1;
+
+	if (rx->rate == KVASER_EMU_LINE_RATE) {
+		ch->next_rx_ns = end_ns;
+		return;
+	}
+
+	/* A burst goes out back to back, then the bus rests */
+	if (--ch->burst_left)
+		return;
+
+	ch->burst_left = burst;
+	ch->next_rx_ns += burst * (1000000000ULL / rx->rate);
+}
+
+static void kvaser_emu_catch_up(struct kvaser_emu_channel *ch,
+				uint64_t now_ns)
+{
+	/* Do not replay more than a second of traffic nobody waited for */
+	if (now_ns > KVASER_EMU_MAX_CATCH_UP_NS &&
+	    ch->bus_free_ns < now_ns - KVASER_EMU_MAX_CATCH_UP_NS) {
+		ch->bus_free_ns = now_ns - KVASER_EMU_MAX_CATCH_UP_NS;
+		if (ch->next_rx_ns < ch->bus_free_ns)
+			ch->next_rx_ns = ch->bus_free_ns;
+	}
+}
+
+/* Plays all buses forward to @now_ns, reporting frames in the order they
+ * end like the device does
+ */
+static void kvaser_emu_run(struct kvaser_emu *emu, uint64_t now_ns)
+{
+	unsigned int i;
+
+	for (i = 0; i < emu->cfg.nchannels; i++)
+		kvaser_emu_catch_up(&emu->channels[i], now_ns);
+
+	for (;;) {
+		struct kvaser_emu_frame frame, next_frame;
+		struct kvaser_emu_channel *ch;
+		uint64_t end = UINT64_MAX;
+		unsigned int channel = 0;
+		bool is_tx = false;
+
+		for (i = 0; i < emu->cfg.nchannels; i++) {
+			bool tx;
+			uint64_t e = kvaser_emu_next_frame(emu,
+							   &emu->channels[i],
+							   &frame, &tx);
+
+			if (e < end) {
+				end = e;
+				channel = i;
+				is_tx = tx;
+				next_frame = frame;
+			}
+		}
+
+		if (end > now_ns)
+			break;
+
+		ch = &emu->channels[channel];
+		if (is_tx) {
+			const struct kvaser_emu_tx *tx = &ch->tx[ch->tx_head];
+
+			if (!emu->cfg.no_tx_ack) {
+				emu->ops->tx_ack(emu, channel, tx, end);
+				emu->stats.tx_acks++;
+			}
+			ch->tx_head = (ch->tx_head + 1) % KVASER_EMU_MAX_TX;
+			ch->tx_count--;
+		} else {
+			emu->ops->rx_frame(emu, channel, &next_frame, end);
+			emu->stats.rx_frames++;
+			ch->rx_seq++;
+			kvaser_emu_schedule_rx(emu, ch, end);
+		}
+		ch->bus_free_ns = end;
+	}
+}
+
+uint64_t kvaser_emu_next_event(const struct kvaser_emu *emu)
+{
+	uint64_t next = UINT64_MAX;
+	unsigned int i;
+
+	if (emu->queue_count)
+		return 0;
+
+	for (i = 0; i < emu->cfg.nchannels; i++) {
+		struct kvaser_emu_frame frame;
+		bool is_tx;
+		uint64_t end = kvaser_emu_next_frame(emu, &emu->channels[i],
+						     &frame, &is_tx);
+
+		if (end < next)
+			next = end;
+	}
+
+	return next;
+}
+
+int kvaser_emu_event(struct kvaser_emu *emu, unsigned int channel,
+		     enum kvaser_emu_event event, uint64_t now_ns)
+{
+	if (channel >= emu->cfg.nchannels || !emu->ops->event)
+		return -1;
+
+	return emu->ops->event(emu, channel, event, now_ns);
+}
+
+int kvaser_emu_out(struct kvaser_emu *emu, const void *buf, size_t len,
+		   uint64_t now_ns)
+{
+	const uint8_t *data = buf;
+	size_t pos = 0;
+	int cmds = 0;
+
+	while (pos < len) {
+		int cmd_len = emu->ops->cmd_size(data + pos, len - pos);
+
+		if (cmd_len <= 0 || pos + cmd_len > len) {
+			emu->stats.format_errors++;
+			return -1;
+		}
+
+		emu->ops->handle_cmd(emu, data + pos, cmd_len, now_ns);
+		emu->stats.cmds_out++;
+		pos += cmd_len;
+		cmds++;
+	}
+
+	return cmds;
+}
+
+/* Leaf firmware never lets a command cross a wMaxPacketSize boundary. A
+ * zero length byte in front of the boundary tells the host to skip to it.
+ */
+static size_t kvaser_emu_fill_packets(struct kvaser_emu *emu, uint8_t *buf,
+				      size_t len)
+{
+	size_t max_packet = emu->cfg.max_packet;
+	size_t pos = 0;
+
+	while (emu->queue_count) {
+		const struct kvaser_emu_cmd *cmd = &emu->queue[emu->queue_head];
+		size_t room = max_packet - pos % max_packet;
+
+		if (cmd->len > room) {
+			size_t boundary = pos + room;
+
+			if (boundary >= len)
+				break;
+
+			memset(buf + pos, 0, room);
+			emu->stats.placeholders++;
+			pos = boundary;
+			continue;
+		}
+
+		if (pos + cmd->len > len)
+			break;
+
+		memcpy(buf + pos, cmd->data, cmd->len);
+		pos += cmd->len;
+		emu->queue_head = (emu->queue_head + 1) % KVASER_EMU_QUEUE_LEN;
+		emu->queue_count--;
+		emu->stats.cmds_in++;
+	}
+
+	return pos;
+}
+
+/* Hydra firmware fills the transfer and continues a command in the next */
+static size_t kvaser_emu_fill_stream(struct kvaser_emu *emu, uint8_t *buf,
+				     size_t len)
+{
+	size_t pos = 0;
+
+	while (emu->queue_count && pos < len) {
+		const struct kvaser_emu_cmd *cmd = &emu->queue[emu->queue_head];
+		size_t n = cmd->len - emu->queue_sent;
+
+		if (n > len - pos)
+			n = len - pos;
+
+		memcpy(buf + pos, cmd->data + emu->queue_sent, n);
+		pos += n;
+		emu->queue_sent += n;
+
+		if (emu->queue_sent == cmd->len) {
+			emu->queue_sent = 0;
+			emu->queue_head = (emu->queue_head + 1) %
+					  KVASER_EMU_QUEUE_LEN;
+			emu->queue_count--;
+			emu->stats.cmds_in++;
+		}
+	}
+
+	return pos;
+}
+
+size_t kvaser_emu_in(struct kvaser_emu *emu, void *buf, size_t len,
+		     uint64_t now_ns)
+{
+	size_t n;
+
+	kvaser_emu_run(emu, now_ns);
+
+	if (emu->ops->placeholders)
+		n = kvaser_emu_fill_packets(emu, buf, len);
+	else
+		n = kvaser_emu_fill_stream(emu, buf, len);
+
+	emu->stats.bytes_in += n;
+
+	return n;
+}
@@ -0,0 +1,613 @@
+// SPDX-License-Identifier: GPL-2.0 OR BSD-2-Clause
+/* Kvaser USB device emulator, hydra firmware model.
+ *
+ * Command layouts and numbers follow kvaser_usb_hydra.c. Every command the
+ * host sends during probe, bus parameter setup and start/stop is answered
+ * the way the firmware does; commands the model does not know are counted
+ * and ignored, like the firmware ignores them.
+ */
+
+#include "emu_priv.h"
+
+#define CMD_SET_BUSPARAMS_REQ			16
+#define CMD_GET_BUSPARAMS_REQ			17
+#define CMD_GET_BUSPARAMS_RESP			18
+#define CMD_GET_CHIP_STATE_REQ			19
+#define CMD_CHIP_STATE_EVENT			20
+#define CMD_SET_DRIVERMODE_REQ			21
+#define CMD_START_CHIP_REQ			26
+#define CMD_START_CHIP_RESP			27
+#define CMD_STOP_CHIP_REQ			28
+#define CMD_STOP_CHIP_RESP			29
+#define CMD_TX_CAN_MESSAGE			33
+#define CMD_GET_CARD_INFO_REQ			34
+#define CMD_GET_CARD_INFO_RESP			35
+#define CMD_GET_SOFTWARE_INFO_REQ		38
+#define CMD_GET_SOFTWARE_INFO_RESP		39
+#define CMD_FLUSH_QUEUE				48
+#define CMD_TX_ACKNOWLEDGE			50
+#define CMD_FLUSH_QUEUE_RESP			66
+#define CMD_SET_BUSPARAMS_FD_REQ		69
+#define CMD_SET_BUSPARAMS_FD_RESP		70
+#define CMD_SET_BUSPARAMS_RESP			85
+#define CMD_GET_CAPABILITIES_REQ		95
+#define CMD_GET_CAPABILITIES_RESP		96
+#define CMD_RX_MESSAGE				106
+#define CMD_MAP_CHANNEL_REQ			200
+#define CMD_MAP_CHANNEL_RESP			201
+#define CMD_GET_SOFTWARE_DETAILS_REQ		202
+#define CMD_GET_SOFTWARE_DETAILS_RESP		203
+#define CMD_EXTENDED				255
+
+#define CMD_TX_CAN_MESSAGE_FD			224
+#define CMD_TX_ACKNOWLEDGE_FD			225
+#define CMD_RX_MESSAGE_FD			226
+
+#define HYDRA_CMD_LEN				32
+#define HYDRA_CMD_EXT_HEADER_LEN		8
+#define HYDRA_CMD_SIZE_BYTES			6
+#define HYDRA_TRANSID_MASK			0x0fff
+#define HYDRA_HE_ADDR_DEST_MASK			0x3f
+
+#define HYDRA_TRANSID_CANHE			0x40
+#define HYDRA_TRANSID_SYSDBG			0x61
+
+/* HE addresses the model hands out, any value but ROUTER and ILLEGAL works */
+#define HYDRA_HE_CAN_BASE			0x21
+#define HYDRA_HE_SYSDBG				0x30
+
+#define HYDRA_SW_FLAG_FREQ_80M			(1U << 5)
+#define HYDRA_SW_FLAG_EXT_CMD			(1U << 9)
+#define HYDRA_SW_FLAG_CANFD			(1U << 10)
+#define HYDRA_SW_FLAG_EXT_CAP			(1U << 12)
+
+#define HYDRA_CAP_CMD_LISTEN_MODE		0x02
+#define HYDRA_CAP_CMD_ERR_REPORT		0x05
+#define HYDRA_CAP_CMD_ONE_SHOT			0x06
+#define HYDRA_CAP_STAT_OK			0x00
+#define HYDRA_CAP_STAT_NOT_IMPL			0x01
+
+#define HYDRA_BUS_ERR_PASS			(1U << 5)
+#define HYDRA_BUS_BUS_OFF			(1U << 6)
+
+#define HYDRA_BUSPARAM_TYPE_CANFD		0x01
+#define HYDRA_CTRLMODE_LISTEN			0x02
+
+#define HYDRA_EXTENDED_FRAME_ID			(1U << 31)
+#define HYDRA_CF_FLAG_REMOTE_FRAME		(1U << 4)
+#define HYDRA_CF_FLAG_EXTENDED_ID		(1U << 5)
+#define HYDRA_CF_FLAG_TX_ACK			(1U << 6)
+#define HYDRA_CF_FLAG_FDF			(1U << 16)
+#define HYDRA_CF_FLAG_BRS			(1U << 17)
+#define HYDRA_KCAN_DATA_DLC_SHIFT		8
+#define HYDRA_KCAN_DATA_BRS			(1U << 14)
+#define HYDRA_KCAN_DATA_FDF			(1U << 15)
+#define HYDRA_KCAN_DATA_RTR			(1U << 29)
+#define HYDRA_KCAN_DATA_IDE			(1U << 30)
+
+/* Offsets into a command, the payload union starts after the header */
+#define HYDRA_OFF_PAYLOAD			4
+#define HYDRA_OFF_EXT_LEN			4
+#define HYDRA_OFF_EXT_CMD_NO			6
+#define HYDRA_OFF_EXT_PAYLOAD			8
+
+static const uint8_t hydra_fd_len2dlc[65] = {
+	0, 1, 2, 3, 4, 5, 6, 7, 8,
+	9, 9, 9, 9, 10, 10, 10, 10, 11, 11, 11, 11, 12, 12, 12, 12,
+	13, 13, 13, 13, 13, 13, 13, 13, 14, 14, 14, 14, 14, 14, 14, 14,
+	14, 14, 14, 14, 14, 14, 14, 14, 15, 15, 15, 15, 15, 15, 15, 15,
+	15, 15, 15, 15, 15, 15, 15, 15,
+};
+
+static const uint8_t hydra_fd_dlc2len[16] = {
+	0, 1, 2, 3, 4, 5, 6, 7, 8, 12, 16, 20, 24, 32, 48, 64,
+};
+
+static int hydra_cmd_size(const uint8_t *buf, size_t avail)
+{
+	size_t len;
+
+	if (buf[0] != CMD_EXTENDED)
+		return HYDRA_CMD_LEN;
+
+	if (avail < HYDRA_CMD_SIZE_BYTES)
+		return 0;
+
+	len = kvaser_emu_get_le16(buf + HYDRA_OFF_EXT_LEN);
+	if (len < HYDRA_CMD_EXT_HEADER_LEN || len > KVASER_EMU_MAX_CMD_LEN)
+		return -1;
+
+	return len;
+}
+
+static uint16_t hydra_transid(const uint8_t *cmd)
+{
+	return kvaser_emu_get_le16(cmd + 2) & HYDRA_TRANSID_MASK;
+}
+
+static int hydra_channel_from_he(const struct kvaser_emu *emu, uint8_t he)
+{
+	unsigned int i;
+
+	for (i = 0; i < emu->cfg.nchannels; i++) {
+		if (emu->he_addr[i] == he)
+			return i;
+	}
+
+	return -1;
+}
+
+/* Responses carry the HE they come from and the request's transid */
+static void hydra_set_header(uint8_t *cmd, uint8_t cmd_no, uint8_t src_he,
+			     uint16_t transid)
+{
+	cmd[0] = cmd_no;
+	cmd[1] = (src_he & 0x30) << 2;
+	kvaser_emu_put_le16(cmd + 2, (src_he & 0x0f) << 12 |
+			    (transid & HYDRA_TRANSID_MASK));
+}
+
+static uint8_t *hydra_reply(struct kvaser_emu *emu, uint8_t cmd_no,
+			    uint8_t src_he, uint16_t transid)
+{
+	uint8_t *resp = kvaser_emu_queue_cmd(emu, HYDRA_CMD_LEN);
+
+	if (resp)
+		hydra_set_header(resp, cmd_no, src_he, transid);
+
+	return resp;
+}
+
+static uint8_t hydra_bus_status(const struct kvaser_emu_channel *ch)
+{
+	switch (ch->state) {
+	case KVASER_EMU_EVENT_BUS_OFF:
+		return HYDRA_BUS_BUS_OFF;
+	case KVASER_EMU_EVENT_ERROR_PASSIVE:
+		return HYDRA_BUS_ERR_PASS;
+	default:
+		return 0;
+	}
+}
+
+static void hydra_chip_state_event(struct kvaser_emu *emu,
+				   unsigned int channel, uint16_t transid,
+				   uint64_t now_ns)
+{
+	const struct kvaser_emu_channel *ch = &emu->channels[channel];
+	uint8_t *resp;
+
+	resp = hydra_reply(emu, CMD_CHIP_STATE_EVENT, emu->he_addr[channel],
+			   transid);
+	if (!resp)
+		return;
+
+	kvaser_emu_put_ts48(resp + HYDRA_OFF_PAYLOAD,
+			    kvaser_emu_ticks(now_ns, emu->cfg.clock_mhz));
+	resp[HYDRA_OFF_PAYLOAD + 6] = ch->txerr;
+	resp[HYDRA_OFF_PAYLOAD + 7] = ch->rxerr;
+	resp[HYDRA_OFF_PAYLOAD + 8] = hydra_bus_status(ch);
+}
+
+static void hydra_map_channel(struct kvaser_emu *emu, const uint8_t *cmd)
+{
+	uint16_t transid = hydra_transid(cmd);
+	uint8_t *resp;
+	uint8_t he;
+
+	if (transid == HYDRA_TRANSID_SYSDBG) {
+		he = HYDRA_HE_SYSDBG;
+		emu->sysdbg_he = he;
+	} else if (transid >= HYDRA_TRANSID_CANHE &&
+		   transid < HYDRA_TRANSID_CANHE + KVASER_EMU_MAX_CHANNELS) {
+		unsigned int channel = transid - HYDRA_TRANSID_CANHE;
+
+		/* Channels the card does not have map to an unused HE, like
+		 * the firmware does
+		 */
+		he = HYDRA_HE_CAN_BASE + channel;
+		if (channel < emu->cfg.nchannels)
+			emu->he_addr[channel] = he;
+	} else {
+		emu->stats.unknown_cmds++;
+		return;
+	}
+
+	resp = hydra_reply(emu, CMD_MAP_CHANNEL_RESP, 0, transid);
+	if (!resp)
+		return;
+
+	resp[HYDRA_OFF_PAYLOAD] = he;
+	resp[HYDRA_OFF_PAYLOAD + 1] = cmd[HYDRA_OFF_PAYLOAD + 16];
+}
+
+static void hydra_software_info(struct kvaser_emu *emu, uint16_t transid)
+{
+	uint8_t *resp;
+
+	resp = hydra_reply(emu, CMD_GET_SOFTWARE_INFO_RESP, 0, transid);
+	if (resp)
+		kvaser_emu_put_le16(resp + HYDRA_OFF_PAYLOAD + 8,
+				    emu->cfg.max_outstanding_tx);
+}
+
+static void hydra_software_details(struct kvaser_emu *emu, uint16_t transid)
+{
+	uint32_t flags = 0;
+	uint8_t *resp;
+
+	resp = hydra_reply(emu, CMD_GET_SOFTWARE_DETAILS_RESP, 0, transid);
+	if (!resp)
+		return;
+
+	if (emu->cfg.clock_mhz == 80)
+		flags |= HYDRA_SW_FLAG_FREQ_80M;
+	if (emu->cfg.ext_cmd)
+		flags |= HYDRA_SW_FLAG_EXT_CMD;
+	if (emu->cfg.canfd)
+		flags |= HYDRA_SW_FLAG_CANFD;
+	if (emu->cfg.ext_cap)
+		flags |= HYDRA_SW_FLAG_EXT_CAP;
+
+	kvaser_emu_put_le32(resp + HYDRA_OFF_PAYLOAD, flags);
+	/* Firmware 5.0.0 */
+	kvaser_emu_put_le32(resp + HYDRA_OFF_PAYLOAD + 4, 0x05000000);
+	kvaser_emu_put_le32(resp + HYDRA_OFF_PAYLOAD + 20,
+			    emu->cfg.canfd ? 8000000 : 1000000);
+}
+
+static void hydra_card_info(struct kvaser_emu *emu, uint16_t transid)
+{
+	uint8_t *resp;
+
+	resp = hydra_reply(emu, CMD_GET_CARD_INFO_RESP, 0, transid);
+	if (!resp)
+		return;
+
+	kvaser_emu_put_le32(resp + HYDRA_OFF_PAYLOAD, emu->cfg.serial);
+	kvaser_emu_put_le32(resp + HYDRA_OFF_PAYLOAD + 4, 1000);
+	/* EAN 73-30130-00752-9, a USBcan Pro 2xHS v2 */
+	kvaser_emu_put_le32(resp + HYDRA_OFF_PAYLOAD + 12, 0x30007529);
+	kvaser_emu_put_le32(resp + HYDRA_OFF_PAYLOAD + 16, 0x00073301);
+	resp[HYDRA_OFF_PAYLOAD + 24] = emu->cfg.nchannels;
+}
+
+static void hydra_capability(struct kvaser_emu *emu, const uint8_t *cmd)
+{
+	uint16_t cap_cmd = kvaser_emu_get_le16(cmd + HYDRA_OFF_PAYLOAD);
+	uint32_t channels = (1U << emu->cfg.nchannels) - 1;
+	uint8_t *resp;
+
+	resp = hydra_reply(emu, CMD_GET_CAPABILITIES_RESP, emu->sysdbg_he,
+			   hydra_transid(cmd));
+	if (!resp)
+		return;
+
+	kvaser_emu_put_le16(resp + HYDRA_OFF_PAYLOAD, cap_cmd);
+
+	switch (cap_cmd) {
+	case HYDRA_CAP_CMD_LISTEN_MODE:
+	case HYDRA_CAP_CMD_ERR_REPORT:
+	case HYDRA_CAP_CMD_ONE_SHOT:
+		kvaser_emu_put_le16(resp + HYDRA_OFF_PAYLOAD + 2,
+				    HYDRA_CAP_STAT_OK);
+		kvaser_emu_put_le32(resp + HYDRA_OFF_PAYLOAD + 4, channels);
+		kvaser_emu_put_le32(resp + HYDRA_OFF_PAYLOAD + 8, channels);
+		break;
+	default:
+		kvaser_emu_put_le16(resp + HYDRA_OFF_PAYLOAD + 2,
+				    HYDRA_CAP_STAT_NOT_IMPL);
+		break;
+	}
+}
+
+static void hydra_tx_std(struct kvaser_emu *emu, unsigned int channel,
+			 const uint8_t *cmd, uint64_t now_ns)
+{
+	const uint8_t *p = cmd + HYDRA_OFF_PAYLOAD;
+	uint32_t id = kvaser_emu_get_le32(p);
+	struct kvaser_emu_tx tx = { 0 };
+
+	tx.frame.ext_id = id & HYDRA_EXTENDED_FRAME_ID;
+	tx.frame.id = id & ~HYDRA_EXTENDED_FRAME_ID;
+	tx.frame.len = p[12] > 8 ? 8 : p[12];
+	tx.frame.rtr = p[13] & HYDRA_CF_FLAG_REMOTE_FRAME;
+	memcpy(tx.frame.data, p + 4, tx.frame.len);
+	tx.ready_ns = now_ns;
+	tx.transid = hydra_transid(cmd);
+
+	kvaser_emu_queue_tx(emu, channel, &tx);
+}
+
+static void hydra_tx_ext(struct kvaser_emu *emu, unsigned int channel,
+			 const uint8_t *cmd, size_t len, uint64_t now_ns)
+{
+	const uint8_t *p = cmd + HYDRA_OFF_EXT_PAYLOAD;
+	uint32_t kcan_id = kvaser_emu_get_le32(p + 8);
+	uint32_t kcan_header = kvaser_emu_get_le32(p + 12);
+	uint8_t dlc = (kcan_header >> HYDRA_KCAN_DATA_DLC_SHIFT) & 0xf;
+	struct kvaser_emu_tx tx = { 0 };
+
+	tx.frame.ext_id = kcan_id & HYDRA_KCAN_DATA_IDE;
+	tx.frame.id = kvaser_emu_get_le32(p + 4);
+	tx.frame.fd = kcan_header & HYDRA_KCAN_DATA_FDF;
+	tx.frame.brs = kcan_header & HYDRA_KCAN_DATA_BRS;
+	tx.frame.rtr = kcan_id & HYDRA_KCAN_DATA_RTR;
+	tx.frame.len = tx.frame.fd ? hydra_fd_dlc2len[dlc] :
+				     (dlc > 8 ? 8 : dlc);
+	/* Never read past the command, whatever databytes claims */
+	if (HYDRA_OFF_EXT_PAYLOAD + 24U + tx.frame.len > len)
+		tx.frame.len = len - HYDRA_OFF_EXT_PAYLOAD - 24;
+	memcpy(tx.frame.data, p + 24, tx.frame.len);
+	tx.ready_ns = now_ns;
+	tx.transid = hydra_transid(cmd);
+	tx.ext = true;
+
+	kvaser_emu_queue_tx(emu, channel, &tx);
+}
+
+static void hydra_handle_ext(struct kvaser_emu *emu, const uint8_t *cmd,
+			     size_t len, uint64_t now_ns)
+{
+	int channel = hydra_channel_from_he(emu, cmd[1] &
+					    HYDRA_HE_ADDR_DEST_MASK);
+
+	if (cmd[HYDRA_OFF_EXT_CMD_NO] != CMD_TX_CAN_MESSAGE_FD ||
+	    len < HYDRA_OFF_EXT_PAYLOAD + 24 || channel < 0) {
+		emu->stats.unknown_cmds++;
+		return;
+	}
+
+	if (!emu->channels[channel].on_bus ||
+	    emu->channels[channel].listen_only)
+		return;
+
+	hydra_tx_ext(emu, channel, cmd, len, now_ns);
+}
+
+static void hydra_handle_channel_cmd(struct kvaser_emu *emu,
+				     unsigned int channel, const uint8_t *cmd,
+				     uint64_t now_ns)
+{
+	struct kvaser_emu_channel *ch = &emu->channels[channel];
+	const uint8_t *p = cmd + HYDRA_OFF_PAYLOAD;
+	uint16_t transid = hydra_transid(cmd);
+	uint8_t he = emu->he_addr[channel];
+	uint8_t *resp;
+
+	switch (cmd[0]) {
+	case CMD_SET_BUSPARAMS_REQ:
+		memcpy(ch->busparams, p, sizeof(ch->busparams));
+		hydra_reply(emu, CMD_SET_BUSPARAMS_RESP, he, transid);
+		break;
+
+	case CMD_SET_BUSPARAMS_FD_REQ:
+		memcpy(ch->busparams_data, p + 12, sizeof(ch->busparams_data));
+		ch->canfd_mode = p[20];
+		hydra_reply(emu, CMD_SET_BUSPARAMS_FD_RESP, he, transid);
+		break;
+
+	case CMD_GET_BUSPARAMS_REQ:
+		resp = hydra_reply(emu, CMD_GET_BUSPARAMS_RESP, he, transid);
+		if (!resp)
+			break;
+		if (p[0] == HYDRA_BUSPARAM_TYPE_CANFD)
+			memcpy(resp + HYDRA_OFF_PAYLOAD, ch->busparams_data,
+			       sizeof(ch->busparams_data));
+		else
+			memcpy(resp + HYDRA_OFF_PAYLOAD, ch->busparams,
+			       sizeof(ch->busparams));
+		break;
+
+	case CMD_SET_DRIVERMODE_REQ:
+		ch->listen_only = p[0] == HYDRA_CTRLMODE_LISTEN;
+		break;
+
+	case CMD_GET_CHIP_STATE_REQ:
+		hydra_chip_state_event(emu, channel, transid, now_ns);
+		break;
+
+	case CMD_START_CHIP_REQ:
+		ch->state = KVASER_EMU_EVENT_ERROR_ACTIVE;
+		ch->txerr = 0;
+		ch->rxerr = 0;
+		kvaser_emu_bus_on(emu, channel, now_ns);
+		hydra_reply(emu, CMD_START_CHIP_RESP, he, transid);
+		hydra_chip_state_event(emu, channel, 0, now_ns);
+		break;
+
+	case CMD_STOP_CHIP_REQ:
+		kvaser_emu_bus_off(emu, channel);
+		hydra_reply(emu, CMD_STOP_CHIP_RESP, he, transid);
+		break;
+
+	case CMD_FLUSH_QUEUE:
+		kvaser_emu_flush_tx(emu, channel);
+		hydra_reply(emu, CMD_FLUSH_QUEUE_RESP, he, transid);
+		break;
+
+	case CMD_TX_CAN_MESSAGE:
+		if (ch->on_bus && !ch->listen_only)
+			hydra_tx_std(emu, channel, cmd, now_ns);
+		break;
+
+	default:
+		emu->stats.unknown_cmds++;
+		break;
+	}
+}
+
+static void hydra_handle_cmd(struct kvaser_emu *emu, const uint8_t *cmd,
+			     size_t len, uint64_t now_ns)
+{
+	uint8_t dest_he = cmd[1] & HYDRA_HE_ADDR_DEST_MASK;
+	int channel;
+
+	switch (cmd[0]) {
+	case CMD_EXTENDED:
+		hydra_handle_ext(emu, cmd, len, now_ns);
+		return;
+
+	case CMD_MAP_CHANNEL_REQ:
+		hydra_map_channel(emu, cmd);
+		return;
+
+	case CMD_GET_SOFTWARE_INFO_REQ:
+		hydra_software_info(emu, hydra_transid(cmd));
+		return;
+
+	case CMD_GET_SOFTWARE_DETAILS_REQ:
+		hydra_software_details(emu, hydra_transid(cmd));
+		return;
+
+	case CMD_GET_CARD_INFO_REQ:
+		hydra_card_info(emu, hydra_transid(cmd));
+		return;
+
+	case CMD_GET_CAPABILITIES_REQ:
+		hydra_capability(emu, cmd);
+		return;
+	}
+
+	channel = hydra_channel_from_he(emu, dest_he);
+	if (channel < 0) {
+		emu->stats.unknown_cmds++;
+		return;
+	}
+
+	hydra_handle_channel_cmd(emu, channel, cmd, now_ns);
+}
+
+static void hydra_rx_std(struct kvaser_emu *emu, unsigned int channel,
+			 const struct kvaser_emu_frame *frame, uint64_t ts_ns)
+{
+	uint8_t *cmd = kvaser_emu_queue_cmd(emu, HYDRA_CMD_LEN);
+	uint32_t id = frame->id;
+
+	if (!cmd)
+		return;
+
+	hydra_set_header(cmd, CMD_RX_MESSAGE, emu->he_addr[channel], 0);
+	if (frame->ext_id)
+		id |= HYDRA_EXTENDED_FRAME_ID;
+
+	/* rx_can has its own cmd_len and cmd_no in front of the channel */
+	cmd[HYDRA_OFF_PAYLOAD] = HYDRA_CMD_LEN;
+	cmd[HYDRA_OFF_PAYLOAD + 1] = CMD_RX_MESSAGE;
+	cmd[HYDRA_OFF_PAYLOAD + 2] = channel;
+	kvaser_emu_put_ts48(cmd + HYDRA_OFF_PAYLOAD + 4,
+			    kvaser_emu_ticks(ts_ns, emu->cfg.clock_mhz));
+	cmd[HYDRA_OFF_PAYLOAD + 10] = frame->len;
+	kvaser_emu_put_le32(cmd + HYDRA_OFF_PAYLOAD + 12, id);
+	memcpy(cmd + HYDRA_OFF_PAYLOAD + 16, frame->data, frame->len);
+}
+
+static void hydra_rx_ext(struct kvaser_emu *emu, unsigned int channel,
+			 const struct kvaser_emu_frame *frame, uint64_t ts_ns)
+{
+	size_t len = KVASER_EMU_ALIGN(HYDRA_OFF_EXT_PAYLOAD + 24 + frame->len,
+				      8);
+	uint8_t dlc = hydra_fd_len2dlc[frame->len];
+	uint32_t flags = 0;
+	uint8_t *cmd;
+	uint8_t *p;
+
+	cmd = kvaser_emu_queue_cmd(emu, len);
+	if (!cmd)
+		return;
+
+	hydra_set_header(cmd, CMD_EXTENDED, emu->he_addr[channel], 0);
+	kvaser_emu_put_le16(cmd + HYDRA_OFF_EXT_LEN, len);
+	cmd[HYDRA_OFF_EXT_CMD_NO] = CMD_RX_MESSAGE_FD;
+
+	if (frame->ext_id)
+		flags |= HYDRA_CF_FLAG_EXTENDED_ID;
+	if (frame->fd)
+		flags |= HYDRA_CF_FLAG_FDF;
+	if (frame->brs)
+		flags |= HYDRA_CF_FLAG_BRS;
+
+	p = cmd + HYDRA_OFF_EXT_PAYLOAD;
+	kvaser_emu_put_le32(p, flags);
+	kvaser_emu_put_le32(p + 4, frame->id);
+	kvaser_emu_put_le32(p + 8, frame->id |
+			    (frame->ext_id ? HYDRA_KCAN_DATA_IDE : 0));
+	kvaser_emu_put_le32(p + 12, dlc << HYDRA_KCAN_DATA_DLC_SHIFT |
+			    (frame->fd ? HYDRA_KCAN_DATA_FDF : 0) |
+			    (frame->brs ? HYDRA_KCAN_DATA_BRS : 0));
+	kvaser_emu_put_le64(p + 16,
+			    kvaser_emu_ticks(ts_ns, emu->cfg.clock_mhz));
+	memcpy(p + 24, frame->data, frame->len);
+}
+
+static void hydra_rx_frame(struct kvaser_emu *emu, unsigned int channel,
+			   const struct kvaser_emu_frame *frame,
+			   uint64_t ts_ns)
+{
+	if (emu->cfg.ext_cmd)
+		hydra_rx_ext(emu, channel, frame, ts_ns);
+	else
+		hydra_rx_std(emu, channel, frame, ts_ns);
+}
+
+static void hydra_tx_ack(struct kvaser_emu *emu, unsigned int channel,
+			 const struct kvaser_emu_tx *tx, uint64_t ts_ns)
+{
+	uint8_t he = emu->he_addr[channel];
+	uint8_t *cmd;
+
+	if (!tx->ext) {
+		hydra_reply(emu, CMD_TX_ACKNOWLEDGE, he, tx->transid);
+		return;
+	}
+
+	cmd = kvaser_emu_queue_cmd(emu, HYDRA_CMD_LEN);
+	if (!cmd)
+		return;
+
+	hydra_set_header(cmd, CMD_EXTENDED, he, tx->transid);
+	kvaser_emu_put_le16(cmd + HYDRA_OFF_EXT_LEN, HYDRA_CMD_LEN);
+	cmd[HYDRA_OFF_EXT_CMD_NO] = CMD_TX_ACKNOWLEDGE_FD;
+	kvaser_emu_put_le32(cmd + HYDRA_OFF_EXT_PAYLOAD, HYDRA_CF_FLAG_TX_ACK);
+	kvaser_emu_put_le64(cmd + HYDRA_OFF_EXT_PAYLOAD + 8,
+			    kvaser_emu_ticks(ts_ns, emu->cfg.clock_mhz));
+}
+
+static int hydra_event(struct kvaser_emu *emu, unsigned int channel,
+		       enum kvaser_emu_event event, uint64_t now_ns)
+{
+	struct kvaser_emu_channel *ch = &emu->channels[channel];
+
+	ch->state = event;
+
+	switch (event) {
+	case KVASER_EMU_EVENT_ERROR_PASSIVE:
+		ch->txerr = 128;
+		ch->rxerr = 0;
+		break;
+	case KVASER_EMU_EVENT_BUS_OFF:
+		ch->txerr = 255;
+		ch->rxerr = 0;
+		/* Frames waiting for the bus are lost */
+		kvaser_emu_flush_tx(emu, channel);
+		break;
+	case KVASER_EMU_EVENT_ERROR_ACTIVE:
+		ch->txerr = 0;
+		ch->rxerr = 0;
+		ch->bus_free_ns = now_ns;
+		ch->next_rx_ns = now_ns;
+		break;
+	}
+
+	hydra_chip_state_event(emu, channel, 0, now_ns);
+
+	return 0;
+}
+
+const struct kvaser_emu_ops kvaser_emu_hydra_ops = {
+	.cmd_size = hydra_cmd_size,
+	.handle_cmd = hydra_handle_cmd,
+	.rx_frame = hydra_rx_frame,
+	.tx_ack = hydra_tx_ack,
+	.event = hydra_event,
+};
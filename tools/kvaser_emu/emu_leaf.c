@@ -0,0 +1,611 @@
+// SPDX-License-Identifier: GPL-2.0 OR BSD-2-Clause
+/* Kvaser USB device emulator, leaf and USBcan II firmware models.
+ *
+ * Command layouts and numbers follow kvaser_usb_leaf.c. The two families
+ * share the command set but not all layouts: Rx messages, chip state,
+ * CAN error and error events differ, USBcan II has no CMD_LEAF_LOG_MESSAGE
+ * and no flush reply, and it reports the wrap of its 16-bit timer with
+ * CMD_USBCAN_CLOCK_OVERFLOW_EVENT. Commands never cross a wMaxPacketSize
+ * boundary, the engine pads with zero-length placeholders.
+ */
+
+#include "emu_priv.h"
+
+#define CMD_HEADER_LEN				2
+
+#define CMD_RX_STD_MESSAGE			12
+#define CMD_TX_STD_MESSAGE			13
+#define CMD_RX_EXT_MESSAGE			14
+#define CMD_TX_EXT_MESSAGE			15
+#define CMD_SET_BUS_PARAMS			16
+#define CMD_GET_BUS_PARAMS			17
+#define CMD_GET_BUS_PARAMS_REPLY		18
+#define CMD_GET_CHIP_STATE			19
+#define CMD_CHIP_STATE_EVENT			20
+#define CMD_SET_CTRL_MODE			21
+#define CMD_RESET_CHIP				24
+#define CMD_START_CHIP				26
+#define CMD_START_CHIP_REPLY			27
+#define CMD_STOP_CHIP				28
+#define CMD_STOP_CHIP_REPLY			29
+#define CMD_USBCAN_CLOCK_OVERFLOW_EVENT		33
+#define CMD_GET_CARD_INFO			34
+#define CMD_GET_CARD_INFO_REPLY			35
+#define CMD_GET_SOFTWARE_INFO			38
+#define CMD_GET_SOFTWARE_INFO_REPLY		39
+#define CMD_ERROR_EVENT				45
+#define CMD_FLUSH_QUEUE				48
+#define CMD_TX_ACKNOWLEDGE			50
+#define CMD_CAN_ERROR_EVENT			51
+#define CMD_FLUSH_QUEUE_REPLY			68
+#define CMD_GET_CAPABILITIES_REQ		95
+#define CMD_GET_CAPABILITIES_RESP		96
+#define CMD_LEAF_LOG_MESSAGE			106
+
+#define MSG_FLAG_REMOTE_FRAME			(1U << 4)
+
+#define M16C_STATE_BUS_PASSIVE			(1U << 5)
+#define M16C_STATE_BUS_OFF			(1U << 6)
+
+#define M16C_EF_ACKE				(1U << 0)
+
+#define LEAF_SWOPTION_FREQ_24_MHZ_CLK		(1U << 6)
+#define LEAF_SWOPTION_FREQ_32_MHZ_CLK		(1U << 5)
+#define LEAF_SWOPTION_EXT_CAP			(1U << 12)
+
+#define LEAF_CAP_CMD_LISTEN_MODE		0x02
+#define LEAF_CAP_CMD_ERR_REPORT			0x05
+#define LEAF_CAP_STAT_OK			0x00
+#define LEAF_CAP_STAT_NOT_IMPL			0x01
+
+#define LEAF_ERROR_EVENT_TX_QUEUE_FULL		0x8
+#define LEAF_ERROR_EVENT_PARAM			0x9
+
+#define LEAF_CTRL_MODE_SILENT			2
+
+#define LEAF_EXTENDED_FRAME			(1U << 31)
+
+/* Timestamps are in microseconds, USBcan II only has 16 bits of them */
+#define LEAF_TIMESTAMP_MHZ			1
+#define USBCAN_CLOCK_BITS			16
+
+static bool leaf_is_usbcan(const struct kvaser_emu *emu)
+{
+	return emu->cfg.family == KVASER_EMU_USBCAN;
+}
+
+static int leaf_cmd_size(const uint8_t *buf, size_t avail)
+{
+	/* The host sends one command per transfer, without placeholders */
+	if (buf[0] < CMD_HEADER_LEN)
+		return -1;
+
+	return buf[0];
+}
+
+static uint64_t leaf_ticks(uint64_t ns)
+{
+	return kvaser_emu_ticks(ns, LEAF_TIMESTAMP_MHZ);
+}
+
+/* USBcan II reports each wrap of its timer before the first command that
+ * carries a timestamp from after the wrap
+ */
+static void usbcan_clock(struct kvaser_emu *emu, uint64_t ns)
+{
+	uint64_t wraps = leaf_ticks(ns) >> USBCAN_CLOCK_BITS;
+	uint8_t *cmd;
+
+	if (!leaf_is_usbcan(emu) || wraps <= emu->clock_wraps)
+		return;
+
+	emu->clock_wraps = wraps;
+
+	cmd = kvaser_emu_queue_cmd(emu, 8);
+	if (!cmd)
+		return;
+
+	cmd[0] = 8;
+	cmd[1] = CMD_USBCAN_CLOCK_OVERFLOW_EVENT;
+	kvaser_emu_put_le32(cmd + 4, leaf_ticks(ns));
+}
+
+static uint8_t *leaf_reply(struct kvaser_emu *emu, uint8_t id, size_t len)
+{
+	uint8_t *cmd = kvaser_emu_queue_cmd(emu, len);
+
+	if (cmd) {
+		cmd[0] = len;
+		cmd[1] = id;
+	}
+
+	return cmd;
+}
+
+/* Replies that only carry tid and channel */
+static void leaf_simple_reply(struct kvaser_emu *emu, uint8_t id, uint8_t tid,
+			      uint8_t channel)
+{
+	uint8_t *cmd = leaf_reply(emu, id, 4);
+
+	if (cmd) {
+		cmd[2] = tid;
+		cmd[3] = channel;
+	}
+}
+
+static void leaf_error_event(struct kvaser_emu *emu, uint8_t error_code,
+			     uint16_t info1, uint16_t info2, uint64_t now_ns)
+{
+	uint8_t *cmd;
+
+	usbcan_clock(emu, now_ns);
+
+	if (leaf_is_usbcan(emu)) {
+		cmd = leaf_reply(emu, CMD_ERROR_EVENT, 14);
+		if (!cmd)
+			return;
+		cmd[3] = error_code;
+		kvaser_emu_put_le16(cmd + 4, info1);
+		kvaser_emu_put_le16(cmd + 6, info2);
+		kvaser_emu_put_le16(cmd + 8, leaf_ticks(now_ns));
+	} else {
+		cmd = leaf_reply(emu, CMD_ERROR_EVENT, 16);
+		if (!cmd)
+			return;
+		cmd[3] = error_code;
+		kvaser_emu_put_ts48(cmd + 4, leaf_ticks(now_ns));
+		kvaser_emu_put_le16(cmd + 12, info1);
+		kvaser_emu_put_le16(cmd + 14, info2);
+	}
+}
+
+static uint8_t leaf_bus_status(const struct kvaser_emu_channel *ch)
+{
+	switch (ch->state) {
+	case KVASER_EMU_EVENT_BUS_OFF:
+		return M16C_STATE_BUS_OFF;
+	case KVASER_EMU_EVENT_ERROR_PASSIVE:
+		return M16C_STATE_BUS_PASSIVE;
+	default:
+		return 0;
+	}
+}
+
+static void leaf_chip_state_event(struct kvaser_emu *emu, unsigned int channel,
+				  uint8_t tid, uint64_t now_ns)
+{
+	const struct kvaser_emu_channel *ch = &emu->channels[channel];
+	uint8_t *cmd;
+
+	usbcan_clock(emu, now_ns);
+
+	if (leaf_is_usbcan(emu)) {
+		cmd = leaf_reply(emu, CMD_CHIP_STATE_EVENT, 12);
+		if (!cmd)
+			return;
+		cmd[4] = ch->txerr;
+		cmd[5] = ch->rxerr;
+		kvaser_emu_put_le16(cmd + 6, leaf_ticks(now_ns));
+		cmd[8] = leaf_bus_status(ch);
+	} else {
+		cmd = leaf_reply(emu, CMD_CHIP_STATE_EVENT, 16);
+		if (!cmd)
+			return;
+		kvaser_emu_put_ts48(cmd + 4, leaf_ticks(now_ns));
+		cmd[10] = ch->txerr;
+		cmd[11] = ch->rxerr;
+		cmd[12] = leaf_bus_status(ch);
+	}
+
+	cmd[2] = tid;
+	cmd[3] = channel;
+}
+
+/* USBcan II reports the counters and status of both channels at once */
+static void leaf_can_error_event(struct kvaser_emu *emu, unsigned int channel,
+				 uint64_t now_ns)
+{
+	const struct kvaser_emu_channel *ch = &emu->channels[channel];
+	uint8_t *cmd;
+
+	usbcan_clock(emu, now_ns);
+
+	if (leaf_is_usbcan(emu)) {
+		const struct kvaser_emu_channel *ch1 = &emu->channels[1];
+		const struct kvaser_emu_channel *ch0 = &emu->channels[0];
+
+		cmd = leaf_reply(emu, CMD_CAN_ERROR_EVENT, 12);
+		if (!cmd)
+			return;
+		cmd[4] = ch0->txerr;
+		cmd[5] = ch0->rxerr;
+		cmd[6] = ch1->txerr;
+		cmd[7] = ch1->rxerr;
+		cmd[8] = leaf_bus_status(ch0);
+		cmd[9] = leaf_bus_status(ch1);
+		kvaser_emu_put_le16(cmd + 10, leaf_ticks(now_ns));
+	} else {
+		cmd = leaf_reply(emu, CMD_CAN_ERROR_EVENT, 16);
+		if (!cmd)
+			return;
+		kvaser_emu_put_ts48(cmd + 4, leaf_ticks(now_ns));
+		cmd[10] = channel;
+		cmd[12] = ch->txerr;
+		cmd[13] = ch->rxerr;
+		cmd[14] = leaf_bus_status(ch);
+		/* The errors that got the channel here were missing ACKs */
+		cmd[15] = M16C_EF_ACKE;
+	}
+}
+
+static void leaf_software_info(struct kvaser_emu *emu)
+{
+	uint32_t sw_options = 0;
+	uint8_t *cmd;
+
+	if (leaf_is_usbcan(emu)) {
+		cmd = leaf_reply(emu, CMD_GET_SOFTWARE_INFO_REPLY, 24);
+		if (!cmd)
+			return;
+		cmd[2] = 0xff;
+		memcpy(cmd + 3, "EMU", 3);
+		kvaser_emu_put_le16(cmd + 8, emu->cfg.max_outstanding_tx);
+		/* Firmware 2.5.0 */
+		kvaser_emu_put_le32(cmd + 16, 0x02050000);
+		return;
+	}
+
+	switch (emu->cfg.clock_mhz) {
+	case 24:
+		sw_options |= LEAF_SWOPTION_FREQ_24_MHZ_CLK;
+		break;
+	case 32:
+		sw_options |= LEAF_SWOPTION_FREQ_32_MHZ_CLK;
+		break;
+	}
+	if (emu->cfg.ext_cap)
+		sw_options |= LEAF_SWOPTION_EXT_CAP;
+
+	cmd = leaf_reply(emu, CMD_GET_SOFTWARE_INFO_REPLY, 32);
+	if (!cmd)
+		return;
+	cmd[2] = 0xff;
+	kvaser_emu_put_le32(cmd + 4, sw_options);
+	/* Firmware 3.0.0 */
+	kvaser_emu_put_le32(cmd + 8, 0x03000000);
+	kvaser_emu_put_le16(cmd + 12, emu->cfg.max_outstanding_tx);
+}
+
+static void leaf_card_info(struct kvaser_emu *emu)
+{
+	/* EAN 73-30130-00685-0, a Leaf Light v2 */
+	static const uint8_t ean[8] = { 0x50, 0x68, 0x00, 0x30, 0x01, 0x33,
+					0x07, 0x00 };
+	uint8_t *cmd;
+
+	cmd = leaf_reply(emu, CMD_GET_CARD_INFO_REPLY, 32);
+	if (!cmd)
+		return;
+
+	cmd[2] = 0xff;
+	cmd[3] = emu->cfg.nchannels;
+	kvaser_emu_put_le32(cmd + 4, emu->cfg.serial);
+	kvaser_emu_put_le32(cmd + 12, 1000);
+	memcpy(cmd + 20, ean, sizeof(ean));
+	/* usb_hs_mode on leaf */
+	cmd[29] = !leaf_is_usbcan(emu) && emu->cfg.max_packet == 512;
+}
+
+static void leaf_capability(struct kvaser_emu *emu, const uint8_t *cmd)
+{
+	uint16_t cap_cmd = kvaser_emu_get_le16(cmd + 4);
+	uint32_t channels = (1U << emu->cfg.nchannels) - 1;
+	uint8_t *resp;
+
+	if (leaf_is_usbcan(emu) || !emu->cfg.ext_cap) {
+		emu->stats.unknown_cmds++;
+		return;
+	}
+
+	resp = leaf_reply(emu, CMD_GET_CAPABILITIES_RESP, 16);
+	if (!resp)
+		return;
+
+	kvaser_emu_put_le16(resp + 4, cap_cmd);
+
+	switch (cap_cmd) {
+	case LEAF_CAP_CMD_LISTEN_MODE:
+	case LEAF_CAP_CMD_ERR_REPORT:
+		kvaser_emu_put_le16(resp + 6, LEAF_CAP_STAT_OK);
+		kvaser_emu_put_le32(resp + 8, channels);
+		kvaser_emu_put_le32(resp + 12, channels);
+		break;
+	default:
+		kvaser_emu_put_le16(resp + 6, LEAF_CAP_STAT_NOT_IMPL);
+		break;
+	}
+}
+
+static void leaf_tx(struct kvaser_emu *emu, unsigned int channel,
+		    const uint8_t *cmd, uint64_t now_ns)
+{
+	struct kvaser_emu_channel *ch = &emu->channels[channel];
+	const uint8_t *data = cmd + 4;
+	uint8_t flags = leaf_is_usbcan(emu) ? cmd[18] : cmd[19];
+	struct kvaser_emu_tx tx = { 0 };
+
+	/* The host must not have more than max_outstanding_tx frames in
+	 * flight, the firmware drops the rest
+	 */
+	if (ch->tx_count >= emu->cfg.max_outstanding_tx) {
+		emu->stats.overruns++;
+		leaf_error_event(emu, LEAF_ERROR_EVENT_TX_QUEUE_FULL, channel,
+				 0, now_ns);
+		return;
+	}
+
+	if (cmd[1] == CMD_TX_EXT_MESSAGE) {
+		tx.frame.ext_id = true;
+		tx.frame.id = (data[0] & 0x1f) << 24 | (data[1] & 0x3f) << 18 |
+			      (data[2] & 0x0f) << 14 | data[3] << 6 |
+			      (data[4] & 0x3f);
+	} else {
+		tx.frame.id = (data[0] & 0x1f) << 6 | (data[1] & 0x3f);
+	}
+	tx.frame.len = data[5] > 8 ? 8 : data[5];
+	tx.frame.rtr = flags & MSG_FLAG_REMOTE_FRAME;
+	memcpy(tx.frame.data, data + 6, tx.frame.len);
+	tx.ready_ns = now_ns;
+	tx.transid = cmd[3];
+
+	kvaser_emu_queue_tx(emu, channel, &tx);
+}
+
+static void leaf_handle_cmd(struct kvaser_emu *emu, const uint8_t *cmd,
+			    size_t len, uint64_t now_ns)
+{
+	struct kvaser_emu_channel *ch;
+	uint8_t *resp;
+	uint8_t tid = cmd[2];
+	uint8_t channel = cmd[3];
+
+	switch (cmd[1]) {
+	case CMD_GET_SOFTWARE_INFO:
+		leaf_software_info(emu);
+		return;
+
+	case CMD_GET_CARD_INFO:
+		leaf_card_info(emu);
+		return;
+
+	case CMD_GET_CAPABILITIES_REQ:
+		leaf_capability(emu, cmd);
+		return;
+
+	case CMD_TX_STD_MESSAGE:
+	case CMD_TX_EXT_MESSAGE:
+		/* tx_can has the channel in front of the tid */
+		channel = cmd[2];
+		if (len < 20 || channel >= emu->cfg.nchannels) {
+			emu->stats.unknown_cmds++;
+			return;
+		}
+		ch = &emu->channels[channel];
+		if (ch->on_bus && !ch->listen_only)
+			leaf_tx(emu, channel, cmd, now_ns);
+		return;
+	}
+
+	if (len < 4 || channel >= emu->cfg.nchannels) {
+		/* The firmware names the offending command */
+		if (cmd[1] == CMD_SET_BUS_PARAMS || cmd[1] == CMD_SET_CTRL_MODE)
+			leaf_error_event(emu, LEAF_ERROR_EVENT_PARAM, cmd[1],
+					 channel, now_ns);
+		else
+			emu->stats.unknown_cmds++;
+		return;
+	}
+
+	ch = &emu->channels[channel];
+
+	switch (cmd[1]) {
+	case CMD_SET_BUS_PARAMS:
+		if (len < 12) {
+			leaf_error_event(emu, LEAF_ERROR_EVENT_PARAM, cmd[1],
+					 channel, now_ns);
+			break;
+		}
+		memcpy(ch->busparams, cmd + 4, sizeof(ch->busparams));
+		break;
+
+	case CMD_GET_BUS_PARAMS:
+		if (leaf_is_usbcan(emu)) {
+			emu->stats.unknown_cmds++;
+			break;
+		}
+		resp = leaf_reply(emu, CMD_GET_BUS_PARAMS_REPLY, 12);
+		if (!resp)
+			break;
+		resp[2] = tid;
+		resp[3] = channel;
+		memcpy(resp + 4, ch->busparams, sizeof(ch->busparams));
+		break;
+
+	case CMD_SET_CTRL_MODE:
+		ch->listen_only = len > 4 && cmd[4] == LEAF_CTRL_MODE_SILENT;
+		break;
+
+	case CMD_RESET_CHIP:
+		kvaser_emu_bus_off(emu, channel);
+		break;
+
+	case CMD_GET_CHIP_STATE:
+		leaf_chip_state_event(emu, channel, tid, now_ns);
+		break;
+
+	case CMD_START_CHIP:
+		ch->state = KVASER_EMU_EVENT_ERROR_ACTIVE;
+		ch->txerr = 0;
+		ch->rxerr = 0;
+		kvaser_emu_bus_on(emu, channel, now_ns);
+		leaf_simple_reply(emu, CMD_START_CHIP_REPLY, tid, channel);
+		/* Ends the host's joining_bus window */
+		leaf_chip_state_event(emu, channel, 0, now_ns);
+		break;
+
+	case CMD_STOP_CHIP:
+		kvaser_emu_bus_off(emu, channel);
+		leaf_simple_reply(emu, CMD_STOP_CHIP_REPLY, tid, channel);
+		break;
+
+	case CMD_FLUSH_QUEUE:
+		kvaser_emu_flush_tx(emu, channel);
+		if (!leaf_is_usbcan(emu))
+			leaf_simple_reply(emu, CMD_FLUSH_QUEUE_REPLY, tid,
+					  channel);
+		break;
+
+	default:
+		emu->stats.unknown_cmds++;
+		break;
+	}
+}
+
+static void leaf_rx_log_message(struct kvaser_emu *emu, unsigned int channel,
+				const struct kvaser_emu_frame *frame,
+				uint64_t ts_ns)
+{
+	uint8_t *cmd = leaf_reply(emu, CMD_LEAF_LOG_MESSAGE, 24);
+	uint32_t id = frame->id;
+
+	if (!cmd)
+		return;
+
+	if (frame->ext_id)
+		id |= LEAF_EXTENDED_FRAME;
+
+	cmd[2] = channel;
+	kvaser_emu_put_ts48(cmd + 4, leaf_ticks(ts_ns));
+	cmd[10] = frame->len;
+	kvaser_emu_put_le32(cmd + 12, id);
+	memcpy(cmd + 16, frame->data, frame->len);
+}
+
+static void leaf_rx_frame(struct kvaser_emu *emu, unsigned int channel,
+			  const struct kvaser_emu_frame *frame, uint64_t ts_ns)
+{
+	bool usbcan = leaf_is_usbcan(emu);
+	uint8_t *cmd;
+	uint8_t *data;
+
+	if (!usbcan && emu->cfg.log_messages) {
+		leaf_rx_log_message(emu, channel, frame, ts_ns);
+		return;
+	}
+
+	usbcan_clock(emu, ts_ns);
+
+	cmd = leaf_reply(emu, frame->ext_id ? CMD_RX_EXT_MESSAGE :
+					      CMD_RX_STD_MESSAGE,
+			 usbcan ? 20 : 24);
+	if (!cmd)
+		return;
+
+	cmd[2] = channel;
+	if (usbcan) {
+		data = cmd + 4;
+		kvaser_emu_put_le16(cmd + 18, leaf_ticks(ts_ns));
+	} else {
+		data = cmd + 10;
+		kvaser_emu_put_ts48(cmd + 4, leaf_ticks(ts_ns));
+	}
+
+	if (frame->ext_id) {
+		data[0] = (frame->id >> 24) & 0x1f;
+		data[1] = (frame->id >> 18) & 0x3f;
+		data[2] = (frame->id >> 14) & 0x0f;
+		data[3] = (frame->id >> 6) & 0xff;
+		data[4] = frame->id & 0x3f;
+	} else {
+		data[0] = (frame->id >> 6) & 0x1f;
+		data[1] = frame->id & 0x3f;
+	}
+	data[5] = frame->len;
+	memcpy(data + 6, frame->data, frame->len);
+}
+
+/* The host only looks at channel and tid, the firmware adds a timestamp */
+static void leaf_tx_ack(struct kvaser_emu *emu, unsigned int channel,
+			const struct kvaser_emu_tx *tx, uint64_t ts_ns)
+{
+	uint8_t *cmd;
+
+	usbcan_clock(emu, ts_ns);
+
+	if (leaf_is_usbcan(emu)) {
+		cmd = leaf_reply(emu, CMD_TX_ACKNOWLEDGE, 6);
+		if (!cmd)
+			return;
+		kvaser_emu_put_le16(cmd + 4, leaf_ticks(ts_ns));
+	} else {
+		cmd = leaf_reply(emu, CMD_TX_ACKNOWLEDGE, 12);
+		if (!cmd)
+			return;
+		kvaser_emu_put_ts48(cmd + 4, leaf_ticks(ts_ns));
+	}
+
+	cmd[2] = channel;
+	cmd[3] = tx->transid;
+}
+
+static int leaf_event(struct kvaser_emu *emu, unsigned int channel,
+		      enum kvaser_emu_event event, uint64_t now_ns)
+{
+	struct kvaser_emu_channel *ch = &emu->channels[channel];
+
+	ch->state = event;
+
+	switch (event) {
+	case KVASER_EMU_EVENT_ERROR_PASSIVE:
+		ch->txerr = 128;
+		ch->rxerr = 0;
+		leaf_can_error_event(emu, channel, now_ns);
+		break;
+	case KVASER_EMU_EVENT_BUS_OFF:
+		ch->txerr = 255;
+		ch->rxerr = 0;
+		/* Frames waiting for the bus are lost */
+		kvaser_emu_flush_tx(emu, channel);
+		leaf_can_error_event(emu, channel, now_ns);
+		break;
+	case KVASER_EMU_EVENT_ERROR_ACTIVE:
+		ch->txerr = 0;
+		ch->rxerr = 0;
+		ch->bus_free_ns = now_ns;
+		ch->next_rx_ns = now_ns;
+		break;
+	}
+
+	leaf_chip_state_event(emu, channel, 0, now_ns);
+
+	return 0;
+}
+
+const struct kvaser_emu_ops kvaser_emu_leaf_ops = {
+	.cmd_size = leaf_cmd_size,
+	.handle_cmd = leaf_handle_cmd,
+	.rx_frame = leaf_rx_frame,
+	.tx_ack = leaf_tx_ack,
+	.event = leaf_event,
+	.placeholders = true,
+};
+
+const struct kvaser_emu_ops kvaser_emu_usbcan_ops = {
+	.cmd_size = leaf_cmd_size,
+	.handle_cmd = leaf_handle_cmd,
+	.rx_frame = leaf_rx_frame,
+	.tx_ack = leaf_tx_ack,
+	.event = leaf_event,
+	.placeholders = true,
+};
@@ -0,0 +1,174 @@
+/* SPDX-License-Identifier: GPL-2.0 OR BSD-2-Clause */
+/* Kvaser USB device emulator, state shared by the engine and the family
+ * models
+ */
+
+#ifndef KVASER_EMU_PRIV_H
+#define KVASER_EMU_PRIV_H
+
+#include <endian.h>
+#include <string.h>
+
+#include "kvaser_emu.h"
+
+/* Longest command of any family */
+#define KVASER_EMU_MAX_CMD_LEN		128
+/* Commands the device buffers for the IN endpoint */
+#define KVASER_EMU_QUEUE_LEN		4096
+/* Tx frames a channel buffers, more than any max_outstanding_tx */
+#define KVASER_EMU_MAX_TX		256
+/* Traffic the bus catches up on after the caller skipped ahead in time */
+#define KVASER_EMU_MAX_CATCH_UP_NS	1000000000ULL
+
+#define KVASER_EMU_ALIGN(x, a)		(((x) + (a) - 1) & ~((size_t)(a) - 1))
+
+/* A frame on the emulated bus */
+struct kvaser_emu_frame {
+	uint32_t id;
+	uint8_t len;
+	uint8_t data[64];
+	bool ext_id;
+	bool fd;
+	bool brs;
+	bool rtr;
+};
+
+/* A Tx frame from the host, acknowledged once it has been on the bus */
+struct kvaser_emu_tx {
+	struct kvaser_emu_frame frame;
+	uint64_t ready_ns;
+	uint16_t transid;
+	/* Acknowledge with the extended command */
+	bool ext;
+};
+
+struct kvaser_emu_channel {
+	bool on_bus;
+	bool listen_only;
+	/* struct kvaser_usb_busparams as written by the host */
+	uint8_t busparams[8];
+	uint8_t busparams_data[8];
+	uint8_t canfd_mode;
+	/* The bus is busy until bus_free_ns */
+	uint64_t bus_free_ns;
+	/* Start of the next generated Rx frame or burst */
+	uint64_t next_rx_ns;
+	uint32_t burst_left;
+	uint32_t rx_seq;
+	struct kvaser_emu_tx tx[KVASER_EMU_MAX_TX];
+	unsigned int tx_head;
+	unsigned int tx_count;
+	uint8_t txerr;
+	uint8_t rxerr;
+	enum kvaser_emu_event state;
+};
+
+struct kvaser_emu_cmd {
+	uint8_t len;
+	uint8_t data[KVASER_EMU_MAX_CMD_LEN];
+};
+
+struct kvaser_emu_ops {
+	/* Length of the command at @buf, which holds @avail bytes. Returns 0
+	 * if more bytes are needed and -1 if the command is malformed.
+	 */
+	int (*cmd_size)(const uint8_t *buf, size_t avail);
+	void (*handle_cmd)(struct kvaser_emu *emu, const uint8_t *cmd,
+			   size_t len, uint64_t now_ns);
+	void (*rx_frame)(struct kvaser_emu *emu, unsigned int channel,
+			 const struct kvaser_emu_frame *frame, uint64_t ts_ns);
+	void (*tx_ack)(struct kvaser_emu *emu, unsigned int channel,
+		       const struct kvaser_emu_tx *tx, uint64_t ts_ns);
+	int (*event)(struct kvaser_emu *emu, unsigned int channel,
+		     enum kvaser_emu_event event, uint64_t now_ns);
+	/* Commands never cross a max_packet boundary, a zero-length
+	 * placeholder fills the rest of the packet instead
+	 */
+	bool placeholders;
+};
+
+struct kvaser_emu {
+	struct kvaser_emu_config cfg;
+	const struct kvaser_emu_ops *ops;
+	struct kvaser_emu_stats stats;
+	struct kvaser_emu_channel channels[KVASER_EMU_MAX_CHANNELS];
+
+	/* IN queue, the head command may be partly sent */
+	struct kvaser_emu_cmd *queue;
+	unsigned int queue_head;
+	unsigned int queue_count;
+	size_t queue_sent;
+
+	/* Family model state */
+	uint8_t he_addr[KVASER_EMU_MAX_CHANNELS];
+	uint8_t sysdbg_he;
+	/* USBcan II timer wraps reported so far */
+	uint64_t clock_wraps;
+};
+
+extern const struct kvaser_emu_ops kvaser_emu_hydra_ops;
+extern const struct kvaser_emu_ops kvaser_emu_leaf_ops;
+extern const struct kvaser_emu_ops kvaser_emu_usbcan_ops;
+
+/* Queues a command for the IN endpoint, returns NULL if the queue is full.
+ * The command is zeroed and @len bytes long.
+ */
+uint8_t *kvaser_emu_queue_cmd(struct kvaser_emu *emu, size_t len);
+
+/* Queues a Tx frame for the bus, acknowledged in kvaser_emu_in() */
+void kvaser_emu_queue_tx(struct kvaser_emu *emu, unsigned int channel,
+			 const struct kvaser_emu_tx *tx);
+void kvaser_emu_flush_tx(struct kvaser_emu *emu, unsigned int channel);
+void kvaser_emu_bus_on(struct kvaser_emu *emu, unsigned int channel,
+		       uint64_t now_ns);
+void kvaser_emu_bus_off(struct kvaser_emu *emu, unsigned int channel);
+
+/* Device timestamp of @ns in ticks of @mhz */
+static inline uint64_t kvaser_emu_ticks(uint64_t ns, unsigned int mhz)
+{
+	return ns * mhz / 1000;
+}
+
+static inline void kvaser_emu_put_le16(uint8_t *p, uint16_t v)
+{
+	v = htole16(v);
+	memcpy(p, &v, sizeof(v));
+}
+
+static inline void kvaser_emu_put_le32(uint8_t *p, uint32_t v)
+{
+	v = htole32(v);
+	memcpy(p, &v, sizeof(v));
+}
+
+static inline void kvaser_emu_put_le64(uint8_t *p, uint64_t v)
+{
+	v = htole64(v);
+	memcpy(p, &v, sizeof(v));
+}
+
+static inline uint16_t kvaser_emu_get_le16(const uint8_t *p)
+{
+	uint16_t v;
+
+	memcpy(&v, p, sizeof(v));
+	return le16toh(v);
+}
+
+static inline uint32_t kvaser_emu_get_le32(const uint8_t *p)
+{
+	uint32_t v;
+
+	memcpy(&v, p, sizeof(v));
+	return le32toh(v);
+}
+
+/* Ticks of a timestamp in three little endian 16-bit words */
+static inline void kvaser_emu_put_ts48(uint8_t *p, uint64_t ticks)
+{
+	kvaser_emu_put_le16(p, ticks);
+	kvaser_emu_put_le16(p + 2, ticks >> 16);
+	kvaser_emu_put_le16(p + 4, ticks >> 32);
+}
+
+#endif /* KVASER_EMU_PRIV_H */
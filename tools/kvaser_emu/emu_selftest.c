@@ -0,0 +1,897 @@
+// SPDX-License-Identifier: GPL-2.0 OR BSD-2-Clause
+/* Self test of the Kvaser USB device emulator. Plays the host side of
+ * kvaser_usb_hydra and kvaser_usb_leaf against the engine on a virtual
+ * clock: the probe sequence, bus parameters, start/stop, Tx
+ * acknowledgements, Rx traffic at line rate and bus events.
+ */
+
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "emu_priv.h"
+
+#define CMD_SET_BUSPARAMS_REQ			16
+#define CMD_GET_BUSPARAMS_REQ			17
+#define CMD_GET_BUSPARAMS_RESP			18
+#define CMD_CHIP_STATE_EVENT			20
+#define CMD_START_CHIP_REQ			26
+#define CMD_START_CHIP_RESP			27
+#define CMD_STOP_CHIP_REQ			28
+#define CMD_STOP_CHIP_RESP			29
+#define CMD_TX_CAN_MESSAGE			33
+#define CMD_GET_CARD_INFO_REQ			34
+#define CMD_GET_CARD_INFO_RESP			35
+#define CMD_GET_SOFTWARE_INFO_REQ		38
+#define CMD_GET_SOFTWARE_INFO_RESP		39
+#define CMD_TX_ACKNOWLEDGE			50
+#define CMD_SET_BUSPARAMS_RESP			85
+#define CMD_GET_CAPABILITIES_REQ		95
+#define CMD_GET_CAPABILITIES_RESP		96
+#define CMD_RX_MESSAGE				106
+#define CMD_MAP_CHANNEL_REQ			200
+#define CMD_MAP_CHANNEL_RESP			201
+#define CMD_GET_SOFTWARE_DETAILS_REQ		202
+#define CMD_GET_SOFTWARE_DETAILS_RESP		203
+#define CMD_EXTENDED				255
+#define CMD_TX_CAN_MESSAGE_FD			224
+#define CMD_TX_ACKNOWLEDGE_FD			225
+#define CMD_RX_MESSAGE_FD			226
+
+/* Leaf and USBcan II */
+#define LEAF_CMD_RX_STD_MESSAGE			12
+#define LEAF_CMD_TX_STD_MESSAGE			13
+#define LEAF_CMD_SET_BUS_PARAMS			16
+#define LEAF_CMD_GET_BUS_PARAMS			17
+#define LEAF_CMD_GET_BUS_PARAMS_REPLY		18
+#define LEAF_CMD_CHIP_STATE_EVENT		20
+#define LEAF_CMD_START_CHIP			26
+#define LEAF_CMD_START_CHIP_REPLY		27
+#define LEAF_CMD_CLOCK_OVERFLOW_EVENT		33
+#define LEAF_CMD_GET_CARD_INFO			34
+#define LEAF_CMD_GET_CARD_INFO_REPLY		35
+#define LEAF_CMD_GET_SOFTWARE_INFO		38
+#define LEAF_CMD_GET_SOFTWARE_INFO_REPLY	39
+#define LEAF_CMD_ERROR_EVENT			45
+#define LEAF_CMD_FLUSH_QUEUE			48
+#define LEAF_CMD_TX_ACKNOWLEDGE			50
+#define LEAF_CMD_CAN_ERROR_EVENT		51
+#define LEAF_CMD_FLUSH_QUEUE_REPLY		68
+#define LEAF_CMD_GET_CAPABILITIES_REQ		95
+#define LEAF_CMD_GET_CAPABILITIES_RESP		96
+#define LEAF_CMD_LOG_MESSAGE			106
+
+#define HE_ILLEGAL				0x3e
+#define IN_LEN					3072
+#define BIT_NS_500K				2000ULL
+
+struct host {
+	struct kvaser_emu *emu;
+	uint64_t now;
+	uint8_t channel_to_he[KVASER_EMU_MAX_CHANNELS];
+	uint8_t sysdbg_he;
+	uint16_t transid;
+
+	/* Bytes of a command split across IN transfers */
+	uint8_t leftover[KVASER_EMU_MAX_CMD_LEN];
+	size_t leftover_len;
+
+	/* What the last poll received */
+	unsigned int cmds[256];
+	unsigned int ext_cmds[256];
+	uint8_t last[256][KVASER_EMU_MAX_CMD_LEN];
+	uint16_t ack_transids[1024];
+	unsigned int nacks;
+	uint64_t last_rx_ticks;
+	bool rx_ts_backwards;
+	unsigned int format_errors;
+
+	/* Leaf and USBcan II */
+	bool leaf;
+	bool usbcan;
+	size_t max_packet;
+	unsigned int placeholders;
+	unsigned int crossings;
+	uint64_t clock_wraps;
+};
+
+static int failures;
+
+#define CHECK(cond, ...) do { \
+	if (!(cond)) { \
+		failures++; \
+		printf("  FAIL %s:%d: ", __func__, __LINE__); \
+		printf(__VA_ARGS__); \
+		printf("\n"); \
+	} \
+} while (0)
+
+static size_t cmd_size(const uint8_t *cmd)
+{
+	if (cmd[0] == CMD_EXTENDED)
+		return kvaser_emu_get_le16(cmd + 4);
+
+	return 32;
+}
+
+static uint8_t src_he(const uint8_t *cmd)
+{
+	return (cmd[1] & 0xc0) >> 2 | kvaser_emu_get_le16(cmd + 2) >> 12;
+}
+
+static void host_handle(struct host *host, const uint8_t *cmd, size_t len)
+{
+	uint8_t cmd_no = cmd[0];
+
+	if (cmd_no == CMD_EXTENDED) {
+		uint8_t ext = cmd[6];
+
+		host->ext_cmds[ext]++;
+		if (ext == CMD_TX_ACKNOWLEDGE_FD && host->nacks < 1024)
+			host->ack_transids[host->nacks++] =
+				kvaser_emu_get_le16(cmd + 2) & 0xfff;
+		if (ext == CMD_RX_MESSAGE_FD) {
+			uint64_t ticks;
+
+			memcpy(&ticks, cmd + 24, sizeof(ticks));
+			ticks = le64toh(ticks);
+			if (ticks < host->last_rx_ticks)
+				host->rx_ts_backwards = true;
+			host->last_rx_ticks = ticks;
+		}
+		return;
+	}
+
+	host->cmds[cmd_no]++;
+	memcpy(host->last[cmd_no], cmd, len);
+	if (cmd_no == CMD_TX_ACKNOWLEDGE && host->nacks < 1024)
+		host->ack_transids[host->nacks++] =
+			kvaser_emu_get_le16(cmd + 2) & 0xfff;
+}
+
+/* A simplified kvaser_usb_hydra_read_bulk_callback() */
+static void host_parse(struct host *host, const uint8_t *buf, size_t len)
+{
+	size_t pos = 0;
+
+	while (pos < len) {
+		size_t need, n;
+
+		if (host->leftover_len < 6) {
+			n = 6 - host->leftover_len;
+			if (n > len - pos)
+				n = len - pos;
+			memcpy(host->leftover + host->leftover_len, buf + pos, n);
+			host->leftover_len += n;
+			pos += n;
+			if (host->leftover_len < 6)
+				break;
+		}
+
+		need = cmd_size(host->leftover);
+		if (need < 8 || need > KVASER_EMU_MAX_CMD_LEN) {
+			host->format_errors++;
+			host->leftover_len = 0;
+			return;
+		}
+
+		n = need - host->leftover_len;
+		if (n > len - pos)
+			n = len - pos;
+		memcpy(host->leftover + host->leftover_len, buf + pos, n);
+		host->leftover_len += n;
+		pos += n;
+
+		if (host->leftover_len == need) {
+			host_handle(host, host->leftover, need);
+			host->leftover_len = 0;
+		}
+	}
+}
+
+/* kvaser_usb_leaf_read_bulk_callback(), which also checks that no command
+ * crosses a wMaxPacketSize boundary
+ */
+static void host_parse_leaf(struct host *host, const uint8_t *buf,
+			    size_t len)
+{
+	size_t pos = 0;
+
+	while (pos + 2 <= len) {
+		const uint8_t *cmd = buf + pos;
+		uint8_t cmd_no = cmd[1];
+
+		if (!cmd[0]) {
+			host->placeholders++;
+			pos = (pos / host->max_packet + 1) * host->max_packet;
+			continue;
+		}
+
+		if (pos + cmd[0] > len) {
+			host->format_errors++;
+			return;
+		}
+
+		if (pos / host->max_packet !=
+		    (pos + cmd[0] - 1) / host->max_packet)
+			host->crossings++;
+
+		host->cmds[cmd_no]++;
+		memcpy(host->last[cmd_no], cmd, cmd[0]);
+
+		if (cmd_no == LEAF_CMD_TX_ACKNOWLEDGE && host->nacks < 1024)
+			host->ack_transids[host->nacks++] = cmd[3];
+
+		/* USBcan II time is 16 bits, extended by the overflow events */
+		if (host->usbcan && cmd_no == LEAF_CMD_CLOCK_OVERFLOW_EVENT)
+			host->clock_wraps++;
+		if (host->usbcan && cmd_no == LEAF_CMD_RX_STD_MESSAGE) {
+			uint64_t ticks = host->clock_wraps << 16 |
+					 kvaser_emu_get_le16(cmd + 18);
+
+			if (ticks < host->last_rx_ticks)
+				host->rx_ts_backwards = true;
+			host->last_rx_ticks = ticks;
+		}
+
+		pos += cmd[0];
+	}
+}
+
+static void host_clear(struct host *host)
+{
+	memset(host->cmds, 0, sizeof(host->cmds));
+	memset(host->ext_cmds, 0, sizeof(host->ext_cmds));
+	host->nacks = 0;
+}
+
+/* Reads IN transfers of @in_len until the device has nothing more to say
+ * at the current time
+ */
+static void host_poll(struct host *host, size_t in_len)
+{
+	uint8_t buf[IN_LEN];
+	size_t n;
+
+	while ((n = kvaser_emu_in(host->emu, buf, in_len, host->now))) {
+		if (host->leaf)
+			host_parse_leaf(host, buf, n);
+		else
+			host_parse(host, buf, n);
+	}
+}
+
+static void host_send(struct host *host, const uint8_t *cmd, size_t len)
+{
+	CHECK(kvaser_emu_out(host->emu, cmd, len, host->now) == 1,
+	      "OUT command %u rejected", cmd[0]);
+}
+
+static void host_simple_cmd(struct host *host, uint8_t cmd_no, uint8_t he)
+{
+	uint8_t cmd[32] = { cmd_no, he };
+
+	kvaser_emu_put_le16(cmd + 2, ++host->transid);
+	host_send(host, cmd, sizeof(cmd));
+}
+
+static void host_probe(struct host *host, const struct kvaser_emu_config *cfg)
+{
+	static const uint16_t caps[] = { 0x02, 0x05, 0x06, 0x10 };
+	uint8_t cmd[32];
+	uint32_t flags;
+	unsigned int i;
+
+	/* kvaser_usb_hydra_init_card() */
+	for (i = 0; i <= KVASER_EMU_MAX_CHANNELS; i++) {
+		uint16_t transid = i < KVASER_EMU_MAX_CHANNELS ? 0x40 | i : 0x61;
+
+		memset(cmd, 0, sizeof(cmd));
+		cmd[0] = CMD_MAP_CHANNEL_REQ;
+		kvaser_emu_put_le16(cmd + 2, transid);
+		strcpy((char *)cmd + 4, i < KVASER_EMU_MAX_CHANNELS ?
+					"CAN" : "SYSDBG");
+		cmd[20] = i < KVASER_EMU_MAX_CHANNELS ? i : 0;
+		host_send(host, cmd, sizeof(cmd));
+
+		host_clear(host);
+		host_poll(host, IN_LEN);
+		CHECK(host->cmds[CMD_MAP_CHANNEL_RESP] == 1, "no map response");
+		CHECK((kvaser_emu_get_le16(host->last[CMD_MAP_CHANNEL_RESP] + 2) &
+		       0xfff) == transid, "map response transid");
+
+		if (i < KVASER_EMU_MAX_CHANNELS)
+			host->channel_to_he[i] =
+				host->last[CMD_MAP_CHANNEL_RESP][4];
+		else
+			host->sysdbg_he = host->last[CMD_MAP_CHANNEL_RESP][4];
+	}
+
+	for (i = 0; i < KVASER_EMU_MAX_CHANNELS; i++)
+		CHECK(host->channel_to_he[i] != 0 &&
+		      host->channel_to_he[i] != HE_ILLEGAL, "channel %u HE", i);
+
+	host_clear(host);
+	host_simple_cmd(host, CMD_GET_SOFTWARE_INFO_REQ, HE_ILLEGAL);
+	host_simple_cmd(host, CMD_GET_SOFTWARE_DETAILS_REQ, HE_ILLEGAL);
+	host_simple_cmd(host, CMD_GET_CARD_INFO_REQ, HE_ILLEGAL);
+	host_poll(host, IN_LEN);
+
+	CHECK(host->cmds[CMD_GET_SOFTWARE_INFO_RESP] == 1, "no software info");
+	CHECK(kvaser_emu_get_le16(host->last[CMD_GET_SOFTWARE_INFO_RESP] + 12) ==
+	      cfg->max_outstanding_tx, "max_outstanding_tx");
+
+	CHECK(host->cmds[CMD_GET_SOFTWARE_DETAILS_RESP] == 1,
+	      "no software details");
+	flags = kvaser_emu_get_le32(host->last[CMD_GET_SOFTWARE_DETAILS_RESP] + 4);
+	CHECK(!!(flags & (1U << 9)) == cfg->ext_cmd, "EXT_CMD flag");
+	CHECK(!!(flags & (1U << 10)) == cfg->canfd, "CANFD flag");
+	CHECK(!(flags & (1U << 4)), "firmware marked bad");
+
+	CHECK(host->cmds[CMD_GET_CARD_INFO_RESP] == 1, "no card info");
+	CHECK(host->last[CMD_GET_CARD_INFO_RESP][28] == cfg->nchannels,
+	      "nchannels %u", host->last[CMD_GET_CARD_INFO_RESP][28]);
+	CHECK(kvaser_emu_get_le32(host->last[CMD_GET_CARD_INFO_RESP] + 4) ==
+	      cfg->serial, "serial");
+
+	/* kvaser_usb_hydra_get_capabilities() */
+	for (i = 0; i < sizeof(caps) / sizeof(caps[0]); i++) {
+		uint16_t status;
+
+		memset(cmd, 0, sizeof(cmd));
+		cmd[0] = CMD_GET_CAPABILITIES_REQ;
+		cmd[1] = host->sysdbg_he;
+		kvaser_emu_put_le16(cmd + 2, ++host->transid);
+		kvaser_emu_put_le16(cmd + 4, caps[i]);
+		host_send(host, cmd, sizeof(cmd));
+
+		host_clear(host);
+		host_poll(host, IN_LEN);
+		CHECK(host->cmds[CMD_GET_CAPABILITIES_RESP] == 1,
+		      "no capability response");
+		CHECK(src_he(host->last[CMD_GET_CAPABILITIES_RESP]) ==
+		      host->sysdbg_he, "capability response source HE");
+		status = kvaser_emu_get_le16(host->last[CMD_GET_CAPABILITIES_RESP] + 6);
+		CHECK(status == (caps[i] < 0x10 ? 0 : 1),
+		      "capability 0x%x status %u", caps[i], status);
+	}
+}
+
+static void host_start(struct host *host, unsigned int channel)
+{
+	/* 500 kbit/s nominal, 2 Mbit/s data */
+	uint8_t cmd[32] = { CMD_SET_BUSPARAMS_REQ, host->channel_to_he[channel] };
+
+	kvaser_emu_put_le16(cmd + 2, ++host->transid);
+	kvaser_emu_put_le32(cmd + 4, 500000);
+	cmd[8] = 13;
+	cmd[9] = 2;
+	cmd[10] = 1;
+	cmd[11] = 1;
+	host_send(host, cmd, sizeof(cmd));
+
+	cmd[0] = CMD_GET_BUSPARAMS_REQ;
+	kvaser_emu_put_le16(cmd + 2, ++host->transid);
+	cmd[4] = 0;
+	host_send(host, cmd, sizeof(cmd));
+
+	memset(cmd + 4, 0, sizeof(cmd) - 4);
+	cmd[0] = 69;
+	kvaser_emu_put_le16(cmd + 2, ++host->transid);
+	kvaser_emu_put_le32(cmd + 16, 2000000);
+	host_send(host, cmd, sizeof(cmd));
+
+	host_clear(host);
+	host_poll(host, IN_LEN);
+	CHECK(host->cmds[CMD_SET_BUSPARAMS_RESP] == 1, "no SET_BUSPARAMS_RESP");
+	CHECK(host->cmds[CMD_GET_BUSPARAMS_RESP] == 1, "no GET_BUSPARAMS_RESP");
+	CHECK(kvaser_emu_get_le32(host->last[CMD_GET_BUSPARAMS_RESP] + 4) ==
+	      500000 && host->last[CMD_GET_BUSPARAMS_RESP][8] == 13,
+	      "bus parameters read back differ");
+
+	host_clear(host);
+	host_simple_cmd(host, CMD_START_CHIP_REQ, host->channel_to_he[channel]);
+	host_poll(host, IN_LEN);
+	CHECK(host->cmds[CMD_START_CHIP_RESP] == 1, "no START_CHIP_RESP");
+	CHECK(src_he(host->last[CMD_START_CHIP_RESP]) ==
+	      host->channel_to_he[channel], "START_CHIP_RESP source HE");
+	CHECK(host->cmds[CMD_CHIP_STATE_EVENT] == 1 &&
+	      host->last[CMD_CHIP_STATE_EVENT][12] == 0,
+	      "not error active after start");
+}
+
+static struct kvaser_emu *create(struct host *host,
+				 const struct kvaser_emu_config *cfg)
+{
+	memset(host, 0, sizeof(*host));
+	host->emu = kvaser_emu_create(cfg);
+	if (!host->emu) {
+		perror("kvaser_emu_create");
+		exit(EXIT_FAILURE);
+	}
+	host->now = 1000000;
+	host->leaf = cfg->family != KVASER_EMU_HYDRA;
+	host->usbcan = cfg->family == KVASER_EMU_USBCAN;
+	host->max_packet = cfg->max_packet;
+
+	return host->emu;
+}
+
+static void test_probe(void)
+{
+	struct kvaser_emu_config cfg;
+	struct host host;
+
+	kvaser_emu_default_config(&cfg, KVASER_EMU_HYDRA);
+	cfg.nchannels = 4;
+	create(&host, &cfg);
+	host_probe(&host, &cfg);
+	host_start(&host, 3);
+
+	host_clear(&host);
+	host_simple_cmd(&host, CMD_STOP_CHIP_REQ, host.channel_to_he[3]);
+	host_poll(&host, IN_LEN);
+	CHECK(host.cmds[CMD_STOP_CHIP_RESP] == 1, "no STOP_CHIP_RESP");
+	CHECK(kvaser_emu_stats(host.emu)->unknown_cmds == 0,
+	      "%" PRIu64 " unknown commands",
+	      kvaser_emu_stats(host.emu)->unknown_cmds);
+
+	kvaser_emu_destroy(host.emu);
+}
+
+/* Classic 8 byte frames with 11-bit identifiers take 111 bits */
+static void test_tx_ack(bool ext_cmd)
+{
+	const uint64_t frame_ns = 111 * BIT_NS_500K;
+	struct kvaser_emu_config cfg;
+	struct host host;
+	uint16_t first;
+	unsigned int i;
+
+	kvaser_emu_default_config(&cfg, KVASER_EMU_HYDRA);
+	cfg.ext_cmd = ext_cmd;
+	create(&host, &cfg);
+	host_probe(&host, &cfg);
+	host_start(&host, 0);
+
+	first = host.transid + 1;
+	for (i = 0; i < 100; i++) {
+		uint8_t cmd[40] = { 0 };
+
+		cmd[1] = host.channel_to_he[0];
+		kvaser_emu_put_le16(cmd + 2, ++host.transid);
+		if (ext_cmd) {
+			cmd[0] = CMD_EXTENDED;
+			kvaser_emu_put_le16(cmd + 4, sizeof(cmd));
+			cmd[6] = CMD_TX_CAN_MESSAGE_FD;
+			kvaser_emu_put_le32(cmd + 12, i);
+			kvaser_emu_put_le32(cmd + 16, i);
+			kvaser_emu_put_le32(cmd + 20, 8 << 8);
+			cmd[24] = 8;
+			cmd[25] = 8;
+			host_send(&host, cmd, sizeof(cmd));
+		} else {
+			cmd[0] = CMD_TX_CAN_MESSAGE;
+			kvaser_emu_put_le32(cmd + 4, i);
+			cmd[16] = 8;
+			host_send(&host, cmd, 32);
+		}
+	}
+
+	/* Nothing is acknowledged before the first frame has left the bus */
+	host_clear(&host);
+	host_poll(&host, IN_LEN);
+	CHECK(host.nacks == 0, "%u early acks", host.nacks);
+	CHECK(kvaser_emu_next_event(host.emu) == host.now + frame_ns,
+	      "next event %" PRIu64 " ns away",
+	      kvaser_emu_next_event(host.emu) - host.now);
+
+	host.now += 50 * frame_ns;
+	host_poll(&host, IN_LEN);
+	CHECK(host.nacks == 50, "%u acks after 50 frame times", host.nacks);
+
+	host.now += 50 * frame_ns;
+	host_poll(&host, IN_LEN);
+	CHECK(host.nacks == 100, "%u acks after 100 frame times", host.nacks);
+
+	for (i = 0; i < host.nacks; i++)
+		CHECK(host.ack_transids[i] == first + i,
+		      "ack %u has transid %u", i, host.ack_transids[i]);
+
+	CHECK(ext_cmd ? host.ext_cmds[CMD_TX_ACKNOWLEDGE_FD] == 100 :
+			host.cmds[CMD_TX_ACKNOWLEDGE] == 100,
+	      "acks of the wrong kind");
+
+	kvaser_emu_destroy(host.emu);
+}
+
+/* At line rate the bus carries 1 s / 222 us = 4504 frames per channel. A
+ * small IN transfer makes the host reassemble split commands.
+ */
+static void test_rx_line_rate(size_t in_len)
+{
+	const uint64_t expected = 1000000000ULL / (111 * BIT_NS_500K);
+	struct kvaser_emu_config cfg;
+	const struct kvaser_emu_stats *stats;
+	struct host host;
+	uint64_t end;
+	unsigned int i;
+
+	kvaser_emu_default_config(&cfg, KVASER_EMU_HYDRA);
+	cfg.nchannels = 2;
+	cfg.rx.rate = KVASER_EMU_LINE_RATE;
+	create(&host, &cfg);
+	host_probe(&host, &cfg);
+	for (i = 0; i < cfg.nchannels; i++)
+		host_start(&host, i);
+
+	host_clear(&host);
+	end = host.now + 1000000000ULL;
+	while (host.now < end) {
+		host.now += 1000000;
+		host_poll(&host, in_len);
+	}
+
+	stats = kvaser_emu_stats(host.emu);
+	CHECK(host.ext_cmds[CMD_RX_MESSAGE_FD] == stats->rx_frames,
+	      "host got %u of %" PRIu64 " Rx frames",
+	      host.ext_cmds[CMD_RX_MESSAGE_FD], stats->rx_frames);
+	CHECK(stats->rx_frames >= 2 * expected - 2 &&
+	      stats->rx_frames <= 2 * expected,
+	      "%" PRIu64 " Rx frames, expected %" PRIu64,
+	      stats->rx_frames, 2 * expected);
+	CHECK(!host.rx_ts_backwards, "Rx timestamps went backwards");
+	CHECK(host.format_errors == 0, "%u format errors", host.format_errors);
+	CHECK(stats->overruns == 0, "%" PRIu64 " overruns", stats->overruns);
+
+	kvaser_emu_destroy(host.emu);
+}
+
+static void test_bus_off(void)
+{
+	struct kvaser_emu_config cfg;
+	const struct kvaser_emu_stats *stats;
+	struct host host;
+	uint64_t rx_frames;
+
+	kvaser_emu_default_config(&cfg, KVASER_EMU_HYDRA);
+	cfg.rx.rate = 1000;
+	create(&host, &cfg);
+	host_probe(&host, &cfg);
+	host_start(&host, 0);
+
+	host.now += 10000000;
+	host_poll(&host, IN_LEN);
+	stats = kvaser_emu_stats(host.emu);
+	CHECK(stats->rx_frames == 10, "%" PRIu64 " Rx frames in 10 ms at 1000/s",
+	      stats->rx_frames);
+
+	host_clear(&host);
+	kvaser_emu_event(host.emu, 0, KVASER_EMU_EVENT_BUS_OFF, host.now);
+	host_poll(&host, IN_LEN);
+	CHECK(host.cmds[CMD_CHIP_STATE_EVENT] == 1 &&
+	      host.last[CMD_CHIP_STATE_EVENT][12] == (1U << 6),
+	      "no BUS_OFF chip state event");
+
+	rx_frames = stats->rx_frames;
+	host.now += 10000000;
+	host_poll(&host, IN_LEN);
+	CHECK(stats->rx_frames == rx_frames, "Rx while bus off");
+	CHECK(kvaser_emu_next_event(host.emu) == UINT64_MAX,
+	      "bus off channel not idle");
+
+	kvaser_emu_destroy(host.emu);
+}
+
+static void test_malformed_out(void)
+{
+	struct kvaser_emu_config cfg;
+	struct host host;
+	uint8_t cmd[32] = { CMD_EXTENDED };
+
+	kvaser_emu_default_config(&cfg, KVASER_EMU_HYDRA);
+	create(&host, &cfg);
+
+	kvaser_emu_put_le16(cmd + 4, 4);
+	CHECK(kvaser_emu_out(host.emu, cmd, sizeof(cmd), host.now) < 0,
+	      "ext command of length 4 accepted");
+	kvaser_emu_put_le16(cmd + 4, 64);
+	CHECK(kvaser_emu_out(host.emu, cmd, sizeof(cmd), host.now) < 0,
+	      "ext command longer than the transfer accepted");
+	CHECK(kvaser_emu_stats(host.emu)->format_errors == 2,
+	      "format errors not counted");
+
+	kvaser_emu_destroy(host.emu);
+}
+
+static void leaf_host_send(struct host *host, const uint8_t *cmd)
+{
+	CHECK(kvaser_emu_out(host->emu, cmd, cmd[0], host->now) == 1,
+	      "OUT command %u rejected", cmd[1]);
+}
+
+static void leaf_host_simple_cmd(struct host *host, uint8_t cmd_no,
+				 uint8_t channel)
+{
+	uint8_t cmd[4] = { sizeof(cmd), cmd_no, 0xff, channel };
+
+	leaf_host_send(host, cmd);
+}
+
+static void leaf_host_probe(struct host *host,
+			    const struct kvaser_emu_config *cfg)
+{
+	uint8_t cap_req[10] = { sizeof(cap_req), LEAF_CMD_GET_CAPABILITIES_REQ };
+	const uint8_t *resp;
+
+	host_clear(host);
+	leaf_host_simple_cmd(host, LEAF_CMD_GET_SOFTWARE_INFO, 0);
+	leaf_host_simple_cmd(host, LEAF_CMD_GET_CARD_INFO, 0);
+	host_poll(host, IN_LEN);
+
+	resp = host->last[LEAF_CMD_GET_SOFTWARE_INFO_REPLY];
+	CHECK(host->cmds[LEAF_CMD_GET_SOFTWARE_INFO_REPLY] == 1,
+	      "no software info");
+	if (host->usbcan) {
+		CHECK(resp[0] == 24 && kvaser_emu_get_le16(resp + 8) ==
+		      cfg->max_outstanding_tx, "USBcan software info");
+	} else {
+		CHECK(resp[0] == 32 && kvaser_emu_get_le16(resp + 12) ==
+		      cfg->max_outstanding_tx, "leaf software info");
+		CHECK(!!(kvaser_emu_get_le32(resp + 4) & (1U << 12)) ==
+		      cfg->ext_cap, "EXT_CAP software option");
+	}
+
+	resp = host->last[LEAF_CMD_GET_CARD_INFO_REPLY];
+	CHECK(host->cmds[LEAF_CMD_GET_CARD_INFO_REPLY] == 1 && resp[0] == 32 &&
+	      resp[3] == cfg->nchannels, "card info");
+
+	if (host->usbcan || !cfg->ext_cap)
+		return;
+
+	host_clear(host);
+	kvaser_emu_put_le16(cap_req + 4, 0x02);
+	leaf_host_send(host, cap_req);
+	kvaser_emu_put_le16(cap_req + 4, 0x05);
+	leaf_host_send(host, cap_req);
+	host_poll(host, IN_LEN);
+	resp = host->last[LEAF_CMD_GET_CAPABILITIES_RESP];
+	CHECK(host->cmds[LEAF_CMD_GET_CAPABILITIES_RESP] == 2 &&
+	      kvaser_emu_get_le16(resp + 4) == 0x05 &&
+	      kvaser_emu_get_le16(resp + 6) == 0 &&
+	      kvaser_emu_get_le32(resp + 8) & 1, "ERR_REPORT capability");
+}
+
+static void leaf_host_start(struct host *host, unsigned int channel)
+{
+	/* 500 kbit/s */
+	uint8_t cmd[12] = { sizeof(cmd), LEAF_CMD_SET_BUS_PARAMS, 0xff,
+			    channel };
+
+	kvaser_emu_put_le32(cmd + 4, 500000);
+	cmd[8] = 13;
+	cmd[9] = 2;
+	cmd[10] = 1;
+	cmd[11] = 1;
+	leaf_host_send(host, cmd);
+
+	host_clear(host);
+	if (!host->usbcan) {
+		leaf_host_simple_cmd(host, LEAF_CMD_GET_BUS_PARAMS, channel);
+		host_poll(host, IN_LEN);
+		CHECK(host->cmds[LEAF_CMD_GET_BUS_PARAMS_REPLY] == 1 &&
+		      !memcmp(host->last[LEAF_CMD_GET_BUS_PARAMS_REPLY] + 4,
+			      cmd + 4, 8), "bus parameters read back differ");
+	}
+
+	host_clear(host);
+	leaf_host_simple_cmd(host, LEAF_CMD_FLUSH_QUEUE, channel);
+	leaf_host_simple_cmd(host, LEAF_CMD_START_CHIP, channel);
+	host_poll(host, IN_LEN);
+	CHECK(host->cmds[LEAF_CMD_FLUSH_QUEUE_REPLY] == !host->usbcan,
+	      "flush reply on the wrong family");
+	CHECK(host->cmds[LEAF_CMD_START_CHIP_REPLY] == 1 &&
+	      host->last[LEAF_CMD_START_CHIP_REPLY][3] == channel,
+	      "no START_CHIP_REPLY");
+	CHECK(host->cmds[LEAF_CMD_CHIP_STATE_EVENT] == 1 &&
+	      host->last[LEAF_CMD_CHIP_STATE_EVENT][host->usbcan ? 8 : 12] == 0,
+	      "not error active after start");
+}
+
+static void test_leaf_probe(enum kvaser_emu_family family)
+{
+	struct kvaser_emu_config cfg;
+	struct host host;
+	uint8_t tx[20] = { sizeof(tx), LEAF_CMD_TX_STD_MESSAGE, 0, 0x42 };
+	unsigned int i;
+
+	kvaser_emu_default_config(&cfg, family);
+	create(&host, &cfg);
+	leaf_host_probe(&host, &cfg);
+	for (i = 0; i < cfg.nchannels; i++)
+		leaf_host_start(&host, i);
+
+	/* Identifier 0x123, 8 bytes, acknowledged with channel and tid */
+	tx[4] = 0x123 >> 6;
+	tx[5] = 0x123 & 0x3f;
+	tx[9] = 8;
+	host_clear(&host);
+	leaf_host_send(&host, tx);
+	host.now += 111 * BIT_NS_500K;
+	host_poll(&host, IN_LEN);
+	CHECK(host.nacks == 1 && host.ack_transids[0] == 0x42 &&
+	      host.last[LEAF_CMD_TX_ACKNOWLEDGE][2] == 0, "Tx acknowledge");
+
+	CHECK(kvaser_emu_stats(host.emu)->unknown_cmds == 0,
+	      "%" PRIu64 " unknown commands",
+	      kvaser_emu_stats(host.emu)->unknown_cmds);
+
+	kvaser_emu_destroy(host.emu);
+}
+
+/* Rx commands are 24 (leaf) or 20 (USBcan II) bytes, neither divides the
+ * packet size, so every full packet ends with a placeholder. Polling every
+ * 10 ms lets the transfers grow past one packet.
+ */
+static void test_leaf_placeholders(enum kvaser_emu_family family,
+				   unsigned int max_packet, bool log_messages)
+{
+	struct kvaser_emu_config cfg;
+	const struct kvaser_emu_stats *stats;
+	struct host host;
+	unsigned int rx_cmd;
+	uint64_t end;
+	unsigned int i;
+
+	kvaser_emu_default_config(&cfg, family);
+	cfg.max_packet = max_packet;
+	cfg.log_messages = log_messages;
+	cfg.rx.rate = KVASER_EMU_LINE_RATE;
+	create(&host, &cfg);
+	leaf_host_probe(&host, &cfg);
+	for (i = 0; i < cfg.nchannels; i++)
+		leaf_host_start(&host, i);
+
+	host_clear(&host);
+	end = host.now + 100000000ULL;
+	while (host.now < end) {
+		host.now += 10000000;
+		host_poll(&host, IN_LEN);
+	}
+
+	stats = kvaser_emu_stats(host.emu);
+	rx_cmd = log_messages ? LEAF_CMD_LOG_MESSAGE : LEAF_CMD_RX_STD_MESSAGE;
+	CHECK(stats->rx_frames > 0 && host.cmds[rx_cmd] == stats->rx_frames,
+	      "host got %u of %" PRIu64 " Rx frames", host.cmds[rx_cmd],
+	      stats->rx_frames);
+	CHECK(host.placeholders > 0 && host.placeholders == stats->placeholders,
+	      "host skipped %u of %" PRIu64 " placeholders", host.placeholders,
+	      stats->placeholders);
+	CHECK(host.crossings == 0, "%u commands cross a packet boundary",
+	      host.crossings);
+	CHECK(host.format_errors == 0, "%u format errors", host.format_errors);
+	CHECK(stats->overruns == 0, "%" PRIu64 " overruns", stats->overruns);
+
+	kvaser_emu_destroy(host.emu);
+}
+
+/* The 16-bit microsecond timer wraps every 65.536 ms */
+static void test_usbcan_clock_overflow(void)
+{
+	struct kvaser_emu_config cfg;
+	struct host host;
+	uint64_t end;
+
+	kvaser_emu_default_config(&cfg, KVASER_EMU_USBCAN);
+	cfg.nchannels = 1;
+	cfg.rx.rate = 1000;
+	create(&host, &cfg);
+	leaf_host_probe(&host, &cfg);
+	leaf_host_start(&host, 0);
+
+	host_clear(&host);
+	end = host.now + 1000000000ULL;
+	while (host.now < end) {
+		host.now += 10000000;
+		host_poll(&host, IN_LEN);
+	}
+
+	CHECK(host.clock_wraps == host.now / 1000 >> 16,
+	      "%" PRIu64 " clock overflows, expected %" PRIu64,
+	      host.clock_wraps, host.now / 1000 >> 16);
+	CHECK(!host.rx_ts_backwards, "Rx timestamps went backwards");
+
+	kvaser_emu_destroy(host.emu);
+}
+
+static void test_leaf_events(enum kvaser_emu_family family)
+{
+	unsigned int status_off = family == KVASER_EMU_USBCAN ? 8 : 12;
+	struct kvaser_emu_config cfg;
+	struct host host;
+	unsigned int i;
+
+	kvaser_emu_default_config(&cfg, family);
+	cfg.no_tx_ack = true;
+	create(&host, &cfg);
+	leaf_host_probe(&host, &cfg);
+	leaf_host_start(&host, 0);
+
+	host_clear(&host);
+	kvaser_emu_event(host.emu, 0, KVASER_EMU_EVENT_ERROR_PASSIVE, host.now);
+	host_poll(&host, IN_LEN);
+	CHECK(host.cmds[LEAF_CMD_CAN_ERROR_EVENT] == 1, "no CAN error event");
+	CHECK(host.cmds[LEAF_CMD_CHIP_STATE_EVENT] == 1 &&
+	      host.last[LEAF_CMD_CHIP_STATE_EVENT][status_off] == (1U << 5),
+	      "no error passive chip state event");
+
+	host_clear(&host);
+	kvaser_emu_event(host.emu, 0, KVASER_EMU_EVENT_BUS_OFF, host.now);
+	host_poll(&host, IN_LEN);
+	CHECK(host.cmds[LEAF_CMD_CHIP_STATE_EVENT] == 1 &&
+	      host.last[LEAF_CMD_CHIP_STATE_EVENT][status_off] == (1U << 6),
+	      "no bus off chip state event");
+
+	/* A host that ignores max_outstanding_tx gets TX_QUEUE_FULL */
+	kvaser_emu_event(host.emu, 0, KVASER_EMU_EVENT_ERROR_ACTIVE, host.now);
+	host_clear(&host);
+	for (i = 0; i <= cfg.max_outstanding_tx; i++) {
+		uint8_t tx[20] = { sizeof(tx), LEAF_CMD_TX_STD_MESSAGE, 0, i };
+
+		leaf_host_send(&host, tx);
+	}
+	host_poll(&host, IN_LEN);
+	CHECK(host.cmds[LEAF_CMD_ERROR_EVENT] == 1 &&
+	      host.last[LEAF_CMD_ERROR_EVENT][3] == 0x8,
+	      "no TX_QUEUE_FULL error event");
+
+	/* Bad parameters are reported with the offending command */
+	host_clear(&host);
+	leaf_host_simple_cmd(&host, LEAF_CMD_SET_BUS_PARAMS, 7);
+	host_poll(&host, IN_LEN);
+	CHECK(host.cmds[LEAF_CMD_ERROR_EVENT] == 1 &&
+	      host.last[LEAF_CMD_ERROR_EVENT][3] == 0x9 &&
+	      kvaser_emu_get_le16(host.last[LEAF_CMD_ERROR_EVENT] +
+				  (family == KVASER_EMU_USBCAN ? 4 : 12)) ==
+	      LEAF_CMD_SET_BUS_PARAMS, "no PARAM error event");
+
+	kvaser_emu_destroy(host.emu);
+}
+
+int main(void)
+{
+	printf("probe\n");
+	test_probe();
+	printf("tx ack, extended commands\n");
+	test_tx_ack(true);
+	printf("tx ack, standard commands\n");
+	test_tx_ack(false);
+	printf("rx at line rate\n");
+	test_rx_line_rate(IN_LEN);
+	printf("rx at line rate, split commands\n");
+	test_rx_line_rate(100);
+	printf("bus off\n");
+	test_bus_off();
+	printf("malformed OUT transfers\n");
+	test_malformed_out();
+	printf("leaf probe, start and tx ack\n");
+	test_leaf_probe(KVASER_EMU_LEAF);
+	printf("usbcan probe, start and tx ack\n");
+	test_leaf_probe(KVASER_EMU_USBCAN);
+	printf("leaf placeholders, 512 byte packets\n");
+	test_leaf_placeholders(KVASER_EMU_LEAF, 512, false);
+	printf("leaf placeholders, 64 byte packets, log messages\n");
+	test_leaf_placeholders(KVASER_EMU_LEAF, 64, true);
+	printf("usbcan placeholders, 64 byte packets\n");
+	test_leaf_placeholders(KVASER_EMU_USBCAN, 64, false);
+	printf("usbcan clock overflow\n");
+	test_usbcan_clock_overflow();
+	printf("leaf error events\n");
+	test_leaf_events(KVASER_EMU_LEAF);
+	printf("usbcan error events\n");
+	test_leaf_events(KVASER_EMU_USBCAN);
+
+	printf("%s\n", failures ? "FAILED" : "PASSED");
+
+	return failures ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -0,0 +1,122 @@
+/* SPDX-License-Identifier: GPL-2.0 OR BSD-2-Clause */
+/* Kvaser USB device emulator.
+ *
+ * The engine models the firmware side of the bulk endpoints: it takes the
+ * commands the host writes to the bulk OUT endpoint and produces what the
+ * device sends on the bulk IN endpoint. It knows nothing about USB itself,
+ * the FunctionFS gadget (kvaser_emu_ffs.c), the self test and the replay
+ * harness all drive the same engine. Time is passed in by the caller, so
+ * runs are reproducible when the caller uses a virtual clock.
+ */
+
+#ifndef KVASER_EMU_H
+#define KVASER_EMU_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define KVASER_EMU_MAX_CHANNELS		5
+
+/* Rx rate that keeps the bus fully loaded */
+#define KVASER_EMU_LINE_RATE		UINT32_MAX
+
+enum kvaser_emu_family {
+	KVASER_EMU_HYDRA,
+	KVASER_EMU_LEAF,
+	KVASER_EMU_USBCAN,
+};
+
+/* Frames the emulated bus sends to the host on each started channel */
+struct kvaser_emu_traffic {
+	/* Frames/s per channel, 0 for none or KVASER_EMU_LINE_RATE */
+	uint32_t rate;
+	/* Frames sent back to back every 1/rate * burst, 0 or 1 for steady */
+	uint32_t burst;
+	/* Payload length, clamped to 8 for classic frames */
+	uint8_t len;
+	bool ext_id;
+	bool fd;
+	bool brs;
+};
+
+struct kvaser_emu_config {
+	enum kvaser_emu_family family;
+	unsigned int nchannels;
+	/* Bulk endpoint wMaxPacketSize */
+	unsigned int max_packet;
+	/* Reported as max_outstanding_tx, sizes the host's Tx contexts */
+	unsigned int max_outstanding_tx;
+	/* Firmware flags: extended commands, CAN FD, extended capabilities */
+	bool ext_cmd;
+	bool canfd;
+	bool ext_cap;
+	/* Device clock in MHz: 80 (kcan) or 24 (flexc) for hydra, 16, 24 or
+	 * 32 for leaf. USBcan II runs at 8 MHz.
+	 */
+	unsigned int clock_mhz;
+	uint32_t serial;
+	/* Do not acknowledge Tx frames, the host runs out of Tx contexts */
+	bool no_tx_ack;
+	/* Leaf: report Rx frames with CMD_LEAF_LOG_MESSAGE */
+	bool log_messages;
+	struct kvaser_emu_traffic rx;
+};
+
+struct kvaser_emu_stats {
+	uint64_t cmds_out;
+	uint64_t cmds_in;
+	uint64_t bytes_in;
+	uint64_t rx_frames;
+	uint64_t tx_frames;
+	uint64_t tx_acks;
+	/* Commands the host sent that the model does not know */
+	uint64_t unknown_cmds;
+	/* Malformed OUT data, the rest of the transfer is dropped */
+	uint64_t format_errors;
+	/* Generated commands dropped because the IN queue was full */
+	uint64_t overruns;
+	/* Zero-length placeholders written before a packet boundary */
+	uint64_t placeholders;
+};
+
+struct kvaser_emu;
+
+/* Fills @cfg with the defaults of @family */
+void kvaser_emu_default_config(struct kvaser_emu_config *cfg,
+			       enum kvaser_emu_family family);
+struct kvaser_emu *kvaser_emu_create(const struct kvaser_emu_config *cfg);
+void kvaser_emu_destroy(struct kvaser_emu *emu);
+
+/* Hands one bulk OUT transfer to the device. Returns the number of commands
+ * processed, or -1 if the transfer was malformed.
+ */
+int kvaser_emu_out(struct kvaser_emu *emu, const void *buf, size_t len,
+		   uint64_t now_ns);
+
+/* Fills one bulk IN transfer of at most @len bytes with what the device has
+ * to say at @now_ns. Returns the transfer length, 0 if there is nothing.
+ */
+size_t kvaser_emu_in(struct kvaser_emu *emu, void *buf, size_t len,
+		     uint64_t now_ns);
+
+/* Time at which kvaser_emu_in() has something new, UINT64_MAX if the
+ * device is idle until the host writes again
+ */
+uint64_t kvaser_emu_next_event(const struct kvaser_emu *emu);
+
+const struct kvaser_emu_stats *kvaser_emu_stats(const struct kvaser_emu *emu);
+
+/* Queues a bus event on @channel, see the family models for what is
+ * supported. Returns 0, or -1 if the family does not know the event.
+ */
+enum kvaser_emu_event {
+	KVASER_EMU_EVENT_ERROR_ACTIVE,
+	KVASER_EMU_EVENT_ERROR_PASSIVE,
+	KVASER_EMU_EVENT_BUS_OFF,
+};
+
+int kvaser_emu_event(struct kvaser_emu *emu, unsigned int channel,
+		     enum kvaser_emu_event event, uint64_t now_ns);
+
+#endif /* KVASER_EMU_H */
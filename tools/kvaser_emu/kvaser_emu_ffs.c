@@ -0,0 +1,501 @@
+// SPDX-License-Identifier: GPL-2.0 OR BSD-2-Clause
+/* Kvaser USB device emulator, FunctionFS gadget daemon.
+ *
+ * Serves the emulator engine on a FunctionFS instance, see
+ * kvaser_emu_gadget.sh for setting one up on dummy_hcd. The gadget has one
+ * vendor specific interface with a bulk IN and a bulk OUT endpoint. The
+ * descriptors use virtual endpoint addresses, so the host sees 0x82 and 0x02
+ * whatever endpoints the UDC hands out, as kvaser_usb_hydra requires. The
+ * leaf subdriver takes the first bulk endpoints and does not mind.
+ */
+
+#define _GNU_SOURCE
+
+#include <endian.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <linux/usb/ch9.h>
+#include <linux/usb/functionfs.h>
+
+#include "kvaser_emu.h"
+
+#define KVASER_EMU_EP_IN		0x82
+#define KVASER_EMU_EP_OUT		0x02
+
+/* KVASER_USB_RX_BUFFER_SIZE, the host's bulk IN transfer size */
+#define KVASER_EMU_IN_LEN		3072
+#define KVASER_EMU_OUT_LEN		4096
+
+struct kvaser_emu_ffs_func_desc {
+	struct usb_interface_descriptor intf;
+	struct usb_endpoint_descriptor_no_audio in;
+	struct usb_endpoint_descriptor_no_audio out;
+} __attribute__((packed));
+
+struct kvaser_emu_ffs_descs {
+	struct usb_functionfs_descs_head_v2 header;
+	__le32 fs_count;
+	__le32 hs_count;
+	struct kvaser_emu_ffs_func_desc fs;
+	struct kvaser_emu_ffs_func_desc hs;
+} __attribute__((packed));
+
+#define KVASER_EMU_STR_INTERFACE	"Kvaser USB emulator"
+
+struct kvaser_emu_ffs_strings {
+	struct usb_functionfs_strings_head header;
+	struct {
+		__le16 code;
+		char str[sizeof(KVASER_EMU_STR_INTERFACE)];
+	} __attribute__((packed)) lang0;
+} __attribute__((packed));
+
+struct kvaser_emu_ffs {
+	const char *dir;
+	int ep0;
+	int ep_in;
+	int ep_out;
+	struct kvaser_emu_config cfg;
+
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	/* Recreated on every FUNCTIONFS_ENABLE, the host starts over */
+	struct kvaser_emu *emu;
+	bool verbose;
+};
+
+static uint64_t kvaser_emu_ffs_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void kvaser_emu_ffs_func_desc(struct kvaser_emu_ffs_func_desc *desc,
+				     uint16_t max_packet)
+{
+	desc->intf.bLength = sizeof(desc->intf);
+	desc->intf.bDescriptorType = USB_DT_INTERFACE;
+	desc->intf.bNumEndpoints = 2;
+	desc->intf.bInterfaceClass = USB_CLASS_VENDOR_SPEC;
+	desc->intf.iInterface = 1;
+
+	desc->in.bLength = sizeof(desc->in);
+	desc->in.bDescriptorType = USB_DT_ENDPOINT;
+	desc->in.bEndpointAddress = KVASER_EMU_EP_IN;
+	desc->in.bmAttributes = USB_ENDPOINT_XFER_BULK;
+	desc->in.wMaxPacketSize = htole16(max_packet);
+
+	desc->out = desc->in;
+	desc->out.bEndpointAddress = KVASER_EMU_EP_OUT;
+}
+
+static int kvaser_emu_ffs_write_descs(struct kvaser_emu_ffs *ffs)
+{
+	struct kvaser_emu_ffs_descs descs = { 0 };
+	struct kvaser_emu_ffs_strings strings = { 0 };
+
+	descs.header.magic = htole32(FUNCTIONFS_DESCRIPTORS_MAGIC_V2);
+	descs.header.length = htole32(sizeof(descs));
+	descs.header.flags = htole32(FUNCTIONFS_HAS_FS_DESC |
+				     FUNCTIONFS_HAS_HS_DESC |
+				     FUNCTIONFS_VIRTUAL_ADDR);
+	descs.fs_count = htole32(3);
+	descs.hs_count = htole32(3);
+	kvaser_emu_ffs_func_desc(&descs.fs, 64);
+	kvaser_emu_ffs_func_desc(&descs.hs, 512);
+
+	strings.header.magic = htole32(FUNCTIONFS_STRINGS_MAGIC);
+	strings.header.length = htole32(sizeof(strings));
+	strings.header.str_count = htole32(1);
+	strings.header.lang_count = htole32(1);
+	strings.lang0.code = htole16(0x0409);
+	strcpy(strings.lang0.str, KVASER_EMU_STR_INTERFACE);
+
+	if (write(ffs->ep0, &descs, sizeof(descs)) != sizeof(descs)) {
+		perror("write descriptors");
+		return -1;
+	}
+
+	if (write(ffs->ep0, &strings, sizeof(strings)) != sizeof(strings)) {
+		perror("write strings");
+		return -1;
+	}
+
+	return 0;
+}
+
+static int kvaser_emu_ffs_open_ep(const struct kvaser_emu_ffs *ffs,
+				  const char *name, int flags)
+{
+	char path[256];
+	int fd;
+
+	snprintf(path, sizeof(path), "%s/%s", ffs->dir, name);
+	fd = open(path, flags);
+	if (fd < 0)
+		fprintf(stderr, "%s: %s\n", path, strerror(errno));
+
+	return fd;
+}
+
+static void kvaser_emu_ffs_reset(struct kvaser_emu_ffs *ffs)
+{
+	pthread_mutex_lock(&ffs->lock);
+	kvaser_emu_destroy(ffs->emu);
+	ffs->emu = kvaser_emu_create(&ffs->cfg);
+	if (!ffs->emu)
+		perror("kvaser_emu_create");
+	pthread_cond_broadcast(&ffs->cond);
+	pthread_mutex_unlock(&ffs->lock);
+}
+
+static void kvaser_emu_ffs_print_stats(struct kvaser_emu_ffs *ffs)
+{
+	const struct kvaser_emu_stats *stats;
+
+	pthread_mutex_lock(&ffs->lock);
+	if (ffs->emu) {
+		stats = kvaser_emu_stats(ffs->emu);
+		fprintf(stderr,
+			"cmds out %" PRIu64 " in %" PRIu64 ", rx %" PRIu64
+			", tx %" PRIu64 " acked %" PRIu64 ", unknown %" PRIu64
+			", format errors %" PRIu64 ", overruns %" PRIu64 "\n",
+			stats->cmds_out, stats->cmds_in, stats->rx_frames,
+			stats->tx_frames, stats->tx_acks, stats->unknown_cmds,
+			stats->format_errors, stats->overruns);
+	}
+	pthread_mutex_unlock(&ffs->lock);
+}
+
+/* The device has no vendor control requests, stall whatever comes */
+static void kvaser_emu_ffs_stall(struct kvaser_emu_ffs *ffs,
+				 const struct usb_ctrlrequest *setup)
+{
+	uint8_t buf[1];
+
+	if (setup->bRequestType & USB_DIR_IN)
+		(void)read(ffs->ep0, buf, 0);
+	else
+		(void)write(ffs->ep0, buf, 0);
+}
+
+static void *kvaser_emu_ffs_ep0_thread(void *data)
+{
+	struct kvaser_emu_ffs *ffs = data;
+	struct usb_functionfs_event event;
+
+	for (;;) {
+		ssize_t n = read(ffs->ep0, &event, sizeof(event));
+
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			perror("read ep0");
+			exit(EXIT_FAILURE);
+		}
+
+		switch (event.type) {
+		case FUNCTIONFS_ENABLE:
+			if (ffs->verbose)
+				fprintf(stderr, "enabled\n");
+			kvaser_emu_ffs_reset(ffs);
+			break;
+		case FUNCTIONFS_DISABLE:
+			if (ffs->verbose) {
+				fprintf(stderr, "disabled\n");
+				kvaser_emu_ffs_print_stats(ffs);
+			}
+			break;
+		case FUNCTIONFS_SETUP:
+			kvaser_emu_ffs_stall(ffs, &event.u.setup);
+			break;
+		default:
+			break;
+		}
+	}
+
+	return NULL;
+}
+
+static void *kvaser_emu_ffs_out_thread(void *data)
+{
+	struct kvaser_emu_ffs *ffs = data;
+	static uint8_t buf[KVASER_EMU_OUT_LEN];
+
+	for (;;) {
+		ssize_t n = read(ffs->ep_out, buf, sizeof(buf));
+
+		if (n < 0) {
+			/* The host went away, wait for the next enable */
+			if (errno != EINTR && errno != ESHUTDOWN)
+				usleep(10000);
+			continue;
+		}
+
+		pthread_mutex_lock(&ffs->lock);
+		if (ffs->emu &&
+		    kvaser_emu_out(ffs->emu, buf, n, kvaser_emu_ffs_now()) < 0 &&
+		    ffs->verbose)
+			fprintf(stderr, "malformed OUT transfer, %zd bytes\n", n);
+		pthread_cond_broadcast(&ffs->cond);
+		pthread_mutex_unlock(&ffs->lock);
+	}
+
+	return NULL;
+}
+
+static void kvaser_emu_ffs_wait(struct kvaser_emu_ffs *ffs, uint64_t until)
+{
+	struct timespec ts;
+
+	if (until == UINT64_MAX) {
+		pthread_cond_wait(&ffs->cond, &ffs->lock);
+		return;
+	}
+
+	ts.tv_sec = until / 1000000000ULL;
+	ts.tv_nsec = until % 1000000000ULL;
+	pthread_cond_timedwait(&ffs->cond, &ffs->lock, &ts);
+}
+
+static void *kvaser_emu_ffs_in_thread(void *data)
+{
+	struct kvaser_emu_ffs *ffs = data;
+	static uint8_t buf[KVASER_EMU_IN_LEN];
+	unsigned int max_packet = ffs->cfg.max_packet;
+
+	for (;;) {
+		size_t n = 0;
+
+		pthread_mutex_lock(&ffs->lock);
+		for (;;) {
+			if (ffs->emu) {
+				n = kvaser_emu_in(ffs->emu, buf, sizeof(buf),
+						  kvaser_emu_ffs_now());
+				if (n)
+					break;
+			}
+
+			kvaser_emu_ffs_wait(ffs, ffs->emu ?
+					    kvaser_emu_next_event(ffs->emu) :
+					    UINT64_MAX);
+		}
+		pthread_mutex_unlock(&ffs->lock);
+
+		if (write(ffs->ep_in, buf, n) < 0)
+			continue;
+
+		/* A transfer shorter than the host's buffer that ends on a
+		 * packet boundary needs a zero-length packet to complete
+		 */
+		if (n < sizeof(buf) && !(n % max_packet))
+			(void)write(ffs->ep_in, buf, 0);
+	}
+
+	return NULL;
+}
+
+static int kvaser_emu_ffs_parse_family(const char *arg,
+				       enum kvaser_emu_family *family)
+{
+	if (!strcmp(arg, "hydra")) {
+		*family = KVASER_EMU_HYDRA;
+		return 0;
+	}
+
+	if (!strcmp(arg, "leaf")) {
+		*family = KVASER_EMU_LEAF;
+		return 0;
+	}
+
+	if (!strcmp(arg, "usbcan")) {
+		*family = KVASER_EMU_USBCAN;
+		return 0;
+	}
+
+	return -1;
+}
+
+static void kvaser_emu_ffs_usage(const char *prog)
+{
+	fprintf(stderr,
+		"Usage: %s [options] FFS_DIR\n"
+		"  -f, --family NAME     device family: hydra, leaf or usbcan (default hydra)\n"
+		"  -c, --channels N      number of CAN channels (default 2, 1 for leaf)\n"
+		"  -r, --rx-rate N       generated Rx frames/s per channel, or \"line\" (default 0)\n"
+		"  -b, --burst N         Rx frames per burst (default 1)\n"
+		"  -l, --rx-len N        Rx payload length (default 8)\n"
+		"  -e, --rx-ext          generate 29-bit identifiers\n"
+		"  -F, --rx-fd           generate CAN FD frames\n"
+		"  -B, --rx-brs          generate CAN FD frames with bit rate switch\n"
+		"  -t, --max-tx N        max_outstanding_tx reported to the host\n"
+		"  -p, --max-packet N    bulk wMaxPacketSize in use, 64 or 512 (default 512, 64 for usbcan)\n"
+		"  -s, --std-cmd         no extended commands and no CAN FD\n"
+		"  -L, --log-messages    leaf: report Rx frames with CMD_LEAF_LOG_MESSAGE\n"
+		"  -n, --no-tx-ack       never acknowledge Tx frames\n"
+		"  -v, --verbose         print enable/disable events and statistics\n",
+		prog);
+}
+
+int main(int argc, char *argv[])
+{
+	static const struct option options[] = {
+		{ "family", required_argument, NULL, 'f' },
+		{ "channels", required_argument, NULL, 'c' },
+		{ "rx-rate", required_argument, NULL, 'r' },
+		{ "burst", required_argument, NULL, 'b' },
+		{ "rx-len", required_argument, NULL, 'l' },
+		{ "rx-ext", no_argument, NULL, 'e' },
+		{ "rx-fd", no_argument, NULL, 'F' },
+		{ "rx-brs", no_argument, NULL, 'B' },
+		{ "max-tx", required_argument, NULL, 't' },
+		{ "max-packet", required_argument, NULL, 'p' },
+		{ "std-cmd", no_argument, NULL, 's' },
+		{ "log-messages", no_argument, NULL, 'L' },
+		{ "no-tx-ack", no_argument, NULL, 'n' },
+		{ "verbose", no_argument, NULL, 'v' },
+		{ "help", no_argument, NULL, 'h' },
+		{ }
+	};
+	struct kvaser_emu_ffs ffs = { .ep0 = -1 };
+	struct kvaser_emu_config overrides = { 0 };
+	enum kvaser_emu_family family = KVASER_EMU_HYDRA;
+	pthread_condattr_t condattr;
+	pthread_t ep0_thread, in_thread, out_thread;
+	bool std_cmd = false;
+	char ep_name[8];
+	int opt;
+
+	while ((opt = getopt_long(argc, argv, "f:c:r:b:l:eFBt:p:sLnvh", options,
+				  NULL)) != -1) {
+		switch (opt) {
+		case 'f':
+			if (kvaser_emu_ffs_parse_family(optarg, &family)) {
+				fprintf(stderr, "Unknown family %s\n", optarg);
+				return EXIT_FAILURE;
+			}
+			break;
+		case 'c':
+			overrides.nchannels = strtoul(optarg, NULL, 0);
+			break;
+		case 'r':
+			if (!strcmp(optarg, "line"))
+				overrides.rx.rate = KVASER_EMU_LINE_RATE;
+			else
+				overrides.rx.rate = strtoul(optarg, NULL, 0);
+			break;
+		case 'b':
+			overrides.rx.burst = strtoul(optarg, NULL, 0);
+			break;
+		case 'l':
+			overrides.rx.len = strtoul(optarg, NULL, 0);
+			break;
+		case 'e':
+			overrides.rx.ext_id = true;
+			break;
+		case 'B':
+			overrides.rx.brs = true;
+			/* fall through */
+		case 'F':
+			overrides.rx.fd = true;
+			break;
+		case 't':
+			overrides.max_outstanding_tx = strtoul(optarg, NULL, 0);
+			break;
+		case 'p':
+			overrides.max_packet = strtoul(optarg, NULL, 0);
+			break;
+		case 's':
+			std_cmd = true;
+			break;
+		case 'L':
+			overrides.log_messages = true;
+			break;
+		case 'n':
+			overrides.no_tx_ack = true;
+			break;
+		case 'v':
+			ffs.verbose = true;
+			break;
+		default:
+			kvaser_emu_ffs_usage(argv[0]);
+			return opt == 'h' ? EXIT_SUCCESS : EXIT_FAILURE;
+		}
+	}
+
+	if (optind != argc - 1) {
+		kvaser_emu_ffs_usage(argv[0]);
+		return EXIT_FAILURE;
+	}
+	ffs.dir = argv[optind];
+
+	kvaser_emu_default_config(&ffs.cfg, family);
+	if (overrides.nchannels)
+		ffs.cfg.nchannels = overrides.nchannels;
+	if (overrides.max_outstanding_tx)
+		ffs.cfg.max_outstanding_tx = overrides.max_outstanding_tx;
+	if (overrides.max_packet)
+		ffs.cfg.max_packet = overrides.max_packet;
+	if (overrides.rx.len)
+		ffs.cfg.rx.len = overrides.rx.len;
+	if (std_cmd) {
+		ffs.cfg.ext_cmd = false;
+		ffs.cfg.canfd = false;
+	}
+	ffs.cfg.rx.rate = overrides.rx.rate;
+	ffs.cfg.rx.burst = overrides.rx.burst;
+	ffs.cfg.rx.ext_id = overrides.rx.ext_id;
+	ffs.cfg.rx.fd = overrides.rx.fd;
+	ffs.cfg.rx.brs = overrides.rx.brs;
+	ffs.cfg.no_tx_ack = overrides.no_tx_ack;
+	ffs.cfg.log_messages = overrides.log_messages;
+
+	/* Validate the configuration before touching the gadget */
+	ffs.emu = kvaser_emu_create(&ffs.cfg);
+	if (!ffs.emu) {
+		perror("kvaser_emu_create");
+		return EXIT_FAILURE;
+	}
+
+	pthread_mutex_init(&ffs.lock, NULL);
+	pthread_condattr_init(&condattr);
+	pthread_condattr_setclock(&condattr, CLOCK_MONOTONIC);
+	pthread_cond_init(&ffs.cond, &condattr);
+	signal(SIGPIPE, SIG_IGN);
+
+	ffs.ep0 = kvaser_emu_ffs_open_ep(&ffs, "ep0", O_RDWR);
+	if (ffs.ep0 < 0 || kvaser_emu_ffs_write_descs(&ffs))
+		return EXIT_FAILURE;
+
+	/* With FUNCTIONFS_VIRTUAL_ADDR the files are named after the address */
+	snprintf(ep_name, sizeof(ep_name), "ep%02x", KVASER_EMU_EP_IN);
+	ffs.ep_in = kvaser_emu_ffs_open_ep(&ffs, ep_name, O_WRONLY);
+	snprintf(ep_name, sizeof(ep_name), "ep%02x", KVASER_EMU_EP_OUT);
+	ffs.ep_out = kvaser_emu_ffs_open_ep(&ffs, ep_name, O_RDONLY);
+	if (ffs.ep_in < 0 || ffs.ep_out < 0)
+		return EXIT_FAILURE;
+
+	if (pthread_create(&ep0_thread, NULL, kvaser_emu_ffs_ep0_thread, &ffs) ||
+	    pthread_create(&out_thread, NULL, kvaser_emu_ffs_out_thread, &ffs) ||
+	    pthread_create(&in_thread, NULL, kvaser_emu_ffs_in_thread, &ffs)) {
+		fprintf(stderr, "pthread_create failed\n");
+		return EXIT_FAILURE;
+	}
+
+	pthread_join(ep0_thread, NULL);
+
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,109 @@
+#!/bin/sh
+# SPDX-License-Identifier: GPL-2.0 OR BSD-2-Clause
+#
+# Set up an emulated Kvaser USB device on dummy_hcd, served by kvaser_emu_ffs.
+#
+#   kvaser_emu_gadget.sh start [-P PID] [kvaser_emu_ffs options]
+#   kvaser_emu_gadget.sh stop
+#
+# The default PID 264 is a USBcan Pro 2xHS v2, which kvaser_usb drives with
+# the hydra subdriver. Pass -P 288 (Leaf Light v2) with -f leaf and -P 4
+# (USBcan II) with -f usbcan.
+
+set -e
+
+GADGET=/sys/kernel/config/usb_gadget/kvaser_emu
+FFS_DIR=/dev/kvaser_emu
+PID_FILE=/run/kvaser_emu_ffs.pid
+DAEMON=$(dirname "$0")/kvaser_emu_ffs
+
+VID=0x0bfd
+PID=264
+
+start() {
+	modprobe libcomposite
+	modprobe dummy_hcd
+
+	if ! mountpoint -q /sys/kernel/config; then
+		mount -t configfs none /sys/kernel/config
+	fi
+
+	mkdir "$GADGET"
+	echo $VID > "$GADGET/idVendor"
+	printf '0x%04x\n' "$PID" > "$GADGET/idProduct"
+	echo 0x0200 > "$GADGET/bcdUSB"
+
+	mkdir "$GADGET/strings/0x409"
+	echo "Kvaser AB" > "$GADGET/strings/0x409/manufacturer"
+	echo "Kvaser USB emulator" > "$GADGET/strings/0x409/product"
+	echo "00000001" > "$GADGET/strings/0x409/serialnumber"
+
+	mkdir "$GADGET/configs/c.1"
+	mkdir "$GADGET/configs/c.1/strings/0x409"
+	echo "Kvaser USB emulator" > "$GADGET/configs/c.1/strings/0x409/configuration"
+	echo 500 > "$GADGET/configs/c.1/MaxPower"
+
+	mkdir "$GADGET/functions/ffs.kvaser_emu"
+	ln -s "$GADGET/functions/ffs.kvaser_emu" "$GADGET/configs/c.1/"
+
+	mkdir -p "$FFS_DIR"
+	mount -t functionfs kvaser_emu "$FFS_DIR"
+
+	"$DAEMON" "$@" "$FFS_DIR" &
+	echo $! > "$PID_FILE"
+
+	# The endpoint files appear once the daemon has written its descriptors
+	for i in $(seq 50); do
+		[ -e "$FFS_DIR/ep82" ] && break
+		sleep 0.1
+	done
+	if [ ! -e "$FFS_DIR/ep82" ]; then
+		echo "kvaser_emu_ffs did not start" >&2
+		stop
+		exit 1
+	fi
+
+	ls /sys/class/udc | grep -m 1 dummy_udc > "$GADGET/UDC"
+}
+
+stop() {
+	if [ -e "$GADGET/UDC" ]; then
+		echo "" > "$GADGET/UDC" 2>/dev/null || true
+	fi
+
+	if [ -e "$PID_FILE" ]; then
+		kill "$(cat "$PID_FILE")" 2>/dev/null || true
+		rm -f "$PID_FILE"
+	fi
+
+	if mountpoint -q "$FFS_DIR"; then
+		umount "$FFS_DIR"
+	fi
+
+	if [ -d "$GADGET" ]; then
+		rm -f "$GADGET/configs/c.1/ffs.kvaser_emu"
+		rmdir "$GADGET/configs/c.1/strings/0x409"
+		rmdir "$GADGET/configs/c.1"
+		rmdir "$GADGET/functions/ffs.kvaser_emu"
+		rmdir "$GADGET/strings/0x409"
+		rmdir "$GADGET"
+	fi
+}
+
+case "$1" in
+start)
+	shift
+	if [ "$1" = "-P" ]; then
+		PID=$2
+		shift 2
+	fi
+	start "$@"
+	;;
+stop)
+	stop
+	;;
+*)
+	echo "Usage: $0 start [-P PID] [kvaser_emu_ffs options] | stop" >&2
+	exit 1
+	;;
+esac
@@ -0,0 +1,1212 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+/* Userspace stand-ins for the kernel API used by the Kvaser drivers.
+ *
+ * The driver sources are compiled unmodified against this header, see
+ * tools/kvaser_replay/README. Only what the drivers use is provided, with
+ * the semantics that matter for feeding them recorded traffic: memory is
+ * taken from the libc heap and counted, locks are real so that concurrency
+ * tests mean something, and everything that would reach hardware or the
+ * network stack is recorded by kshim.c instead.
+ */
+
+#ifndef KSHIM_H
+#define KSHIM_H
+
+#include <endian.h>
+#include <limits.h>
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <linux/types.h>
+#include <linux/errno.h>
+#include <linux/can.h>
+#include <linux/can/error.h>
+#include <linux/can/netlink.h>
+#include <linux/usb/ch9.h>
+#include <linux/net_tstamp.h>
+
+#ifndef KSHIM_LINUX_VERSION
+#define KSHIM_LINUX_VERSION	KERNEL_VERSION(6, 6, 0)
+#endif
+#define KERNEL_VERSION(a, b, c)	(((a) << 16) + ((b) << 8) + \
+				 ((c) > 255 ? 255 : (c)))
+#define LINUX_VERSION_CODE	KSHIM_LINUX_VERSION
+
+#define IS_ENABLED(option)	__kshim_is_defined(option)
+#define __kshim_arg_placeholder_1	0,
+#define __kshim_is_defined(x)	___kshim_is_defined(x)
+#define ___kshim_is_defined(val) \
+	____kshim_is_defined(__kshim_arg_placeholder_##val)
+#define ____kshim_is_defined(arg1_or_junk) \
+	__kshim_take_second_arg(arg1_or_junk 1, 0)
+#define __kshim_take_second_arg(__ignored, val, ...) val
+#define IS_BUILTIN(option)	IS_ENABLED(option)
+#define IS_REACHABLE(option)	IS_ENABLED(option)
+#define CONFIG_DEBUG_FS		1
+#define CONFIG_PM		1
+
+/* Types */
+
+typedef uint8_t u8;
+typedef uint16_t u16;
+typedef uint32_t u32;
+typedef unsigned long long u64;
+typedef int8_t s8;
+typedef int16_t s16;
+typedef int32_t s32;
+typedef long long s64;
+typedef unsigned int gfp_t;
+typedef s64 ktime_t;
+typedef u64 dma_addr_t;
+typedef u64 resource_size_t;
+typedef unsigned int fmode_t;
+typedef int netdev_tx_t;
+typedef unsigned int irqreturn_t;
+typedef unsigned long kernel_ulong_t;
+
+#define PAGE_SIZE		4096UL
+
+/* Compiler */
+
+#define __packed		__attribute__((packed))
+#define __aligned(x)		__attribute__((aligned(x)))
+#ifndef __always_inline
+#define __always_inline		inline __attribute__((always_inline))
+#endif
+#define __maybe_unused		__attribute__((unused))
+#define __always_unused		__attribute__((unused))
+#define __must_check		__attribute__((warn_unused_result))
+#define __printf(a, b)		__attribute__((format(printf, a, b)))
+#define __cold			__attribute__((cold))
+#define noinline		__attribute__((noinline))
+#define __init
+#define __exit
+#define __iomem
+#define __user
+#define __rcu
+#define __force
+#define __percpu
+#define __acquires(x)
+#define __releases(x)
+#define __must_hold(x)
+#define fallthrough		__attribute__((fallthrough))
+#define likely(x)		__builtin_expect(!!(x), 1)
+#define unlikely(x)		__builtin_expect(!!(x), 0)
+#define barrier()		__asm__ __volatile__("" ::: "memory")
+#define READ_ONCE(x)		(*(const volatile __typeof__(x) *)&(x))
+#define WRITE_ONCE(x, val)	(*(volatile __typeof__(x) *)&(x) = (val))
+#define smp_mb()		__atomic_thread_fence(__ATOMIC_SEQ_CST)
+#define smp_rmb()		__atomic_thread_fence(__ATOMIC_ACQUIRE)
+#define smp_wmb()		__atomic_thread_fence(__ATOMIC_RELEASE)
+#define smp_mb__before_atomic()	smp_mb()
+#define smp_mb__after_atomic()	smp_mb()
+#define smp_store_release(p, v)	__atomic_store_n(p, v, __ATOMIC_RELEASE)
+#define smp_load_acquire(p)	__atomic_load_n(p, __ATOMIC_ACQUIRE)
+#define BUILD_BUG_ON(cond)	_Static_assert(!(cond), "BUILD_BUG_ON: " #cond)
+#define BUILD_BUG_ON_ZERO(e)	((int)(sizeof(struct { int : (-!!(e)); })))
+#define __same_type(a, b)	__builtin_types_compatible_p(typeof(a), typeof(b))
+#define static_assert(expr, ...) _Static_assert(expr, #expr)
+
+#define container_of(ptr, type, member) \
+	((type *)((char *)(ptr) - offsetof(type, member)))
+#define ARRAY_SIZE(arr)		(sizeof(arr) / sizeof((arr)[0]))
+#define sizeof_field(TYPE, MEMBER) sizeof((((TYPE *)0)->MEMBER))
+#define struct_size(p, member, count) \
+	(sizeof(*(p)) + sizeof(*(p)->member) * (size_t)(count))
+#define flex_array_size(p, member, count) \
+	(sizeof(*(p)->member) * (size_t)(count))
+#define __stringify_1(x...)	#x
+#define __stringify(x...)	__stringify_1(x)
+
+/* Arithmetic */
+
+#define BIT(nr)			(1UL << (nr))
+#define BIT_ULL(nr)		(1ULL << (nr))
+#define BITS_PER_LONG		(8 * sizeof(long))
+#define BITS_PER_TYPE(t)	(8 * sizeof(t))
+#define BITS_TO_LONGS(nr)	(((nr) + BITS_PER_LONG - 1) / BITS_PER_LONG)
+#define GENMASK(h, l) \
+	(((~0UL) - (1UL << (l)) + 1) & (~0UL >> (BITS_PER_LONG - 1 - (h))))
+#define GENMASK_ULL(h, l) \
+	(((~0ULL) - (1ULL << (l)) + 1) & (~0ULL >> (63 - (h))))
+#define __bf_shf(x)		(__builtin_ffsll(x) - 1)
+#define FIELD_PREP(mask, val)	(((typeof(mask))(val) << __bf_shf(mask)) & (mask))
+#define FIELD_GET(mask, reg) \
+	((typeof(mask))(((reg) & (mask)) >> __bf_shf(mask)))
+#define FIELD_MAX(mask)		((typeof(mask))((mask) >> __bf_shf(mask)))
+
+#define min(a, b)		({ typeof(a) _a = (a); typeof(b) _b = (b); \
+				   _a < _b ? _a : _b; })
+#define max(a, b)		({ typeof(a) _a = (a); typeof(b) _b = (b); \
+				   _a > _b ? _a : _b; })
+#define min3(a, b, c)		min(min(a, b), c)
+#define max3(a, b, c)		max(max(a, b), c)
+#define min_t(t, a, b)		min((t)(a), (t)(b))
+#define max_t(t, a, b)		max((t)(a), (t)(b))
+#define clamp(v, lo, hi)	min(max(v, lo), hi)
+#define clamp_t(t, v, lo, hi)	clamp((t)(v), (t)(lo), (t)(hi))
+#define clamp_val(v, lo, hi)	clamp_t(typeof(v), v, lo, hi)
+#define swap(a, b)		do { typeof(a) _t = (a); (a) = (b); \
+				     (b) = _t; } while (0)
+#undef abs
+#define abs(x)			({ typeof(x) _x = (x); _x < 0 ? -_x : _x; })
+#define DIV_ROUND_UP(n, d)	(((n) + (d) - 1) / (d))
+#define DIV_ROUND_CLOSEST(x, d)	(((x) + ((d) / 2)) / (d))
+#define DIV_ROUND_UP_ULL(n, d)	DIV_ROUND_UP((unsigned long long)(n), (d))
+#define roundup(x, y)		((((x) + ((y) - 1)) / (y)) * (y))
+#define rounddown(x, y)		((x) - ((x) % (y)))
+#define round_up(x, y)		((((x) - 1) | ((typeof(x))((y) - 1))) + 1)
+#define round_down(x, y)	((x) & ~((typeof(x))((y) - 1)))
+#define ALIGN(x, a)		(((x) + ((typeof(x))(a) - 1)) & \
+				 ~((typeof(x))(a) - 1))
+#define IS_ALIGNED(x, a)	(((x) & ((typeof(x))(a) - 1)) == 0)
+#define upper_32_bits(n)	((u32)(((n) >> 16) >> 16))
+#define lower_32_bits(n)	((u32)((n) & 0xffffffff))
+#define is_power_of_2(n)	((n) != 0 && (((n) & ((n) - 1)) == 0))
+#define U8_MAX			((u8)~0U)
+#define U16_MAX			((u16)~0U)
+#define U32_MAX			((u32)~0U)
+#define U64_MAX			((u64)~0ULL)
+#define S32_MAX			((s32)(U32_MAX >> 1))
+#define S64_MAX			((s64)(U64_MAX >> 1))
+#define KTIME_MAX		S64_MAX
+
+static inline u64 div_u64_rem(u64 dividend, u32 divisor, u32 *remainder)
+{
+	*remainder = dividend % divisor;
+	return dividend / divisor;
+}
+
+static inline u64 div_u64(u64 dividend, u32 divisor)
+{
+	return dividend / divisor;
+}
+
+static inline s64 div_s64(s64 dividend, s32 divisor)
+{
+	return dividend / divisor;
+}
+
+static inline u64 div64_u64(u64 dividend, u64 divisor)
+{
+	return dividend / divisor;
+}
+
+static inline s64 div64_s64(s64 dividend, s64 divisor)
+{
+	return dividend / divisor;
+}
+
+#define do_div(n, base)		({ u32 __rem = (n) % (base); \
+				   (n) /= (base); __rem; })
+
+static inline u64 mul_u64_u32_shr(u64 a, u32 mul, unsigned int shift)
+{
+	return (u64)(((unsigned __int128)a * mul) >> shift);
+}
+
+static inline u64 mul_u64_u32_div(u64 a, u32 mul, u32 divisor)
+{
+	return (u64)(((unsigned __int128)a * mul) / divisor);
+}
+
+static inline unsigned long find_first_zero_bit(const unsigned long *addr,
+						unsigned long size)
+{
+	unsigned long i;
+
+	for (i = 0; i < size; i++)
+		if (!(addr[i / BITS_PER_LONG] & (1UL << (i % BITS_PER_LONG))))
+			return i;
+	return size;
+}
+
+static inline unsigned long find_first_bit(const unsigned long *addr,
+					   unsigned long size)
+{
+	unsigned long i;
+
+	for (i = 0; i < size; i++)
+		if (addr[i / BITS_PER_LONG] & (1UL << (i % BITS_PER_LONG)))
+			return i;
+	return size;
+}
+
+#define for_each_set_bit(bit, addr, size) \
+	for ((bit) = find_first_bit(addr, size); (bit) < (size); \
+	     (bit) = (bit) + 1 + find_first_bit_from(addr, size, (bit) + 1))
+
+static inline unsigned long find_first_bit_from(const unsigned long *addr,
+						unsigned long size,
+						unsigned long from)
+{
+	unsigned long i;
+
+	for (i = from; i < size; i++)
+		if (addr[i / BITS_PER_LONG] & (1UL << (i % BITS_PER_LONG)))
+			return i - from;
+	return size - from;
+}
+
+static inline int hweight32(u32 w)
+{
+	return __builtin_popcount(w);
+}
+
+static inline int fls(unsigned int x)
+{
+	return x ? 32 - __builtin_clz(x) : 0;
+}
+
+static inline unsigned long __ffs(unsigned long word)
+{
+	return __builtin_ctzl(word);
+}
+
+static inline int ilog2(u64 n)
+{
+	return 63 - __builtin_clzll(n);
+}
+
+static inline u32 hash_32(u32 val, unsigned int bits)
+{
+	return (val * 0x61C88647U) >> (32 - bits);
+}
+
+/* Byte order */
+
+#define cpu_to_le16(x)		((__force __le16)htole16(x))
+#define cpu_to_le32(x)		((__force __le32)htole32(x))
+#define cpu_to_le64(x)		((__force __le64)htole64(x))
+#define le16_to_cpu(x)		le16toh((__force u16)(x))
+#define le32_to_cpu(x)		le32toh((__force u32)(x))
+#define le64_to_cpu(x)		le64toh((__force u64)(x))
+#define cpu_to_be16(x)		((__force __be16)htobe16(x))
+#define cpu_to_be32(x)		htobe32(x)
+#define be32_to_cpu(x)		be32toh(x)
+#define le16_add_cpu(p, v)	(*(p) = cpu_to_le16(le16_to_cpu(*(p)) + (v)))
+
+static inline u16 get_unaligned_le16(const void *p)
+{
+	u16 v;
+
+	memcpy(&v, p, sizeof(v));
+	return le16toh(v);
+}
+
+static inline u32 get_unaligned_le32(const void *p)
+{
+	u32 v;
+
+	memcpy(&v, p, sizeof(v));
+	return le32toh(v);
+}
+
+static inline u64 get_unaligned_le64(const void *p)
+{
+	u64 v;
+
+	memcpy(&v, p, sizeof(v));
+	return le64toh(v);
+}
+
+static inline void put_unaligned_le32(u32 val, void *p)
+{
+	val = htole32(val);
+	memcpy(p, &val, sizeof(val));
+}
+
+/* Time */
+
+#define HZ			1000
+#define MSEC_PER_SEC		1000L
+#define USEC_PER_MSEC		1000L
+#define NSEC_PER_USEC		1000L
+#define NSEC_PER_MSEC		1000000L
+#define USEC_PER_SEC		1000000L
+#define NSEC_PER_SEC		1000000000L
+#define KILO			1000UL
+#define MEGA			1000000UL
+#define GIGA			1000000000UL
+#define HZ_PER_KHZ		1000UL
+#define HZ_PER_MHZ		1000000UL
+#define MAX_JIFFY_OFFSET	((LONG_MAX >> 1) - 1)
+
+u64 kshim_ktime_get_ns(void);
+u64 kshim_ktime_get_real_ns(void);
+
+#define jiffies			((unsigned long)(kshim_ktime_get_ns() / \
+						 NSEC_PER_MSEC))
+#define msecs_to_jiffies(m)	((unsigned long)(m))
+#define usecs_to_jiffies(u)	((unsigned long)DIV_ROUND_UP(u, 1000))
+#define jiffies_to_msecs(j)	((unsigned int)(j))
+#define jiffies_to_usecs(j)	((unsigned int)(j) * 1000U)
+#define time_after(a, b)	((long)((b) - (a)) < 0)
+#define time_before(a, b)	time_after(b, a)
+#define time_after_eq(a, b)	((long)((a) - (b)) >= 0)
+#define time_before_eq(a, b)	time_after_eq(b, a)
+#define round_jiffies_relative(j) (j)
+
+#define ktime_get()		((ktime_t)kshim_ktime_get_ns())
+#define ktime_get_ns()		kshim_ktime_get_ns()
+#define ktime_get_real()	((ktime_t)kshim_ktime_get_real_ns())
+#define ktime_get_real_ns()	kshim_ktime_get_real_ns()
+#define ktime_get_boottime()	ktime_get()
+#define ktime_get_clocktai()	ktime_get_real()
+#define ktime_get_raw_ns()	kshim_ktime_get_ns()
+#define ktime_add(a, b)		((a) + (b))
+#define ktime_sub(a, b)		((a) - (b))
+#define ktime_add_ns(a, n)	((a) + (n))
+#define ktime_add_us(a, u)	((a) + (s64)(u) * NSEC_PER_USEC)
+#define ktime_add_ms(a, m)	((a) + (s64)(m) * NSEC_PER_MSEC)
+#define ktime_sub_ns(a, n)	((a) - (n))
+#define ktime_to_ns(k)		((s64)(k))
+#define ktime_to_us(k)		((s64)(k) / NSEC_PER_USEC)
+#define ktime_to_ms(k)		((s64)(k) / NSEC_PER_MSEC)
+#define ns_to_ktime(n)		((ktime_t)(n))
+#define us_to_ktime(u)		((ktime_t)(u) * NSEC_PER_USEC)
+#define ms_to_ktime(m)		((ktime_t)(m) * NSEC_PER_MSEC)
+#define ktime_set(s, n)		((ktime_t)(s) * NSEC_PER_SEC + (n))
+#define ktime_compare(a, b)	((a) < (b) ? -1 : (a) > (b) ? 1 : 0)
+#define ktime_after(a, b)	((a) > (b))
+#define ktime_before(a, b)	((a) < (b))
+#define ktime_us_delta(a, b)	ktime_to_us(ktime_sub(a, b))
+#define ktime_ms_delta(a, b)	ktime_to_ms(ktime_sub(a, b))
+
+static inline ktime_t ktime_mono_to_any(ktime_t tmono, int offs)
+{
+	return tmono + (offs ? (ktime_t)(kshim_ktime_get_real_ns() -
+					 kshim_ktime_get_ns()) : 0);
+}
+
+#define TK_OFFS_REAL		1
+#define TK_OFFS_BOOT		0
+#define TK_OFFS_TAI		1
+#define ktime_mono_to_real(t)	ktime_mono_to_any(t, TK_OFFS_REAL)
+
+void clocks_calc_mult_shift(u32 *mult, u32 *shift, u32 from, u32 to,
+			    u32 maxsec);
+
+static inline void might_sleep(void)
+{
+}
+
+#define cond_resched()		do { } while (0)
+void msleep(unsigned int msecs);
+void usleep_range(unsigned long min, unsigned long max);
+void udelay(unsigned long usecs);
+#define ndelay(n)		do { } while (0)
+#define mdelay(m)		msleep(m)
+
+/* Printing */
+
+#define KERN_EMERG		""
+#define KERN_ALERT		""
+#define KERN_CRIT		""
+#define KERN_ERR		"E "
+#define KERN_WARNING		"W "
+#define KERN_NOTICE		"N "
+#define KERN_INFO		"I "
+#define KERN_DEBUG		"D "
+#define KERN_CONT		""
+
+/* Messages above kshim_loglevel are only counted, per level */
+extern int kshim_loglevel;
+extern unsigned long kshim_messages[8];
+extern unsigned long kshim_warnings;
+
+__printf(2, 3) void kshim_printk(int level, const char *fmt, ...);
+
+#define printk(fmt, ...)	kshim_printk(6, fmt, ##__VA_ARGS__)
+#define pr_fmt(fmt)		fmt
+#define pr_err(fmt, ...)	kshim_printk(3, pr_fmt(fmt), ##__VA_ARGS__)
+#define pr_warn(fmt, ...)	kshim_printk(4, pr_fmt(fmt), ##__VA_ARGS__)
+#define pr_info(fmt, ...)	kshim_printk(6, pr_fmt(fmt), ##__VA_ARGS__)
+#define pr_debug(fmt, ...)	kshim_printk(7, pr_fmt(fmt), ##__VA_ARGS__)
+#define pr_cont(fmt, ...)	kshim_printk(6, fmt, ##__VA_ARGS__)
+#define pr_err_ratelimited	pr_err
+#define pr_warn_once		pr_warn
+#define pr_info_once		pr_info
+
+#define dev_printk_level(l, d, fmt, ...) \
+	kshim_printk(l, "%s: " fmt, dev_name(d), ##__VA_ARGS__)
+#define dev_err(d, fmt, ...)	dev_printk_level(3, d, fmt, ##__VA_ARGS__)
+#define dev_warn(d, fmt, ...)	dev_printk_level(4, d, fmt, ##__VA_ARGS__)
+#define dev_info(d, fmt, ...)	dev_printk_level(6, d, fmt, ##__VA_ARGS__)
+#define dev_dbg(d, fmt, ...)	dev_printk_level(7, d, fmt, ##__VA_ARGS__)
+#define dev_notice(d, fmt, ...)	dev_printk_level(5, d, fmt, ##__VA_ARGS__)
+#define dev_err_ratelimited	dev_err
+#define dev_warn_ratelimited	dev_warn
+#define dev_info_ratelimited	dev_info
+#define dev_dbg_ratelimited	dev_dbg
+#define dev_warn_once		dev_warn
+#define dev_info_once		dev_info
+#define dev_err_probe(d, err, fmt, ...) \
+	({ dev_err(d, fmt, ##__VA_ARGS__); (err); })
+
+#define netdev_printk_level(l, n, fmt, ...) \
+	kshim_printk(l, "%s: " fmt, (n)->name, ##__VA_ARGS__)
+#define netdev_err(n, fmt, ...)	netdev_printk_level(3, n, fmt, ##__VA_ARGS__)
+#define netdev_warn(n, fmt, ...) netdev_printk_level(4, n, fmt, ##__VA_ARGS__)
+#define netdev_info(n, fmt, ...) netdev_printk_level(6, n, fmt, ##__VA_ARGS__)
+#define netdev_dbg(n, fmt, ...)	netdev_printk_level(7, n, fmt, ##__VA_ARGS__)
+#define netdev_notice(n, fmt, ...) \
+	netdev_printk_level(5, n, fmt, ##__VA_ARGS__)
+#define netdev_err_once		netdev_err
+#define netdev_warn_once	netdev_warn
+#define netdev_info_once	netdev_info
+#define net_ratelimit()		1
+#define printk_ratelimit()	1
+
+#define WARN_ON(cond)		({ int __c = !!(cond); \
+				   if (unlikely(__c)) { \
+					kshim_warn(__FILE__, __LINE__, #cond); \
+				   } \
+				   unlikely(__c); })
+#define WARN_ON_ONCE(cond)	WARN_ON(cond)
+#define WARN(cond, fmt, ...)	({ int __c = !!(cond); if (unlikely(__c)) { \
+				   kshim_printk(4, fmt, ##__VA_ARGS__); \
+				   kshim_warn(__FILE__, __LINE__, #cond); } \
+				   unlikely(__c); })
+#define WARN_ONCE		WARN
+#define BUG()			kshim_bug(__FILE__, __LINE__)
+#define BUG_ON(cond)		do { if (unlikely(cond)) BUG(); } while (0)
+#define lockdep_assert_held(l)	do { } while (0)
+
+void kshim_warn(const char *file, int line, const char *cond);
+__attribute__((noreturn)) void kshim_bug(const char *file, int line);
+
+#define scnprintf(buf, size, fmt, ...) \
+	({ int __n = snprintf(buf, size, fmt, ##__VA_ARGS__); \
+	   (size) ? min_t(int, __n, (int)(size) - 1) : 0; })
+
+ssize_t strscpy(char *dest, const char *src, size_t count);
+
+/* Memory */
+
+#define GFP_KERNEL		0x01U
+#define GFP_ATOMIC		0x02U
+#define GFP_NOWAIT		0x04U
+#define GFP_DMA32		0x08U
+#define __GFP_ZERO		0x100U
+#define __GFP_NOWARN		0x200U
+
+/* Counts every allocation made through the shim */
+struct kshim_alloc_stats {
+	unsigned long allocs;
+	unsigned long frees;
+	unsigned long bytes;
+	unsigned long skbs;
+	unsigned long failed;
+};
+
+extern struct kshim_alloc_stats kshim_alloc_stats;
+/* Makes the next n allocations fail, -1 disables */
+extern long kshim_fail_alloc_after;
+
+void *kshim_malloc(size_t size, gfp_t flags);
+void kshim_free(const void *p);
+
+#define kmalloc(s, f)		kshim_malloc(s, f)
+#define kzalloc(s, f)		kshim_malloc(s, (f) | __GFP_ZERO)
+#define kcalloc(n, s, f)	kshim_malloc((size_t)(n) * (s), \
+					     (f) | __GFP_ZERO)
+#define kmalloc_array(n, s, f)	kshim_malloc((size_t)(n) * (s), f)
+#define kvzalloc(s, f)		kzalloc(s, f)
+#define vzalloc(s)		kzalloc(s, GFP_KERNEL)
+#define vmalloc(s)		kmalloc(s, GFP_KERNEL)
+#define kfree(p)		kshim_free(p)
+#define kvfree(p)		kshim_free(p)
+#define vfree(p)		kshim_free(p)
+#define kfree_sensitive(p)	kshim_free(p)
+#define devm_kzalloc(d, s, f)	kzalloc(s, f)
+#define devm_kcalloc(d, n, s, f) kcalloc(n, s, f)
+#define devm_kfree(d, p)	kfree(p)
+
+static inline void *kmemdup(const void *src, size_t len, gfp_t gfp)
+{
+	void *p = kmalloc(len, gfp);
+
+	if (p)
+		memcpy(p, src, len);
+	return p;
+}
+
+#define ZERO_OR_NULL_PTR(p)	(!(p))
+#define IS_ERR_VALUE(x)		((unsigned long)(void *)(x) >= \
+				 (unsigned long)-4095)
+#define ERR_PTR(err)		((void *)(long)(err))
+#define PTR_ERR(ptr)		((long)(ptr))
+#define IS_ERR(ptr)		IS_ERR_VALUE(ptr)
+#define IS_ERR_OR_NULL(ptr)	(!(ptr) || IS_ERR_VALUE(ptr))
+#define ERR_CAST(ptr)		((void *)(ptr))
+#define PTR_ERR_OR_ZERO(ptr)	(IS_ERR(ptr) ? PTR_ERR(ptr) : 0)
+
+/* Atomics and bit operations */
+
+typedef struct {
+	int counter;
+} atomic_t;
+
+typedef struct {
+	s64 counter;
+} atomic64_t;
+
+#define ATOMIC_INIT(i)		{ (i) }
+#define ATOMIC64_INIT(i)	{ (i) }
+
+#define atomic_read(v)		__atomic_load_n(&(v)->counter, __ATOMIC_RELAXED)
+#define atomic_set(v, i)	__atomic_store_n(&(v)->counter, i, \
+						 __ATOMIC_RELAXED)
+#define atomic_add(i, v)	((void)__atomic_add_fetch(&(v)->counter, i, \
+							  __ATOMIC_SEQ_CST))
+#define atomic_sub(i, v)	((void)__atomic_sub_fetch(&(v)->counter, i, \
+							  __ATOMIC_SEQ_CST))
+#define atomic_inc(v)		atomic_add(1, v)
+#define atomic_dec(v)		atomic_sub(1, v)
+#define atomic_add_return(i, v)	__atomic_add_fetch(&(v)->counter, i, \
+						   __ATOMIC_SEQ_CST)
+#define atomic_sub_return(i, v)	__atomic_sub_fetch(&(v)->counter, i, \
+						   __ATOMIC_SEQ_CST)
+#define atomic_inc_return(v)	atomic_add_return(1, v)
+#define atomic_dec_return(v)	atomic_sub_return(1, v)
+#define atomic_dec_and_test(v)	(atomic_dec_return(v) == 0)
+#define atomic_fetch_inc(v)	__atomic_fetch_add(&(v)->counter, 1, \
+						   __ATOMIC_SEQ_CST)
+#define atomic_xchg(v, n)	__atomic_exchange_n(&(v)->counter, n, \
+						    __ATOMIC_SEQ_CST)
+#define atomic_cmpxchg(v, o, n)	({ typeof((v)->counter) __o = (o); \
+				   __atomic_compare_exchange_n(&(v)->counter, \
+					&__o, n, false, __ATOMIC_SEQ_CST, \
+					__ATOMIC_SEQ_CST); __o; })
+#define atomic_try_cmpxchg(v, po, n) \
+	__atomic_compare_exchange_n(&(v)->counter, po, n, false, \
+				    __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST)
+#define atomic64_read		atomic_read
+#define atomic64_set		atomic_set
+#define atomic64_add		atomic_add
+#define atomic64_sub		atomic_sub
+#define atomic64_inc		atomic_inc
+#define atomic64_dec		atomic_dec
+#define atomic64_add_return	atomic_add_return
+#define atomic64_inc_return	atomic_inc_return
+#define atomic64_xchg		atomic_xchg
+#define atomic64_cmpxchg	atomic_cmpxchg
+#define atomic64_try_cmpxchg	atomic_try_cmpxchg
+#define cmpxchg(p, o, n)	({ typeof(*(p)) __o = (o); \
+				   __atomic_compare_exchange_n(p, &__o, n, \
+					false, __ATOMIC_SEQ_CST, \
+					__ATOMIC_SEQ_CST); __o; })
+#define xchg(p, n)		__atomic_exchange_n(p, n, __ATOMIC_SEQ_CST)
+
+#define BIT_WORD(nr)		((nr) / BITS_PER_LONG)
+#define BIT_MASK(nr)		(1UL << ((nr) % BITS_PER_LONG))
+#define DECLARE_BITMAP(name, bits) unsigned long name[BITS_TO_LONGS(bits)]
+
+static inline void set_bit(long nr, volatile unsigned long *addr)
+{
+	__atomic_fetch_or(&addr[BIT_WORD(nr)], BIT_MASK(nr), __ATOMIC_SEQ_CST);
+}
+
+static inline void clear_bit(long nr, volatile unsigned long *addr)
+{
+	__atomic_fetch_and(&addr[BIT_WORD(nr)], ~BIT_MASK(nr),
+			   __ATOMIC_SEQ_CST);
+}
+
+static inline bool test_bit(long nr, const volatile unsigned long *addr)
+{
+	return __atomic_load_n(&addr[BIT_WORD(nr)], __ATOMIC_RELAXED) &
+	       BIT_MASK(nr);
+}
+
+static inline bool test_and_set_bit(long nr, volatile unsigned long *addr)
+{
+	return __atomic_fetch_or(&addr[BIT_WORD(nr)], BIT_MASK(nr),
+				 __ATOMIC_SEQ_CST) & BIT_MASK(nr);
+}
+
+static inline bool test_and_clear_bit(long nr, volatile unsigned long *addr)
+{
+	return __atomic_fetch_and(&addr[BIT_WORD(nr)], ~BIT_MASK(nr),
+				  __ATOMIC_SEQ_CST) & BIT_MASK(nr);
+}
+
+#define __set_bit		set_bit
+#define __clear_bit		clear_bit
+#define test_and_set_bit_lock	test_and_set_bit
+#define clear_bit_unlock	clear_bit
+#define bitmap_zero(dst, nbits)	memset(dst, 0, BITS_TO_LONGS(nbits) * \
+				       sizeof(unsigned long))
+
+/* Locks */
+
+typedef struct {
+	int locked;
+} spinlock_t;
+
+typedef spinlock_t raw_spinlock_t;
+
+#define __SPIN_LOCK_UNLOCKED(x)	{ 0 }
+#define DEFINE_SPINLOCK(x)	spinlock_t x = __SPIN_LOCK_UNLOCKED(x)
+
+static inline void spin_lock_init(spinlock_t *l)
+{
+	l->locked = 0;
+}
+
+static inline void spin_lock(spinlock_t *l)
+{
+	while (__atomic_exchange_n(&l->locked, 1, __ATOMIC_ACQUIRE))
+		while (__atomic_load_n(&l->locked, __ATOMIC_RELAXED))
+			__builtin_ia32_pause();
+}
+
+static inline int spin_trylock(spinlock_t *l)
+{
+	return !__atomic_exchange_n(&l->locked, 1, __ATOMIC_ACQUIRE);
+}
+
+static inline void spin_unlock(spinlock_t *l)
+{
+	__atomic_store_n(&l->locked, 0, __ATOMIC_RELEASE);
+}
+
+#define spin_lock_irqsave(l, f)	do { (f) = 0; spin_lock(l); } while (0)
+#define spin_unlock_irqrestore(l, f) do { (void)(f); spin_unlock(l); } \
+				     while (0)
+#define spin_lock_bh		spin_lock
+#define spin_unlock_bh		spin_unlock
+#define spin_lock_irq		spin_lock
+#define spin_unlock_irq		spin_unlock
+#define spin_is_locked(l)	READ_ONCE((l)->locked)
+#define assert_spin_locked(l)	WARN_ON(!spin_is_locked(l))
+#define local_bh_disable()	do { } while (0)
+#define local_bh_enable()	do { } while (0)
+#define local_irq_save(f)	((f) = 0)
+#define local_irq_restore(f)	((void)(f))
+#define in_interrupt()		0
+#define in_irq()		0
+#define in_task()		1
+
+struct mutex {
+	spinlock_t lock;
+};
+
+#define DEFINE_MUTEX(m)		struct mutex m = { { 0 } }
+#define mutex_init(m)		spin_lock_init(&(m)->lock)
+#define mutex_destroy(m)	do { } while (0)
+#define mutex_lock(m)		spin_lock(&(m)->lock)
+#define mutex_trylock(m)	spin_trylock(&(m)->lock)
+#define mutex_unlock(m)		spin_unlock(&(m)->lock)
+#define mutex_is_locked(m)	spin_is_locked(&(m)->lock)
+#define mutex_lock_interruptible(m) ({ mutex_lock(m); 0; })
+
+typedef struct {
+	unsigned int sequence;
+	spinlock_t lock;
+} seqlock_t;
+
+#define seqlock_init(s)		do { (s)->sequence = 0; \
+				     spin_lock_init(&(s)->lock); } while (0)
+
+static inline unsigned int read_seqbegin(const seqlock_t *sl)
+{
+	unsigned int seq;
+
+	while ((seq = __atomic_load_n(&sl->sequence, __ATOMIC_ACQUIRE)) & 1)
+		__builtin_ia32_pause();
+	return seq;
+}
+
+static inline unsigned int read_seqretry(const seqlock_t *sl,
+					 unsigned int start)
+{
+	smp_rmb();
+	return __atomic_load_n(&sl->sequence, __ATOMIC_RELAXED) != start;
+}
+
+static inline void write_seqlock(seqlock_t *sl)
+{
+	spin_lock(&sl->lock);
+	__atomic_add_fetch(&sl->sequence, 1, __ATOMIC_RELEASE);
+}
+
+static inline void write_sequnlock(seqlock_t *sl)
+{
+	__atomic_add_fetch(&sl->sequence, 1, __ATOMIC_RELEASE);
+	spin_unlock(&sl->lock);
+}
+
+#define write_seqlock_irqsave(s, f) do { (f) = 0; write_seqlock(s); } \
+				    while (0)
+#define write_sequnlock_irqrestore(s, f) do { (void)(f); \
+					      write_sequnlock(s); } while (0)
+
+struct u64_stats_sync {
+	seqlock_t seq;
+};
+
+#define u64_stats_init(s)	seqlock_init(&(s)->seq)
+#define u64_stats_update_begin(s) write_seqlock(&(s)->seq)
+#define u64_stats_update_end(s)	write_sequnlock(&(s)->seq)
+#define u64_stats_fetch_begin(s) read_seqbegin(&(s)->seq)
+#define u64_stats_fetch_retry(s, st) read_seqretry(&(s)->seq, st)
+
+struct wait_queue_head {
+	int dummy;
+};
+
+typedef struct wait_queue_head wait_queue_head_t;
+
+#define init_waitqueue_head(w)	do { } while (0)
+#define wake_up(w)		do { } while (0)
+#define wake_up_all(w)		do { } while (0)
+
+struct completion {
+	unsigned int done;
+};
+
+#define DECLARE_COMPLETION(c)	struct completion c = { 0 }
+
+static inline void init_completion(struct completion *x)
+{
+	__atomic_store_n(&x->done, 0, __ATOMIC_SEQ_CST);
+}
+
+#define reinit_completion	init_completion
+
+static inline void complete(struct completion *x)
+{
+	__atomic_add_fetch(&x->done, 1, __ATOMIC_SEQ_CST);
+}
+
+static inline void complete_all(struct completion *x)
+{
+	__atomic_store_n(&x->done, UINT_MAX / 2, __ATOMIC_SEQ_CST);
+}
+
+static inline bool completion_done(struct completion *x)
+{
+	return __atomic_load_n(&x->done, __ATOMIC_SEQ_CST) != 0;
+}
+
+/* Runs deferred work, timers and URB completions while waiting */
+unsigned long kshim_wait_for_completion_timeout(struct completion *x,
+						unsigned long timeout);
+
+#define wait_for_completion_timeout kshim_wait_for_completion_timeout
+#define wait_for_completion_interruptible_timeout(x, t) \
+	((long)kshim_wait_for_completion_timeout(x, t))
+#define wait_for_completion(x)	\
+	((void)kshim_wait_for_completion_timeout(x, MAX_JIFFY_OFFSET))
+
+#define rcu_read_lock()		do { } while (0)
+#define rcu_read_unlock()	do { } while (0)
+#define synchronize_rcu()	do { } while (0)
+#define rcu_dereference(p)	(p)
+#define rcu_assign_pointer(p, v) ((p) = (v))
+
+/* Lists */
+
+struct list_head {
+	struct list_head *next, *prev;
+};
+
+#define LIST_HEAD_INIT(name)	{ &(name), &(name) }
+#define LIST_HEAD(name)		struct list_head name = LIST_HEAD_INIT(name)
+
+static inline void INIT_LIST_HEAD(struct list_head *list)
+{
+	list->next = list;
+	list->prev = list;
+}
+
+static inline void __list_add(struct list_head *new, struct list_head *prev,
+			      struct list_head *next)
+{
+	next->prev = new;
+	new->next = next;
+	new->prev = prev;
+	prev->next = new;
+}
+
+static inline void list_add(struct list_head *new, struct list_head *head)
+{
+	__list_add(new, head, head->next);
+}
+
+static inline void list_add_tail(struct list_head *new,
+				 struct list_head *head)
+{
+	__list_add(new, head->prev, head);
+}
+
+static inline void list_del(struct list_head *entry)
+{
+	entry->next->prev = entry->prev;
+	entry->prev->next = entry->next;
+	entry->next = NULL;
+	entry->prev = NULL;
+}
+
+static inline void list_del_init(struct list_head *entry)
+{
+	entry->next->prev = entry->prev;
+	entry->prev->next = entry->next;
+	INIT_LIST_HEAD(entry);
+}
+
+static inline void list_move(struct list_head *list, struct list_head *head)
+{
+	list->next->prev = list->prev;
+	list->prev->next = list->next;
+	list_add(list, head);
+}
+
+static inline void list_move_tail(struct list_head *list,
+				  struct list_head *head)
+{
+	list->next->prev = list->prev;
+	list->prev->next = list->next;
+	list_add_tail(list, head);
+}
+
+static inline int list_empty(const struct list_head *head)
+{
+	return head->next == head;
+}
+
+#define list_entry(ptr, type, member)	container_of(ptr, type, member)
+#define list_first_entry(ptr, type, member) \
+	list_entry((ptr)->next, type, member)
+#define list_last_entry(ptr, type, member) \
+	list_entry((ptr)->prev, type, member)
+#define list_next_entry(pos, member) \
+	list_entry((pos)->member.next, typeof(*(pos)), member)
+#define list_for_each_entry(pos, head, member) \
+	for (pos = list_first_entry(head, typeof(*pos), member); \
+	     &pos->member != (head); pos = list_next_entry(pos, member))
+#define list_for_each_entry_safe(pos, n, head, member) \
+	for (pos = list_first_entry(head, typeof(*pos), member), \
+	     n = list_next_entry(pos, member); &pos->member != (head); \
+	     pos = n, n = list_next_entry(n, member))
+
+/* Timers and deferred work. Nothing runs by itself: kshim_run_pending()
+ * runs whatever is due, and the replay loop calls it between transfers.
+ */
+
+struct kshim_deferred {
+	struct list_head node;
+	bool queued;
+	u64 expires_ns;
+	void (*run)(struct kshim_deferred *d);
+};
+
+void kshim_defer(struct kshim_deferred *d, u64 delay_ns);
+bool kshim_undefer(struct kshim_deferred *d);
+/* Runs what is due, or everything when @all, returns the number run */
+unsigned int kshim_run_pending(bool all);
+
+struct timer_list {
+	struct kshim_deferred d;
+	unsigned long expires;
+	void (*function)(struct timer_list *t);
+};
+
+void kshim_timer_run(struct kshim_deferred *d);
+
+static inline void timer_setup(struct timer_list *t,
+			       void (*fn)(struct timer_list *), unsigned int f)
+{
+	memset(t, 0, sizeof(*t));
+	t->d.run = kshim_timer_run;
+	t->function = fn;
+}
+
+#define from_timer(var, callback_timer, timer_fieldname) \
+	container_of(callback_timer, typeof(*var), timer_fieldname)
+#define timer_container_of	from_timer
+
+int mod_timer(struct timer_list *t, unsigned long expires);
+#define add_timer(t)		mod_timer(t, (t)->expires)
+static inline int del_timer(struct timer_list *t)
+{
+	return kshim_undefer(&t->d);
+}
+
+#define del_timer_sync		del_timer
+#define timer_delete		del_timer
+#define timer_delete_sync	del_timer
+#define timer_shutdown_sync	del_timer
+#define timer_pending(t)	((t)->d.queued)
+
+enum hrtimer_restart {
+	HRTIMER_NORESTART,
+	HRTIMER_RESTART,
+};
+
+#define CLOCK_REALTIME		0
+#define CLOCK_MONOTONIC		1
+#define CLOCK_BOOTTIME		7
+#define CLOCK_TAI		11
+#define HRTIMER_MODE_ABS	0x0
+#define HRTIMER_MODE_REL	0x1
+#define HRTIMER_MODE_SOFT	0x4
+#define HRTIMER_MODE_ABS_SOFT	(HRTIMER_MODE_ABS | HRTIMER_MODE_SOFT)
+#define HRTIMER_MODE_REL_SOFT	(HRTIMER_MODE_REL | HRTIMER_MODE_SOFT)
+
+struct hrtimer {
+	struct kshim_deferred d;
+	ktime_t expires;
+	enum hrtimer_restart (*function)(struct hrtimer *t);
+};
+
+void kshim_hrtimer_run(struct kshim_deferred *d);
+
+static inline void hrtimer_init(struct hrtimer *t, int clock, int mode)
+{
+	memset(t, 0, sizeof(*t));
+	t->d.run = kshim_hrtimer_run;
+}
+
+static inline void hrtimer_setup(struct hrtimer *t,
+				 enum hrtimer_restart (*fn)(struct hrtimer *),
+				 int clock, int mode)
+{
+	hrtimer_init(t, clock, mode);
+	t->function = fn;
+}
+
+void hrtimer_start(struct hrtimer *t, ktime_t tim, int mode);
+int hrtimer_cancel(struct hrtimer *t);
+#define hrtimer_try_to_cancel	hrtimer_cancel
+#define hrtimer_active(t)	((t)->d.queued)
+#define hrtimer_is_queued(t)	((t)->d.queued)
+#define hrtimer_get_expires(t)	((t)->expires)
+#define hrtimer_set_expires(t, e) ((t)->expires = (e))
+#define hrtimer_cb_get_time(t)	ktime_get()
+
+static inline u64 hrtimer_forward(struct hrtimer *t, ktime_t now,
+				  ktime_t interval)
+{
+	u64 n = 0;
+
+	while (t->expires <= now) {
+		t->expires += interval;
+		n++;
+	}
+	return n;
+}
+
+#define hrtimer_forward_now(t, i) hrtimer_forward(t, ktime_get(), i)
+
+struct tasklet_struct {
+	struct kshim_deferred d;
+	void (*func)(unsigned long data);
+	void (*callback)(struct tasklet_struct *t);
+	unsigned long data;
+	bool use_callback;
+};
+
+void kshim_tasklet_run(struct kshim_deferred *d);
+
+static inline void tasklet_init(struct tasklet_struct *t,
+				void (*func)(unsigned long), unsigned long data)
+{
+	memset(t, 0, sizeof(*t));
+	t->d.run = kshim_tasklet_run;
+	t->func = func;
+	t->data = data;
+}
+
+static inline void tasklet_setup(struct tasklet_struct *t,
+				 void (*callback)(struct tasklet_struct *))
+{
+	memset(t, 0, sizeof(*t));
+	t->d.run = kshim_tasklet_run;
+	t->callback = callback;
+	t->use_callback = true;
+}
+
+#define from_tasklet(var, callback_tasklet, tasklet_fieldname) \
+	container_of(callback_tasklet, typeof(*var), tasklet_fieldname)
+#define tasklet_schedule(t)	kshim_defer(&(t)->d, 0)
+#define tasklet_hi_schedule	tasklet_schedule
+#define tasklet_kill(t)		((void)kshim_undefer(&(t)->d))
+#define tasklet_disable(t)	do { } while (0)
+#define tasklet_enable(t)	do { } while (0)
+
+struct work_struct {
+	struct kshim_deferred d;
+	void (*func)(struct work_struct *work);
+};
+
+struct delayed_work {
+	struct work_struct work;
+};
+
+struct workqueue_struct {
+	int dummy;
+};
+
+extern struct workqueue_struct *system_wq;
+extern struct workqueue_struct *system_highpri_wq;
+extern struct workqueue_struct *system_long_wq;
+
+void kshim_work_run(struct kshim_deferred *d);
+
+#define INIT_WORK(w, f)		do { memset(w, 0, sizeof(*(w))); \
+				     (w)->d.run = kshim_work_run; \
+				     (w)->func = (f); } while (0)
+#define INIT_DELAYED_WORK(w, f)	INIT_WORK(&(w)->work, f)
+#define to_delayed_work(w)	container_of(w, struct delayed_work, work)
+#define schedule_work(w)	kshim_queue_work(&(w)->d, 0, false)
+#define queue_work(q, w)	schedule_work(w)
+#define schedule_delayed_work(w, j) \
+	kshim_queue_work(&(w)->work.d, (u64)(j) * NSEC_PER_MSEC, false)
+#define queue_delayed_work(q, w, j) schedule_delayed_work(w, j)
+#define mod_delayed_work(q, w, j) \
+	kshim_queue_work(&(w)->work.d, (u64)(j) * NSEC_PER_MSEC, true)
+#define cancel_work_sync(w)	kshim_undefer(&(w)->d)
+#define cancel_work(w)		kshim_undefer(&(w)->d)
+#define cancel_delayed_work_sync(w) kshim_undefer(&(w)->work.d)
+#define cancel_delayed_work(w)	kshim_undefer(&(w)->work.d)
+#define flush_work(w)		((void)0)
+#define flush_delayed_work(w)	((void)0)
+#define delayed_work_pending(w)	((w)->work.d.queued)
+#define work_pending(w)		((w)->d.queued)
+#define flush_workqueue(q)	((void)kshim_run_pending(true))
+#define alloc_workqueue(n, f, m, ...) system_wq
+#define alloc_ordered_workqueue(n, f, ...) system_wq
+#define destroy_workqueue(q)	do { } while (0)
+#define WQ_HIGHPRI		0
+#define WQ_MEM_RECLAIM		0
+
+bool kshim_queue_work(struct kshim_deferred *d, u64 delay_ns, bool mod);
+
+/* Devices and modules */
+
+struct module;
+#define THIS_MODULE		((struct module *)0)
+#define MODULE_LICENSE(x)
+#define MODULE_AUTHOR(x)
+#define MODULE_DESCRIPTION(x)
+#define MODULE_VERSION(x)
+#define MODULE_DEVICE_TABLE(t, n)
+#define MODULE_ALIAS(x)
+#define MODULE_PARM_DESC(p, d)
+#define EXPORT_SYMBOL(s)
+#define EXPORT_SYMBOL_GPL(s)
+#define module_param(name, type, perm)
+#define module_param_named(name, var, type, perm)
+#define module_param_array(name, type, nump, perm)
+#define module_param_array_named(name, array, type, nump, perm)
+#define module_init(fn)		int kshim_module_init_##fn(void) { \
+					return fn(); }
+#define module_exit(fn)		void kshim_module_exit_##fn(void) { fn(); }
+
+struct device {
+	const char *init_name;
+	struct device *parent;
+	void *driver_data;
+	const struct attribute_group **groups;
+	u64 *dma_mask;
+};
+
+static inline const char *dev_name(const struct device *dev)
+{
+	return dev && dev->init_name ? dev->init_name : "kshim";
+}
+
+static inline void *dev_get_drvdata(const struct device *dev)
+{
+	return dev->driver_data;
+}
+
+static inline void dev_set_drvdata(struct device *dev, void *data)
+{
+	dev->driver_data = data;
+}
+
+#define get_device(d)		(d)
+#define put_device(d)		do { } while (0)
+
+/* debugfs and seq_file, the files are only recorded */
+
+struct dentry {
+	const char *name;
+};
+
+struct inode {
+	void *i_private;
+};
+
+struct file {
+	void *private_data;
+};
+
+struct seq_file {
+	char *buf;
+	size_t size;
+	size_t count;
+	void *private;
+};
+
+struct file_operations {
+	struct module *owner;
+	int (*open)(struct inode *inode, struct file *file);
+	ssize_t (*read)(struct file *file, char __user *buf, size_t count,
+			loff_t *ppos);
+	ssize_t (*write)(struct file *file, const char __user *buf,
+			 size_t count, loff_t *ppos);
+	loff_t (*llseek)(struct file *file, loff_t offset, int whence);
+	int (*release)(struct inode *inode, struct file *file);
+};
+
+__printf(2, 3) void seq_printf(struct seq_file *m, const char *fmt, ...);
+void seq_puts(struct seq_file *m, const char *s);
+#define seq_putc(m, c)		seq_printf(m, "%c", c)
+int single_open(struct file *file, int (*show)(struct seq_file *, void *),
+		void *data);
+int single_release(struct inode *inode, struct file *file);
+ssize_t seq_read(struct file *file, char __user *buf, size_t size,
+		 loff_t *ppos);
+loff_t seq_lseek(struct file *file, loff_t offset, int whence);
+
+#define DEFINE_SHOW_ATTRIBUTE(__name) \
+static int __name ## _open(struct inode *inode, struct file *file) \
+{ \
+	return single_open(file, __name ## _show, inode->i_private); \
+} \
+static const struct file_operations __name ## _fops = { \
+	.owner = THIS_MODULE, \
+	.open = __name ## _open, \
+	.read = seq_read, \
+	.llseek = seq_lseek, \
+	.release = single_release, \
+}
+
+struct dentry *debugfs_create_dir(const char *name, struct dentry *parent);
+struct dentry *debugfs_create_file(const char *name, unsigned short mode,
+				   struct dentry *parent, void *data,
+				   const struct file_operations *fops);
+void debugfs_create_u32(const char *name, unsigned short mode,
+			struct dentry *parent, u32 *value);
+void debugfs_remove_recursive(struct dentry *dentry);
+#define debugfs_remove		debugfs_remove_recursive
+
+/* Prints the output of a show function, for the replay report */
+void kshim_seq_show(int (*show)(struct seq_file *, void *), void *data,
+		    FILE *out);
+
+#include <kshim_net.h>
+#include <kshim_usb.h>
+#include <kshim_pci.h>
+
+#endif /* KSHIM_H */
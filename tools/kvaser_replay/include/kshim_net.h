@@ -0,0 +1,565 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+/* Network device, socket buffer and CAN device stand-ins, see kshim.h */
+
+#ifndef KSHIM_NET_H
+#define KSHIM_NET_H
+
+#define IFNAMSIZ		16
+#define IFF_UP			0x1
+#define IFF_ECHO		0x40000
+#define ETH_GSTRING_LEN		32
+#define ETH_SS_STATS		1
+#define ETH_SS_PRIV_FLAGS	2
+#define ETH_P_CAN		0x000C
+#define ETH_P_CANFD		0x000D
+#define ARPHRD_CAN		280
+#define NETDEV_TX_OK		0x00
+#define NETDEV_TX_BUSY		0x10
+#define SOF_TXTIME_DEADLINE_MODE	BIT(0)
+#define SOCK_TXTIME		24
+
+struct sk_buff;
+struct net_device;
+
+struct sock {
+	unsigned long sk_flags;
+	u8 sk_clockid;
+	u8 sk_txtime_deadline_mode : 1,
+	   sk_txtime_report_errors : 1;
+};
+
+#define sock_flag(sk, flag)	test_bit(flag, &(sk)->sk_flags)
+
+struct skb_shared_hwtstamps {
+	ktime_t hwtstamp;
+};
+
+struct sk_buff {
+	struct sk_buff *next, *prev;
+	struct net_device *dev;
+	struct sock *sk;
+	ktime_t tstamp;
+	u8 tstamp_type;
+	unsigned int len;
+	u32 hash;
+	u32 priority;
+	u16 queue_mapping;
+	u8 l4_hash : 1,
+	   sw_hash : 1;
+	__be16 protocol;
+	struct skb_shared_hwtstamps hwtstamps;
+	unsigned char *head;
+	unsigned char *data;
+	/* Userspace only, set by the shim when the skb is delivered */
+	int kshim_echo;
+};
+
+#define SKB_CLOCK_REALTIME	0
+#define SKB_CLOCK_MONOTONIC	1
+#define SKB_CLOCK_TAI		2
+
+struct sk_buff_head {
+	struct sk_buff *next, *prev;
+	u32 qlen;
+	spinlock_t lock;
+};
+
+struct sk_buff *kshim_alloc_skb(unsigned int size);
+void kshim_free_skb(struct sk_buff *skb);
+struct sk_buff *skb_copy(const struct sk_buff *skb, gfp_t gfp);
+struct sk_buff *skb_clone(struct sk_buff *skb, gfp_t gfp);
+
+#define kfree_skb(skb)		kshim_free_skb(skb)
+#define consume_skb(skb)	kshim_free_skb(skb)
+#define dev_kfree_skb(skb)	kshim_free_skb(skb)
+#define dev_kfree_skb_any(skb)	kshim_free_skb(skb)
+#define dev_kfree_skb_irq(skb)	kshim_free_skb(skb)
+#define dev_consume_skb_any(skb) kshim_free_skb(skb)
+
+static inline struct skb_shared_hwtstamps *skb_hwtstamps(struct sk_buff *skb)
+{
+	return &skb->hwtstamps;
+}
+
+static inline void skb_set_hash(struct sk_buff *skb, u32 hash, int type)
+{
+	skb->hash = hash;
+	skb->l4_hash = type == 3;
+	skb->sw_hash = 0;
+}
+
+#define PKT_HASH_TYPE_NONE	0
+#define PKT_HASH_TYPE_L2	1
+#define PKT_HASH_TYPE_L3	2
+#define PKT_HASH_TYPE_L4	3
+
+static inline u32 skb_get_hash(struct sk_buff *skb)
+{
+	return skb->hash;
+}
+
+static inline u16 skb_get_queue_mapping(const struct sk_buff *skb)
+{
+	return skb->queue_mapping;
+}
+
+static inline void skb_set_queue_mapping(struct sk_buff *skb, u16 q)
+{
+	skb->queue_mapping = q;
+}
+
+static inline void __skb_queue_head_init(struct sk_buff_head *list)
+{
+	list->prev = list->next = (struct sk_buff *)list;
+	list->qlen = 0;
+}
+
+static inline void skb_queue_head_init(struct sk_buff_head *list)
+{
+	spin_lock_init(&list->lock);
+	__skb_queue_head_init(list);
+}
+
+static inline u32 skb_queue_len(const struct sk_buff_head *list)
+{
+	return list->qlen;
+}
+
+static inline int skb_queue_empty(const struct sk_buff_head *list)
+{
+	return list->next == (const struct sk_buff *)list;
+}
+
+static inline struct sk_buff *skb_peek(const struct sk_buff_head *list)
+{
+	struct sk_buff *skb = list->next;
+
+	return skb == (struct sk_buff *)list ? NULL : skb;
+}
+
+static inline struct sk_buff *skb_peek_tail(const struct sk_buff_head *list)
+{
+	struct sk_buff *skb = list->prev;
+
+	return skb == (struct sk_buff *)list ? NULL : skb;
+}
+
+static inline void __skb_insert(struct sk_buff *newsk, struct sk_buff *prev,
+				struct sk_buff *next,
+				struct sk_buff_head *list)
+{
+	newsk->next = next;
+	newsk->prev = prev;
+	next->prev = newsk;
+	prev->next = newsk;
+	list->qlen++;
+}
+
+static inline void __skb_queue_after(struct sk_buff_head *list,
+				     struct sk_buff *prev,
+				     struct sk_buff *newsk)
+{
+	__skb_insert(newsk, prev, prev->next, list);
+}
+
+static inline void __skb_queue_before(struct sk_buff_head *list,
+				      struct sk_buff *next,
+				      struct sk_buff *newsk)
+{
+	__skb_insert(newsk, next->prev, next, list);
+}
+
+static inline void __skb_queue_tail(struct sk_buff_head *list,
+				    struct sk_buff *newsk)
+{
+	__skb_queue_before(list, (struct sk_buff *)list, newsk);
+}
+
+static inline void __skb_queue_head(struct sk_buff_head *list,
+				    struct sk_buff *newsk)
+{
+	__skb_queue_after(list, (struct sk_buff *)list, newsk);
+}
+
+static inline void __skb_unlink(struct sk_buff *skb,
+				struct sk_buff_head *list)
+{
+	list->qlen--;
+	skb->next->prev = skb->prev;
+	skb->prev->next = skb->next;
+	skb->next = skb->prev = NULL;
+}
+
+static inline struct sk_buff *__skb_dequeue(struct sk_buff_head *list)
+{
+	struct sk_buff *skb = skb_peek(list);
+
+	if (skb)
+		__skb_unlink(skb, list);
+	return skb;
+}
+
+static inline void __skb_queue_purge(struct sk_buff_head *list)
+{
+	struct sk_buff *skb;
+
+	while ((skb = __skb_dequeue(list)))
+		kfree_skb(skb);
+}
+
+#define skb_queue_tail(l, s)	__skb_queue_tail(l, s)
+#define skb_dequeue(l)		__skb_dequeue(l)
+#define skb_unlink(s, l)	__skb_unlink(s, l)
+#define skb_queue_purge(l)	__skb_queue_purge(l)
+
+#define skb_queue_walk(queue, skb) \
+	for (skb = (queue)->next; skb != (struct sk_buff *)(queue); \
+	     skb = skb->next)
+#define skb_queue_walk_safe(queue, skb, tmp) \
+	for (skb = (queue)->next, tmp = skb->next; \
+	     skb != (struct sk_buff *)(queue); skb = tmp, tmp = skb->next)
+#define skb_queue_reverse_walk(queue, skb) \
+	for (skb = (queue)->prev; skb != (struct sk_buff *)(queue); \
+	     skb = skb->prev)
+#define skb_queue_reverse_walk_safe(queue, skb, tmp) \
+	for (skb = (queue)->prev, tmp = skb->prev; \
+	     skb != (struct sk_buff *)(queue); skb = tmp, tmp = skb->prev)
+
+/* Network devices */
+
+struct net_device_stats {
+	unsigned long rx_packets;
+	unsigned long tx_packets;
+	unsigned long rx_bytes;
+	unsigned long tx_bytes;
+	unsigned long rx_errors;
+	unsigned long tx_errors;
+	unsigned long rx_dropped;
+	unsigned long tx_dropped;
+	unsigned long rx_over_errors;
+	unsigned long rx_fifo_errors;
+	unsigned long tx_aborted_errors;
+	unsigned long tx_fifo_errors;
+};
+
+struct netdev_queue {
+	unsigned long state;
+	/* Byte Queue Limits, only the in-flight count is kept */
+	unsigned int dql_inflight;
+};
+
+#define __QUEUE_STATE_DRV_XOFF	0
+
+struct rtnl_link_stats64;
+struct ifreq;
+struct ethtool_ops;
+struct kernel_ethtool_ts_info;
+struct ethtool_ts_info;
+struct net_device_path_ctx;
+
+struct net_device_ops {
+	int (*ndo_open)(struct net_device *dev);
+	int (*ndo_stop)(struct net_device *dev);
+	netdev_tx_t (*ndo_start_xmit)(struct sk_buff *skb,
+				      struct net_device *dev);
+	u16 (*ndo_select_queue)(struct net_device *dev, struct sk_buff *skb,
+				struct net_device *sb_dev);
+	int (*ndo_change_mtu)(struct net_device *dev, int new_mtu);
+	int (*ndo_eth_ioctl)(struct net_device *dev, struct ifreq *ifr,
+			     int cmd);
+	int (*ndo_do_ioctl)(struct net_device *dev, struct ifreq *ifr,
+			    int cmd);
+	void (*ndo_get_stats64)(struct net_device *dev,
+				struct rtnl_link_stats64 *stats);
+};
+
+#define KSHIM_MAX_TX_QUEUES	8
+
+struct net_device {
+	char name[IFNAMSIZ];
+	unsigned int flags;
+	unsigned short dev_id;
+	unsigned int mtu;
+	unsigned int num_tx_queues;
+	unsigned int real_num_tx_queues;
+	struct netdev_queue tx_queues[KSHIM_MAX_TX_QUEUES];
+	struct net_device_stats stats;
+	const struct net_device_ops *netdev_ops;
+	const struct ethtool_ops *ethtool_ops;
+	struct device dev;
+	bool running;
+	bool present;
+	bool carrier;
+	bool registered;
+	void *priv;
+};
+
+#define SET_NETDEV_DEV(net, pdev) ((net)->dev.parent = (pdev))
+#define netdev_priv(dev)	((dev)->priv)
+#define netif_running(dev)	((dev)->running)
+#define netif_device_present(dev) ((dev)->present)
+#define netif_device_detach(dev) ((dev)->present = false)
+#define netif_device_attach(dev) ((dev)->present = true)
+#define netif_carrier_on(dev)	((dev)->carrier = true)
+#define netif_carrier_off(dev)	((dev)->carrier = false)
+#define netif_carrier_ok(dev)	((dev)->carrier)
+
+static inline struct netdev_queue *netdev_get_tx_queue(
+	const struct net_device *dev, unsigned int index)
+{
+	return (struct netdev_queue *)&dev->tx_queues[index];
+}
+
+static inline void netif_tx_stop_queue(struct netdev_queue *q)
+{
+	set_bit(__QUEUE_STATE_DRV_XOFF, &q->state);
+}
+
+static inline void netif_tx_start_queue(struct netdev_queue *q)
+{
+	clear_bit(__QUEUE_STATE_DRV_XOFF, &q->state);
+}
+
+#define netif_tx_wake_queue	netif_tx_start_queue
+
+static inline bool netif_tx_queue_stopped(const struct netdev_queue *q)
+{
+	return test_bit(__QUEUE_STATE_DRV_XOFF, &q->state);
+}
+
+#define netif_xmit_stopped	netif_tx_queue_stopped
+
+static inline void netif_stop_subqueue(struct net_device *dev, u16 i)
+{
+	netif_tx_stop_queue(netdev_get_tx_queue(dev, i));
+}
+
+static inline void netif_wake_subqueue(struct net_device *dev, u16 i)
+{
+	netif_tx_wake_queue(netdev_get_tx_queue(dev, i));
+}
+
+#define netif_start_subqueue	netif_wake_subqueue
+
+static inline bool __netif_subqueue_stopped(const struct net_device *dev,
+					    u16 i)
+{
+	return netif_tx_queue_stopped(netdev_get_tx_queue(dev, i));
+}
+
+#define netif_subqueue_stopped(dev, skb) \
+	__netif_subqueue_stopped(dev, skb_get_queue_mapping(skb))
+
+static inline void netif_tx_stop_all_queues(struct net_device *dev)
+{
+	unsigned int i;
+
+	for (i = 0; i < dev->num_tx_queues; i++)
+		netif_tx_stop_queue(netdev_get_tx_queue(dev, i));
+}
+
+static inline void netif_tx_wake_all_queues(struct net_device *dev)
+{
+	unsigned int i;
+
+	for (i = 0; i < dev->num_tx_queues; i++)
+		netif_tx_wake_queue(netdev_get_tx_queue(dev, i));
+}
+
+#define netif_tx_start_all_queues netif_tx_wake_all_queues
+#define netif_stop_queue(dev)	netif_stop_subqueue(dev, 0)
+#define netif_wake_queue(dev)	netif_wake_subqueue(dev, 0)
+#define netif_start_queue(dev)	netif_wake_subqueue(dev, 0)
+#define netif_queue_stopped(dev) __netif_subqueue_stopped(dev, 0)
+
+static inline int netif_set_real_num_tx_queues(struct net_device *dev,
+					       unsigned int txq)
+{
+	if (txq < 1 || txq > dev->num_tx_queues)
+		return -EINVAL;
+	dev->real_num_tx_queues = txq;
+	return 0;
+}
+
+static inline void netdev_tx_sent_queue(struct netdev_queue *q,
+					unsigned int bytes)
+{
+	q->dql_inflight += bytes;
+}
+
+static inline void netdev_tx_completed_queue(struct netdev_queue *q,
+					     unsigned int pkts,
+					     unsigned int bytes)
+{
+	q->dql_inflight -= min(bytes, q->dql_inflight);
+}
+
+static inline void netdev_tx_reset_queue(struct netdev_queue *q)
+{
+	q->dql_inflight = 0;
+}
+
+#define netdev_sent_queue(dev, b) \
+	netdev_tx_sent_queue(netdev_get_tx_queue(dev, 0), b)
+#define netdev_completed_queue(dev, p, b) \
+	netdev_tx_completed_queue(netdev_get_tx_queue(dev, 0), p, b)
+#define netdev_reset_queue(dev)	netdev_tx_reset_queue(netdev_get_tx_queue(dev, 0))
+
+/* Frames delivered to the stack end up here, see kshim.c */
+struct kshim_rx_stats {
+	unsigned long frames;
+	unsigned long fd_frames;
+	unsigned long err_frames;
+	unsigned long echo_frames;
+};
+
+extern struct kshim_rx_stats kshim_rx_stats;
+/* Called for each delivered frame before it is freed, may be NULL */
+extern void (*kshim_rx_hook)(const struct sk_buff *skb);
+
+int netif_rx(struct sk_buff *skb);
+#define netif_rx_ni		netif_rx
+#define netif_receive_skb	netif_rx
+int dev_queue_xmit(struct sk_buff *skb);
+
+void rtnl_lock(void);
+void rtnl_unlock(void);
+#define ASSERT_RTNL()		do { } while (0)
+
+/* ethtool */
+
+struct ethtool_drvinfo {
+	char driver[32];
+	char version[32];
+	char fw_version[32];
+	char bus_info[32];
+};
+
+struct ethtool_stats {
+	u32 cmd;
+	u32 n_stats;
+};
+
+struct ethtool_ops {
+	void (*get_drvinfo)(struct net_device *dev,
+			    struct ethtool_drvinfo *info);
+	int (*get_ts_info)(struct net_device *dev, void *info);
+	void (*get_strings)(struct net_device *dev, u32 stringset, u8 *data);
+	int (*get_sset_count)(struct net_device *dev, int sset);
+	void (*get_ethtool_stats)(struct net_device *dev,
+				  struct ethtool_stats *stats, u64 *data);
+	u32 (*get_priv_flags)(struct net_device *dev);
+	int (*set_priv_flags)(struct net_device *dev, u32 flags);
+};
+
+#define ethtool_op_get_ts_info		NULL
+#define can_ethtool_op_get_ts_info_hwts	NULL
+#define can_eth_ioctl_hwts		NULL
+#define ethtool_sprintf(data, fmt, ...) \
+	do { snprintf((char *)*(data), ETH_GSTRING_LEN, fmt, ##__VA_ARGS__); \
+	     *(data) += ETH_GSTRING_LEN; } while (0)
+
+/* CAN devices */
+
+#define CAN_MAX_DLC		8
+#define CAN_MAX_RAW_DLC		15
+#define CAN_MAX_DLEN		8
+#define CANFD_MAX_DLC		15
+#define CANFD_MAX_DLEN		64
+
+#define CAN_SYNC_SEG		1
+
+enum can_mode {
+	CAN_MODE_STOP = 0,
+	CAN_MODE_START,
+	CAN_MODE_SLEEP,
+};
+
+struct can_priv {
+	struct net_device *dev;
+	struct can_device_stats can_stats;
+	const struct can_bittiming_const *bittiming_const;
+	const struct can_bittiming_const *data_bittiming_const;
+	struct can_bittiming bittiming, data_bittiming;
+	struct can_clock clock;
+	enum can_state state;
+	u32 ctrlmode;
+	u32 ctrlmode_supported;
+	u32 ctrlmode_static;
+	int restart_ms;
+	unsigned int echo_skb_max;
+	struct sk_buff **echo_skb;
+	int (*do_set_bittiming)(struct net_device *dev);
+	int (*do_set_data_bittiming)(struct net_device *dev);
+	int (*do_set_mode)(struct net_device *dev, enum can_mode mode);
+	int (*do_get_state)(const struct net_device *dev,
+			    enum can_state *state);
+	int (*do_get_berr_counter)(const struct net_device *dev,
+				   struct can_berr_counter *bec);
+};
+
+struct net_device *alloc_candev_mqs(int sizeof_priv,
+				    unsigned int echo_skb_max,
+				    unsigned int txqs, unsigned int rxqs);
+#define alloc_candev(s, e)	alloc_candev_mqs(s, e, 1, 1)
+void free_candev(struct net_device *dev);
+int register_candev(struct net_device *dev);
+void unregister_candev(struct net_device *dev);
+int open_candev(struct net_device *dev);
+void close_candev(struct net_device *dev);
+int can_change_mtu(struct net_device *dev, int new_mtu);
+int can_set_static_ctrlmode(struct net_device *dev, u32 static_mode);
+
+int can_put_echo_skb(struct sk_buff *skb, struct net_device *dev,
+		     unsigned int idx, unsigned int frame_len);
+unsigned int can_get_echo_skb(struct net_device *dev, unsigned int idx,
+			      unsigned int *frame_len_ptr);
+void can_free_echo_skb(struct net_device *dev, unsigned int idx,
+		       unsigned int *frame_len_ptr);
+struct sk_buff *alloc_can_skb(struct net_device *dev, struct can_frame **cf);
+struct sk_buff *alloc_canfd_skb(struct net_device *dev,
+				struct canfd_frame **cfd);
+struct sk_buff *alloc_can_err_skb(struct net_device *dev,
+				  struct can_frame **cf);
+void can_change_state(struct net_device *dev, struct can_frame *cf,
+		      enum can_state tx_state, enum can_state rx_state);
+void can_bus_off(struct net_device *dev);
+bool can_dropped_invalid_skb(struct net_device *dev, struct sk_buff *skb);
+bool can_dev_dropped_skb(struct net_device *dev, struct sk_buff *skb);
+u8 can_fd_dlc2len(u8 dlc);
+u8 can_fd_len2dlc(u8 len);
+
+static inline u8 can_cc_dlc2len(u8 dlc)
+{
+	return min_t(u8, dlc, CAN_MAX_DLEN);
+}
+
+static inline u8 can_get_cc_dlc(const struct can_frame *cf, const u32 ctrlmode)
+{
+	if ((ctrlmode & CAN_CTRLMODE_CC_LEN8_DLC) &&
+	    cf->len == CAN_MAX_DLEN && cf->len8_dlc > CAN_MAX_DLEN &&
+	    cf->len8_dlc <= CAN_MAX_RAW_DLC)
+		return cf->len8_dlc;
+	return cf->len;
+}
+
+static inline void can_frame_set_cc_len(struct can_frame *cf, const u8 dlc,
+					const u32 ctrlmode)
+{
+	if (ctrlmode & CAN_CTRLMODE_CC_LEN8_DLC && dlc > CAN_MAX_DLEN)
+		cf->len8_dlc = dlc;
+	cf->len = can_cc_dlc2len(dlc);
+}
+
+static inline bool can_is_canfd_skb(const struct sk_buff *skb)
+{
+	return skb->len == CANFD_MTU;
+}
+
+#define can_dlc2len		can_fd_dlc2len
+#define can_len2dlc		can_fd_len2dlc
+#define get_can_dlc(dlc)	can_cc_dlc2len(dlc)
+
+unsigned int can_skb_get_frame_len(const struct sk_buff *skb);
+
+#endif /* KSHIM_NET_H */
@@ -0,0 +1,128 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+/* PCI, DMA, interrupt and register access stand-ins, see kshim.h.
+ * Register accesses go through kshim_mmio_read32() and kshim_mmio_write32(),
+ * which call the model registered for the address range, if any, and
+ * otherwise access plain memory.
+ */
+
+#ifndef KSHIM_PCI_H
+#define KSHIM_PCI_H
+
+struct pci_dev {
+	struct device dev;
+	u16 vendor;
+	u16 device;
+	unsigned int irq;
+	void __iomem *bar[6];
+};
+
+struct pci_device_id {
+	u32 vendor, device;
+	u32 subvendor, subdevice;
+	u32 class, class_mask;
+	unsigned long driver_data;
+};
+
+#define PCI_ANY_ID		(~0U)
+#define PCI_DEVICE(vend, dev) \
+	.vendor = (vend), .device = (dev), \
+	.subvendor = PCI_ANY_ID, .subdevice = PCI_ANY_ID
+
+struct pci_driver {
+	const char *name;
+	const struct pci_device_id *id_table;
+	int (*probe)(struct pci_dev *dev, const struct pci_device_id *id);
+	void (*remove)(struct pci_dev *dev);
+};
+
+#define module_pci_driver(drv) \
+	const struct pci_driver *kshim_pci_driver = &(drv);
+
+#define pci_set_drvdata(pdev, data) dev_set_drvdata(&(pdev)->dev, data)
+#define pci_get_drvdata(pdev)	dev_get_drvdata(&(pdev)->dev)
+#define pci_enable_device(pdev)	0
+#define pci_disable_device(pdev) do { } while (0)
+#define pci_request_regions(pdev, name) 0
+#define pci_release_regions(pdev) do { } while (0)
+#define pci_set_master(pdev)	do { } while (0)
+#define pci_clear_master(pdev)	do { } while (0)
+#define pci_iomap(pdev, n, max) ((pdev)->bar[n])
+#define pci_iounmap(pdev, addr)	do { } while (0)
+#define pci_alloc_irq_vectors(pdev, min, max, flags) 1
+#define pci_free_irq_vectors(pdev) do { } while (0)
+#define pci_irq_vector(pdev, nr) ((pdev)->irq)
+#define PCI_IRQ_ALL_TYPES	0
+#define PCI_IRQ_INTX		0
+
+#define DMA_BIT_MASK(n)		(((n) == 64) ? ~0ULL : ((1ULL << (n)) - 1))
+#define dma_set_mask_and_coherent(dev, mask) 0
+
+void *dmam_alloc_coherent(struct device *dev, size_t size,
+			  dma_addr_t *dma_handle, gfp_t gfp);
+#define dma_alloc_coherent	dmam_alloc_coherent
+#define dma_free_coherent(dev, size, addr, handle) kfree(addr)
+
+#define IRQ_NONE		0
+#define IRQ_HANDLED		1
+#define IRQF_SHARED		0x80
+
+typedef irqreturn_t (*irq_handler_t)(int irq, void *dev_id);
+
+int request_irq(unsigned int irq, irq_handler_t handler, unsigned long flags,
+		const char *name, void *dev);
+void free_irq(unsigned int irq, void *dev_id);
+#define devm_request_irq(d, irq, h, f, n, dev) request_irq(irq, h, f, n, dev)
+/* Runs the handlers requested for @irq */
+irqreturn_t kshim_irq_raise(unsigned int irq);
+#define synchronize_irq(irq)	do { } while (0)
+
+/* A register model for the range [base, base + size) */
+struct kshim_mmio_model {
+	void __iomem *base;
+	size_t size;
+	u32 (*read32)(struct kshim_mmio_model *model, unsigned long offset);
+	void (*write32)(struct kshim_mmio_model *model, unsigned long offset,
+			u32 value);
+	struct kshim_mmio_model *next;
+};
+
+void kshim_mmio_register(struct kshim_mmio_model *model);
+void kshim_mmio_unregister(struct kshim_mmio_model *model);
+u32 kshim_mmio_read32(const volatile void __iomem *addr);
+void kshim_mmio_write32(u32 value, volatile void __iomem *addr);
+
+#define ioread32(addr)		kshim_mmio_read32(addr)
+#define iowrite32(val, addr)	kshim_mmio_write32(val, addr)
+#define readl(addr)		kshim_mmio_read32(addr)
+#define writel(val, addr)	kshim_mmio_write32(val, addr)
+#define __raw_readl(addr)	kshim_mmio_read32(addr)
+#define __raw_writel(val, addr)	kshim_mmio_write32(val, addr)
+
+static inline void iowrite32_rep(void __iomem *addr, const void *buf,
+				 unsigned long count)
+{
+	const u32 *src = buf;
+
+	while (count--)
+		kshim_mmio_write32(*src++, addr);
+}
+
+#define readx_poll_timeout(op, addr, val, cond, sleep_us, timeout_us) \
+({ \
+	u64 __timeout = kshim_ktime_get_ns() + (u64)(timeout_us) * 1000; \
+	for (;;) { \
+		(val) = op(addr); \
+		if (cond) \
+			break; \
+		if ((timeout_us) && kshim_ktime_get_ns() > __timeout) { \
+			(val) = op(addr); \
+			break; \
+		} \
+	} \
+	(cond) ? 0 : -ETIMEDOUT; \
+})
+#define readl_poll_timeout(addr, val, cond, sleep_us, timeout_us) \
+	readx_poll_timeout(readl, addr, val, cond, sleep_us, timeout_us)
+#define readl_poll_timeout_atomic readl_poll_timeout
+
+#endif /* KSHIM_PCI_H */
@@ -0,0 +1,179 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+/* USB core stand-ins, see kshim.h. Submitted URBs are handed to a backend
+ * set by the replay tool or the tests, see struct kshim_usb_backend.
+ */
+
+#ifndef KSHIM_USB_H
+#define KSHIM_USB_H
+
+#define URB_NO_TRANSFER_DMA_MAP	0x0004
+#define URB_ZERO_PACKET		0x0040
+
+struct usb_device {
+	struct device dev;
+	struct usb_device_descriptor descriptor;
+	int speed;
+	char devpath[16];
+};
+
+struct usb_host_endpoint {
+	struct usb_endpoint_descriptor desc;
+};
+
+struct usb_host_interface {
+	struct usb_interface_descriptor desc;
+	struct usb_host_endpoint *endpoint;
+};
+
+struct usb_interface {
+	struct device dev;
+	struct usb_host_interface *cur_altsetting;
+	struct usb_device *usb_dev;
+};
+
+struct usb_device_id {
+	u16 match_flags;
+	u16 idVendor;
+	u16 idProduct;
+	unsigned long driver_info;
+};
+
+#define USB_DEVICE_ID_MATCH_DEVICE	0x0003
+#define USB_DEVICE(vend, prod) \
+	.match_flags = USB_DEVICE_ID_MATCH_DEVICE, .idVendor = (vend), \
+	.idProduct = (prod)
+
+struct urb;
+typedef void (*usb_complete_t)(struct urb *);
+
+struct usb_anchor {
+	struct list_head urb_list;
+	spinlock_t lock;
+};
+
+struct urb {
+	struct list_head anchor_list;
+	struct usb_anchor *anchor;
+	struct list_head kshim_node;
+	bool kshim_submitted;
+	int kshim_refs;
+	struct usb_device *dev;
+	unsigned int pipe;
+	int status;
+	unsigned int transfer_flags;
+	void *transfer_buffer;
+	dma_addr_t transfer_dma;
+	u32 transfer_buffer_length;
+	u32 actual_length;
+	void *context;
+	usb_complete_t complete;
+};
+
+typedef struct {
+	int event;
+} pm_message_t;
+
+#define PMSG_IS_AUTO(msg)	0
+
+struct usb_driver {
+	const char *name;
+	int (*probe)(struct usb_interface *intf,
+		     const struct usb_device_id *id);
+	void (*disconnect)(struct usb_interface *intf);
+	int (*suspend)(struct usb_interface *intf, pm_message_t message);
+	int (*resume)(struct usb_interface *intf);
+	int (*reset_resume)(struct usb_interface *intf);
+	int (*pre_reset)(struct usb_interface *intf);
+	int (*post_reset)(struct usb_interface *intf);
+	const struct usb_device_id *id_table;
+	unsigned int supports_autosuspend:1;
+	unsigned int disable_hub_initiated_lpm:1;
+};
+
+#define module_usb_driver(drv) \
+	const struct usb_driver *kshim_usb_driver = &(drv);
+#define usb_register(drv)	((void)(drv), 0)
+#define usb_deregister(drv)	do { (void)(drv); } while (0)
+
+/* The tool decides what happens to submitted URBs. Bulk OUT transfers go
+ * to @out, bulk IN URBs are parked until the tool completes them with
+ * kshim_usb_complete_in().
+ */
+struct kshim_usb_backend {
+	void (*out)(struct urb *urb, void *data, int len);
+	int (*bulk_msg)(bool in, void *data, int len, int *actual,
+			int timeout);
+};
+
+extern const struct kshim_usb_backend *kshim_usb_backend;
+
+struct urb *usb_alloc_urb(int iso_packets, gfp_t mem_flags);
+void usb_free_urb(struct urb *urb);
+int usb_submit_urb(struct urb *urb, gfp_t mem_flags);
+void usb_kill_urb(struct urb *urb);
+int usb_unlink_urb(struct urb *urb);
+void *usb_alloc_coherent(struct usb_device *dev, size_t size,
+			 gfp_t mem_flags, dma_addr_t *dma);
+void usb_free_coherent(struct usb_device *dev, size_t size, void *addr,
+		       dma_addr_t dma);
+int usb_bulk_msg(struct usb_device *usb_dev, unsigned int pipe, void *data,
+		 int len, int *actual_length, int timeout);
+void init_usb_anchor(struct usb_anchor *anchor);
+void usb_anchor_urb(struct urb *urb, struct usb_anchor *anchor);
+void usb_unanchor_urb(struct urb *urb);
+void usb_kill_anchored_urbs(struct usb_anchor *anchor);
+void usb_scuttle_anchored_urbs(struct usb_anchor *anchor);
+int usb_wait_anchor_empty_timeout(struct usb_anchor *anchor,
+				  unsigned int timeout);
+int usb_anchor_empty(struct usb_anchor *anchor);
+
+/* Completes the oldest parked bulk IN URB with @len bytes of @data,
+ * returns false when no IN URB is parked
+ */
+bool kshim_usb_complete_in(const void *data, int len, int status);
+/* Completes queued OUT URBs, returns the number completed */
+unsigned int kshim_usb_complete_out(int status);
+unsigned int kshim_usb_in_parked(void);
+
+static inline void usb_fill_bulk_urb(struct urb *urb, struct usb_device *dev,
+				     unsigned int pipe, void *buf, int len,
+				     usb_complete_t complete, void *context)
+{
+	urb->dev = dev;
+	urb->pipe = pipe;
+	urb->transfer_buffer = buf;
+	urb->transfer_buffer_length = len;
+	urb->complete = complete;
+	urb->context = context;
+}
+
+#define USB_DIR_PIPE_IN		0x80
+#define usb_sndbulkpipe(dev, ep) ((unsigned int)(ep) & 0x7f)
+#define usb_rcvbulkpipe(dev, ep) (((unsigned int)(ep) & 0x7f) | \
+				  USB_DIR_PIPE_IN)
+#define usb_pipein(pipe)	((pipe) & USB_DIR_PIPE_IN)
+
+/* The usb_endpoint_*() helpers come with the uapi <linux/usb/ch9.h> */
+
+static inline struct usb_device *interface_to_usbdev(struct usb_interface *i)
+{
+	return i->usb_dev;
+}
+
+static inline void *usb_get_intfdata(struct usb_interface *intf)
+{
+	return dev_get_drvdata(&intf->dev);
+}
+
+static inline void usb_set_intfdata(struct usb_interface *intf, void *data)
+{
+	dev_set_drvdata(&intf->dev, data);
+}
+
+#define usb_get_dev(d)		(d)
+#define usb_put_dev(d)		do { } while (0)
+#define usb_reset_device(d)	0
+#define usb_make_path(d, buf, size) \
+	snprintf(buf, size, "usb-kshim-%s", (d)->devpath)
+
+#endif /* KSHIM_USB_H */
@@ -0,0 +1,151 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+/* Generic netlink stand-ins. The replay never receives netlink requests, the
+ * family is only registered, so the message helpers are stubs.
+ */
+
+#ifndef KSHIM_GENETLINK_H
+#define KSHIM_GENETLINK_H
+
+#include <kshim.h>
+#include <linux/netlink.h>
+
+#define NLMSG_DEFAULT_SIZE	4096
+#define GENL_ADMIN_PERM		0x01
+
+enum {
+	NLA_UNSPEC,
+	NLA_U8,
+	NLA_U16,
+	NLA_U32,
+	NLA_U64,
+	NLA_STRING,
+	NLA_FLAG,
+	NLA_MSECS,
+	NLA_NESTED,
+	NLA_NESTED_ARRAY,
+	NLA_NUL_STRING,
+	NLA_BINARY,
+};
+
+struct net;
+
+struct nla_policy {
+	u8 type;
+	u16 len;
+};
+
+struct genl_info {
+	struct nlattr **attrs;
+	struct net *net;
+};
+
+struct genl_ops {
+	int (*doit)(struct sk_buff *skb, struct genl_info *info);
+	u8 cmd;
+	u8 flags;
+};
+
+struct genl_family {
+	const char *name;
+	unsigned int version;
+	unsigned int maxattr;
+	const struct nla_policy *policy;
+	bool netnsok;
+	struct module *module;
+	const struct genl_ops *ops;
+	unsigned int n_ops;
+};
+
+#define GENL_SET_ERR_MSG(info, msg)	do { } while (0)
+#define genl_info_net(info)		((info)->net)
+
+static inline struct net_device *__dev_get_by_index(struct net *net,
+						    int ifindex)
+{
+	return NULL;
+}
+
+static inline int nla_len(const struct nlattr *nla)
+{
+	return nla->nla_len - NLA_HDRLEN;
+}
+
+static inline void *nla_data(const struct nlattr *nla)
+{
+	return (char *)nla + NLA_HDRLEN;
+}
+
+static inline u32 nla_get_u32(const struct nlattr *nla)
+{
+	u32 v;
+
+	memcpy(&v, nla_data(nla), sizeof(v));
+	return v;
+}
+
+static inline int nla_memcpy(void *dest, const struct nlattr *src, int count)
+{
+	int len = min(count, nla_len(src));
+
+	memcpy(dest, nla_data(src), len);
+	return len;
+}
+
+static inline struct nlattr *nla_nest_start(struct sk_buff *msg, int type)
+{
+	return NULL;
+}
+
+static inline int nla_nest_end(struct sk_buff *msg, struct nlattr *nest)
+{
+	return 0;
+}
+
+static inline int nla_put(struct sk_buff *msg, int type, int len,
+			  const void *data)
+{
+	return -EMSGSIZE;
+}
+
+static inline int nla_put_u32(struct sk_buff *msg, int type, u32 value)
+{
+	return nla_put(msg, type, sizeof(value), &value);
+}
+
+static inline struct sk_buff *genlmsg_new(size_t size, gfp_t flags)
+{
+	return NULL;
+}
+
+static inline void *genlmsg_put_reply(struct sk_buff *msg,
+				      struct genl_info *info,
+				      const struct genl_family *family,
+				      int flags, u8 cmd)
+{
+	return NULL;
+}
+
+static inline void genlmsg_end(struct sk_buff *msg, void *hdr)
+{
+}
+
+static inline void nlmsg_free(struct sk_buff *msg)
+{
+}
+
+static inline int genlmsg_reply(struct sk_buff *msg, struct genl_info *info)
+{
+	return -EOPNOTSUPP;
+}
+
+static inline int genl_register_family(struct genl_family *family)
+{
+	return 0;
+}
+
+static inline int genl_unregister_family(const struct genl_family *family)
+{
+	return 0;
+}
+
+#endif /* KSHIM_GENETLINK_H */
@@ -0,0 +1,1152 @@
+// SPDX-License-Identifier: GPL-2.0
+/* Userspace implementation of the kernel API declared in include/kshim.h.
+ *
+ * Everything runs on the caller's thread: deferred work and timers run from
+ * kshim_run_pending() and the completion waits, URBs complete when the tool
+ * says so and frames handed to netif_rx() are counted and freed.
+ */
+
+#include <ctype.h>
+#include <errno.h>
+#include <time.h>
+
+#include <kshim.h>
+
+/* Time */
+
+static u64 kshim_clock_ns(clockid_t clock)
+{
+	struct timespec ts;
+
+	clock_gettime(clock, &ts);
+	return (u64)ts.tv_sec * NSEC_PER_SEC + ts.tv_nsec;
+}
+
+u64 kshim_ktime_get_ns(void)
+{
+	return kshim_clock_ns(CLOCK_MONOTONIC);
+}
+
+u64 kshim_ktime_get_real_ns(void)
+{
+	return kshim_clock_ns(CLOCK_REALTIME);
+}
+
+static void kshim_sleep_ns(u64 ns)
+{
+	struct timespec ts = {
+		.tv_sec = ns / NSEC_PER_SEC,
+		.tv_nsec = ns % NSEC_PER_SEC,
+	};
+
+	while (nanosleep(&ts, &ts) && errno == EINTR)
+		;
+}
+
+void msleep(unsigned int msecs)
+{
+	kshim_sleep_ns((u64)msecs * NSEC_PER_MSEC);
+}
+
+void usleep_range(unsigned long min, unsigned long max)
+{
+	kshim_sleep_ns((u64)min * NSEC_PER_USEC);
+}
+
+void udelay(unsigned long usecs)
+{
+	u64 end = kshim_ktime_get_ns() + (u64)usecs * NSEC_PER_USEC;
+
+	while (kshim_ktime_get_ns() < end)
+		;
+}
+
+/* Same as kernel/time/clocksource.c */
+void clocks_calc_mult_shift(u32 *mult, u32 *shift, u32 from, u32 to,
+			    u32 maxsec)
+{
+	u64 tmp;
+	u32 sft, sftacc = 32;
+
+	tmp = ((u64)maxsec * from) >> 32;
+	while (tmp) {
+		tmp >>= 1;
+		sftacc--;
+	}
+
+	for (sft = 32; sft > 0; sft--) {
+		tmp = (u64)to << sft;
+		tmp += from / 2;
+		tmp /= from;
+		if ((tmp >> sftacc) == 0)
+			break;
+	}
+	*mult = tmp;
+	*shift = sft;
+}
+
+/* Printing */
+
+int kshim_loglevel = 4;
+unsigned long kshim_messages[8];
+unsigned long kshim_warnings;
+
+void kshim_printk(int level, const char *fmt, ...)
+{
+	static const char * const names[] = {
+		"emerg", "alert", "crit", "err", "warn", "notice", "info",
+		"debug",
+	};
+	va_list ap;
+
+	level = clamp(level, 0, 7);
+	kshim_messages[level]++;
+	if (level > kshim_loglevel)
+		return;
+
+	fprintf(stderr, "%s: ", names[level]);
+	va_start(ap, fmt);
+	vfprintf(stderr, fmt, ap);
+	va_end(ap);
+}
+
+void kshim_warn(const char *file, int line, const char *cond)
+{
+	kshim_warnings++;
+	fprintf(stderr, "WARNING: %s:%d: %s\n", file, line, cond);
+}
+
+void kshim_bug(const char *file, int line)
+{
+	fprintf(stderr, "BUG at %s:%d\n", file, line);
+	abort();
+}
+
+/* Strings */
+
+ssize_t strscpy(char *dest, const char *src, size_t count)
+{
+	size_t len;
+
+	if (!count)
+		return -E2BIG;
+
+	len = strnlen(src, count);
+	if (len == count) {
+		memcpy(dest, src, count - 1);
+		dest[count - 1] = '\0';
+		return -E2BIG;
+	}
+	memcpy(dest, src, len + 1);
+	return len;
+}
+
+/* Memory */
+
+struct kshim_alloc_stats kshim_alloc_stats;
+long kshim_fail_alloc_after = -1;
+
+void *kshim_malloc(size_t size, gfp_t flags)
+{
+	void *p;
+
+	if (kshim_fail_alloc_after == 0) {
+		kshim_alloc_stats.failed++;
+		return NULL;
+	}
+	if (kshim_fail_alloc_after > 0)
+		kshim_fail_alloc_after--;
+
+	p = flags & __GFP_ZERO ? calloc(1, size ?: 1) : malloc(size ?: 1);
+	if (!p) {
+		kshim_alloc_stats.failed++;
+		return NULL;
+	}
+	kshim_alloc_stats.allocs++;
+	kshim_alloc_stats.bytes += size;
+	return p;
+}
+
+void kshim_free(const void *p)
+{
+	if (!p)
+		return;
+	kshim_alloc_stats.frees++;
+	free((void *)p);
+}
+
+/* Deferred work and timers */
+
+static LIST_HEAD(kshim_pending);
+
+void kshim_defer(struct kshim_deferred *d, u64 delay_ns)
+{
+	d->expires_ns = kshim_ktime_get_ns() + delay_ns;
+	if (d->queued)
+		return;
+	d->queued = true;
+	list_add_tail(&d->node, &kshim_pending);
+}
+
+bool kshim_undefer(struct kshim_deferred *d)
+{
+	if (!d->queued)
+		return false;
+	d->queued = false;
+	list_del_init(&d->node);
+	return true;
+}
+
+unsigned int kshim_run_pending(bool all)
+{
+	/* Bounds what runs in one call, timers may rearm themselves */
+	const unsigned int max_runs = 100000;
+	unsigned int runs = 0;
+
+	while (runs < max_runs) {
+		struct kshim_deferred *d, *due = NULL;
+		u64 now = kshim_ktime_get_ns();
+
+		list_for_each_entry(d, &kshim_pending, node) {
+			if (all || d->expires_ns <= now) {
+				due = d;
+				break;
+			}
+		}
+		if (!due)
+			break;
+
+		kshim_undefer(due);
+		due->run(due);
+		runs++;
+	}
+	return runs;
+}
+
+void kshim_timer_run(struct kshim_deferred *d)
+{
+	struct timer_list *t = container_of(d, struct timer_list, d);
+
+	t->function(t);
+}
+
+int mod_timer(struct timer_list *t, unsigned long expires)
+{
+	unsigned long now = jiffies;
+	bool pending = kshim_undefer(&t->d);
+
+	t->expires = expires;
+	kshim_defer(&t->d, time_after(expires, now) ?
+			   (u64)(expires - now) * NSEC_PER_MSEC : 0);
+	return pending;
+}
+
+void kshim_hrtimer_run(struct kshim_deferred *d)
+{
+	struct hrtimer *t = container_of(d, struct hrtimer, d);
+	ktime_t now;
+
+	if (t->function(t) != HRTIMER_RESTART)
+		return;
+
+	now = ktime_get();
+	kshim_defer(&t->d, t->expires > now ? t->expires - now : 0);
+}
+
+void hrtimer_start(struct hrtimer *t, ktime_t tim, int mode)
+{
+	ktime_t now = ktime_get();
+
+	if (mode & HRTIMER_MODE_REL)
+		tim += now;
+	t->expires = tim;
+	kshim_undefer(&t->d);
+	kshim_defer(&t->d, tim > now ? tim - now : 0);
+}
+
+int hrtimer_cancel(struct hrtimer *t)
+{
+	return kshim_undefer(&t->d);
+}
+
+void kshim_tasklet_run(struct kshim_deferred *d)
+{
+	struct tasklet_struct *t = container_of(d, struct tasklet_struct, d);
+
+	if (t->use_callback)
+		t->callback(t);
+	else
+		t->func(t->data);
+}
+
+static struct workqueue_struct kshim_wq;
+struct workqueue_struct *system_wq = &kshim_wq;
+struct workqueue_struct *system_highpri_wq = &kshim_wq;
+struct workqueue_struct *system_long_wq = &kshim_wq;
+
+void kshim_work_run(struct kshim_deferred *d)
+{
+	struct work_struct *w = container_of(d, struct work_struct, d);
+
+	w->func(w);
+}
+
+bool kshim_queue_work(struct kshim_deferred *d, u64 delay_ns, bool mod)
+{
+	bool queued = d->queued;
+
+	if (queued && !mod)
+		return false;
+	kshim_undefer(d);
+	kshim_defer(d, delay_ns);
+	return mod ? queued : true;
+}
+
+unsigned long kshim_wait_for_completion_timeout(struct completion *x,
+						unsigned long timeout)
+{
+	u64 start = kshim_ktime_get_ns();
+	u64 limit = (u64)timeout * NSEC_PER_MSEC;
+
+	for (;;) {
+		unsigned int done = __atomic_load_n(&x->done, __ATOMIC_SEQ_CST);
+		u64 elapsed;
+
+		if (done) {
+			if (done != UINT_MAX / 2)
+				__atomic_sub_fetch(&x->done, 1,
+						   __ATOMIC_SEQ_CST);
+			elapsed = kshim_ktime_get_ns() - start;
+			return max_t(unsigned long, 1,
+				     timeout - min_t(u64, timeout,
+						     elapsed / NSEC_PER_MSEC));
+		}
+
+		elapsed = kshim_ktime_get_ns() - start;
+		if (elapsed >= limit)
+			return 0;
+		if (!kshim_run_pending(false))
+			kshim_sleep_ns(10 * NSEC_PER_USEC);
+	}
+}
+
+/* debugfs and seq_file */
+
+static struct dentry kshim_dentry = { .name = "kshim" };
+
+struct dentry *debugfs_create_dir(const char *name, struct dentry *parent)
+{
+	return &kshim_dentry;
+}
+
+struct dentry *debugfs_create_file(const char *name, unsigned short mode,
+				   struct dentry *parent, void *data,
+				   const struct file_operations *fops)
+{
+	return &kshim_dentry;
+}
+
+void debugfs_create_u32(const char *name, unsigned short mode,
+			struct dentry *parent, u32 *value)
+{
+}
+
+void debugfs_remove_recursive(struct dentry *dentry)
+{
+}
+
+void seq_printf(struct seq_file *m, const char *fmt, ...)
+{
+	va_list ap;
+	int n;
+
+	for (;;) {
+		size_t room = m->size - m->count;
+
+		va_start(ap, fmt);
+		n = vsnprintf(m->buf ? m->buf + m->count : NULL, room, fmt, ap);
+		va_end(ap);
+		if (n < 0)
+			return;
+		if ((size_t)n < room) {
+			m->count += n;
+			return;
+		}
+
+		m->size = max_t(size_t, 2 * m->size, m->count + n + 1);
+		m->buf = realloc(m->buf, m->size);
+		if (!m->buf)
+			abort();
+	}
+}
+
+void seq_puts(struct seq_file *m, const char *s)
+{
+	seq_printf(m, "%s", s);
+}
+
+struct kshim_single {
+	struct seq_file m;
+	int (*show)(struct seq_file *m, void *v);
+	bool shown;
+};
+
+int single_open(struct file *file, int (*show)(struct seq_file *, void *),
+		void *data)
+{
+	struct kshim_single *s = calloc(1, sizeof(*s));
+
+	if (!s)
+		return -ENOMEM;
+	s->m.private = data;
+	s->show = show;
+	file->private_data = &s->m;
+	return 0;
+}
+
+int single_release(struct inode *inode, struct file *file)
+{
+	struct kshim_single *s = container_of(file->private_data,
+					      struct kshim_single, m);
+
+	free(s->m.buf);
+	free(s);
+	return 0;
+}
+
+ssize_t seq_read(struct file *file, char __user *buf, size_t size,
+		 loff_t *ppos)
+{
+	struct kshim_single *s = container_of(file->private_data,
+					      struct kshim_single, m);
+	size_t n;
+
+	if (!s->shown) {
+		int err = s->show(&s->m, NULL);
+
+		if (err)
+			return err;
+		s->shown = true;
+	}
+	if ((size_t)*ppos >= s->m.count)
+		return 0;
+
+	n = min(size, s->m.count - (size_t)*ppos);
+	memcpy(buf, s->m.buf + *ppos, n);
+	*ppos += n;
+	return n;
+}
+
+loff_t seq_lseek(struct file *file, loff_t offset, int whence)
+{
+	return offset;
+}
+
+void kshim_seq_show(int (*show)(struct seq_file *, void *), void *data,
+		    FILE *out)
+{
+	struct seq_file m = { .private = data };
+
+	if (!show(&m, NULL) && m.count)
+		fwrite(m.buf, 1, m.count, out);
+	free(m.buf);
+}
+
+/* Socket buffers and network devices */
+
+struct kshim_rx_stats kshim_rx_stats;
+void (*kshim_rx_hook)(const struct sk_buff *skb);
+
+struct sk_buff *kshim_alloc_skb(unsigned int size)
+{
+	struct sk_buff *skb;
+
+	skb = kshim_malloc(sizeof(*skb) + size, GFP_ATOMIC | __GFP_ZERO);
+	if (!skb)
+		return NULL;
+
+	kshim_alloc_stats.skbs++;
+	skb->head = (unsigned char *)(skb + 1);
+	skb->data = skb->head;
+	skb->len = size;
+	return skb;
+}
+
+void kshim_free_skb(struct sk_buff *skb)
+{
+	kshim_free(skb);
+}
+
+struct sk_buff *skb_copy(const struct sk_buff *skb, gfp_t gfp)
+{
+	struct sk_buff *n = kshim_alloc_skb(skb->len);
+
+	if (!n)
+		return NULL;
+
+	memcpy(n->data, skb->data, skb->len);
+	n->dev = skb->dev;
+	n->sk = skb->sk;
+	n->tstamp = skb->tstamp;
+	n->tstamp_type = skb->tstamp_type;
+	n->hash = skb->hash;
+	n->priority = skb->priority;
+	n->queue_mapping = skb->queue_mapping;
+	n->protocol = skb->protocol;
+	n->hwtstamps = skb->hwtstamps;
+	return n;
+}
+
+/* The data is copied, no driver writes to a frame it has cloned */
+struct sk_buff *skb_clone(struct sk_buff *skb, gfp_t gfp)
+{
+	return skb_copy(skb, gfp);
+}
+
+int netif_rx(struct sk_buff *skb)
+{
+	const struct can_frame *cf = (const struct can_frame *)skb->data;
+
+	kshim_rx_stats.frames++;
+	if (can_is_canfd_skb(skb))
+		kshim_rx_stats.fd_frames++;
+	else if (cf->can_id & CAN_ERR_FLAG)
+		kshim_rx_stats.err_frames++;
+	if (skb->kshim_echo)
+		kshim_rx_stats.echo_frames++;
+
+	if (kshim_rx_hook)
+		kshim_rx_hook(skb);
+
+	kshim_free_skb(skb);
+	return 0;
+}
+
+int dev_queue_xmit(struct sk_buff *skb)
+{
+	kshim_free_skb(skb);
+	return 0;
+}
+
+static int kshim_rtnl;
+
+void rtnl_lock(void)
+{
+	kshim_rtnl++;
+}
+
+void rtnl_unlock(void)
+{
+	kshim_rtnl--;
+}
+
+/* CAN devices */
+
+static unsigned int kshim_candevs;
+
+struct net_device *alloc_candev_mqs(int sizeof_priv,
+				    unsigned int echo_skb_max,
+				    unsigned int txqs, unsigned int rxqs)
+{
+	struct net_device *dev;
+	struct can_priv *priv;
+
+	dev = kshim_malloc(sizeof(*dev), GFP_KERNEL | __GFP_ZERO);
+	if (!dev)
+		return NULL;
+
+	priv = kshim_malloc(max_t(size_t, sizeof_priv, sizeof(*priv)),
+			    GFP_KERNEL | __GFP_ZERO);
+	if (!priv)
+		goto err_dev;
+
+	if (echo_skb_max) {
+		priv->echo_skb = kshim_malloc(echo_skb_max *
+					      sizeof(*priv->echo_skb),
+					      GFP_KERNEL | __GFP_ZERO);
+		if (!priv->echo_skb)
+			goto err_priv;
+	}
+
+	snprintf(dev->name, sizeof(dev->name), "can%u", kshim_candevs++);
+	dev->dev.init_name = dev->name;
+	dev->mtu = CAN_MTU;
+	dev->num_tx_queues = clamp_t(unsigned int, txqs, 1,
+				     KSHIM_MAX_TX_QUEUES);
+	dev->real_num_tx_queues = dev->num_tx_queues;
+	dev->present = true;
+	dev->priv = priv;
+	priv->dev = dev;
+	priv->echo_skb_max = echo_skb_max;
+	priv->state = CAN_STATE_STOPPED;
+	return dev;
+
+err_priv:
+	kshim_free(priv);
+err_dev:
+	kshim_free(dev);
+	return NULL;
+}
+
+void free_candev(struct net_device *dev)
+{
+	struct can_priv *priv = netdev_priv(dev);
+	unsigned int i;
+
+	for (i = 0; i < priv->echo_skb_max; i++)
+		kshim_free_skb(priv->echo_skb[i]);
+	kshim_free(priv->echo_skb);
+	kshim_free(priv);
+	kshim_free(dev);
+}
+
+int register_candev(struct net_device *dev)
+{
+	dev->registered = true;
+	return 0;
+}
+
+void unregister_candev(struct net_device *dev)
+{
+	dev->registered = false;
+	dev->running = false;
+}
+
+int open_candev(struct net_device *dev)
+{
+	struct can_priv *priv = netdev_priv(dev);
+
+	if (!priv->bittiming.bitrate)
+		return -EINVAL;
+	dev->carrier = true;
+	return 0;
+}
+
+void close_candev(struct net_device *dev)
+{
+	struct can_priv *priv = netdev_priv(dev);
+	unsigned int i;
+
+	for (i = 0; i < priv->echo_skb_max; i++)
+		can_free_echo_skb(dev, i, NULL);
+	dev->carrier = false;
+}
+
+int can_change_mtu(struct net_device *dev, int new_mtu)
+{
+	if (new_mtu != CAN_MTU && new_mtu != CANFD_MTU)
+		return -EINVAL;
+	dev->mtu = new_mtu;
+	return 0;
+}
+
+int can_set_static_ctrlmode(struct net_device *dev, u32 static_mode)
+{
+	struct can_priv *priv = netdev_priv(dev);
+
+	priv->ctrlmode = static_mode;
+	priv->ctrlmode_static = static_mode;
+	return 0;
+}
+
+int can_put_echo_skb(struct sk_buff *skb, struct net_device *dev,
+		     unsigned int idx, unsigned int frame_len)
+{
+	struct can_priv *priv = netdev_priv(dev);
+
+	if (idx >= priv->echo_skb_max || priv->echo_skb[idx]) {
+		kshim_free_skb(skb);
+		return -EINVAL;
+	}
+	skb->dev = dev;
+	priv->echo_skb[idx] = skb;
+	return 0;
+}
+
+unsigned int can_get_echo_skb(struct net_device *dev, unsigned int idx,
+			      unsigned int *frame_len_ptr)
+{
+	struct can_priv *priv = netdev_priv(dev);
+	const struct canfd_frame *cfd;
+	struct sk_buff *skb;
+	unsigned int len;
+
+	if (idx >= priv->echo_skb_max || !priv->echo_skb[idx])
+		return 0;
+
+	skb = priv->echo_skb[idx];
+	priv->echo_skb[idx] = NULL;
+	cfd = (const struct canfd_frame *)skb->data;
+	len = cfd->can_id & CAN_RTR_FLAG ? 0 : cfd->len;
+	if (frame_len_ptr)
+		*frame_len_ptr = 0;
+
+	skb->kshim_echo = 1;
+	netif_rx(skb);
+	return len;
+}
+
+void can_free_echo_skb(struct net_device *dev, unsigned int idx,
+		       unsigned int *frame_len_ptr)
+{
+	struct can_priv *priv = netdev_priv(dev);
+
+	if (idx >= priv->echo_skb_max)
+		return;
+	kshim_free_skb(priv->echo_skb[idx]);
+	priv->echo_skb[idx] = NULL;
+	if (frame_len_ptr)
+		*frame_len_ptr = 0;
+}
+
+static struct sk_buff *kshim_alloc_can_skb(struct net_device *dev,
+					   unsigned int mtu, u16 proto)
+{
+	struct sk_buff *skb = kshim_alloc_skb(mtu);
+
+	if (!skb)
+		return NULL;
+	skb->dev = dev;
+	skb->protocol = cpu_to_be16(proto);
+	return skb;
+}
+
+struct sk_buff *alloc_can_skb(struct net_device *dev, struct can_frame **cf)
+{
+	struct sk_buff *skb = kshim_alloc_can_skb(dev, CAN_MTU, ETH_P_CAN);
+
+	*cf = skb ? (struct can_frame *)skb->data : NULL;
+	return skb;
+}
+
+struct sk_buff *alloc_canfd_skb(struct net_device *dev,
+				struct canfd_frame **cfd)
+{
+	struct sk_buff *skb = kshim_alloc_can_skb(dev, CANFD_MTU, ETH_P_CANFD);
+
+	*cfd = skb ? (struct canfd_frame *)skb->data : NULL;
+	return skb;
+}
+
+struct sk_buff *alloc_can_err_skb(struct net_device *dev,
+				  struct can_frame **cf)
+{
+	struct sk_buff *skb = alloc_can_skb(dev, cf);
+
+	if (!skb)
+		return NULL;
+	(*cf)->can_id = CAN_ERR_FLAG;
+	(*cf)->len = CAN_ERR_DLC;
+	return skb;
+}
+
+static u8 kshim_can_state_err(enum can_state state, bool tx)
+{
+	switch (state) {
+	case CAN_STATE_ERROR_ACTIVE:
+		return CAN_ERR_CRTL_ACTIVE;
+	case CAN_STATE_ERROR_WARNING:
+		return tx ? CAN_ERR_CRTL_TX_WARNING : CAN_ERR_CRTL_RX_WARNING;
+	case CAN_STATE_ERROR_PASSIVE:
+		return tx ? CAN_ERR_CRTL_TX_PASSIVE : CAN_ERR_CRTL_RX_PASSIVE;
+	default:
+		return 0;
+	}
+}
+
+/* Follows drivers/net/can/dev/dev.c, without the restart handling */
+void can_change_state(struct net_device *dev, struct can_frame *cf,
+		      enum can_state tx_state, enum can_state rx_state)
+{
+	struct can_priv *priv = netdev_priv(dev);
+	enum can_state new_state = max(tx_state, rx_state);
+
+	if (new_state == priv->state)
+		return;
+
+	if (new_state > priv->state) {
+		switch (new_state) {
+		case CAN_STATE_ERROR_WARNING:
+			priv->can_stats.error_warning++;
+			break;
+		case CAN_STATE_ERROR_PASSIVE:
+			priv->can_stats.error_passive++;
+			break;
+		case CAN_STATE_BUS_OFF:
+			priv->can_stats.bus_off++;
+			break;
+		default:
+			break;
+		}
+	}
+	priv->state = new_state;
+
+	if (!cf)
+		return;
+
+	if (new_state == CAN_STATE_BUS_OFF) {
+		cf->can_id |= CAN_ERR_BUSOFF;
+		return;
+	}
+
+	cf->can_id |= CAN_ERR_CRTL;
+	cf->data[1] |= tx_state >= rx_state ?
+		       kshim_can_state_err(tx_state, true) : 0;
+	cf->data[1] |= tx_state <= rx_state ?
+		       kshim_can_state_err(rx_state, false) : 0;
+}
+
+void can_bus_off(struct net_device *dev)
+{
+	/* Counted by can_change_state() */
+	dev->carrier = false;
+}
+
+bool can_dropped_invalid_skb(struct net_device *dev, struct sk_buff *skb)
+{
+	if (skb->len == CAN_MTU || skb->len == CANFD_MTU)
+		return false;
+	dev->stats.tx_dropped++;
+	kshim_free_skb(skb);
+	return true;
+}
+
+bool can_dev_dropped_skb(struct net_device *dev, struct sk_buff *skb)
+{
+	struct can_priv *priv = netdev_priv(dev);
+
+	if (priv->ctrlmode & CAN_CTRLMODE_LISTENONLY) {
+		dev->stats.tx_dropped++;
+		kshim_free_skb(skb);
+		return true;
+	}
+	return can_dropped_invalid_skb(dev, skb);
+}
+
+static const u8 kshim_dlc2len[] = {
+	0, 1, 2, 3, 4, 5, 6, 7, 8, 12, 16, 20, 24, 32, 48, 64
+};
+
+u8 can_fd_dlc2len(u8 dlc)
+{
+	return kshim_dlc2len[dlc & 0x0f];
+}
+
+u8 can_fd_len2dlc(u8 len)
+{
+	u8 dlc = 0;
+
+	while (dlc < CANFD_MAX_DLC && kshim_dlc2len[dlc] < len)
+		dlc++;
+	return dlc;
+}
+
+unsigned int can_skb_get_frame_len(const struct sk_buff *skb)
+{
+	return 0;
+}
+
+/* USB */
+
+const struct kshim_usb_backend *kshim_usb_backend;
+static LIST_HEAD(kshim_urbs_in);
+static LIST_HEAD(kshim_urbs_out);
+
+struct urb *usb_alloc_urb(int iso_packets, gfp_t mem_flags)
+{
+	struct urb *urb = kshim_malloc(sizeof(*urb), mem_flags | __GFP_ZERO);
+
+	if (!urb)
+		return NULL;
+	INIT_LIST_HEAD(&urb->anchor_list);
+	INIT_LIST_HEAD(&urb->kshim_node);
+	urb->kshim_refs = 1;
+	return urb;
+}
+
+void usb_free_urb(struct urb *urb)
+{
+	if (urb && !--urb->kshim_refs)
+		kshim_free(urb);
+}
+
+void usb_anchor_urb(struct urb *urb, struct usb_anchor *anchor)
+{
+	list_add_tail(&urb->anchor_list, &anchor->urb_list);
+	urb->anchor = anchor;
+}
+
+void usb_unanchor_urb(struct urb *urb)
+{
+	if (!urb->anchor)
+		return;
+	list_del_init(&urb->anchor_list);
+	urb->anchor = NULL;
+}
+
+/* Like usb_hcd_giveback_urb(): unanchor, then complete */
+static void kshim_urb_giveback(struct urb *urb, int status)
+{
+	list_del_init(&urb->kshim_node);
+	urb->kshim_submitted = false;
+	urb->status = status;
+	urb->kshim_refs++;
+	usb_unanchor_urb(urb);
+	urb->complete(urb);
+	usb_free_urb(urb);
+}
+
+int usb_submit_urb(struct urb *urb, gfp_t mem_flags)
+{
+	if (urb->kshim_submitted)
+		return -EBUSY;
+
+	urb->kshim_submitted = true;
+	urb->status = -EINPROGRESS;
+	urb->actual_length = 0;
+	if (usb_pipein(urb->pipe)) {
+		list_add_tail(&urb->kshim_node, &kshim_urbs_in);
+		return 0;
+	}
+
+	list_add_tail(&urb->kshim_node, &kshim_urbs_out);
+	if (kshim_usb_backend && kshim_usb_backend->out)
+		kshim_usb_backend->out(urb, urb->transfer_buffer,
+				       urb->transfer_buffer_length);
+	return 0;
+}
+
+void usb_kill_urb(struct urb *urb)
+{
+	if (urb && urb->kshim_submitted)
+		kshim_urb_giveback(urb, -ENOENT);
+}
+
+int usb_unlink_urb(struct urb *urb)
+{
+	if (!urb->kshim_submitted)
+		return -EIDRM;
+	kshim_urb_giveback(urb, -ECONNRESET);
+	return 0;
+}
+
+void *usb_alloc_coherent(struct usb_device *dev, size_t size,
+			 gfp_t mem_flags, dma_addr_t *dma)
+{
+	void *p = kshim_malloc(size, mem_flags);
+
+	*dma = (dma_addr_t)(uintptr_t)p;
+	return p;
+}
+
+void usb_free_coherent(struct usb_device *dev, size_t size, void *addr,
+		       dma_addr_t dma)
+{
+	kshim_free(addr);
+}
+
+int usb_bulk_msg(struct usb_device *usb_dev, unsigned int pipe, void *data,
+		 int len, int *actual_length, int timeout)
+{
+	if (!kshim_usb_backend || !kshim_usb_backend->bulk_msg)
+		return -ETIMEDOUT;
+	return kshim_usb_backend->bulk_msg(usb_pipein(pipe), data, len,
+					   actual_length, timeout);
+}
+
+void init_usb_anchor(struct usb_anchor *anchor)
+{
+	INIT_LIST_HEAD(&anchor->urb_list);
+	spin_lock_init(&anchor->lock);
+}
+
+void usb_kill_anchored_urbs(struct usb_anchor *anchor)
+{
+	while (!list_empty(&anchor->urb_list)) {
+		struct urb *urb = list_last_entry(&anchor->urb_list,
+						  struct urb, anchor_list);
+
+		if (urb->kshim_submitted)
+			usb_kill_urb(urb);
+		else
+			usb_unanchor_urb(urb);
+	}
+}
+
+void usb_scuttle_anchored_urbs(struct usb_anchor *anchor)
+{
+	while (!list_empty(&anchor->urb_list))
+		usb_unanchor_urb(list_first_entry(&anchor->urb_list,
+						  struct urb, anchor_list));
+}
+
+int usb_wait_anchor_empty_timeout(struct usb_anchor *anchor,
+				  unsigned int timeout)
+{
+	if (list_empty(&anchor->urb_list))
+		return 1;
+	kshim_usb_complete_out(0);
+	return list_empty(&anchor->urb_list);
+}
+
+int usb_anchor_empty(struct usb_anchor *anchor)
+{
+	return list_empty(&anchor->urb_list);
+}
+
+bool kshim_usb_complete_in(const void *data, int len, int status)
+{
+	struct urb *urb;
+
+	if (list_empty(&kshim_urbs_in))
+		return false;
+
+	urb = list_first_entry(&kshim_urbs_in, struct urb, kshim_node);
+	len = min_t(int, len, urb->transfer_buffer_length);
+	if (len > 0)
+		memcpy(urb->transfer_buffer, data, len);
+	urb->actual_length = max(len, 0);
+	kshim_urb_giveback(urb, status);
+	return true;
+}
+
+unsigned int kshim_usb_complete_out(int status)
+{
+	unsigned int n = 0;
+
+	while (!list_empty(&kshim_urbs_out)) {
+		struct urb *urb = list_first_entry(&kshim_urbs_out, struct urb,
+						   kshim_node);
+
+		urb->actual_length = status ? 0 : urb->transfer_buffer_length;
+		kshim_urb_giveback(urb, status);
+		n++;
+	}
+	return n;
+}
+
+unsigned int kshim_usb_in_parked(void)
+{
+	struct urb *urb;
+	unsigned int n = 0;
+
+	list_for_each_entry(urb, &kshim_urbs_in, kshim_node)
+		n++;
+	return n;
+}
+
+/* PCI, DMA and interrupts */
+
+void *dmam_alloc_coherent(struct device *dev, size_t size,
+			  dma_addr_t *dma_handle, gfp_t gfp)
+{
+	void *p = kshim_malloc(size, gfp | __GFP_ZERO);
+
+	*dma_handle = (dma_addr_t)(uintptr_t)p;
+	return p;
+}
+
+#define KSHIM_MAX_IRQS		8
+
+static struct kshim_irq {
+	unsigned int irq;
+	irq_handler_t handler;
+	void *dev;
+} kshim_irqs[KSHIM_MAX_IRQS];
+
+int request_irq(unsigned int irq, irq_handler_t handler, unsigned long flags,
+		const char *name, void *dev)
+{
+	unsigned int i;
+
+	for (i = 0; i < KSHIM_MAX_IRQS; i++) {
+		if (!kshim_irqs[i].handler) {
+			kshim_irqs[i].irq = irq;
+			kshim_irqs[i].handler = handler;
+			kshim_irqs[i].dev = dev;
+			return 0;
+		}
+	}
+	return -EBUSY;
+}
+
+void free_irq(unsigned int irq, void *dev_id)
+{
+	unsigned int i;
+
+	for (i = 0; i < KSHIM_MAX_IRQS; i++) {
+		if (kshim_irqs[i].handler && kshim_irqs[i].irq == irq &&
+		    kshim_irqs[i].dev == dev_id)
+			memset(&kshim_irqs[i], 0, sizeof(kshim_irqs[i]));
+	}
+}
+
+irqreturn_t kshim_irq_raise(unsigned int irq)
+{
+	irqreturn_t ret = IRQ_NONE;
+	unsigned int i;
+
+	for (i = 0; i < KSHIM_MAX_IRQS; i++) {
+		if (kshim_irqs[i].handler && kshim_irqs[i].irq == irq)
+			ret |= kshim_irqs[i].handler(irq, kshim_irqs[i].dev);
+	}
+	return ret;
+}
+
+static struct kshim_mmio_model *kshim_mmio_models;
+
+void kshim_mmio_register(struct kshim_mmio_model *model)
+{
+	model->next = kshim_mmio_models;
+	kshim_mmio_models = model;
+}
+
+void kshim_mmio_unregister(struct kshim_mmio_model *model)
+{
+	struct kshim_mmio_model **m;
+
+	for (m = &kshim_mmio_models; *m; m = &(*m)->next) {
+		if (*m == model) {
+			*m = model->next;
+			return;
+		}
+	}
+}
+
+static struct kshim_mmio_model *kshim_mmio_find(const volatile void *addr,
+						unsigned long *offset)
+{
+	struct kshim_mmio_model *m;
+
+	for (m = kshim_mmio_models; m; m = m->next) {
+		uintptr_t base = (uintptr_t)m->base;
+
+		if ((uintptr_t)addr >= base &&
+		    (uintptr_t)addr - base < m->size) {
+			*offset = (uintptr_t)addr - base;
+			return m;
+		}
+	}
+	return NULL;
+}
+
+u32 kshim_mmio_read32(const volatile void __iomem *addr)
+{
+	unsigned long offset;
+	struct kshim_mmio_model *m = kshim_mmio_find(addr, &offset);
+
+	if (m && m->read32)
+		return m->read32(m, offset);
+	return *(const volatile u32 *)addr;
+}
+
+void kshim_mmio_write32(u32 value, volatile void __iomem *addr)
+{
+	unsigned long offset;
+	struct kshim_mmio_model *m = kshim_mmio_find(addr, &offset);
+
+	if (m && m->write32)
+		m->write32(m, offset, value);
+	else
+		*(volatile u32 *)addr = value;
+}
@@ -0,0 +1,707 @@
+// SPDX-License-Identifier: GPL-2.0
+/* Replays captured Kvaser traffic through the unmodified driver parsers:
+ * bulk IN transfers from a usbmon capture through the hydra or leaf
+ * read_bulk_callback, or DMA buffers through kvaser_pciefd_read_buffer().
+ * Reports decode throughput, allocations and the cost per command type.
+ */
+
+#include <errno.h>
+#include <getopt.h>
+
+#include "replay.h"
+
+/* pcap link types of usbmon captures */
+#define REPLAY_LINKTYPE_USB_LINUX		189
+#define REPLAY_LINKTYPE_USB_LINUX_MMAPPED	220
+
+#define REPLAY_PCAP_MAGIC_US	0xa1b2c3d4
+#define REPLAY_PCAP_MAGIC_NS	0xa1b23c4d
+
+#define REPLAY_PCAPNG_SHB	0x0a0d0d0a
+#define REPLAY_PCAPNG_IDB	0x00000001
+#define REPLAY_PCAPNG_EPB	0x00000006
+#define REPLAY_PCAPNG_BOM	0x1a2b3c4d
+#define REPLAY_PCAPNG_MAX_IF	64
+
+#define REPLAY_USBMON_XFER_BULK	3
+#define REPLAY_DMA_SIZE		4096
+#define REPLAY_DEFAULT_PASSES	10
+
+struct replay_pcap_hdr {
+	u32 magic;
+	u16 version_major;
+	u16 version_minor;
+	s32 thiszone;
+	u32 sigfigs;
+	u32 snaplen;
+	u32 linktype;
+} __packed;
+
+struct replay_pcap_rec {
+	u32 ts_sec;
+	u32 ts_usec;
+	u32 incl_len;
+	u32 orig_len;
+} __packed;
+
+/* struct usbmon_packet, Documentation/usb/usbmon.rst. The last four
+ * fields are only present with LINKTYPE_USB_LINUX_MMAPPED.
+ */
+struct replay_usbmon {
+	u64 id;
+	u8 type;
+	u8 xfer_type;
+	u8 epnum;
+	u8 devnum;
+	u16 busnum;
+	s8 flag_setup;
+	s8 flag_data;
+	s64 ts_sec;
+	s32 ts_usec;
+	s32 status;
+	u32 length;
+	u32 len_cap;
+	u8 setup[8];
+	s32 interval;
+	s32 start_frame;
+	u32 xfer_flags;
+	u32 ndesc;
+} __packed;
+
+#define REPLAY_USBMON_LEN \
+	offsetof(struct replay_usbmon, interval)
+#define REPLAY_USBMON_MMAPPED_LEN	sizeof(struct replay_usbmon)
+
+struct replay_capture {
+	struct replay_rec *recs;
+	unsigned int nrecs;
+	unsigned int size;
+	/* Transfer filter, -1 until set or taken from the first match */
+	int busnum;
+	int devnum;
+	int epnum;
+	unsigned long skipped;
+	unsigned long truncated;
+	unsigned long failed;
+};
+
+static const struct replay_family *replay_families[] = {
+	&replay_hydra,
+	&replay_leaf,
+	&replay_usbcan,
+	&replay_pciefd,
+};
+
+static void replay_usage(FILE *out)
+{
+	fprintf(out,
+		"Usage: kvaser_replay -f FAMILY [options] CAPTURE\n"
+		"       kvaser_replay -f FAMILY [options] -S OUT\n"
+		"\n"
+		"  -f FAMILY    hydra, leaf, usbcan or pciefd\n"
+		"  -p MAXP      Bulk IN wMaxPacketSize: 64, 512 (default) or 1024\n"
+		"  -c CHANNELS  Number of channels, learned from the capture by default\n"
+		"  -F MHZ       CAN clock, learned from the capture by default\n"
+		"  -s           pciefd: SmartFusion2 register layout\n"
+		"  -d BUS:DEV   Only transfers from this USB device\n"
+		"  -e EP        Only transfers from this IN endpoint, e.g. 0x81\n"
+		"  -n PASSES    Timed passes over the capture (default %d)\n"
+		"  -S OUT       Write a synthetic capture to OUT and replay it,\n"
+		"               checking the frames delivered\n"
+		"  -X           Fail on format errors, driver errors or warnings\n"
+		"  -v, -q       More or less driver log output\n"
+		"\n"
+		"USB captures are usbmon pcap or pcapng files, pciefd captures are\n"
+		"raw dumps of %d-byte DMA buffers.\n",
+		REPLAY_DEFAULT_PASSES, REPLAY_DMA_SIZE);
+}
+
+static u32 replay_synth_xorshift(u32 x)
+{
+	x ^= x << 13;
+	x ^= x >> 17;
+	x ^= x << 5;
+	return x;
+}
+
+u32 replay_synth_rand(struct replay_synth *s)
+{
+	s->seed = replay_synth_xorshift(s->seed);
+	return s->seed;
+}
+
+static int replay_recs_add(struct replay_rec **recs, unsigned int *nrecs,
+			   unsigned int *size, const u8 *data, u32 len)
+{
+	if (*nrecs == *size) {
+		unsigned int new_size = *size ? 2 * *size : 1024;
+		struct replay_rec *new_recs;
+
+		new_recs = realloc(*recs, new_size * sizeof(*new_recs));
+		if (!new_recs)
+			return -ENOMEM;
+		*recs = new_recs;
+		*size = new_size;
+	}
+	(*recs)[*nrecs].data = data;
+	(*recs)[*nrecs].len = len;
+	(*nrecs)++;
+	return 0;
+}
+
+int replay_synth_add(struct replay_synth *s, const void *data, u32 len)
+{
+	u8 *copy = malloc(len);
+	int err;
+
+	if (!copy)
+		return -ENOMEM;
+	memcpy(copy, data, len);
+	err = replay_recs_add(&s->recs, &s->nrecs, &s->size, copy, len);
+	if (err)
+		free(copy);
+	return err;
+}
+
+static void replay_synth_free(struct replay_synth *s)
+{
+	unsigned int i;
+
+	for (i = 0; i < s->nrecs; i++)
+		free((void *)s->recs[i].data);
+	free(s->recs);
+}
+
+static u8 *replay_read_file(const char *path, size_t *len)
+{
+	long size;
+	u8 *buf;
+	FILE *f;
+
+	f = fopen(path, "rb");
+	if (!f || fseek(f, 0, SEEK_END) || (size = ftell(f)) < 0 ||
+	    fseek(f, 0, SEEK_SET)) {
+		perror(path);
+		if (f)
+			fclose(f);
+		return NULL;
+	}
+
+	/* Rounded up, so a short last DMA buffer reads as zeroes */
+	buf = calloc(1, ALIGN(size, REPLAY_DMA_SIZE) + REPLAY_DMA_SIZE);
+	if (!buf || fread(buf, 1, size, f) != (size_t)size) {
+		fprintf(stderr, "%s: read failed\n", path);
+		free(buf);
+		fclose(f);
+		return NULL;
+	}
+	fclose(f);
+	*len = size;
+	return buf;
+}
+
+/* Keeps the completions of bulk IN transfers that kvaser_usb's Rx path
+ * would see, i.e. with status 0
+ */
+static int replay_usbmon_add(struct replay_capture *cap, u32 linktype,
+			     const u8 *data, u32 caplen)
+{
+	size_t hdr_len = linktype == REPLAY_LINKTYPE_USB_LINUX_MMAPPED ?
+			 REPLAY_USBMON_MMAPPED_LEN : REPLAY_USBMON_LEN;
+	struct replay_usbmon mon;
+
+	if (linktype != REPLAY_LINKTYPE_USB_LINUX &&
+	    linktype != REPLAY_LINKTYPE_USB_LINUX_MMAPPED) {
+		cap->skipped++;
+		return 0;
+	}
+	if (caplen < hdr_len) {
+		cap->truncated++;
+		return 0;
+	}
+	memcpy(&mon, data, hdr_len);
+
+	if (mon.type != 'C' || mon.xfer_type != REPLAY_USBMON_XFER_BULK ||
+	    !(mon.epnum & USB_DIR_IN)) {
+		cap->skipped++;
+		return 0;
+	}
+
+	if (cap->busnum < 0) {
+		cap->busnum = mon.busnum;
+		cap->devnum = mon.devnum;
+	}
+	if (cap->epnum < 0)
+		cap->epnum = mon.epnum;
+	if (mon.busnum != cap->busnum || mon.devnum != cap->devnum ||
+	    mon.epnum != cap->epnum) {
+		cap->skipped++;
+		return 0;
+	}
+
+	if (mon.status) {
+		cap->failed++;
+		return 0;
+	}
+	if (!mon.length)
+		return 0;
+	if (mon.len_cap < mon.length || caplen - hdr_len < mon.length) {
+		cap->truncated++;
+		return 0;
+	}
+
+	return replay_recs_add(&cap->recs, &cap->nrecs, &cap->size,
+			       data + hdr_len, mon.length);
+}
+
+static int replay_load_pcap(struct replay_capture *cap, const u8 *buf,
+			    size_t len)
+{
+	const struct replay_pcap_hdr *hdr = (const void *)buf;
+	size_t pos = sizeof(*hdr);
+	int err = 0;
+
+	while (!err && pos + sizeof(struct replay_pcap_rec) <= len) {
+		const struct replay_pcap_rec *rec = (const void *)(buf + pos);
+
+		pos += sizeof(*rec);
+		if (rec->incl_len > len - pos) {
+			cap->truncated++;
+			break;
+		}
+		err = replay_usbmon_add(cap, hdr->linktype, buf + pos,
+					rec->incl_len);
+		pos += rec->incl_len;
+	}
+	return err;
+}
+
+static int replay_load_pcapng(struct replay_capture *cap, const u8 *buf,
+			      size_t len)
+{
+	u32 linktypes[REPLAY_PCAPNG_MAX_IF];
+	unsigned int nifs = 0;
+	size_t pos = 0;
+	int err = 0;
+
+	while (!err && pos + 12 <= len) {
+		const u32 *block = (const u32 *)(buf + pos);
+		u32 type = block[0], total = block[1];
+
+		if (total < 12 || total % 4 || total > len - pos) {
+			cap->truncated++;
+			break;
+		}
+
+		switch (type) {
+		case REPLAY_PCAPNG_SHB:
+			if (block[2] != REPLAY_PCAPNG_BOM) {
+				fprintf(stderr,
+					"pcapng: only native byte order is supported\n");
+				return -EINVAL;
+			}
+			nifs = 0;
+			break;
+
+		case REPLAY_PCAPNG_IDB:
+			if (nifs < ARRAY_SIZE(linktypes))
+				linktypes[nifs++] = block[2] & 0xffff;
+			break;
+
+		case REPLAY_PCAPNG_EPB:
+			/* Interface, timestamp, captured and original length */
+			if (total < 32 || block[2] >= nifs ||
+			    block[5] > total - 32) {
+				cap->truncated++;
+				break;
+			}
+			err = replay_usbmon_add(cap, linktypes[block[2]],
+						buf + pos + 28, block[5]);
+			break;
+		}
+		pos += total;
+	}
+	return err;
+}
+
+static int replay_load_usb(struct replay_capture *cap, const u8 *buf,
+			   size_t len)
+{
+	u32 magic = len >= 4 ? *(const u32 *)buf : 0;
+
+	switch (magic) {
+	case REPLAY_PCAP_MAGIC_US:
+	case REPLAY_PCAP_MAGIC_NS:
+		if (len < sizeof(struct replay_pcap_hdr))
+			break;
+		return replay_load_pcap(cap, buf, len);
+	case REPLAY_PCAPNG_SHB:
+		return replay_load_pcapng(cap, buf, len);
+	}
+
+	fprintf(stderr,
+		"not a native byte order pcap or pcapng file\n");
+	return -EINVAL;
+}
+
+static int replay_load_dma(struct replay_capture *cap, const u8 *buf,
+			   size_t len)
+{
+	size_t pos;
+	int err;
+
+	for (pos = 0; pos < len; pos += REPLAY_DMA_SIZE) {
+		err = replay_recs_add(&cap->recs, &cap->nrecs, &cap->size,
+				      buf + pos, REPLAY_DMA_SIZE);
+		if (err)
+			return err;
+	}
+	return 0;
+}
+
+/* Leaf families get the 48-byte usbmon header, hydra the mmapped one, so
+ * make check reads both
+ */
+static int replay_write_pcap(const char *path, const struct replay_family *fam,
+			     const struct replay_synth *s)
+{
+	u32 linktype = fam == &replay_hydra ?
+		       REPLAY_LINKTYPE_USB_LINUX_MMAPPED :
+		       REPLAY_LINKTYPE_USB_LINUX;
+	size_t hdr_len = linktype == REPLAY_LINKTYPE_USB_LINUX_MMAPPED ?
+			 REPLAY_USBMON_MMAPPED_LEN : REPLAY_USBMON_LEN;
+	struct replay_pcap_hdr hdr = {
+		.magic = REPLAY_PCAP_MAGIC_US,
+		.version_major = 2,
+		.version_minor = 4,
+		.snaplen = 0x40000,
+		.linktype = linktype,
+	};
+	unsigned int i;
+	FILE *f;
+
+	f = fopen(path, "wb");
+	if (!f) {
+		perror(path);
+		return -errno;
+	}
+	fwrite(&hdr, sizeof(hdr), 1, f);
+
+	for (i = 0; i < s->nrecs; i++) {
+		struct replay_usbmon mon = {
+			.id = i,
+			.type = 'C',
+			.xfer_type = REPLAY_USBMON_XFER_BULK,
+			.epnum = USB_DIR_IN | 1,
+			.devnum = 2,
+			.busnum = 1,
+			.flag_setup = '-',
+			.ts_sec = i / 1000,
+			.ts_usec = i % 1000 * 1000,
+			.length = s->recs[i].len,
+			.len_cap = s->recs[i].len,
+		};
+		struct replay_pcap_rec rec = {
+			.ts_sec = mon.ts_sec,
+			.ts_usec = mon.ts_usec,
+			.incl_len = hdr_len + s->recs[i].len,
+			.orig_len = hdr_len + s->recs[i].len,
+		};
+
+		fwrite(&rec, sizeof(rec), 1, f);
+		fwrite(&mon, hdr_len, 1, f);
+		fwrite(s->recs[i].data, s->recs[i].len, 1, f);
+	}
+
+	if (fclose(f)) {
+		perror(path);
+		return -EIO;
+	}
+	return 0;
+}
+
+static int replay_write_dma(const char *path, const struct replay_synth *s)
+{
+	unsigned int i;
+	FILE *f;
+
+	f = fopen(path, "wb");
+	if (!f) {
+		perror(path);
+		return -errno;
+	}
+	for (i = 0; i < s->nrecs; i++)
+		fwrite(s->recs[i].data, s->recs[i].len, 1, f);
+	if (fclose(f)) {
+		perror(path);
+		return -EIO;
+	}
+	return 0;
+}
+
+static void replay_feed_all(const struct replay_family *fam,
+			    const struct replay_rec *recs, unsigned int nrecs)
+{
+	unsigned int i;
+
+	for (i = 0; i < nrecs; i++) {
+		fam->feed(&recs[i]);
+		/* Timers and work the parser scheduled */
+		kshim_run_pending(false);
+	}
+}
+
+static int replay_cmd_stat_cmp(const void *a, const void *b)
+{
+	const struct replay_cmd_stat *x = a, *y = b;
+
+	if (x->time_ns != y->time_ns)
+		return x->time_ns < y->time_ns ? 1 : -1;
+	return x->id < y->id ? -1 : x->id > y->id;
+}
+
+static unsigned long replay_messages(int max_level)
+{
+	unsigned long n = 0;
+	int i;
+
+	for (i = 0; i <= max_level; i++)
+		n += kshim_messages[i];
+	return n;
+}
+
+static double replay_per(double x, u64 n)
+{
+	return n ? x / n : 0;
+}
+
+int main(int argc, char **argv)
+{
+	const struct replay_family *fam = NULL;
+	struct replay_opts opts = { .maxp = 512 };
+	struct replay_capture cap = { .busnum = -1, .devnum = -1, .epnum = -1 };
+	struct replay_synth synth = { .seed = 0x4b76736b };
+	static struct replay_cmd_stat stats[REPLAY_MAX_CMD_TYPES];
+	unsigned int passes = REPLAY_DEFAULT_PASSES;
+	struct kshim_alloc_stats alloc0, alloc1;
+	struct kshim_rx_stats rx0, rx1;
+	unsigned long errors0, warnings0, errors, warnings;
+	const char *synth_path = NULL;
+	const struct replay_rec *recs;
+	unsigned int nrecs, first = 0;
+	u64 bytes = 0, commands = 0, format_errors = 0, elapsed = 0, data;
+	unsigned int i, nstats, p;
+	bool strict = false;
+	u8 *file = NULL;
+	size_t file_len;
+	int opt, err;
+
+	while ((opt = getopt(argc, argv, "f:p:c:F:sd:e:n:S:Xvqh")) != -1) {
+		switch (opt) {
+		case 'f':
+			for (i = 0; i < ARRAY_SIZE(replay_families); i++) {
+				if (!strcmp(optarg, replay_families[i]->name))
+					fam = replay_families[i];
+			}
+			if (!fam) {
+				fprintf(stderr, "unknown family %s\n", optarg);
+				return 2;
+			}
+			break;
+		case 'p':
+			opts.maxp = strtoul(optarg, NULL, 0);
+			if (opts.maxp != 64 && opts.maxp != 512 &&
+			    opts.maxp != 1024) {
+				fprintf(stderr, "-p must be 64, 512 or 1024\n");
+				return 2;
+			}
+			break;
+		case 'c':
+			opts.nchannels = strtoul(optarg, NULL, 0);
+			break;
+		case 'F':
+			opts.freq_mhz = strtoul(optarg, NULL, 0);
+			break;
+		case 's':
+			opts.sf2 = true;
+			break;
+		case 'd':
+			if (sscanf(optarg, "%d:%d", &cap.busnum,
+				   &cap.devnum) != 2) {
+				fprintf(stderr, "-d takes BUS:DEV\n");
+				return 2;
+			}
+			break;
+		case 'e':
+			cap.epnum = strtoul(optarg, NULL, 0) | USB_DIR_IN;
+			break;
+		case 'n':
+			passes = strtoul(optarg, NULL, 0);
+			if (!passes)
+				passes = 1;
+			break;
+		case 'S':
+			synth_path = optarg;
+			break;
+		case 'X':
+			strict = true;
+			break;
+		case 'v':
+			kshim_loglevel++;
+			break;
+		case 'q':
+			kshim_loglevel = 0;
+			break;
+		case 'h':
+			replay_usage(stdout);
+			return 0;
+		default:
+			replay_usage(stderr);
+			return 2;
+		}
+	}
+
+	if (!fam || (!synth_path && optind != argc - 1) ||
+	    (synth_path && optind != argc)) {
+		replay_usage(stderr);
+		return 2;
+	}
+
+	if (synth_path) {
+		err = fam->synth(&synth, &opts);
+		if (!err)
+			err = fam->usb ? replay_write_pcap(synth_path, fam, &synth) :
+					 replay_write_dma(synth_path, &synth);
+		if (err) {
+			fprintf(stderr, "%s: %s\n", synth_path, strerror(-err));
+			return 1;
+		}
+		recs = synth.recs;
+		nrecs = synth.nrecs;
+	} else {
+		file = replay_read_file(argv[optind], &file_len);
+		if (!file)
+			return 1;
+		err = fam->usb ? replay_load_usb(&cap, file, file_len) :
+				 replay_load_dma(&cap, file, file_len);
+		if (err)
+			return 1;
+		recs = cap.recs;
+		nrecs = cap.nrecs;
+	}
+
+	if (!nrecs) {
+		fprintf(stderr, "no transfers to replay\n");
+		return 1;
+	}
+
+	err = fam->setup(&opts, recs, nrecs);
+	if (err) {
+		fprintf(stderr, "%s: setup failed: %s\n", fam->name,
+			strerror(-err));
+		return 1;
+	}
+
+	if (fam->probe_reply) {
+		while (first < nrecs && fam->probe_reply(&recs[first]))
+			first++;
+	}
+	recs += first;
+	nrecs -= first;
+	for (i = 0; i < nrecs; i++)
+		bytes += recs[i].len;
+
+	/* Timed passes, with the driver's command timing off */
+	alloc0 = kshim_alloc_stats;
+	rx0 = kshim_rx_stats;
+	errors0 = replay_messages(3);
+	warnings0 = kshim_messages[4] + kshim_warnings;
+
+	for (p = 0; p < passes; p++) {
+		u64 start;
+
+		fam->reset();
+		start = ktime_get_ns();
+		replay_feed_all(fam, recs, nrecs);
+		elapsed += ktime_get_ns() - start;
+		commands += fam->commands();
+		format_errors += fam->format_errors();
+	}
+
+	alloc1 = kshim_alloc_stats;
+	rx1 = kshim_rx_stats;
+	errors = replay_messages(3) - errors0;
+	warnings = kshim_messages[4] + kshim_warnings - warnings0;
+
+	/* One more pass for the cost per command type */
+	fam->reset();
+	fam->profile(true);
+	replay_feed_all(fam, recs, nrecs);
+	fam->profile(false);
+	nstats = fam->cmd_stats(stats);
+	qsort(stats, nstats, sizeof(*stats), replay_cmd_stat_cmp);
+
+	printf("%s: %u %s, %llu bytes",
+	       synth_path ?: argv[optind], nrecs,
+	       fam->usb ? "transfers" : "DMA buffers",
+	       (unsigned long long)bytes);
+	if (first)
+		printf(", %u probe replies skipped", first);
+	if (cap.skipped || cap.truncated || cap.failed)
+		printf(", %lu other records, %lu truncated, %lu failed transfers",
+		       cap.skipped, cap.truncated, cap.failed);
+	if (cap.busnum >= 0)
+		printf(", device %d:%d endpoint 0x%02x", cap.busnum,
+		       cap.devnum, cap.epnum);
+	printf("\n");
+
+	printf("decode: %u passes, %llu commands per pass, %.0f ns/cmd, %.2f Mcmd/s, %.1f MB/s\n",
+	       passes, (unsigned long long)(commands / passes),
+	       replay_per(elapsed, commands),
+	       replay_per(commands * 1e3, elapsed),
+	       replay_per((double)bytes * passes * 1e3, elapsed));
+	printf("frames per pass: %llu, CAN FD %llu, error %llu, echo %llu\n",
+	       (unsigned long long)((rx1.frames - rx0.frames) / passes),
+	       (unsigned long long)((rx1.fd_frames - rx0.fd_frames) / passes),
+	       (unsigned long long)((rx1.err_frames - rx0.err_frames) / passes),
+	       (unsigned long long)((rx1.echo_frames - rx0.echo_frames) /
+				    passes));
+	printf("allocations per cmd: %.2f allocs, %.2f frees, %.2f skbs, %.1f bytes, %lu failed\n",
+	       replay_per(alloc1.allocs - alloc0.allocs, commands),
+	       replay_per(alloc1.frees - alloc0.frees, commands),
+	       replay_per(alloc1.skbs - alloc0.skbs, commands),
+	       replay_per(alloc1.bytes - alloc0.bytes, commands),
+	       alloc1.failed - alloc0.failed);
+	printf("format errors: %llu, driver errors: %lu, warnings: %lu\n",
+	       (unsigned long long)format_errors, errors, warnings);
+	fam->report(stdout);
+
+	printf("\n%4s  %-32s %10s %12s %8s\n", "id", "command", "count",
+	       "total ns", "ns/cmd");
+	for (i = 0; i < nstats; i++)
+		printf("%4u  %-32s %10llu %12llu %8.0f\n", stats[i].id,
+		       stats[i].name ?: "?", (unsigned long long)stats[i].count,
+		       (unsigned long long)stats[i].time_ns,
+		       replay_per(stats[i].time_ns, stats[i].count));
+
+	err = 0;
+	if (synth_path) {
+		data = (rx1.frames - rx0.frames - rx1.err_frames +
+			rx0.err_frames) / passes;
+		if (data != synth.frames) {
+			fprintf(stderr,
+				"synthetic capture: %llu frames per pass, expected %llu\n",
+				(unsigned long long)data,
+				(unsigned long long)synth.frames);
+			err = 1;
+		}
+	}
+	if (strict && (format_errors || errors || warnings))
+		err = 1;
+
+	fam->teardown();
+	replay_synth_free(&synth);
+	free(cap.recs);
+	free(file);
+	return err;
+}
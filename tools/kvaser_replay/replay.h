@@ -0,0 +1,97 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+/* Kvaser parser replay, shared between replay.c and the family backends */
+
+#ifndef REPLAY_H
+#define REPLAY_H
+
+#include <kshim.h>
+
+/* One bulk IN transfer, or one DMA buffer */
+struct replay_rec {
+	const u8 *data;
+	u32 len;
+};
+
+struct replay_opts {
+	unsigned int maxp;	/* bulk IN wMaxPacketSize, USB only */
+	unsigned int nchannels;	/* 0 to learn it from the capture */
+	unsigned int freq_mhz;	/* 0 to learn it, or the family default */
+	bool sf2;		/* pciefd: SmartFusion2 register layout */
+};
+
+/* Per command type counters, collected by the profiling pass */
+struct replay_cmd_stat {
+	unsigned int id;
+	const char *name;
+	u64 count;
+	u64 time_ns;
+};
+
+#define REPLAY_MAX_CMD_TYPES	256
+
+/* A synthetic capture, built by the family from the driver's own command
+ * layouts, for make check
+ */
+struct replay_synth {
+	struct replay_rec *recs;
+	unsigned int nrecs;
+	unsigned int size;
+	u32 seed;
+	/* CAN data frames the parser must deliver per pass */
+	u64 frames;
+};
+
+int replay_synth_add(struct replay_synth *s, const void *data, u32 len);
+u32 replay_synth_rand(struct replay_synth *s);
+
+struct replay_family {
+	const char *name;
+	bool usb;
+	/* True if @rec only holds replies to the probe sequence, which
+	 * kvaser_usb reads with usb_bulk_msg() and not through the Rx URBs.
+	 * Leading transfers like that are not replayed. USB only.
+	 */
+	bool (*probe_reply)(const struct replay_rec *rec);
+	/* Sets up the device, learning what it can from the capture */
+	int (*setup)(const struct replay_opts *opts,
+		     const struct replay_rec *recs, unsigned int nrecs);
+	/* Hands one transfer or buffer to the driver's parser */
+	void (*feed)(const struct replay_rec *rec);
+	/* Drops parser state and counters between passes */
+	void (*reset)(void);
+	/* Enables per command timing in the driver */
+	void (*profile)(bool on);
+	/* Commands or packets parsed, and format errors, since reset() */
+	u64 (*commands)(void);
+	u64 (*format_errors)(void);
+	/* Fills @stats with the command types seen, returns their number */
+	unsigned int (*cmd_stats)(struct replay_cmd_stat *stats);
+	/* Family specific counters for the report */
+	void (*report)(FILE *out);
+	void (*teardown)(void);
+	/* Fills @s with probe replies and Rx traffic */
+	int (*synth)(struct replay_synth *s, const struct replay_opts *opts);
+};
+
+extern const struct replay_family replay_hydra;
+extern const struct replay_family replay_leaf;
+extern const struct replay_family replay_usbcan;
+extern const struct replay_family replay_pciefd;
+
+/* replay_usb.c, struct kvaser_usb set up without probing */
+struct kvaser_usb;
+struct kvaser_usb_dev_cfg;
+struct kvaser_usb_driver_info;
+
+struct kvaser_usb *replay_usb_alloc(const struct kvaser_usb_driver_info *info,
+				    unsigned int maxp);
+int replay_usb_add_channels(struct kvaser_usb *dev, unsigned int nchannels);
+void replay_usb_reset(struct kvaser_usb *dev);
+unsigned int replay_usb_cmd_stats(struct kvaser_usb *dev,
+				  const char * const *names,
+				  struct replay_cmd_stat *stats);
+u64 replay_usb_commands(struct kvaser_usb *dev);
+u64 replay_usb_format_errors(struct kvaser_usb *dev);
+void replay_usb_free(struct kvaser_usb *dev);
+
+#endif /* REPLAY_H */
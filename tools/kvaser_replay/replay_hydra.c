@@ -0,0 +1,459 @@
+// SPDX-License-Identifier: GPL-2.0
+/* Hydra backend. The driver source is included so that its static parser,
+ * device configurations and command layouts can be reached; it is compiled
+ * unmodified.
+ */
+
+#include "replay.h"
+#include "kvaser_usb_hydra.c"
+
+#define REPLAY_HYDRA_CMD(c)	[c] = #c
+
+static const char * const replay_hydra_cmd_names[REPLAY_MAX_CMD_TYPES] = {
+	REPLAY_HYDRA_CMD(CMD_GET_BUSPARAMS_RESP),
+	REPLAY_HYDRA_CMD(CMD_CHIP_STATE_EVENT),
+	REPLAY_HYDRA_CMD(CMD_START_CHIP_RESP),
+	REPLAY_HYDRA_CMD(CMD_STOP_CHIP_RESP),
+	REPLAY_HYDRA_CMD(CMD_GET_CARD_INFO_RESP),
+	REPLAY_HYDRA_CMD(CMD_GET_SOFTWARE_INFO_RESP),
+	REPLAY_HYDRA_CMD(CMD_ERROR_EVENT),
+	REPLAY_HYDRA_CMD(CMD_TX_ACKNOWLEDGE),
+	REPLAY_HYDRA_CMD(CMD_FLUSH_QUEUE_RESP),
+	REPLAY_HYDRA_CMD(CMD_SET_BUSPARAMS_FD_RESP),
+	REPLAY_HYDRA_CMD(CMD_SET_BUSPARAMS_RESP),
+	REPLAY_HYDRA_CMD(CMD_GET_CAPABILITIES_RESP),
+	REPLAY_HYDRA_CMD(CMD_RX_MESSAGE),
+	REPLAY_HYDRA_CMD(CMD_MAP_CHANNEL_RESP),
+	REPLAY_HYDRA_CMD(CMD_GET_SOFTWARE_DETAILS_RESP),
+	REPLAY_HYDRA_CMD(CMD_TX_ACKNOWLEDGE_FD),
+	REPLAY_HYDRA_CMD(CMD_RX_MESSAGE_FD),
+};
+
+static const struct kvaser_usb_driver_info replay_hydra_info = {
+	.quirks = KVASER_USB_QUIRK_HAS_HARDWARE_TIMESTAMP,
+	.family = KVASER_LEAF,
+	.ops = &kvaser_usb_hydra_dev_ops,
+};
+
+static struct kvaser_usb *replay_hydra_dev;
+
+/* Calls @fn for each command of the capture, as one stream */
+static void replay_hydra_walk(const struct replay_rec *recs,
+			      unsigned int nrecs,
+			      void (*fn)(struct kvaser_usb *dev,
+					 struct kvaser_cmd *cmd))
+{
+	u8 cmd_buf[KVASER_USB_HYDRA_MAX_CMD_LEN];
+	size_t have = 0, need = 0;
+	unsigned int i;
+	u32 pos;
+
+	for (i = 0; i < nrecs; i++) {
+		for (pos = 0; pos < recs[i].len; ) {
+			size_t n;
+
+			if (!need) {
+				n = min_t(size_t, KVASER_USB_HYDRA_CMD_SIZE_BYTES -
+						  have, recs[i].len - pos);
+				memcpy(cmd_buf + have, recs[i].data + pos, n);
+				have += n;
+				pos += n;
+				if (have < KVASER_USB_HYDRA_CMD_SIZE_BYTES)
+					continue;
+				need = kvaser_usb_hydra_cmd_size_checked
+						((struct kvaser_cmd *)cmd_buf);
+				if (!need)
+					return;
+			}
+
+			n = min_t(size_t, need - have, recs[i].len - pos);
+			memcpy(cmd_buf + have, recs[i].data + pos, n);
+			have += n;
+			pos += n;
+			if (have < need)
+				continue;
+
+			fn(replay_hydra_dev, (struct kvaser_cmd *)cmd_buf);
+			have = 0;
+			need = 0;
+		}
+	}
+}
+
+static bool replay_hydra_mapped;
+
+/* Replies to the probe sequence, when the capture starts before probe */
+static void replay_hydra_learn(struct kvaser_usb *dev, struct kvaser_cmd *cmd)
+{
+	u32 flags;
+
+	switch (cmd->header.cmd_no) {
+	case CMD_MAP_CHANNEL_RESP:
+		if (!kvaser_usb_hydra_map_channel_resp(dev, cmd) &&
+		    kvaser_usb_hydra_get_cmd_transid(cmd) !=
+		    KVASER_USB_HYDRA_TRANSID_SYSDBG)
+			replay_hydra_mapped = true;
+		break;
+
+	case CMD_GET_SOFTWARE_INFO_RESP:
+		dev->max_tx_urbs =
+			min_t(unsigned int, KVASER_USB_MAX_TX_URBS,
+			      le16_to_cpu(cmd->sw_info.max_outstanding_tx));
+		break;
+
+	case CMD_GET_SOFTWARE_DETAILS_RESP:
+		/* As kvaser_usb_hydra_get_software_details() */
+		flags = le32_to_cpu(cmd->sw_detail_res.sw_flags);
+		if (flags & KVASER_USB_HYDRA_SW_FLAG_CANFD)
+			dev->card_data.ctrlmode_supported |= CAN_CTRLMODE_FD;
+		if (flags & KVASER_USB_HYDRA_SW_FLAG_EXT_CMD)
+			dev->card_data.capabilities |=
+				KVASER_USB_HYDRA_CAP_EXT_CMD;
+		if (flags & KVASER_USB_HYDRA_SW_FLAG_FREQ_80M)
+			dev->cfg = &kvaser_usb_hydra_dev_cfg_kcan;
+		else if (flags & KVASER_USB_HYDRA_SW_FLAG_CAN_FREQ_80M)
+			dev->cfg = &kvaser_usb_hydra_dev_cfg_rt;
+		else
+			dev->cfg = &kvaser_usb_hydra_dev_cfg_flexc;
+		break;
+
+	case CMD_GET_CARD_INFO_RESP:
+		dev->nchannels = min_t(unsigned int, KVASER_USB_MAX_NET_DEVICES,
+				       cmd->card_info.nchannels);
+		break;
+	}
+}
+
+static unsigned int replay_hydra_hes;
+
+/* Without the channel map, channels are numbered in the order their
+ * hydra end points first send traffic
+ */
+static void replay_hydra_learn_he(struct kvaser_usb *dev,
+				  struct kvaser_cmd *cmd)
+{
+	struct kvaser_usb_dev_card_data_hydra *card_data =
+							&dev->card_data.hydra;
+	u8 he = kvaser_usb_hydra_get_cmd_src_he(cmd);
+	unsigned int i;
+
+	switch (cmd->header.cmd_no) {
+	case CMD_RX_MESSAGE:
+	case CMD_TX_ACKNOWLEDGE:
+	case CMD_CHIP_STATE_EVENT:
+	case CMD_EXTENDED:
+		break;
+	default:
+		return;
+	}
+
+	for (i = 0; i < replay_hydra_hes; i++) {
+		if (card_data->channel_to_he[i] == he)
+			return;
+	}
+	if (replay_hydra_hes < KVASER_USB_MAX_NET_DEVICES)
+		card_data->channel_to_he[replay_hydra_hes++] = he;
+}
+
+static int replay_hydra_setup(const struct replay_opts *opts,
+			      const struct replay_rec *recs, unsigned int nrecs)
+{
+	struct kvaser_usb *dev;
+	unsigned int nchannels;
+
+	dev = replay_usb_alloc(&replay_hydra_info, opts->maxp);
+	if (!dev)
+		return -ENOMEM;
+	replay_hydra_dev = dev;
+
+	dev->card_data.ctrlmode_supported = CAN_CTRLMODE_FD;
+	replay_hydra_walk(recs, nrecs, replay_hydra_learn);
+	if (!replay_hydra_mapped) {
+		memset(dev->card_data.hydra.channel_to_he, 0xff,
+		       sizeof(dev->card_data.hydra.channel_to_he));
+		replay_hydra_walk(recs, nrecs, replay_hydra_learn_he);
+		fprintf(stderr,
+			"hydra: no channel map in the capture, %u channels by first use\n",
+			replay_hydra_hes);
+	}
+
+	switch (opts->freq_mhz) {
+	case 0:
+		if (!dev->cfg)
+			dev->cfg = &kvaser_usb_hydra_dev_cfg_kcan;
+		break;
+	case 24:
+		dev->cfg = &kvaser_usb_hydra_dev_cfg_flexc;
+		break;
+	case 80:
+		dev->cfg = &kvaser_usb_hydra_dev_cfg_kcan;
+		break;
+	default:
+		fprintf(stderr, "hydra: clock must be 24 or 80 MHz\n");
+		return -EINVAL;
+	}
+
+	nchannels = opts->nchannels ?: dev->nchannels;
+	if (!nchannels)
+		nchannels = replay_hydra_mapped ? KVASER_USB_MAX_NET_DEVICES :
+						  max(replay_hydra_hes, 1U);
+	return replay_usb_add_channels(dev, min_t(unsigned int, nchannels,
+						  KVASER_USB_MAX_NET_DEVICES));
+}
+
+static void replay_hydra_feed(const struct replay_rec *rec)
+{
+	kvaser_usb_hydra_read_bulk_callback(replay_hydra_dev, (void *)rec->data,
+					    rec->len);
+}
+
+static void replay_hydra_reset(void)
+{
+	replay_usb_reset(replay_hydra_dev);
+	atomic64_set(&replay_hydra_dev->card_data.hydra.usb_rx_leftovers, 0);
+}
+
+static void replay_hydra_profile(bool on)
+{
+	replay_hydra_dev->cmd_timing = on;
+}
+
+static u64 replay_hydra_commands(void)
+{
+	return replay_usb_commands(replay_hydra_dev);
+}
+
+static u64 replay_hydra_format_errors(void)
+{
+	return replay_usb_format_errors(replay_hydra_dev);
+}
+
+static unsigned int replay_hydra_cmd_stats(struct replay_cmd_stat *stats)
+{
+	return replay_usb_cmd_stats(replay_hydra_dev, replay_hydra_cmd_names,
+				    stats);
+}
+
+static void replay_hydra_report(FILE *out)
+{
+	struct kvaser_usb *dev = replay_hydra_dev;
+	unsigned int i;
+
+	fprintf(out, "channels: %u, clock %u MHz, he map:", dev->nchannels,
+		(unsigned int)(dev->cfg->clock.freq / MEGA));
+	for (i = 0; i < dev->nchannels; i++)
+		fprintf(out, " %u", dev->card_data.hydra.channel_to_he[i]);
+	fprintf(out, "\nleftovers: %lld\n",
+		(long long)atomic64_read(&dev->card_data.hydra.usb_rx_leftovers));
+}
+
+static void replay_hydra_teardown(void)
+{
+	replay_usb_free(replay_hydra_dev);
+	replay_hydra_dev = NULL;
+}
+
+/* Replies read by kvaser_usb_hydra_wait_cmd() during probe */
+static bool replay_hydra_probe_reply(const struct replay_rec *rec)
+{
+	u32 pos = 0;
+
+	while (pos + KVASER_USB_HYDRA_CMD_SIZE_BYTES <= rec->len) {
+		struct kvaser_cmd *cmd = (struct kvaser_cmd *)(rec->data + pos);
+		size_t size = kvaser_usb_hydra_cmd_size_checked(cmd);
+
+		if (!size || pos + size > rec->len)
+			return false;
+
+		switch (cmd->header.cmd_no) {
+		case CMD_MAP_CHANNEL_RESP:
+		case CMD_GET_SOFTWARE_INFO_RESP:
+		case CMD_GET_SOFTWARE_DETAILS_RESP:
+		case CMD_GET_CARD_INFO_RESP:
+		case CMD_GET_CAPABILITIES_RESP:
+			break;
+		default:
+			return false;
+		}
+		pos += size;
+	}
+	return pos && pos == rec->len;
+}
+
+#define REPLAY_HYDRA_SYNTH_CMDS		20000
+#define REPLAY_HYDRA_SYNTH_STATE_EVERY	500
+
+/* Channel HEs with bits in both the he_addr and the transid part */
+static const u8 replay_hydra_synth_he[] = { 0x12, 0x23 };
+
+static void replay_hydra_synth_set_src_he(struct kvaser_cmd *cmd, u8 he)
+{
+	cmd->header.he_addr = (he << KVASER_USB_HYDRA_HE_ADDR_SRC_BITS) &
+			      KVASER_USB_HYDRA_HE_ADDR_SRC_MASK;
+	cmd->header.transid =
+		cpu_to_le16((he & GENMASK(3, 0)) << KVASER_USB_HYDRA_TRANSID_BITS);
+}
+
+static int replay_hydra_synth_probe(struct replay_synth *s)
+{
+	struct kvaser_cmd cmd;
+	unsigned int i;
+	int err;
+
+	for (i = 0; i < ARRAY_SIZE(replay_hydra_synth_he); i++) {
+		memset(&cmd, 0, sizeof(cmd));
+		cmd.header.cmd_no = CMD_MAP_CHANNEL_RESP;
+		kvaser_usb_hydra_set_cmd_transid(&cmd,
+						 KVASER_USB_HYDRA_TRANSID_CANHE +
+						 i);
+		cmd.map_ch_res.he_addr = replay_hydra_synth_he[i];
+		cmd.map_ch_res.channel = i;
+		err = replay_synth_add(s, &cmd, sizeof(cmd));
+		if (err)
+			return err;
+	}
+
+	memset(&cmd, 0, sizeof(cmd));
+	cmd.header.cmd_no = CMD_GET_SOFTWARE_INFO_RESP;
+	cmd.sw_info.max_outstanding_tx = cpu_to_le16(200);
+	err = replay_synth_add(s, &cmd, sizeof(cmd));
+	if (err)
+		return err;
+
+	memset(&cmd, 0, sizeof(cmd));
+	cmd.header.cmd_no = CMD_GET_SOFTWARE_DETAILS_RESP;
+	cmd.sw_detail_res.sw_flags =
+		cpu_to_le32(KVASER_USB_HYDRA_SW_FLAG_FREQ_80M |
+			    KVASER_USB_HYDRA_SW_FLAG_EXT_CMD |
+			    KVASER_USB_HYDRA_SW_FLAG_CANFD);
+	err = replay_synth_add(s, &cmd, sizeof(cmd));
+	if (err)
+		return err;
+
+	memset(&cmd, 0, sizeof(cmd));
+	cmd.header.cmd_no = CMD_GET_CARD_INFO_RESP;
+	cmd.card_info.nchannels = ARRAY_SIZE(replay_hydra_synth_he);
+	return replay_synth_add(s, &cmd, sizeof(cmd));
+}
+
+/* One Rx command at @buf, returns its size */
+static size_t replay_hydra_synth_cmd(struct replay_synth *s, u8 *buf,
+				     unsigned int n)
+{
+	u8 he = replay_hydra_synth_he[n % ARRAY_SIZE(replay_hydra_synth_he)];
+	struct kvaser_cmd_ext *ext = (struct kvaser_cmd_ext *)buf;
+	struct kvaser_cmd *cmd = (struct kvaser_cmd *)buf;
+	u32 r = replay_synth_rand(s);
+	u32 flags, id;
+	u8 len, i;
+	size_t size;
+
+	memset(buf, 0, KVASER_USB_HYDRA_MAX_CMD_LEN);
+
+	if (n % REPLAY_HYDRA_SYNTH_STATE_EVERY ==
+	    REPLAY_HYDRA_SYNTH_STATE_EVERY - 1) {
+		/* Error passive and back */
+		bool passive = n / REPLAY_HYDRA_SYNTH_STATE_EVERY % 2 == 0;
+
+		cmd->header.cmd_no = CMD_CHIP_STATE_EVENT;
+		replay_hydra_synth_set_src_he(cmd, he);
+		cmd->chip_state_event.bus_status =
+			passive ? KVASER_USB_HYDRA_BUS_ERR_PASS :
+				  KVASER_USB_HYDRA_BUS_ERR_ACT;
+		cmd->chip_state_event.tx_err_counter = passive ? 128 : 0;
+		return sizeof(*cmd);
+	}
+
+	s->frames++;
+	switch (r % 3) {
+	case 0:
+		/* Classic, 11-bit id */
+		cmd->header.cmd_no = CMD_RX_MESSAGE;
+		replay_hydra_synth_set_src_he(cmd, he);
+		cmd->rx_can.id = cpu_to_le32((r >> 8) & CAN_SFF_MASK);
+		cmd->rx_can.dlc = (r >> 4) % (CAN_MAX_DLEN + 1);
+		for (i = 0; i < cmd->rx_can.dlc; i++)
+			cmd->rx_can.data[i] = n + i;
+		return sizeof(*cmd);
+
+	case 1:
+		/* CAN FD with bit rate switch, 29-bit id */
+		len = can_fd_dlc2len((r >> 4) % (CANFD_MAX_DLC + 1));
+		flags = KVASER_USB_HYDRA_CF_FLAG_FDF |
+			KVASER_USB_HYDRA_CF_FLAG_BRS |
+			KVASER_USB_HYDRA_CF_FLAG_EXTENDED_ID;
+		id = (r >> 8) & CAN_EFF_MASK;
+		break;
+
+	default:
+		/* Classic, 29-bit id, as an extended command */
+		len = (r >> 4) % (CAN_MAX_DLEN + 1);
+		flags = KVASER_USB_HYDRA_CF_FLAG_EXTENDED_ID;
+		id = (r >> 8) & CAN_EFF_MASK;
+		break;
+	}
+
+	size = KVASER_USB_HYDRA_CMD_EXT_HEADER_LEN +
+	       offsetof(struct kvaser_cmd_ext_rx_can, kcan_payload) +
+	       ALIGN(len, 4);
+	ext->header.cmd_no = CMD_EXTENDED;
+	replay_hydra_synth_set_src_he(cmd, he);
+	ext->len = cpu_to_le16(size);
+	ext->cmd_no_ext = CMD_RX_MESSAGE_FD;
+	ext->rx_can.flags = cpu_to_le32(flags);
+	ext->rx_can.id = cpu_to_le32(id);
+	ext->rx_can.kcan_header =
+		cpu_to_le32(can_fd_len2dlc(len) << KVASER_USB_KCAN_DATA_DLC_SHIFT);
+	for (i = 0; i < len; i++)
+		ext->rx_can.kcan_payload[i] = n + i;
+	return size;
+}
+
+/* The Rx stream is cut at random points, so commands span transfers */
+static int replay_hydra_synth(struct replay_synth *s,
+			      const struct replay_opts *opts)
+{
+	size_t len = 0, size = REPLAY_HYDRA_SYNTH_CMDS *
+			       KVASER_USB_HYDRA_MAX_CMD_LEN;
+	unsigned int n;
+	size_t pos;
+	u8 *stream;
+	int err;
+
+	err = replay_hydra_synth_probe(s);
+	if (err)
+		return err;
+
+	stream = malloc(size);
+	if (!stream)
+		return -ENOMEM;
+	for (n = 0; n < REPLAY_HYDRA_SYNTH_CMDS; n++)
+		len += replay_hydra_synth_cmd(s, stream + len, n);
+
+	for (pos = 0; pos < len && !err; ) {
+		size_t chunk = min_t(size_t, len - pos,
+				     1 + replay_synth_rand(s) %
+					 KVASER_USB_RX_BUFFER_SIZE);
+
+		err = replay_synth_add(s, stream + pos, chunk);
+		pos += chunk;
+	}
+	free(stream);
+	return err;
+}
+
+const struct replay_family replay_hydra = {
+	.name = "hydra",
+	.usb = true,
+	.probe_reply = replay_hydra_probe_reply,
+	.setup = replay_hydra_setup,
+	.feed = replay_hydra_feed,
+	.reset = replay_hydra_reset,
+	.profile = replay_hydra_profile,
+	.commands = replay_hydra_commands,
+	.format_errors = replay_hydra_format_errors,
+	.cmd_stats = replay_hydra_cmd_stats,
+	.report = replay_hydra_report,
+	.teardown = replay_hydra_teardown,
+	.synth = replay_hydra_synth,
+};
@@ -0,0 +1,425 @@
+// SPDX-License-Identifier: GPL-2.0
+/* Leaf and USBcan II backends, see replay_hydra.c */
+
+#include "replay.h"
+#include "kvaser_usb_leaf.c"
+
+#define REPLAY_LEAF_CMD(c)	[c] = #c
+
+static const char * const replay_leaf_cmd_names[REPLAY_MAX_CMD_TYPES] = {
+	REPLAY_LEAF_CMD(CMD_RX_STD_MESSAGE),
+	REPLAY_LEAF_CMD(CMD_RX_EXT_MESSAGE),
+	REPLAY_LEAF_CMD(CMD_GET_BUS_PARAMS_REPLY),
+	REPLAY_LEAF_CMD(CMD_CHIP_STATE_EVENT),
+	REPLAY_LEAF_CMD(CMD_START_CHIP_REPLY),
+	REPLAY_LEAF_CMD(CMD_STOP_CHIP_REPLY),
+	REPLAY_LEAF_CMD(CMD_USBCAN_CLOCK_OVERFLOW_EVENT),
+	REPLAY_LEAF_CMD(CMD_GET_CARD_INFO_REPLY),
+	REPLAY_LEAF_CMD(CMD_GET_SOFTWARE_INFO_REPLY),
+	REPLAY_LEAF_CMD(CMD_ERROR_EVENT),
+	REPLAY_LEAF_CMD(CMD_TX_ACKNOWLEDGE),
+	REPLAY_LEAF_CMD(CMD_CAN_ERROR_EVENT),
+	REPLAY_LEAF_CMD(CMD_FLUSH_QUEUE_REPLY),
+	REPLAY_LEAF_CMD(CMD_GET_CAPABILITIES_RESP),
+	REPLAY_LEAF_CMD(CMD_LEAF_LOG_MESSAGE),
+};
+
+/* Leaf devices that report their clock, kvaser_usb_driver_info_leafimx */
+static const struct kvaser_usb_driver_info replay_leaf_info = {
+	.family = KVASER_LEAF,
+	.ops = &kvaser_usb_leaf_dev_ops,
+};
+
+static const struct kvaser_usb_driver_info replay_usbcan_info = {
+	.quirks = KVASER_USB_QUIRK_HAS_TXRX_ERRORS |
+		  KVASER_USB_QUIRK_HAS_SILENT_MODE,
+	.family = KVASER_USBCAN,
+	.ops = &kvaser_usb_leaf_dev_ops,
+};
+
+static struct kvaser_usb *replay_leaf_dev;
+
+/* Replies to the probe sequence, when the capture starts before probe.
+ * Leaf commands never span transfers.
+ */
+static void replay_leaf_learn(struct kvaser_usb *dev,
+			      const struct replay_rec *rec)
+{
+	int pos = 0;
+
+	while (pos <= (int)rec->len - CMD_HEADER_LEN) {
+		struct kvaser_cmd *cmd = (struct kvaser_cmd *)(rec->data + pos);
+
+		if (!cmd->len) {
+			pos = kvaser_usb_leaf_skip_placeholder(dev, pos);
+			continue;
+		}
+		if (cmd->len < CMD_HEADER_LEN || pos + cmd->len > rec->len)
+			return;
+
+		switch (cmd->id) {
+		case CMD_GET_SOFTWARE_INFO_REPLY:
+			if (kvaser_usb_leaf_verify_size(dev, cmd))
+				break;
+			if (dev->driver_info->family == KVASER_LEAF) {
+				kvaser_usb_leaf_get_software_info_leaf
+						(dev, &cmd->u.leaf.softinfo);
+			} else {
+				dev->max_tx_urbs = le16_to_cpu
+					(cmd->u.usbcan.softinfo.max_outstanding_tx);
+			}
+			break;
+
+		case CMD_GET_CARD_INFO_REPLY:
+			if (kvaser_usb_leaf_verify_size(dev, cmd))
+				break;
+			dev->nchannels = cmd->u.cardinfo.nchannels;
+			break;
+		}
+		pos += cmd->len;
+	}
+}
+
+static int replay_leaf_setup_family(const struct kvaser_usb_driver_info *info,
+				    const struct replay_opts *opts,
+				    const struct replay_rec *recs,
+				    unsigned int nrecs)
+{
+	unsigned int i, max_channels;
+	struct kvaser_usb *dev;
+
+	dev = replay_usb_alloc(info, opts->maxp);
+	if (!dev)
+		return -ENOMEM;
+	replay_leaf_dev = dev;
+
+	for (i = 0; i < nrecs; i++)
+		replay_leaf_learn(dev, &recs[i]);
+	dev->max_tx_urbs = clamp_t(unsigned int, dev->max_tx_urbs, 1,
+				   KVASER_USB_MAX_TX_URBS);
+
+	if (info->family == KVASER_USBCAN) {
+		dev->cfg = &kvaser_usb_leaf_usbcan_dev_cfg;
+		max_channels = MAX_USBCAN_NET_DEVICES;
+	} else {
+		switch (opts->freq_mhz) {
+		case 0:
+			if (!dev->cfg)
+				dev->cfg = &kvaser_usb_leaf_imx_dev_cfg_24mhz;
+			break;
+		case 16:
+			dev->cfg = &kvaser_usb_leaf_imx_dev_cfg_16mhz;
+			break;
+		case 24:
+			dev->cfg = &kvaser_usb_leaf_imx_dev_cfg_24mhz;
+			break;
+		case 32:
+			dev->cfg = &kvaser_usb_leaf_imx_dev_cfg_32mhz;
+			break;
+		default:
+			fprintf(stderr, "leaf: clock must be 16, 24 or 32 MHz\n");
+			return -EINVAL;
+		}
+		max_channels = KVASER_USB_MAX_NET_DEVICES;
+	}
+
+	if (opts->nchannels)
+		dev->nchannels = opts->nchannels;
+	if (!dev->nchannels)
+		dev->nchannels = MAX_USBCAN_NET_DEVICES;
+	return replay_usb_add_channels(dev, min(dev->nchannels, max_channels));
+}
+
+static int replay_leaf_setup(const struct replay_opts *opts,
+			     const struct replay_rec *recs, unsigned int nrecs)
+{
+	return replay_leaf_setup_family(&replay_leaf_info, opts, recs, nrecs);
+}
+
+static int replay_usbcan_setup(const struct replay_opts *opts,
+			       const struct replay_rec *recs,
+			       unsigned int nrecs)
+{
+	return replay_leaf_setup_family(&replay_usbcan_info, opts, recs, nrecs);
+}
+
+static void replay_leaf_feed(const struct replay_rec *rec)
+{
+	kvaser_usb_leaf_read_bulk_callback(replay_leaf_dev, (void *)rec->data,
+					   rec->len);
+}
+
+static void replay_leaf_reset(void)
+{
+	replay_usb_reset(replay_leaf_dev);
+	memset(&replay_leaf_dev->card_data.leaf, 0,
+	       sizeof(replay_leaf_dev->card_data.leaf));
+}
+
+static void replay_leaf_profile(bool on)
+{
+	replay_leaf_dev->cmd_timing = on;
+}
+
+static u64 replay_leaf_commands(void)
+{
+	return replay_usb_commands(replay_leaf_dev);
+}
+
+static u64 replay_leaf_format_errors(void)
+{
+	return replay_usb_format_errors(replay_leaf_dev);
+}
+
+static unsigned int replay_leaf_cmd_stats(struct replay_cmd_stat *stats)
+{
+	return replay_usb_cmd_stats(replay_leaf_dev, replay_leaf_cmd_names,
+				    stats);
+}
+
+static void replay_leaf_report(FILE *out)
+{
+	struct kvaser_usb *dev = replay_leaf_dev;
+	struct kvaser_usb_dev_card_data_leaf *leaf = &dev->card_data.leaf;
+
+	fprintf(out, "channels: %u, clock %u MHz, max outstanding tx %u\n",
+		dev->nchannels, (unsigned int)(dev->cfg->clock.freq / MEGA),
+		dev->max_tx_urbs);
+	fprintf(out,
+		"placeholders: %lld, log messages: %lld, chip state events: %lld, error events: %lld, clock overflows: %lld\n",
+		(long long)atomic64_read(&leaf->placeholders),
+		(long long)atomic64_read(&leaf->log_messages),
+		(long long)atomic64_read(&leaf->chip_state_events),
+		(long long)atomic64_read(&leaf->error_events),
+		(long long)atomic64_read(&leaf->clock_overflows));
+}
+
+static void replay_leaf_teardown(void)
+{
+	replay_usb_free(replay_leaf_dev);
+	replay_leaf_dev = NULL;
+}
+
+/* Replies read by kvaser_usb_leaf_wait_cmd() during probe */
+static bool replay_leaf_probe_reply(const struct replay_rec *rec)
+{
+	bool reply = false;
+	u32 pos = 0;
+
+	while (pos + CMD_HEADER_LEN <= rec->len) {
+		const struct kvaser_cmd *cmd =
+				(const struct kvaser_cmd *)(rec->data + pos);
+
+		if (!cmd->len) {
+			pos = kvaser_usb_leaf_skip_placeholder(replay_leaf_dev,
+							       pos);
+			continue;
+		}
+		if (cmd->len < CMD_HEADER_LEN || pos + cmd->len > rec->len)
+			return false;
+
+		switch (cmd->id) {
+		case CMD_GET_CARD_INFO_REPLY:
+		case CMD_GET_SOFTWARE_INFO_REPLY:
+		case CMD_GET_CAPABILITIES_RESP:
+			reply = true;
+			break;
+		default:
+			return false;
+		}
+		pos += cmd->len;
+	}
+	return reply;
+}
+
+#define REPLAY_LEAF_SYNTH_CMDS		20000
+#define REPLAY_LEAF_SYNTH_CHANNELS	2
+#define REPLAY_LEAF_SYNTH_STATE_EVERY	500
+
+static int replay_leaf_synth_probe(struct replay_synth *s, bool usbcan)
+{
+	struct kvaser_cmd cmd;
+	int err;
+
+	memset(&cmd, 0, sizeof(cmd));
+	cmd.id = CMD_GET_CARD_INFO_REPLY;
+	cmd.len = CMD_HEADER_LEN + sizeof(cmd.u.cardinfo);
+	cmd.u.cardinfo.nchannels = REPLAY_LEAF_SYNTH_CHANNELS;
+	err = replay_synth_add(s, &cmd, cmd.len);
+	if (err)
+		return err;
+
+	memset(&cmd, 0, sizeof(cmd));
+	cmd.id = CMD_GET_SOFTWARE_INFO_REPLY;
+	if (usbcan) {
+		cmd.len = CMD_HEADER_LEN + sizeof(cmd.u.usbcan.softinfo);
+		cmd.u.usbcan.softinfo.max_outstanding_tx = cpu_to_le16(16);
+	} else {
+		cmd.len = CMD_HEADER_LEN + sizeof(cmd.u.leaf.softinfo);
+		cmd.u.leaf.softinfo.max_outstanding_tx = cpu_to_le16(64);
+		cmd.u.leaf.softinfo.sw_options =
+			cpu_to_le32(KVASER_USB_LEAF_SWOPTION_FREQ_24_MHZ_CLK);
+	}
+	return replay_synth_add(s, &cmd, cmd.len);
+}
+
+/* One Rx command, in the layout of the family */
+static void replay_leaf_synth_cmd(struct replay_synth *s,
+				  struct kvaser_cmd *cmd, bool usbcan,
+				  unsigned int n)
+{
+	u8 channel = n % REPLAY_LEAF_SYNTH_CHANNELS;
+	u32 r = replay_synth_rand(s);
+	u8 *rx_data;
+	u32 id;
+	u8 i;
+
+	memset(cmd, 0, sizeof(*cmd));
+
+	if (n % REPLAY_LEAF_SYNTH_STATE_EVERY ==
+	    REPLAY_LEAF_SYNTH_STATE_EVERY - 1) {
+		/* Error passive and back */
+		bool passive = n / REPLAY_LEAF_SYNTH_STATE_EVERY % 2 == 0;
+		u8 status = passive ? M16C_STATE_BUS_PASSIVE : 0;
+		u8 txerr = passive ? 128 : 0;
+
+		cmd->id = CMD_CHIP_STATE_EVENT;
+		if (usbcan) {
+			cmd->len = CMD_HEADER_LEN +
+				   sizeof(cmd->u.usbcan.chip_state_event);
+			cmd->u.usbcan.chip_state_event.channel = channel;
+			cmd->u.usbcan.chip_state_event.status = status;
+			cmd->u.usbcan.chip_state_event.tx_errors_count = txerr;
+		} else {
+			cmd->len = CMD_HEADER_LEN +
+				   sizeof(cmd->u.leaf.chip_state_event);
+			cmd->u.leaf.chip_state_event.channel = channel;
+			cmd->u.leaf.chip_state_event.status = status;
+			cmd->u.leaf.chip_state_event.tx_errors_count = txerr;
+		}
+		return;
+	}
+
+	s->frames++;
+	cmd->u.rx_can_header.channel = channel;
+	if (usbcan) {
+		cmd->len = CMD_HEADER_LEN + sizeof(cmd->u.usbcan.rx_can);
+		rx_data = cmd->u.usbcan.rx_can.data;
+	} else {
+		cmd->len = CMD_HEADER_LEN + sizeof(cmd->u.leaf.rx_can);
+		rx_data = cmd->u.leaf.rx_can.data;
+	}
+
+	/* The id split as kvaser_usb_leaf_rx_can_msg() reassembles it */
+	if (r & 1) {
+		id = (r >> 3) & CAN_EFF_MASK;
+		cmd->id = CMD_RX_EXT_MESSAGE;
+		rx_data[0] = (id >> 24) & 0x1f;
+		rx_data[1] = (id >> 18) & 0x3f;
+		rx_data[2] = (id >> 14) & 0x0f;
+		rx_data[3] = (id >> 6) & 0xff;
+		rx_data[4] = id & 0x3f;
+	} else {
+		id = (r >> 3) & CAN_SFF_MASK;
+		cmd->id = CMD_RX_STD_MESSAGE;
+		rx_data[0] = (id >> 6) & 0x1f;
+		rx_data[1] = id & 0x3f;
+	}
+	rx_data[5] = (r >> 1) % (CAN_MAX_DLEN + 1);
+	for (i = 0; i < rx_data[5]; i++)
+		rx_data[6 + i] = n + i;
+}
+
+/* Firmware never lets a command cross a wMaxPacketSize boundary: the rest
+ * of the packet starts with a zero-length placeholder. A transfer ends with
+ * a short packet.
+ */
+static int replay_leaf_synth_family(struct replay_synth *s,
+				    const struct replay_opts *opts,
+				    bool usbcan)
+{
+	unsigned int maxp = opts->maxp;
+	unsigned int packets = KVASER_USB_RX_BUFFER_SIZE / maxp;
+	struct kvaser_cmd cmd;
+	unsigned int n = 0;
+	u8 *buf;
+	int err;
+
+	err = replay_leaf_synth_probe(s, usbcan);
+	if (err)
+		return err;
+
+	buf = malloc(KVASER_USB_RX_BUFFER_SIZE);
+	if (!buf)
+		return -ENOMEM;
+
+	replay_leaf_synth_cmd(s, &cmd, usbcan, n);
+	while (n < REPLAY_LEAF_SYNTH_CMDS && !err) {
+		unsigned int last = replay_synth_rand(s) % packets;
+		unsigned int p, len = 0;
+
+		for (p = 0; p <= last && n < REPLAY_LEAF_SYNTH_CMDS; p++) {
+			unsigned int end = (p + 1) * maxp;
+
+			while (n < REPLAY_LEAF_SYNTH_CMDS &&
+			       len + cmd.len <= end) {
+				memcpy(buf + len, &cmd, cmd.len);
+				len += cmd.len;
+				if (++n < REPLAY_LEAF_SYNTH_CMDS)
+					replay_leaf_synth_cmd(s, &cmd, usbcan,
+							      n);
+			}
+			if (p < last && len < end) {
+				memset(buf + len, 0, end - len);
+				len = end;
+			}
+		}
+		err = replay_synth_add(s, buf, len);
+	}
+	free(buf);
+	return err;
+}
+
+static int replay_leaf_synth(struct replay_synth *s,
+			     const struct replay_opts *opts)
+{
+	return replay_leaf_synth_family(s, opts, false);
+}
+
+static int replay_usbcan_synth(struct replay_synth *s,
+			       const struct replay_opts *opts)
+{
+	return replay_leaf_synth_family(s, opts, true);
+}
+
+const struct replay_family replay_leaf = {
+	.name = "leaf",
+	.usb = true,
+	.probe_reply = replay_leaf_probe_reply,
+	.setup = replay_leaf_setup,
+	.feed = replay_leaf_feed,
+	.reset = replay_leaf_reset,
+	.profile = replay_leaf_profile,
+	.commands = replay_leaf_commands,
+	.format_errors = replay_leaf_format_errors,
+	.cmd_stats = replay_leaf_cmd_stats,
+	.report = replay_leaf_report,
+	.teardown = replay_leaf_teardown,
+	.synth = replay_leaf_synth,
+};
+
+const struct replay_family replay_usbcan = {
+	.name = "usbcan",
+	.usb = true,
+	.probe_reply = replay_leaf_probe_reply,
+	.setup = replay_usbcan_setup,
+	.feed = replay_leaf_feed,
+	.reset = replay_leaf_reset,
+	.profile = replay_leaf_profile,
+	.commands = replay_leaf_commands,
+	.format_errors = replay_leaf_format_errors,
+	.cmd_stats = replay_leaf_cmd_stats,
+	.report = replay_leaf_report,
+	.teardown = replay_leaf_teardown,
+	.synth = replay_usbcan_synth,
+};
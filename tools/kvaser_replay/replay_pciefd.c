@@ -0,0 +1,375 @@
+// SPDX-License-Identifier: GPL-2.0
+/* PCIe FD backend. DMA buffers from the dump are handed one at a time to
+ * kvaser_pciefd_read_buffer(), as the receive interrupt does. The register
+ * model only answers what kvaser_pciefd_setup_can_ctrls() checks; the rest
+ * of the register file is plain memory.
+ */
+
+#include "replay.h"
+#include "kvaser_pciefd.c"
+
+#define REPLAY_PCIEFD_REGS_SIZE	0x200000
+#define REPLAY_PCIEFD_TX_PACKETS 32
+
+#define REPLAY_PCIEFD_TYPE(t)	[KVASER_PCIEFD_PACK_TYPE_##t] = #t
+
+static const char * const replay_pciefd_type_names[REPLAY_MAX_CMD_TYPES] = {
+	REPLAY_PCIEFD_TYPE(DATA),
+	REPLAY_PCIEFD_TYPE(ACK),
+	REPLAY_PCIEFD_TYPE(TXRQ),
+	REPLAY_PCIEFD_TYPE(ERROR),
+	REPLAY_PCIEFD_TYPE(EFLUSH_ACK),
+	REPLAY_PCIEFD_TYPE(EFRAME_ACK),
+	REPLAY_PCIEFD_TYPE(ACK_DATA),
+	REPLAY_PCIEFD_TYPE(STATUS),
+	REPLAY_PCIEFD_TYPE(BUS_LOAD),
+};
+
+static struct replay_pciefd {
+	struct pci_dev pci;
+	struct kvaser_pciefd *pcie;
+	struct kshim_mmio_model model;
+	void *regs;
+	bool profile;
+	u64 read_errors;
+	struct replay_cmd_stat types[16];
+} replay_pciefd_board;
+
+static u32 replay_pciefd_read32(struct kshim_mmio_model *model,
+				unsigned long offset)
+{
+	struct replay_pciefd *board = container_of(model, struct replay_pciefd,
+						   model);
+	const struct kvaser_pciefd_address_offset *o =
+					board->pcie->driver_data->address_offset;
+	unsigned long span = o->kcan_ch1 - o->kcan_ch0;
+
+	if (offset >= o->kcan_ch0 &&
+	    offset < o->kcan_ch0 + KVASER_PCIEFD_MAX_CAN_CHANNELS * span) {
+		switch ((offset - o->kcan_ch0) % span) {
+		case KVASER_PCIEFD_KCAN_STAT_REG:
+			return KVASER_PCIEFD_KCAN_STAT_FD |
+			       KVASER_PCIEFD_KCAN_STAT_CAP;
+		case KVASER_PCIEFD_KCAN_TX_NR_PACKETS_REG:
+			return REPLAY_PCIEFD_TX_PACKETS <<
+			       KVASER_PCIEFD_KCAN_TX_NR_PACKETS_MAX_SHIFT;
+		}
+	}
+	return *(u32 *)(board->regs + offset);
+}
+
+/* Highest channel id used in the dump, -1 if there are no packets */
+static int replay_pciefd_max_channel(const struct replay_rec *recs,
+				     unsigned int nrecs)
+{
+	const unsigned int words = KVASER_PCIEFD_DMA_SIZE / sizeof(u32);
+	int max_ch = -1;
+	unsigned int i;
+
+	for (i = 0; i < nrecs; i++) {
+		const __le32 *buf = (const __le32 *)recs[i].data;
+		unsigned int pos = 0;
+
+		while (pos + 3 <= words) {
+			struct kvaser_pciefd_rx_packet p;
+			u32 size = le32_to_cpu(buf[pos]);
+
+			if (!size || size > words - pos)
+				break;
+			p.header[1] = le32_to_cpu(buf[pos + 2]);
+			max_ch = max_t(int, max_ch, KVASER_PCIEFD_PACKET_CHID(&p));
+			pos += size;
+		}
+	}
+	return max_ch;
+}
+
+static int replay_pciefd_setup(const struct replay_opts *opts,
+			       const struct replay_rec *recs,
+			       unsigned int nrecs)
+{
+	struct replay_pciefd *board = &replay_pciefd_board;
+	struct kvaser_pciefd *pcie;
+	unsigned int i;
+	int err;
+
+	pcie = kzalloc(sizeof(*pcie), GFP_KERNEL);
+	board->regs = kzalloc(REPLAY_PCIEFD_REGS_SIZE, GFP_KERNEL);
+	/* The second buffer keeps a parser running off the end of the first
+	 * in zeroed memory, as the next DMA buffer would
+	 */
+	if (pcie)
+		pcie->dma_data[0] = kzalloc(2 * KVASER_PCIEFD_DMA_SIZE,
+					    GFP_KERNEL);
+	if (!pcie || !board->regs || !pcie->dma_data[0])
+		return -ENOMEM;
+
+	board->pci.dev.init_name = "pciefd";
+	board->pcie = pcie;
+	pcie->pci = &board->pci;
+	pcie->reg_base = board->regs;
+	pcie->driver_data = opts->sf2 ? &kvaser_pciefd_sf2_driver_data :
+					&kvaser_pciefd_altera_driver_data;
+	pci_set_drvdata(&board->pci, pcie);
+
+	board->model.base = board->regs;
+	board->model.size = REPLAY_PCIEFD_REGS_SIZE;
+	board->model.read32 = replay_pciefd_read32;
+	kshim_mmio_register(&board->model);
+
+	pcie->nr_channels = opts->nchannels ?:
+			    replay_pciefd_max_channel(recs, nrecs) + 1;
+	pcie->nr_channels = clamp_t(unsigned int, pcie->nr_channels, 1,
+				    KVASER_PCIEFD_MAX_CAN_CHANNELS);
+	pcie->freq = (opts->freq_mhz ?: 80) * MEGA;
+	pcie->bus_freq = pcie->freq;
+	u64_stats_init(&pcie->stats.syncp);
+	kvaser_pciefd_init_timestamp(pcie);
+
+	err = kvaser_pciefd_setup_can_ctrls(pcie);
+	if (err)
+		return err;
+
+	/* Running, as after ip link set up */
+	for (i = 0; i < pcie->nr_channels; i++) {
+		struct kvaser_pciefd_can *can = pcie->can[i];
+		struct net_device *netdev = can->can.dev;
+
+		can->can.state = CAN_STATE_ERROR_ACTIVE;
+		can->can.ctrlmode |= CAN_CTRLMODE_FD;
+		netdev->flags |= IFF_UP;
+		netdev->running = true;
+		netdev->carrier = true;
+	}
+
+	return 0;
+}
+
+/* kvaser_pciefd_read_buffer() with each packet timed by its type */
+static void replay_pciefd_read_buffer_profiled(struct kvaser_pciefd *pcie)
+{
+	struct replay_pciefd *board = &replay_pciefd_board;
+	__le32 *buffer = pcie->dma_data[0];
+	unsigned int packets = 0;
+	int pos = 0;
+	int res;
+
+	do {
+		struct kvaser_pciefd_rx_packet p;
+		u64 start;
+		u8 type;
+
+		p.header[1] = le32_to_cpu(buffer[pos + 2]);
+		type = KVASER_PCIEFD_PACKET_TYPE(&p);
+
+		start = ktime_get_ns();
+		res = kvaser_pciefd_read_packet(pcie, &pos, 0);
+		if (!res && pos > 0) {
+			board->types[type].count++;
+			board->types[type].time_ns += ktime_get_ns() - start;
+			packets++;
+		}
+	} while (!res && pos > 0 && pos < KVASER_PCIEFD_DMA_SIZE);
+
+	u64_stats_update_begin(&pcie->stats.syncp);
+	pcie->stats.dma_buffers++;
+	pcie->stats.dma_packets += packets;
+	if (packets > pcie->stats.dma_packets_max)
+		pcie->stats.dma_packets_max = packets;
+	u64_stats_update_end(&pcie->stats.syncp);
+
+	if (res)
+		board->read_errors++;
+}
+
+static void replay_pciefd_feed(const struct replay_rec *rec)
+{
+	struct replay_pciefd *board = &replay_pciefd_board;
+	struct kvaser_pciefd *pcie = board->pcie;
+
+	memcpy(pcie->dma_data[0], rec->data, KVASER_PCIEFD_DMA_SIZE);
+	if (board->profile)
+		replay_pciefd_read_buffer_profiled(pcie);
+	else if (kvaser_pciefd_read_buffer(pcie, 0))
+		board->read_errors++;
+}
+
+static void replay_pciefd_reset(void)
+{
+	struct replay_pciefd *board = &replay_pciefd_board;
+	struct kvaser_pciefd *pcie = board->pcie;
+	struct u64_stats_sync syncp = pcie->stats.syncp;
+
+	memset(&pcie->stats, 0, sizeof(pcie->stats));
+	pcie->stats.syncp = syncp;
+	memset(board->types, 0, sizeof(board->types));
+	board->read_errors = 0;
+}
+
+static void replay_pciefd_profile(bool on)
+{
+	replay_pciefd_board.profile = on;
+}
+
+static u64 replay_pciefd_commands(void)
+{
+	return replay_pciefd_board.pcie->stats.dma_packets;
+}
+
+static u64 replay_pciefd_format_errors(void)
+{
+	return replay_pciefd_board.read_errors;
+}
+
+static unsigned int replay_pciefd_cmd_stats(struct replay_cmd_stat *stats)
+{
+	struct replay_pciefd *board = &replay_pciefd_board;
+	unsigned int i, n = 0;
+
+	for (i = 0; i < ARRAY_SIZE(board->types); i++) {
+		if (!board->types[i].count)
+			continue;
+		stats[n] = board->types[i];
+		stats[n].id = i;
+		stats[n].name = replay_pciefd_type_names[i];
+		n++;
+	}
+	return n;
+}
+
+static void replay_pciefd_report(FILE *out)
+{
+	struct kvaser_pciefd *pcie = replay_pciefd_board.pcie;
+	const struct kvaser_pciefd_board_stats *stats = &pcie->stats;
+
+	fprintf(out, "channels: %u, clock %u MHz, %s layout\n",
+		pcie->nr_channels, (unsigned int)(pcie->freq / MEGA),
+		pcie->driver_data == &kvaser_pciefd_sf2_driver_data ?
+		"sf2" : "altera");
+	fprintf(out,
+		"dma buffers: %llu, packets max per buffer: %llu, unexpected packets: %llu\n",
+		stats->dma_buffers, stats->dma_packets_max,
+		stats->unexpected_packets);
+}
+
+static void replay_pciefd_teardown(void)
+{
+	struct replay_pciefd *board = &replay_pciefd_board;
+	struct kvaser_pciefd *pcie = board->pcie;
+	unsigned int i;
+
+	for (i = 0; i < pcie->nr_channels; i++) {
+		if (!pcie->can[i])
+			continue;
+		del_timer(&pcie->can[i]->bec_poll_timer);
+		free_candev(pcie->can[i]->can.dev);
+	}
+	kshim_run_pending(true);
+	kshim_mmio_unregister(&board->model);
+	kfree(pcie->dma_data[0]);
+	kfree(pcie);
+	kfree(board->regs);
+	board->pcie = NULL;
+}
+
+#define REPLAY_PCIEFD_SYNTH_PACKETS	20000
+#define REPLAY_PCIEFD_SYNTH_CHANNELS	2
+
+/* Words of the data packet for frame @n, returns their number */
+static unsigned int replay_pciefd_synth_packet(struct replay_synth *s,
+					       __le32 *buf, unsigned int n)
+{
+	u32 r = replay_synth_rand(s);
+	u32 header[2] = { 0, 0 };
+	unsigned int words, i;
+	u8 len, dlc;
+
+	switch (r % 3) {
+	case 0:
+		/* Classic, 11-bit id */
+		header[0] = (r >> 8) & CAN_SFF_MASK;
+		dlc = (r >> 4) % (CAN_MAX_DLC + 1);
+		len = can_cc_dlc2len(dlc);
+		break;
+	case 1:
+		/* Classic, 29-bit id */
+		header[0] = ((r >> 3) & CAN_EFF_MASK) |
+			    KVASER_PCIEFD_RPACKET_IDE;
+		dlc = (r >> 4) % (CAN_MAX_DLC + 1);
+		len = can_cc_dlc2len(dlc);
+		break;
+	default:
+		/* CAN FD with bit rate switch, 29-bit id */
+		header[0] = ((r >> 3) & CAN_EFF_MASK) |
+			    KVASER_PCIEFD_RPACKET_IDE;
+		header[1] = KVASER_PCIEFD_RPACKET_FDF |
+			    KVASER_PCIEFD_RPACKET_BRS;
+		dlc = (r >> 4) % (CANFD_MAX_DLC + 1);
+		len = can_fd_dlc2len(dlc);
+		break;
+	}
+	header[1] |= dlc << KVASER_PCIEFD_RPACKET_DLC_SHIFT |
+		     (n % REPLAY_PCIEFD_SYNTH_CHANNELS) <<
+		     KVASER_PCIEFD_PACKET_CHID_SHIFT |
+		     KVASER_PCIEFD_PACK_TYPE_DATA <<
+		     KVASER_PCIEFD_PACKET_TYPE_SHIFT |
+		     (n & KVASER_PCIEFD_PACKET_SEQ_MASK);
+
+	/* Size, header, 64-bit timestamp and the data */
+	words = 5 + DIV_ROUND_UP(len, 4);
+	buf[0] = cpu_to_le32(words);
+	buf[1] = cpu_to_le32(header[0]);
+	buf[2] = cpu_to_le32(header[1]);
+	buf[3] = cpu_to_le32(n * 1000);
+	buf[4] = 0;
+	for (i = 0; i < len; i++)
+		((u8 *)&buf[5])[i] = n + i;
+
+	s->frames++;
+	return words;
+}
+
+/* Buffers hold a random number of packets and end with a zero size word,
+ * as the DMA engine leaves them
+ */
+static int replay_pciefd_synth(struct replay_synth *s,
+			       const struct replay_opts *opts)
+{
+	const unsigned int words = KVASER_PCIEFD_DMA_SIZE / sizeof(u32);
+	/* Room for a CAN FD packet and the terminating zero */
+	const unsigned int room = 5 + CANFD_MAX_DLEN / 4 + 1;
+	__le32 *buf;
+	unsigned int n = 0;
+	int err = 0;
+
+	buf = malloc(KVASER_PCIEFD_DMA_SIZE);
+	if (!buf)
+		return -ENOMEM;
+
+	while (n < REPLAY_PCIEFD_SYNTH_PACKETS && !err) {
+		unsigned int packets = 1 + replay_synth_rand(s) % 128;
+		unsigned int pos = 0;
+
+		memset(buf, 0, KVASER_PCIEFD_DMA_SIZE);
+		while (packets-- && pos + room <= words &&
+		       n < REPLAY_PCIEFD_SYNTH_PACKETS)
+			pos += replay_pciefd_synth_packet(s, buf + pos, n++);
+		err = replay_synth_add(s, buf, KVASER_PCIEFD_DMA_SIZE);
+	}
+	free(buf);
+	return err;
+}
+
+const struct replay_family replay_pciefd = {
+	.name = "pciefd",
+	.setup = replay_pciefd_setup,
+	.feed = replay_pciefd_feed,
+	.reset = replay_pciefd_reset,
+	.profile = replay_pciefd_profile,
+	.commands = replay_pciefd_commands,
+	.format_errors = replay_pciefd_format_errors,
+	.cmd_stats = replay_pciefd_cmd_stats,
+	.report = replay_pciefd_report,
+	.teardown = replay_pciefd_teardown,
+	.synth = replay_pciefd_synth,
+};
@@ -0,0 +1,184 @@
+// SPDX-License-Identifier: GPL-2.0
+/* Sets up a struct kvaser_usb the way kvaser_usb_probe() would leave it,
+ * without talking to a device. What probe learns from the firmware is
+ * filled in by the family backends, from the capture or from options.
+ */
+
+#include "replay.h"
+#include "kvaser_usb.h"
+
+struct kvaser_usb *replay_usb_alloc(const struct kvaser_usb_driver_info *info,
+				    unsigned int maxp)
+{
+	struct usb_endpoint_descriptor *in, *out;
+	struct usb_interface *intf;
+	struct usb_device *udev;
+	struct kvaser_usb *dev;
+
+	dev = kzalloc(sizeof(*dev), GFP_KERNEL);
+	intf = kzalloc(sizeof(*intf), GFP_KERNEL);
+	udev = kzalloc(sizeof(*udev), GFP_KERNEL);
+	in = kzalloc(sizeof(*in), GFP_KERNEL);
+	out = kzalloc(sizeof(*out), GFP_KERNEL);
+	if (!dev || !intf || !udev || !in || !out)
+		return NULL;
+
+	udev->dev.init_name = "replay";
+	intf->dev.init_name = "replay";
+	intf->usb_dev = udev;
+	usb_set_intfdata(intf, dev);
+
+	in->bEndpointAddress = USB_DIR_IN | 1;
+	in->bmAttributes = USB_ENDPOINT_XFER_BULK;
+	in->wMaxPacketSize = cpu_to_le16(maxp);
+	out->bEndpointAddress = USB_DIR_OUT | 2;
+	out->bmAttributes = USB_ENDPOINT_XFER_BULK;
+	out->wMaxPacketSize = cpu_to_le16(maxp);
+
+	dev->bulk_in = in;
+	dev->bulk_out = out;
+	dev->udev = udev;
+	dev->intf = intf;
+	dev->driver_info = info;
+	dev->max_tx_urbs = KVASER_USB_MAX_TX_URBS;
+	dev->rx_size = KVASER_USB_RX_BUFFER_SIZE;
+	init_usb_anchor(&dev->rx_submitted);
+	mutex_init(&dev->rx_lock);
+
+	return dev;
+}
+
+/* The parts of kvaser_usb_init_one() that the Rx path depends on. The
+ * channels are left running, as after ip link set up.
+ */
+int replay_usb_add_channels(struct kvaser_usb *dev, unsigned int nchannels)
+{
+	const struct kvaser_usb_dev_ops *ops = dev->driver_info->ops;
+	unsigned int i, j;
+	int err;
+
+	for (i = 0; i < nchannels; i++) {
+		struct kvaser_usb_net_priv *priv;
+		struct net_device *netdev;
+
+		netdev = alloc_candev(struct_size(priv, tx_contexts,
+						  dev->max_tx_urbs),
+				      dev->max_tx_urbs);
+		if (!netdev)
+			return -ENOMEM;
+
+		priv = netdev_priv(netdev);
+		init_usb_anchor(&priv->tx_submitted);
+		init_completion(&priv->start_comp);
+		init_completion(&priv->stop_comp);
+		init_completion(&priv->flush_comp);
+		init_completion(&priv->get_busparams_comp);
+
+		priv->dev = dev;
+		priv->netdev = netdev;
+		priv->channel = i;
+
+		spin_lock_init(&priv->tx_contexts_lock);
+		for (j = 0; j < dev->max_tx_urbs; j++)
+			priv->tx_contexts[j].echo_index = dev->max_tx_urbs;
+		spin_lock_init(&priv->periodic_lock);
+		kvaser_txtime_init(&priv->txtime, netdev);
+
+		priv->can.clock.freq = dev->cfg->clock.freq;
+		priv->can.bittiming_const = dev->cfg->bittiming_const;
+		priv->can.ctrlmode_supported = dev->card_data.ctrlmode_supported;
+		priv->can.state = CAN_STATE_ERROR_ACTIVE;
+
+		netdev->flags |= IFF_ECHO | IFF_UP;
+		netdev->dev_id = i;
+		SET_NETDEV_DEV(netdev, &dev->intf->dev);
+		dev->nets[i] = priv;
+
+		if (ops->dev_init_channel) {
+			err = ops->dev_init_channel(priv);
+			if (err)
+				return err;
+		}
+
+		err = register_candev(netdev);
+		if (err)
+			return err;
+		netdev->running = true;
+		netdev->carrier = true;
+	}
+	dev->nchannels = nchannels;
+
+	return 0;
+}
+
+void replay_usb_reset(struct kvaser_usb *dev)
+{
+	const struct kvaser_usb_dev_ops *ops = dev->driver_info->ops;
+
+	if (ops->dev_rx_reset)
+		ops->dev_rx_reset(dev);
+	memset(&dev->stats, 0, sizeof(dev->stats));
+	memset(dev->cmd_stats, 0, sizeof(dev->cmd_stats));
+}
+
+unsigned int replay_usb_cmd_stats(struct kvaser_usb *dev,
+				  const char * const *names,
+				  struct replay_cmd_stat *stats)
+{
+	unsigned int i, n = 0;
+
+	for (i = 0; i < ARRAY_SIZE(dev->cmd_stats); i++) {
+		s64 count = atomic64_read(&dev->cmd_stats[i].count);
+
+		if (!count)
+			continue;
+
+		stats[n].id = i;
+		stats[n].name = names[i];
+		stats[n].count = count;
+		stats[n].time_ns = atomic64_read(&dev->cmd_stats[i].time_ns);
+		n++;
+	}
+	return n;
+}
+
+u64 replay_usb_commands(struct kvaser_usb *dev)
+{
+	unsigned int i;
+	u64 n = 0;
+
+	for (i = 0; i < ARRAY_SIZE(dev->cmd_stats); i++)
+		n += atomic64_read(&dev->cmd_stats[i].count);
+	return n;
+}
+
+u64 replay_usb_format_errors(struct kvaser_usb *dev)
+{
+	return atomic64_read(&dev->stats.cmd_format_errors);
+}
+
+void replay_usb_free(struct kvaser_usb *dev)
+{
+	const struct kvaser_usb_dev_ops *ops = dev->driver_info->ops;
+	unsigned int i;
+
+	for (i = 0; i < dev->nchannels; i++) {
+		struct kvaser_usb_net_priv *priv = dev->nets[i];
+
+		if (!priv)
+			continue;
+		unregister_candev(priv->netdev);
+		if (ops->dev_remove_channel)
+			ops->dev_remove_channel(priv);
+		/* devm_kzalloc() in dev_init_channel() */
+		kfree(priv->sub_priv);
+		free_candev(priv->netdev);
+	}
+	kshim_run_pending(true);
+
+	kfree(dev->bulk_in);
+	kfree(dev->bulk_out);
+	kfree(dev->udev);
+	kfree(dev->intf);
+	kfree(dev);
+}